@@ -0,0 +1,330 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <stdio.h>
+
+#include "alloc-util.h"
+#include "analyze-profile.h"
+#include "bus-error.h"
+#include "bus-util.h"
+#include "format-table.h"
+#include "hashmap.h"
+#include "locale-util.h"
+#include "sort-util.h"
+#include "string-util.h"
+#include "terminal-util.h"
+#include "time-util.h"
+
+/* Renders the per-phase counters and the ring buffer of recent dispatch spans PID 1 keeps about its own work. Spans
+ * that lie within another span (e.g. a transaction that was built while dispatching the run queue) are shown as
+ * children of it, like in a flame graph: each line shows the total time spent in the phase at this position of the
+ * stack, how much of it was not spent in nested phases, and a bar proportional to the total. */
+
+#define FLAME_NAME_WIDTH 32
+#define FLAME_BAR_WIDTH 40
+
+typedef struct DispatchSpan {
+        const char *phase; /* Points into the reply message */
+        usec_t begin;
+        usec_t duration;
+        uint32_t n_items;
+} DispatchSpan;
+
+typedef struct FlameFrame {
+        char *path;        /* Phases from the outermost to this one, separated by ";" */
+        unsigned depth;
+        uint64_t n_spans;
+        usec_t total_usec;
+        usec_t self_usec;
+} FlameFrame;
+
+typedef struct FlameStackEntry {
+        usec_t end;
+        FlameFrame *frame;
+} FlameStackEntry;
+
+static FlameFrame *flame_frame_free(FlameFrame *f) {
+        if (!f)
+                return NULL;
+
+        free(f->path);
+        return mfree(f);
+}
+
+DEFINE_PRIVATE_HASH_OPS_WITH_VALUE_DESTRUCTOR(flame_frame_hash_ops, char, string_hash_func, string_compare_func, FlameFrame, flame_frame_free);
+
+static int dispatch_span_compare(const DispatchSpan *a, const DispatchSpan *b) {
+        int r;
+
+        /* Outer spans first: by start time, and the longer one first if two start at the same time */
+
+        r = CMP(a->begin, b->begin);
+        if (r != 0)
+                return r;
+
+        return -CMP(a->duration, b->duration);
+}
+
+static int flame_frame_compare(FlameFrame * const *a, FlameFrame * const *b) {
+        const char *x = (*a)->path, *y = (*b)->path;
+
+        /* Order lexicographically by path, but with the separator sorting before anything else, so that all
+         * children directly follow their parent. */
+
+        for (; *x && *x == *y; x++, y++)
+                ;
+
+        if (*x == *y)
+                return 0;
+        if (*x == 0 || *x == ';')
+                return -1;
+        if (*y == 0 || *y == ';')
+                return 1;
+
+        return CMP(*x, *y);
+}
+
+static int acquire_flame_frames(DispatchSpan *spans, size_t n_spans, Hashmap **ret) {
+        _cleanup_(hashmap_freep) Hashmap *frames = NULL;
+        _cleanup_free_ FlameStackEntry *stack = NULL;
+        size_t n_stack = 0;
+        size_t i;
+        int r;
+
+        assert(spans || n_spans == 0);
+        assert(ret);
+
+        frames = hashmap_new(&flame_frame_hash_ops);
+        if (!frames)
+                return log_oom();
+
+        stack = new(FlameStackEntry, n_spans);
+        if (!stack && n_spans > 0)
+                return log_oom();
+
+        typesafe_qsort(spans, n_spans, dispatch_span_compare);
+
+        for (i = 0; i < n_spans; i++) {
+                _cleanup_free_ char *path = NULL;
+                DispatchSpan *s = spans + i;
+                usec_t end = usec_add(s->begin, s->duration);
+                FlameFrame *f;
+
+                /* Leave all spans this one is not nested in */
+                while (n_stack > 0 &&
+                       (s->begin >= stack[n_stack-1].end || end > stack[n_stack-1].end))
+                        n_stack--;
+
+                if (n_stack > 0)
+                        path = strjoin(stack[n_stack-1].frame->path, ";", s->phase);
+                else
+                        path = strdup(s->phase);
+                if (!path)
+                        return log_oom();
+
+                f = hashmap_get(frames, path);
+                if (!f) {
+                        f = new(FlameFrame, 1);
+                        if (!f)
+                                return log_oom();
+
+                        *f = (FlameFrame) {
+                                .path = TAKE_PTR(path),
+                                .depth = n_stack,
+                        };
+
+                        r = hashmap_put(frames, f->path, f);
+                        if (r < 0) {
+                                flame_frame_free(f);
+                                return log_oom();
+                        }
+                }
+
+                f->n_spans++;
+                f->total_usec += s->duration;
+                f->self_usec += s->duration;
+
+                /* Time spent in here is not spent in the parent itself */
+                if (n_stack > 0) {
+                        FlameFrame *parent = stack[n_stack-1].frame;
+
+                        parent->self_usec -= MIN(parent->self_usec, s->duration);
+                }
+
+                stack[n_stack++] = (FlameStackEntry) {
+                        .end = end,
+                        .frame = f,
+                };
+        }
+
+        *ret = TAKE_PTR(frames);
+        return 0;
+}
+
+static void print_bar(size_t n) {
+        const char *glyph = is_locale_utf8() ? "\342\226\210" : "#";
+
+        while (n-- > 0)
+                fputs(glyph, stdout);
+}
+
+static int print_flame(DispatchSpan *spans, size_t n_spans) {
+        _cleanup_(hashmap_freep) Hashmap *frames = NULL;
+        _cleanup_free_ FlameFrame **sorted = NULL;
+        usec_t first = USEC_INFINITY, last = 0, root_usec = 0;
+        char span[FORMAT_TIMESPAN_MAX];
+        FlameFrame *f;
+        Iterator it;
+        size_t i, n = 0;
+        int r;
+
+        if (n_spans == 0) {
+                printf("No dispatch spans recorded.\n");
+                return 0;
+        }
+
+        for (i = 0; i < n_spans; i++) {
+                first = MIN(first, spans[i].begin);
+                last = MAX(last, usec_add(spans[i].begin, spans[i].duration));
+        }
+
+        r = acquire_flame_frames(spans, n_spans, &frames);
+        if (r < 0)
+                return r;
+
+        sorted = new(FlameFrame*, hashmap_size(frames));
+        if (!sorted)
+                return log_oom();
+
+        HASHMAP_FOREACH(f, frames, it) {
+                sorted[n++] = f;
+
+                if (f->depth == 0)
+                        root_usec += f->total_usec;
+        }
+
+        typesafe_qsort(sorted, n, flame_frame_compare);
+
+        printf("\n%s%zu most recent dispatch spans, covering %s:%s\n\n",
+               ansi_highlight(), n_spans,
+               format_timespan(span, sizeof(span), usec_sub_unsigned(last, first), 0),
+               ansi_normal());
+
+        printf("%s%-*s %8s %10s %10s%s\n",
+               ansi_underline(), FLAME_NAME_WIDTH, "PHASE", "SPANS", "TOTAL", "SELF", ansi_normal());
+
+        for (i = 0; i < n; i++) {
+                char total[FORMAT_TIMESPAN_MAX], self[FORMAT_TIMESPAN_MAX];
+                unsigned indent = MIN(sorted[i]->depth * 2, FLAME_NAME_WIDTH - 1U);
+                const char *name;
+
+                name = strrchr(sorted[i]->path, ';');
+                name = name ? name + 1 : sorted[i]->path;
+
+                printf("%*s%-*s %8" PRIu64 " %10s %10s ",
+                       (int) indent, "",
+                       (int) (FLAME_NAME_WIDTH - indent), name,
+                       sorted[i]->n_spans,
+                       format_timespan(total, sizeof(total), sorted[i]->total_usec, USEC_PER_MSEC / 10),
+                       format_timespan(self, sizeof(self), sorted[i]->self_usec, USEC_PER_MSEC / 10));
+
+                if (root_usec > 0)
+                        print_bar(DIV_ROUND_UP(sorted[i]->total_usec * FLAME_BAR_WIDTH, root_usec));
+
+                putchar('\n');
+        }
+
+        return 0;
+}
+
+static int print_phase_counters(sd_bus_message *reply) {
+        _cleanup_(table_unrefp) Table *table = NULL;
+        uint64_t n_spans, n_items;
+        usec_t total, max;
+        const char *phase;
+        TableCell *cell;
+        size_t i;
+        int r;
+
+        table = table_new("phase", "spans", "items", "total", "max", "average");
+        if (!table)
+                return log_oom();
+
+        for (i = 1; i < 6; i++) {
+                assert_se(cell = table_get_cell(table, 0, i));
+                r = table_set_align_percent(table, cell, 100);
+                if (r < 0)
+                        return r;
+        }
+
+        r = sd_bus_message_enter_container(reply, 'a', "(stttt)");
+        if (r < 0)
+                return bus_log_parse_error(r);
+
+        while ((r = sd_bus_message_read(reply, "(stttt)", &phase, &n_spans, &n_items, &total, &max)) > 0) {
+                usec_t average = n_spans > 0 ? total / n_spans : 0;
+
+                r = table_add_many(table,
+                                   TABLE_STRING, phase,
+                                   TABLE_UINT64, n_spans,
+                                   TABLE_UINT64, n_items,
+                                   TABLE_TIMESPAN, total,
+                                   TABLE_TIMESPAN, max,
+                                   TABLE_TIMESPAN, average);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to add table row: %m");
+        }
+        if (r < 0)
+                return bus_log_parse_error(r);
+
+        r = sd_bus_message_exit_container(reply);
+        if (r < 0)
+                return bus_log_parse_error(r);
+
+        return table_print(table, NULL);
+}
+
+int analyze_dispatch_profile(sd_bus *bus) {
+        _cleanup_(sd_bus_error_free) sd_bus_error error = SD_BUS_ERROR_NULL;
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+        _cleanup_free_ DispatchSpan *spans = NULL;
+        size_t n_spans = 0, n_allocated = 0;
+        DispatchSpan s = {};
+        int r;
+
+        assert(bus);
+
+        r = sd_bus_call_method(
+                        bus,
+                        "org.freedesktop.systemd1",
+                        "/org/freedesktop/systemd1",
+                        "org.freedesktop.systemd1.Manager",
+                        "GetDispatchProfile",
+                        &error,
+                        &reply,
+                        NULL);
+        if (r < 0)
+                return log_error_errno(r, "Failed to issue method call GetDispatchProfile: %s", bus_error_message(&error, r));
+
+        r = print_phase_counters(reply);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_enter_container(reply, 'a', "(sttu)");
+        if (r < 0)
+                return bus_log_parse_error(r);
+
+        while ((r = sd_bus_message_read(reply, "(sttu)", &s.phase, &s.begin, &s.duration, &s.n_items)) > 0) {
+                if (!GREEDY_REALLOC(spans, n_allocated, n_spans + 1))
+                        return log_oom();
+
+                spans[n_spans++] = s;
+        }
+        if (r < 0)
+                return bus_log_parse_error(r);
+
+        r = sd_bus_message_exit_container(reply);
+        if (r < 0)
+                return bus_log_parse_error(r);
+
+        return print_flame(spans, n_spans);
+}
@@ -13,6 +13,7 @@
 
 #include "alloc-util.h"
 #include "analyze-condition.h"
+#include "analyze-profile.h"
 #include "analyze-security.h"
 #include "analyze-verify.h"
 #include "build.h"
@@ -1398,6 +1399,19 @@ static int dump(int argc, char *argv[], void *userdata) {
         return copy_bytes(fd, STDOUT_FILENO, (uint64_t) -1, 0);
 }
 
+static int dispatch_profile(int argc, char *argv[], void *userdata) {
+        _cleanup_(sd_bus_flush_close_unrefp) sd_bus *bus = NULL;
+        int r;
+
+        r = acquire_bus(&bus, NULL);
+        if (r < 0)
+                return log_error_errno(r, "Failed to create bus connection: %m");
+
+        (void) pager_open(arg_pager_flags);
+
+        return analyze_dispatch_profile(bus);
+}
+
 static int cat_config(int argc, char *argv[], void *userdata) {
         char **arg, **list;
         int r;
@@ -2249,6 +2263,7 @@ static int help(int argc, char *argv[], void *userdata) {
                "  plot                     Output SVG graphic showing service initialization\n"
                "  dot [UNIT...]            Output dependency graph in %s format\n"
                "  dump                     Output state serialization of service manager\n"
+               "  dispatch-profile         Show where the service manager itself spent time\n"
                "  cat-config               Show configuration file and drop-ins\n"
                "  unit-files               List files and symlinks for units\n"
                "  unit-paths               List load directories for units\n"
@@ -2485,6 +2500,7 @@ static int run(int argc, char *argv[]) {
                 { "get-log-target",    VERB_ANY, 1,        0,            get_log_target         },
                 { "service-watchdogs", VERB_ANY, 2,        0,            service_watchdogs      },
                 { "dump",              VERB_ANY, 1,        0,            dump                   },
+                { "dispatch-profile",  VERB_ANY, 1,        0,            dispatch_profile       },
                 { "cat-config",        2,        VERB_ANY, 0,            cat_config             },
                 { "unit-files",        VERB_ANY, VERB_ANY, 0,            do_unit_files          },
                 { "unit-paths",        1,        1,        0,            dump_unit_paths        },
@@ -22,6 +22,9 @@
 #define NOTIFY_FD_MAX 768
 #define NOTIFY_BUFFER_MAX PIPE_BUF
 
+/* How many sd_notify() messages PID 1 processes per event loop iteration before letting other work run */
+#define DEFAULT_NOTIFY_MESSAGE_BUDGET 64U
+
 #if HAVE_SPLIT_USR
 #  define _CONF_PATHS_SPLIT_USR_NULSTR(n) "/lib/" n "\0"
 #  define _CONF_PATHS_SPLIT_USR(n) , "/lib/" n
@@ -308,7 +308,7 @@ int verify_file(const char *fn, const char *blob, bool accept_extra_nl) {
         return 1;
 }
 
-int read_full_virtual_file(const char *filename, char **ret_contents, size_t *ret_size) {
+int read_full_virtual_file_at(int dir_fd, const char *filename, char **ret_contents, size_t *ret_size) {
         _cleanup_free_ char *buf = NULL;
         _cleanup_close_ int fd = -1;
         struct stat st;
@@ -316,6 +316,8 @@ int read_full_virtual_file(const char *filename, char **ret_contents, size_t *re
         int n_retries;
         char *p;
 
+        assert(dir_fd >= 0 || dir_fd == AT_FDCWD);
+        assert(filename);
         assert(ret_contents);
 
         /* Virtual filesystems such as sysfs or procfs use kernfs, and kernfs can work
@@ -327,7 +329,7 @@ int read_full_virtual_file(const char *filename, char **ret_contents, size_t *re
          * why the usage of fread(3) is prohibited in this case as it always performs a
          * second call to read(2) looking for EOF. See issue 13585. */
 
-        fd = open(filename, O_RDONLY|O_CLOEXEC);
+        fd = openat(dir_fd, filename, O_RDONLY|O_CLOEXEC);
         if (fd < 0)
                 return -errno;
 
@@ -4,6 +4,44 @@
 
 #include "hash-funcs.h"
 #include "path-util.h"
+#include "unaligned.h"
+
+/* The finalizer of MurmurHash3, every input bit affects every output bit */
+static uint64_t fast_hash_mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= UINT64_C(0xff51afd7ed558ccd);
+        h ^= h >> 33;
+        h *= UINT64_C(0xc4ceb9fe1a85ec53);
+        h ^= h >> 33;
+
+        return h;
+}
+
+static uint64_t fast_hash_round(uint64_t h, uint64_t k) {
+        k *= UINT64_C(0x87c37b91114253d5);
+        k = (k << 31) | (k >> 33);
+        k *= UINT64_C(0x4cf5ad432745937f);
+
+        h ^= k;
+        h = (h << 27) | (h >> 37);
+        return h * 5 + UINT64_C(0x52dce729);
+}
+
+uint64_t fast_hash_bytes(const void *p, size_t l, uint64_t seed) {
+        const uint8_t *q = p;
+        uint64_t h = seed, k = 0;
+        size_t n = l;
+
+        for (; n >= sizeof(uint64_t); n -= sizeof(uint64_t), q += sizeof(uint64_t))
+                h = fast_hash_round(h, unaligned_read_ne64(q));
+
+        if (n > 0) {
+                memcpy(&k, q, n);
+                h = fast_hash_round(h, k);
+        }
+
+        return fast_hash_mix(h ^ l);
+}
 
 void string_hash_func(const char *p, struct siphash *state) {
         siphash24_compress(p, strlen(p) + 1, state);
@@ -14,6 +52,16 @@ DEFINE_HASH_OPS_FULL(string_hash_ops_free_free,
                      char, string_hash_func, string_compare_func, free,
                      char, free);
 
+uint64_t string_fast_hash_func(const char *p, uint64_t seed) {
+        return fast_hash_bytes(p, strlen(p), seed);
+}
+
+const struct hash_ops string_fast_hash_ops = {
+        .hash = (hash_func_t) string_hash_func,
+        .compare = (compare_func_t) string_compare_func,
+        .fast_hash = (fast_hash_func_t) string_fast_hash_func,
+};
+
 void path_hash_func(const char *q, struct siphash *state) {
         size_t n;
 
@@ -67,6 +115,16 @@ const struct hash_ops trivial_hash_ops = {
         .compare = trivial_compare_func,
 };
 
+uint64_t trivial_fast_hash_func(const void *p, uint64_t seed) {
+        return fast_hash_mix((uint64_t) (uintptr_t) p ^ seed);
+}
+
+const struct hash_ops trivial_fast_hash_ops = {
+        .hash = trivial_hash_func,
+        .compare = trivial_compare_func,
+        .fast_hash = trivial_fast_hash_func,
+};
+
 void uint64_hash_func(const uint64_t *p, struct siphash *state) {
         siphash24_compress(p, sizeof(uint64_t), state);
 }
@@ -77,6 +135,16 @@ int uint64_compare_func(const uint64_t *a, const uint64_t *b) {
 
 DEFINE_HASH_OPS(uint64_hash_ops, uint64_t, uint64_hash_func, uint64_compare_func);
 
+uint64_t uint64_fast_hash_func(const uint64_t *p, uint64_t seed) {
+        return fast_hash_mix(*p ^ seed);
+}
+
+const struct hash_ops uint64_fast_hash_ops = {
+        .hash = (hash_func_t) uint64_hash_func,
+        .compare = (compare_func_t) uint64_compare_func,
+        .fast_hash = (fast_hash_func_t) uint64_fast_hash_func,
+};
+
 #if SIZEOF_DEV_T != 8
 void devt_hash_func(const dev_t *p, struct siphash *state) {
         siphash24_compress(p, sizeof(dev_t), state);
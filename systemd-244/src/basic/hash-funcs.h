@@ -6,6 +6,7 @@
 #include "siphash24.h"
 
 typedef void (*hash_func_t)(const void *p, struct siphash *state);
+typedef uint64_t (*fast_hash_func_t)(const void *p, uint64_t seed);
 typedef int (*compare_func_t)(const void *a, const void *b);
 
 struct hash_ops {
@@ -13,6 +14,10 @@ struct hash_ops {
         compare_func_t compare;
         free_func_t free_key;
         free_func_t free_value;
+
+        /* Optional. If set, hashmaps use this instead of SipHash. The fast hash functions below are not resistant
+         * to hash flooding, only use them for keys that cannot be chosen by untrusted parties. */
+        fast_hash_func_t fast_hash;
 };
 
 #define _DEFINE_HASH_OPS(uq, name, type, hash_func, compare_func, free_key_func, free_value_func, scope) \
@@ -78,6 +83,11 @@ void string_hash_func(const char *p, struct siphash *state);
 extern const struct hash_ops string_hash_ops;
 extern const struct hash_ops string_hash_ops_free_free;
 
+/* Seeded non-cryptographic hashing, see fast_hash in struct hash_ops above */
+uint64_t fast_hash_bytes(const void *p, size_t l, uint64_t seed) _pure_;
+uint64_t string_fast_hash_func(const char *p, uint64_t seed) _pure_;
+extern const struct hash_ops string_fast_hash_ops;
+
 void path_hash_func(const char *p, struct siphash *state);
 extern const struct hash_ops path_hash_ops;
 
@@ -86,12 +96,16 @@ extern const struct hash_ops path_hash_ops;
 void trivial_hash_func(const void *p, struct siphash *state);
 int trivial_compare_func(const void *a, const void *b) _const_;
 extern const struct hash_ops trivial_hash_ops;
+uint64_t trivial_fast_hash_func(const void *p, uint64_t seed) _const_;
+extern const struct hash_ops trivial_fast_hash_ops;
 
 /* 32bit values we can always just embed in the pointer itself, but in order to support 32bit archs we need store 64bit
  * values indirectly, since they don't fit in a pointer. */
 void uint64_hash_func(const uint64_t *p, struct siphash *state);
 int uint64_compare_func(const uint64_t *a, const uint64_t *b) _pure_;
 extern const struct hash_ops uint64_hash_ops;
+uint64_t uint64_fast_hash_func(const uint64_t *p, uint64_t seed) _pure_;
+extern const struct hash_ops uint64_fast_hash_ops;
 
 /* On some archs dev_t is 32bit, and on others 64bit. And sometimes it's 64bit on 32bit archs, and sometimes 32bit on
  * 64bit archs. Yuck! */
@@ -17,6 +17,13 @@
 #include "siphash24.h"
 #include "string-util.h"
 #include "strv.h"
+#include "unaligned.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #if ENABLE_DEBUG_HASHMAP
 #include <pthread.h>
@@ -63,6 +70,12 @@
  * Khuong, P. 2013. The Other Robin Hood Hashing.
  * http://www.pvk.ca/Blog/2013/11/26/the-other-robin-hood-hashing/
  * - Short summary of random vs. linear probing, and tombstones vs. backward shift.
+ *
+ * Metadata: with indirect storage every bucket has a DIB byte and a tag byte
+ *   (8 more bits of the hash value) in two separate arrays. Lookups only call
+ *   compare() on entries with the right DIB and tag, and long lookups compare
+ *   a whole group of buckets at once with SSE2/NEON, similar to the control
+ *   bytes of Swiss tables.
  */
 
 /*
@@ -111,10 +124,15 @@ struct set_entry {
 assert_cc(IDX_FIRST == _IDX_SWAP_END);
 assert_cc(IDX_FIRST == _IDX_ITERATOR_FIRST);
 
+/* Some more bits of the hash value of an entry. They are stored per bucket
+ * next to the DIB array, but only with indirect storage. */
+typedef uint8_t hash_tag_t;
+
 /* Storage space for the "swap" buckets.
  * All entry types can fit into a ordered_hashmap_entry. */
 struct swap_entries {
         struct ordered_hashmap_entry e[_IDX_SWAP_END - _IDX_SWAP_BEGIN];
+        hash_tag_t tags[_IDX_SWAP_END - _IDX_SWAP_BEGIN];
 };
 
 /* Distance from Initial Bucket */
@@ -126,6 +144,15 @@ typedef uint8_t dib_raw_t;
 
 #define DIB_FREE UINT_MAX
 
+/* Number of buckets whose metadata is compared at once during lookups, and
+ * the DIB from which on lookups do that */
+#if defined(__SSE2__) || (defined(__aarch64__) && defined(__ARM_NEON))
+#define BUCKET_GROUP_SIZE 16U
+#else
+#define BUCKET_GROUP_SIZE 0U
+#endif
+#define BUCKET_GROUP_SCAN_AFTER 4U
+
 #if ENABLE_DEBUG_HASHMAP
 struct hashmap_debug_info {
         LIST_FIELDS(struct hashmap_debug_info, debug_list);
@@ -160,7 +187,7 @@ enum HashmapType {
 };
 
 struct _packed_ indirect_storage {
-        void *storage;                     /* where buckets and DIBs are stored */
+        void *storage;                     /* where buckets, DIBs and tags are stored */
         uint8_t  hash_key[HASH_KEY_SIZE];  /* hash key; changes during resize */
 
         unsigned n_entries;                /* number of stored entries */
@@ -183,6 +210,10 @@ struct direct_storage {
 #define DIRECT_BUCKETS(entry_t) \
         (sizeof(struct direct_storage) / (sizeof(entry_t) + sizeof(dib_raw_t)))
 
+/* Size of a bucket with its metadata in indirect storage */
+#define INDIRECT_BUCKET_SIZE(entry_size) \
+        ((entry_size) + sizeof(dib_raw_t) + sizeof(hash_tag_t))
+
 /* We should be able to store at least one entry directly. */
 assert_cc(DIRECT_BUCKETS(struct ordered_hashmap_entry) >= 1);
 
@@ -194,7 +225,7 @@ assert_cc(DIRECT_BUCKETS(struct set_entry) < (1 << 3));
  * a handful of directly stored entries in a hashmap. When a hashmap
  * outgrows direct storage, it gets its own key for indirect storage. */
 static uint8_t shared_hash_key[HASH_KEY_SIZE];
-static bool shared_hash_key_initialized;
+static pthread_once_t shared_hash_key_once = PTHREAD_ONCE_INIT;
 
 /* Fields that all hashmap/set types must have */
 struct HashmapBase {
@@ -335,19 +366,32 @@ static uint8_t *hash_key(HashmapBase *h) {
                                : shared_hash_key;
 }
 
-static unsigned base_bucket_hash(HashmapBase *h, const void *p) {
+static uint64_t base_bucket_hash(HashmapBase *h, const void *p) {
         struct siphash state;
-        uint64_t hash;
+        const uint8_t *k;
+
+        k = hash_key(h);
+
+        /* Hash ops for trusted keys may bring a cheaper hash function */
+        if (h->hash_ops->fast_hash)
+                return h->hash_ops->fast_hash(p, unaligned_read_ne64(k) ^ unaligned_read_ne64(k + 8));
 
-        siphash24_init(&state, hash_key(h));
+        siphash24_init(&state, k);
 
         h->hash_ops->hash(p, &state);
 
-        hash = siphash24_finalize(&state);
+        return siphash24_finalize(&state);
+}
+#define bucket_hash(h, p) base_bucket_hash(HASHMAP_BASE(h), p)
 
+static unsigned hash_to_idx(HashmapBase *h, uint64_t hash) {
         return (unsigned) (hash % n_buckets(h));
 }
-#define bucket_hash(h, p) base_bucket_hash(HASHMAP_BASE(h), p)
+
+static hash_tag_t hash_to_tag(uint64_t hash) {
+        /* The high bits, the bucket index is mostly determined by the low bits */
+        return (hash_tag_t) (hash >> 56);
+}
 
 static void base_set_dirty(HashmapBase *h) {
         h->dirty = true;
@@ -355,15 +399,16 @@ static void base_set_dirty(HashmapBase *h) {
 #define hashmap_set_dirty(h) base_set_dirty(HASHMAP_BASE(h))
 
 static void get_hash_key(uint8_t hash_key[HASH_KEY_SIZE], bool reuse_is_ok) {
-        static uint8_t current[HASH_KEY_SIZE];
-        static bool current_initialized = false;
+        static thread_local uint8_t current[HASH_KEY_SIZE];
+        static thread_local bool current_initialized = false;
 
         /* Returns a hash function key to use. In order to keep things
          * fast we will not generate a new key each time we allocate a
          * new hash table. Instead, we'll just reuse the most recently
          * generated one, except if we never generated one or when we
          * are rehashing an entire hash table because we reached a
-         * fill level */
+         * fill level. The key is per thread, as hash tables may be
+         * allocated from several threads. */
 
         if (!current_initialized || !reuse_is_ok) {
                 random_bytes(current, sizeof(current));
@@ -412,6 +457,23 @@ static dib_raw_t *dib_raw_ptr(HashmapBase *h) {
                 ((uint8_t*) storage_ptr(h) + hashmap_type_info[h->type].entry_size * n_buckets(h));
 }
 
+static hash_tag_t *tag_ptr(HashmapBase *h) {
+        assert(h->has_indirect);
+
+        return (hash_tag_t*) (dib_raw_ptr(h) + n_buckets(h));
+}
+
+/* Like bucket_at_virtual(), but for the tag of a bucket */
+static hash_tag_t *bucket_tag_virtual(HashmapBase *h, struct swap_entries *swap, unsigned idx) {
+        if (idx < _IDX_SWAP_BEGIN)
+                return tag_ptr(h) + idx;
+
+        if (idx < _IDX_SWAP_END)
+                return &swap->tags[idx - _IDX_SWAP_BEGIN];
+
+        assert_not_reached("Invalid index");
+}
+
 static unsigned bucket_distance(HashmapBase *h, unsigned idx, unsigned from) {
         return idx >= from ? idx - from
                            : n_buckets(h) + idx - from;
@@ -436,7 +498,7 @@ static unsigned bucket_calculate_dib(HashmapBase *h, unsigned idx, dib_raw_t raw
          * This returns the correct DIB value by recomputing the hash value in
          * the unlikely case. XXX Hitting this case could be a hint to rehash.
          */
-        initial_bucket = bucket_hash(h, bucket_at(h, idx)->key);
+        initial_bucket = hash_to_idx(h, bucket_hash(h, bucket_at(h, idx)->key));
         return bucket_distance(h, idx, initial_bucket);
 }
 
@@ -472,6 +534,9 @@ static void bucket_move_entry(HashmapBase *h, struct swap_entries *swap,
 
         memcpy(e_to, e_from, hashmap_type_info[h->type].entry_size);
 
+        if (h->has_indirect)
+                *bucket_tag_virtual(h, swap, to) = *bucket_tag_virtual(h, swap, from);
+
         if (h->type == HASHMAP_TYPE_ORDERED) {
                 OrderedHashmap *lh = (OrderedHashmap*) h;
                 struct ordered_hashmap_entry *le, *le_to;
@@ -770,6 +835,10 @@ static void reset_direct_storage(HashmapBase *h) {
         memset(p, DIB_RAW_INIT, sizeof(dib_raw_t) * hi->n_direct_buckets);
 }
 
+static void shared_hash_key_initialize(void) {
+        random_bytes(shared_hash_key, sizeof(shared_hash_key));
+}
+
 static struct HashmapBase *hashmap_base_new(const struct hash_ops *hash_ops, enum HashmapType type HASHMAP_DEBUG_PARAMS) {
         HashmapBase *h;
         const struct hashmap_type_info *hi = &hashmap_type_info[type];
@@ -792,10 +861,9 @@ static struct HashmapBase *hashmap_base_new(const struct hash_ops *hash_ops, enu
 
         reset_direct_storage(h);
 
-        if (!shared_hash_key_initialized) {
-                random_bytes(shared_hash_key, sizeof(shared_hash_key));
-                shared_hash_key_initialized= true;
-        }
+        /* Hash tables may be allocated from several threads, and the first ones concurrently, too. The
+         * key must not change anymore once a hash table uses it. */
+        assert_se(pthread_once(&shared_hash_key_once, shared_hash_key_initialize) == 0);
 
 #if ENABLE_DEBUG_HASHMAP
         h->debug.func = func;
@@ -860,11 +928,9 @@ static void hashmap_free_no_clear(HashmapBase *h) {
         assert_se(pthread_mutex_unlock(&hashmap_debug_list_mutex) == 0);
 #endif
 
-        if (h->from_pool) {
-                /* Ensure that the object didn't get migrated between threads. */
-                assert_se(is_main_thread());
+        if (h->from_pool)
                 mempool_free_tile(hashmap_type_info[h->type].mempool, h);
-        } else
+        else
                 free(h);
 }
 
@@ -983,20 +1049,18 @@ static bool hashmap_put_robin_hood(HashmapBase *h, unsigned idx,
 /*
  * Puts an entry into a hashmap, boldly - no check whether key already exists.
  * The caller must place the entry (only its key and value, not link indexes)
- * in swap slot IDX_PUT.
+ * in swap slot IDX_PUT, and pass the hash value of its key.
  * Caller must ensure: the key does not exist yet in the hashmap.
  *                     that resize is not needed if !may_resize.
  * Returns: 1 if entry was put successfully.
  *          -ENOMEM if may_resize==true and resize failed with -ENOMEM.
  *          Cannot return -ENOMEM if !may_resize.
  */
-static int hashmap_base_put_boldly(HashmapBase *h, unsigned idx,
+static int hashmap_base_put_boldly(HashmapBase *h, uint64_t hash,
                                    struct swap_entries *swap, bool may_resize) {
         struct ordered_hashmap_entry *new_entry;
         int r;
 
-        assert(idx < n_buckets(h));
-
         new_entry = bucket_at_swap(swap, IDX_PUT);
 
         if (may_resize) {
@@ -1004,10 +1068,12 @@ static int hashmap_base_put_boldly(HashmapBase *h, unsigned idx,
                 if (r < 0)
                         return r;
                 if (r > 0)
-                        idx = bucket_hash(h, new_entry->p.b.key);
+                        hash = bucket_hash(h, new_entry->p.b.key);
         }
         assert(n_entries(h) < n_buckets(h));
 
+        swap->tags[IDX_PUT - _IDX_SWAP_BEGIN] = hash_to_tag(hash);
+
         if (h->type == HASHMAP_TYPE_ORDERED) {
                 OrderedHashmap *lh = (OrderedHashmap*) h;
 
@@ -1027,7 +1093,7 @@ static int hashmap_base_put_boldly(HashmapBase *h, unsigned idx,
                         lh->iterate_list_head = IDX_PUT;
         }
 
-        assert_se(hashmap_put_robin_hood(h, idx, swap) == false);
+        assert_se(hashmap_put_robin_hood(h, hash_to_idx(h, hash), swap) == false);
 
         n_entries_inc(h);
 #if ENABLE_DEBUG_HASHMAP
@@ -1038,8 +1104,8 @@ static int hashmap_base_put_boldly(HashmapBase *h, unsigned idx,
 
         return 1;
 }
-#define hashmap_put_boldly(h, idx, swap, may_resize) \
-        hashmap_base_put_boldly(HASHMAP_BASE(h), idx, swap, may_resize)
+#define hashmap_put_boldly(h, hash, swap, may_resize) \
+        hashmap_base_put_boldly(HASHMAP_BASE(h), hash, swap, may_resize)
 
 /*
  * Returns 0 if resize is not needed.
@@ -1050,8 +1116,10 @@ static int resize_buckets(HashmapBase *h, unsigned entries_add) {
         struct swap_entries swap;
         void *new_storage;
         dib_raw_t *old_dibs, *new_dibs;
+        hash_tag_t *new_tags;
         const struct hashmap_type_info *hi;
         unsigned idx, optimal_idx;
+        uint64_t hash;
         unsigned old_n_buckets, new_n_buckets, n_rehashed, new_n_entries;
         uint8_t new_shift;
         bool rehash_next;
@@ -1078,7 +1146,7 @@ static int resize_buckets(HashmapBase *h, unsigned entries_add) {
         if (_unlikely_(new_n_buckets < new_n_entries))
                 return -ENOMEM;
 
-        if (_unlikely_(new_n_buckets > UINT_MAX / (hi->entry_size + sizeof(dib_raw_t))))
+        if (_unlikely_(new_n_buckets > UINT_MAX / INDIRECT_BUCKET_SIZE(hi->entry_size)))
                 return -ENOMEM;
 
         old_n_buckets = n_buckets(h);
@@ -1087,10 +1155,10 @@ static int resize_buckets(HashmapBase *h, unsigned entries_add) {
                 return 0;
 
         new_shift = log2u_round_up(MAX(
-                        new_n_buckets * (hi->entry_size + sizeof(dib_raw_t)),
+                        new_n_buckets * INDIRECT_BUCKET_SIZE(hi->entry_size),
                         2 * sizeof(struct direct_storage)));
 
-        /* Realloc storage (buckets and DIB array). */
+        /* Realloc storage (buckets, DIB and tag arrays). */
         new_storage = realloc(h->has_indirect ? h->indirect.storage : NULL,
                               1U << new_shift);
         if (!new_storage)
@@ -1113,16 +1181,19 @@ static int resize_buckets(HashmapBase *h, unsigned entries_add) {
         h->has_indirect = true;
         h->indirect.storage = new_storage;
         h->indirect.n_buckets = (1U << new_shift) /
-                                (hi->entry_size + sizeof(dib_raw_t));
+                                INDIRECT_BUCKET_SIZE(hi->entry_size);
 
         old_dibs = (dib_raw_t*)((uint8_t*) new_storage + hi->entry_size * old_n_buckets);
         new_dibs = dib_raw_ptr(h);
+        new_tags = tag_ptr(h);
 
         /*
          * Move the DIB array to the new place, replacing valid DIB values with
          * DIB_RAW_REHASH to indicate all of the used buckets need rehashing.
          * Note: Overlap is not possible, because we have at least doubled the
-         * number of buckets and dib_raw_t is smaller than any entry type.
+         * number of buckets and dib_raw_t and hash_tag_t together are smaller
+         * than any entry type. The old tags are simply dropped, the new hash
+         * key changes them anyway.
          */
         for (idx = 0; idx < old_n_buckets; idx++) {
                 assert(old_dibs[idx] != DIB_RAW_REHASH);
@@ -1138,20 +1209,25 @@ static int resize_buckets(HashmapBase *h, unsigned entries_add) {
         memset(&new_dibs[old_n_buckets], DIB_RAW_INIT,
                (n_buckets(h) - old_n_buckets) * sizeof(dib_raw_t));
 
+        /* Tags of free buckets are never looked at, but are loaded with the others of their group */
+        memzero(new_tags, n_buckets(h) * sizeof(hash_tag_t));
+
         /* Rehash entries that need it */
         n_rehashed = 0;
         for (idx = 0; idx < old_n_buckets; idx++) {
                 if (new_dibs[idx] != DIB_RAW_REHASH)
                         continue;
 
-                optimal_idx = bucket_hash(h, bucket_at(h, idx)->key);
+                hash = bucket_hash(h, bucket_at(h, idx)->key);
+                optimal_idx = hash_to_idx(h, hash);
 
                 /*
                  * Not much to do if by luck the entry hashes to its current
-                 * location. Just set its DIB.
+                 * location. Just set its DIB and tag.
                  */
                 if (optimal_idx == idx) {
                         new_dibs[idx] = 0;
+                        new_tags[idx] = hash_to_tag(hash);
                         n_rehashed++;
                         continue;
                 }
@@ -1160,6 +1236,7 @@ static int resize_buckets(HashmapBase *h, unsigned entries_add) {
                 bucket_move_entry(h, &swap, idx, IDX_PUT);
                 /* bucket_move_entry does not clear the source */
                 memzero(bucket_at(h, idx), hi->entry_size);
+                swap.tags[IDX_PUT - _IDX_SWAP_BEGIN] = hash_to_tag(hash);
 
                 do {
                         /*
@@ -1170,8 +1247,11 @@ static int resize_buckets(HashmapBase *h, unsigned entries_add) {
                         n_rehashed++;
 
                         /* Did the current entry displace another one? */
-                        if (rehash_next)
-                                optimal_idx = bucket_hash(h, bucket_at_swap(&swap, IDX_PUT)->p.b.key);
+                        if (rehash_next) {
+                                hash = bucket_hash(h, bucket_at_swap(&swap, IDX_PUT)->p.b.key);
+                                optimal_idx = hash_to_idx(h, hash);
+                                swap.tags[IDX_PUT - _IDX_SWAP_BEGIN] = hash_to_tag(hash);
+                        }
                 } while (rehash_next);
         }
 
@@ -1180,18 +1260,136 @@ static int resize_buckets(HashmapBase *h, unsigned entries_add) {
         return 1;
 }
 
+#if BUCKET_GROUP_SIZE > 0
+/*
+ * Compares the metadata of the BUCKET_GROUP_SIZE buckets starting at 'idx'
+ * with what the entry we look for would have there, if it was placed in that
+ * bucket, i.e. a DIB of 'distance' plus the offset in the group and 'tag'.
+ * Sets bits in ret_match for buckets with matching DIB and tag, and in
+ * ret_stop for buckets at which the scan ends: free ones, and ones with a
+ * lower DIB.
+ * The caller must ensure that the group does not wrap around, and that the
+ * DIBs looked for stay below DIB_RAW_OVERFLOW. An entry with an overflown
+ * DIB then neither matches nor stops the scan, which is correct, because its
+ * actual DIB is larger.
+ */
+static void bucket_group_match(HashmapBase *h, unsigned idx, unsigned distance, hash_tag_t tag,
+                               unsigned *ret_match, unsigned *ret_stop) {
+        static const uint8_t offsets[BUCKET_GROUP_SIZE] = {
+                0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+        };
+        const dib_raw_t *dibs = dib_raw_ptr(h) + idx;
+        const hash_tag_t *tags = tag_ptr(h) + idx;
+
+        assert(idx + BUCKET_GROUP_SIZE <= n_buckets(h));
+        assert(distance + BUCKET_GROUP_SIZE <= DIB_RAW_OVERFLOW);
+
+#if defined(__SSE2__)
+        __m128i d, t, want, eq, le, free_bucket;
+
+        d = _mm_loadu_si128((const __m128i*) dibs);
+        t = _mm_loadu_si128((const __m128i*) tags);
+        want = _mm_add_epi8(_mm_set1_epi8((char) distance), _mm_loadu_si128((const __m128i*) offsets));
+
+        /* There is no unsigned less-than for bytes, but d <= want iff max(d, want) == want */
+        eq = _mm_cmpeq_epi8(d, want);
+        le = _mm_cmpeq_epi8(_mm_max_epu8(d, want), want);
+        free_bucket = _mm_cmpeq_epi8(d, _mm_set1_epi8((char) DIB_RAW_FREE));
+
+        *ret_match = _mm_movemask_epi8(_mm_and_si128(eq, _mm_cmpeq_epi8(t, _mm_set1_epi8((char) tag))));
+        *ret_stop = _mm_movemask_epi8(_mm_or_si128(_mm_andnot_si128(eq, le), free_bucket));
+#else
+        static const uint8_t bits[BUCKET_GROUP_SIZE] = {
+                1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+        };
+        uint8x16_t d, t, want, match, stop;
+
+        d = vld1q_u8(dibs);
+        t = vld1q_u8(tags);
+        want = vaddq_u8(vdupq_n_u8(distance), vld1q_u8(offsets));
+
+        match = vandq_u8(vceqq_u8(d, want), vceqq_u8(t, vdupq_n_u8(tag)));
+        stop = vorrq_u8(vcltq_u8(d, want), vceqq_u8(d, vdupq_n_u8(DIB_RAW_FREE)));
+
+        /* NEON has no movemask, assemble it from one bit per byte */
+        match = vandq_u8(match, vld1q_u8(bits));
+        stop = vandq_u8(stop, vld1q_u8(bits));
+        *ret_match = vaddv_u8(vget_low_u8(match)) | (vaddv_u8(vget_high_u8(match)) << 8);
+        *ret_stop = vaddv_u8(vget_low_u8(stop)) | (vaddv_u8(vget_high_u8(stop)) << 8);
+#endif
+}
+
+/*
+ * Continues a scan for 'key' at bucket 'idx' with DIB 'distance' a group of
+ * buckets at a time, as long as the groups do not wrap around.
+ * Returns: true if the scan is complete, with the index of the found entry
+ *          or IDX_NIL in ret. false if the caller needs to continue from
+ *          the updated idx and distance.
+ */
+static bool bucket_group_scan(HashmapBase *h, unsigned *idx, unsigned *distance, hash_tag_t tag,
+                              const void *key, unsigned *ret) {
+        struct hashmap_base_entry *e;
+
+        while (*idx + BUCKET_GROUP_SIZE <= n_buckets(h) &&
+               *distance + BUCKET_GROUP_SIZE <= DIB_RAW_OVERFLOW) {
+                unsigned match, stop;
+
+                bucket_group_match(h, *idx, *distance, tag, &match, &stop);
+
+                /* Only candidates before the first stop bucket count */
+                if (stop != 0)
+                        match &= (stop & -stop) - 1;
+
+                for (; match != 0; match &= match - 1) {
+                        unsigned i = *idx + __builtin_ctz(match);
+
+                        e = bucket_at(h, i);
+                        if (h->hash_ops->compare(e->key, key) == 0) {
+                                *ret = i;
+                                return true;
+                        }
+                }
+
+                if (stop != 0) {
+                        *ret = IDX_NIL;
+                        return true;
+                }
+
+                *idx = (*idx + BUCKET_GROUP_SIZE) % n_buckets(h);
+                *distance += BUCKET_GROUP_SIZE;
+        }
+
+        return false;
+}
+#endif
+
 /*
  * Finds an entry with a matching key
  * Returns: index of the found entry, or IDX_NIL if not found.
  */
-static unsigned base_bucket_scan(HashmapBase *h, unsigned idx, const void *key) {
+static unsigned base_bucket_scan(HashmapBase *h, uint64_t hash, const void *key) {
         struct hashmap_base_entry *e;
-        unsigned dib, distance;
+        unsigned idx, dib, distance;
         dib_raw_t *dibs = dib_raw_ptr(h);
+        hash_tag_t tag;
 
-        assert(idx < n_buckets(h));
+        idx = hash_to_idx(h, hash);
+        tag = hash_to_tag(hash);
 
         for (distance = 0; ; distance++) {
+#if BUCKET_GROUP_SIZE > 0
+                /* Most scans end within the first few buckets. Checking those one by one is faster, because
+                 * the CPU loads the entry while still looking at the DIB. Only longer scans, which happen with
+                 * full tables and poorly distributed hash values, compare a whole group of buckets at once.
+                 * Tags are only kept with indirect storage. */
+                if (distance == BUCKET_GROUP_SCAN_AFTER && h->has_indirect) {
+                        unsigned found;
+
+                        if (bucket_group_scan(h, &idx, &distance, tag, key, &found))
+                                return found;
+                }
+#endif
+
                 if (dibs[idx] == DIB_RAW_FREE)
                         return IDX_NIL;
 
@@ -1199,7 +1397,7 @@ static unsigned base_bucket_scan(HashmapBase *h, unsigned idx, const void *key)
 
                 if (dib < distance)
                         return IDX_NIL;
-                if (dib == distance) {
+                if (dib == distance && (!h->has_indirect || tag_ptr(h)[idx] == tag)) {
                         e = bucket_at(h, idx);
                         if (h->hash_ops->compare(e->key, key) == 0)
                                 return idx;
@@ -1208,12 +1406,13 @@ static unsigned base_bucket_scan(HashmapBase *h, unsigned idx, const void *key)
                 idx = next_idx(h, idx);
         }
 }
-#define bucket_scan(h, idx, key) base_bucket_scan(HASHMAP_BASE(h), idx, key)
+#define bucket_scan(h, hash, key) base_bucket_scan(HASHMAP_BASE(h), hash, key)
 
 int hashmap_put(Hashmap *h, const void *key, void *value) {
         struct swap_entries swap;
         struct plain_hashmap_entry *e;
-        unsigned hash, idx;
+        uint64_t hash;
+        unsigned idx;
 
         assert(h);
 
@@ -1235,7 +1434,8 @@ int hashmap_put(Hashmap *h, const void *key, void *value) {
 int set_put(Set *s, const void *key) {
         struct swap_entries swap;
         struct hashmap_base_entry *e;
-        unsigned hash, idx;
+        uint64_t hash;
+        unsigned idx;
 
         assert(s);
 
@@ -1252,7 +1452,8 @@ int set_put(Set *s, const void *key) {
 int hashmap_replace(Hashmap *h, const void *key, void *value) {
         struct swap_entries swap;
         struct plain_hashmap_entry *e;
-        unsigned hash, idx;
+        uint64_t hash;
+        unsigned idx;
 
         assert(h);
 
@@ -1285,7 +1486,8 @@ int hashmap_replace(Hashmap *h, const void *key, void *value) {
 
 int hashmap_update(Hashmap *h, const void *key, void *value) {
         struct plain_hashmap_entry *e;
-        unsigned hash, idx;
+        uint64_t hash;
+        unsigned idx;
 
         assert(h);
 
@@ -1303,7 +1505,8 @@ int hashmap_update(Hashmap *h, const void *key, void *value) {
 
 void *internal_hashmap_get(HashmapBase *h, const void *key) {
         struct hashmap_base_entry *e;
-        unsigned hash, idx;
+        uint64_t hash;
+        unsigned idx;
 
         if (!h)
                 return NULL;
@@ -1319,7 +1522,8 @@ void *internal_hashmap_get(HashmapBase *h, const void *key) {
 
 void *hashmap_get2(Hashmap *h, const void *key, void **key2) {
         struct plain_hashmap_entry *e;
-        unsigned hash, idx;
+        uint64_t hash;
+        unsigned idx;
 
         if (!h)
                 return NULL;
@@ -1337,7 +1541,7 @@ void *hashmap_get2(Hashmap *h, const void *key, void **key2) {
 }
 
 bool internal_hashmap_contains(HashmapBase *h, const void *key) {
-        unsigned hash;
+        uint64_t hash;
 
         if (!h)
                 return false;
@@ -1348,7 +1552,8 @@ bool internal_hashmap_contains(HashmapBase *h, const void *key) {
 
 void *internal_hashmap_remove(HashmapBase *h, const void *key) {
         struct hashmap_base_entry *e;
-        unsigned hash, idx;
+        uint64_t hash;
+        unsigned idx;
         void *data;
 
         if (!h)
@@ -1368,7 +1573,8 @@ void *internal_hashmap_remove(HashmapBase *h, const void *key) {
 
 void *hashmap_remove2(Hashmap *h, const void *key, void **rkey) {
         struct plain_hashmap_entry *e;
-        unsigned hash, idx;
+        uint64_t hash;
+        unsigned idx;
         void *data;
 
         if (!h) {
@@ -1398,7 +1604,8 @@ void *hashmap_remove2(Hashmap *h, const void *key, void **rkey) {
 int hashmap_remove_and_put(Hashmap *h, const void *old_key, const void *new_key, void *value) {
         struct swap_entries swap;
         struct plain_hashmap_entry *e;
-        unsigned old_hash, new_hash, idx;
+        uint64_t old_hash, new_hash;
+        unsigned idx;
 
         if (!h)
                 return -ENOENT;
@@ -1425,7 +1632,8 @@ int hashmap_remove_and_put(Hashmap *h, const void *old_key, const void *new_key,
 int set_remove_and_put(Set *s, const void *old_key, const void *new_key) {
         struct swap_entries swap;
         struct hashmap_base_entry *e;
-        unsigned old_hash, new_hash, idx;
+        uint64_t old_hash, new_hash;
+        unsigned idx;
 
         if (!s)
                 return -ENOENT;
@@ -1451,7 +1659,8 @@ int set_remove_and_put(Set *s, const void *old_key, const void *new_key) {
 int hashmap_remove_and_replace(Hashmap *h, const void *old_key, const void *new_key, void *value) {
         struct swap_entries swap;
         struct plain_hashmap_entry *e;
-        unsigned old_hash, new_hash, idx_old, idx_new;
+        uint64_t old_hash, new_hash;
+        unsigned idx_old, idx_new;
 
         if (!h)
                 return -ENOENT;
@@ -1486,7 +1695,8 @@ int hashmap_remove_and_replace(Hashmap *h, const void *old_key, const void *new_
 
 void *internal_hashmap_remove_value(HashmapBase *h, const void *key, void *value) {
         struct hashmap_base_entry *e;
-        unsigned hash, idx;
+        uint64_t hash;
+        unsigned idx;
 
         if (!h)
                 return NULL;
@@ -1632,7 +1842,7 @@ int internal_hashmap_move(HashmapBase *h, HashmapBase *other) {
                 return r;
 
         HASHMAP_FOREACH_IDX(idx, other, i) {
-                unsigned h_hash;
+                uint64_t h_hash;
 
                 e = bucket_at(other, idx);
                 h_hash = bucket_hash(h, e->key);
@@ -1654,7 +1864,8 @@ int internal_hashmap_move(HashmapBase *h, HashmapBase *other) {
 
 int internal_hashmap_move_one(HashmapBase *h, HashmapBase *other, const void *key) {
         struct swap_entries swap;
-        unsigned h_hash, other_hash, idx;
+        uint64_t h_hash, other_hash;
+        unsigned idx;
         struct hashmap_base_entry *e, *n;
         int r;
 
@@ -1738,7 +1949,8 @@ char **internal_hashmap_get_strv(HashmapBase *h) {
 
 void *ordered_hashmap_next(OrderedHashmap *h, const void *key) {
         struct ordered_hashmap_entry *e;
-        unsigned hash, idx;
+        uint64_t hash;
+        unsigned idx;
 
         if (!h)
                 return NULL;
@@ -85,6 +85,14 @@ int memfd_set_sealed(int fd) {
 
         assert(fd >= 0);
 
+        /* Once F_SEAL_SEAL is set no seals may be added anymore, not even the ones already set, hence check
+         * first, so that a memfd that is already sealed can be passed around more than once. */
+        r = memfd_get_sealed(fd);
+        if (r < 0)
+                return r;
+        if (r > 0)
+                return 0;
+
         r = fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
         if (r < 0)
                 return -errno;
@@ -1,5 +1,6 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -7,32 +8,131 @@
 #include "macro.h"
 #include "memory-util.h"
 #include "mempool.h"
-#include "process-util.h"
 #include "util.h"
 
+/* Number of tiles moved between a thread's cache and the shared free list at once. A cache holds at most
+ * twice as many. */
+#define MEMPOOL_BATCH 32U
+
 struct pool {
         struct pool *next;
         size_t n_tiles;
         size_t n_used;
 };
 
-void* mempool_alloc_tile(struct mempool *mp) {
-        size_t i;
+/* All pools used so far, so that their locks can be taken around fork() */
+static pthread_mutex_t mempools_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mempool *mempools = NULL;
 
-        /* When a tile is released we add it to the list and simply
-         * place the next pointer at its offset 0. */
+static void mempools_atfork_prepare(void) {
+        struct mempool *mp;
 
-        assert(mp->tile_size >= sizeof(void*));
-        assert(mp->at_least > 0);
+        /* Lock order: the list first, then the pools. No pool lock is held while taking the list lock. */
+        assert_se(pthread_mutex_lock(&mempools_lock) == 0);
+        for (mp = mempools; mp; mp = mp->next_registered)
+                assert_se(pthread_mutex_lock(&mp->lock) == 0);
+}
 
-        if (mp->freelist) {
-                void *r;
+static void mempools_atfork_release(void) {
+        struct mempool *mp;
 
-                r = mp->freelist;
-                mp->freelist = * (void**) mp->freelist;
-                return r;
+        /* Called in both the parent and the child. The thread that forked holds all locks, and it is the only
+         * thread in the child, hence it may release them there, too. */
+        for (mp = mempools; mp; mp = mp->next_registered)
+                assert_se(pthread_mutex_unlock(&mp->lock) == 0);
+        assert_se(pthread_mutex_unlock(&mempools_lock) == 0);
+}
+
+static int mempool_register(struct mempool *mp) {
+        static bool atfork_installed = false;
+        int r = 0;
+
+        /* Adds the pool to the list of pools locked around fork(). Call without the pool's lock held. */
+
+        if (__atomic_load_n(&mp->registered, __ATOMIC_ACQUIRE))
+                return 0;
+
+        assert_se(pthread_mutex_lock(&mempools_lock) == 0);
+
+        if (!mp->registered) {
+                if (!atfork_installed) {
+                        if (pthread_atfork(mempools_atfork_prepare, mempools_atfork_release, mempools_atfork_release) != 0) {
+                                r = -ENOMEM;
+                                goto finish;
+                        }
+
+                        atfork_installed = true;
+                }
+
+                mp->next_registered = mempools;
+                mempools = mp;
+                __atomic_store_n(&mp->registered, true, __ATOMIC_RELEASE);
+        }
+
+finish:
+        assert_se(pthread_mutex_unlock(&mempools_lock) == 0);
+        return r;
+}
+
+static void mempool_cache_flush(struct mempool *mp, struct mempool_cache *c, size_t n) {
+        /* Moves n tiles from the cache to the shared free list, and the pending statistics too. Call with the
+         * lock held. When a tile is released we add it to the list and simply place the next pointer at its
+         * offset 0. */
+
+        assert(n <= c->n_free);
+
+        for (; n > 0; n--) {
+                void *p = c->freelist;
+
+                c->freelist = * (void**) p;
+                c->n_free--;
+
+                * (void**) p = mp->freelist;
+                mp->freelist = p;
+                mp->n_free++;
+        }
+
+        mp->stats.n_allocs += c->n_allocs;
+        mp->stats.n_cache_hits += c->n_cache_hits;
+        c->n_allocs = c->n_cache_hits = 0;
+}
+
+static void mempool_cache_destroy(void *userdata) {
+        struct mempool_cache *c = userdata;
+        struct mempool *mp = c->mempool;
+
+        /* The thread exits, return whatever it has cached */
+
+        assert_se(pthread_mutex_lock(&mp->lock) == 0);
+        mempool_cache_flush(mp, c, c->n_free);
+        assert_se(pthread_mutex_unlock(&mp->lock) == 0);
+}
+
+static int mempool_cache_register(struct mempool *mp, struct mempool_cache *c) {
+        /* Makes sure the cache is emptied when the thread exits. Call with the lock held. */
+
+        if (c->mempool)
+                return 0;
+
+        if (!mp->cache_key_initialized) {
+                if (pthread_key_create(&mp->cache_key, mempool_cache_destroy) != 0)
+                        return -ENOMEM;
+
+                mp->cache_key_initialized = true;
         }
 
+        if (pthread_setspecific(mp->cache_key, c) != 0)
+                return -ENOMEM;
+
+        c->mempool = mp;
+        return 0;
+}
+
+static void *mempool_alloc_new_tile(struct mempool *mp) {
+        size_t i;
+
+        /* Call with the lock held */
+
         if (_unlikely_(!mp->first_pool) ||
             _unlikely_(mp->first_pool->n_used >= mp->first_pool->n_tiles)) {
                 size_t size, n;
@@ -52,13 +152,83 @@ void* mempool_alloc_tile(struct mempool *mp) {
                 p->n_used = 0;
 
                 mp->first_pool = p;
+                mp->stats.n_pools++;
         }
 
         i = mp->first_pool->n_used++;
+        mp->stats.n_tiles++;
 
         return ((uint8_t*) mp->first_pool) + ALIGN(sizeof(struct pool)) + i*mp->tile_size;
 }
 
+static int mempool_cache_refill(struct mempool *mp, struct mempool_cache *c) {
+        int r = 0;
+
+        assert(c->n_free == 0);
+
+        /* Tiles come from here first, hence every pool that is in use is registered */
+        r = mempool_register(mp);
+        if (r < 0)
+                return r;
+
+        assert_se(pthread_mutex_lock(&mp->lock) == 0);
+
+        r = mempool_cache_register(mp, c);
+        if (r < 0)
+                goto finish;
+
+        while (c->n_free < MEMPOOL_BATCH) {
+                void *p;
+
+                if (mp->freelist) {
+                        p = mp->freelist;
+                        mp->freelist = * (void**) p;
+                        mp->n_free--;
+                } else {
+                        p = mempool_alloc_new_tile(mp);
+                        if (!p) {
+                                /* Only fail if we got nothing at all */
+                                if (c->n_free == 0)
+                                        r = -ENOMEM;
+                                break;
+                        }
+                }
+
+                * (void**) p = c->freelist;
+                c->freelist = p;
+                c->n_free++;
+        }
+
+        /* Take the opportunity to publish the statistics */
+        mempool_cache_flush(mp, c, 0);
+
+finish:
+        assert_se(pthread_mutex_unlock(&mp->lock) == 0);
+        return r;
+}
+
+void* mempool_alloc_tile(struct mempool *mp) {
+        struct mempool_cache *c;
+        void *r;
+
+        assert(mp->tile_size >= sizeof(void*));
+        assert(mp->at_least > 0);
+
+        c = mp->get_cache();
+
+        if (c->freelist)
+                c->n_cache_hits++;
+        else if (mempool_cache_refill(mp, c) < 0)
+                return NULL;
+
+        r = c->freelist;
+        c->freelist = * (void**) r;
+        c->n_free--;
+        c->n_allocs++;
+
+        return r;
+}
+
 void* mempool_alloc0_tile(struct mempool *mp) {
         void *p;
 
@@ -69,22 +239,63 @@ void* mempool_alloc0_tile(struct mempool *mp) {
 }
 
 void mempool_free_tile(struct mempool *mp, void *p) {
-        * (void**) p = mp->freelist;
-        mp->freelist = p;
+        struct mempool_cache *c;
+
+        c = mp->get_cache();
+
+        * (void**) p = c->freelist;
+        c->freelist = p;
+        c->n_free++;
+
+        /* If the tile came from another thread, this cache might not be registered yet, and is not returned
+         * when this thread exits. Flush it right away then, the lock is needed for registering anyway. */
+        if (c->n_free >= 2 * MEMPOOL_BATCH || !c->mempool) {
+                assert_se(pthread_mutex_lock(&mp->lock) == 0);
+                if (mempool_cache_register(mp, c) < 0)
+                        mempool_cache_flush(mp, c, c->n_free);
+                else if (c->n_free >= 2 * MEMPOOL_BATCH)
+                        mempool_cache_flush(mp, c, MEMPOOL_BATCH);
+                assert_se(pthread_mutex_unlock(&mp->lock) == 0);
+        }
+}
+
+void mempool_get_stats(struct mempool *mp, MempoolStats *ret) {
+        struct mempool_cache *c;
+
+        assert(mp);
+        assert(ret);
+
+        /* Other threads add their numbers only when they next take the lock, hence this is not exact */
+
+        c = mp->get_cache();
+
+        (void) mempool_register(mp);
+
+        assert_se(pthread_mutex_lock(&mp->lock) == 0);
+        *ret = mp->stats;
+        ret->n_free = mp->n_free;
+        assert_se(pthread_mutex_unlock(&mp->lock) == 0);
+
+        ret->n_allocs += c->n_allocs;
+        ret->n_cache_hits += c->n_cache_hits;
+}
+
+static bool mempool_enabled_by_env = false;
+
+static void mempool_enabled_initialize(void) {
+        mempool_enabled_by_env = getenv_bool("SYSTEMD_MEMPOOL") != 0;
 }
 
 bool mempool_enabled(void) {
-        static int b = -1;
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
 
-        if (!is_main_thread())
+        if (!mempool_use_allowed)
                 return false;
 
-        if (!mempool_use_allowed)
-                b = false;
-        if (b < 0)
-                b = getenv_bool("SYSTEMD_MEMPOOL") != 0;
+        /* The first hash tables might be allocated concurrently from several threads */
+        assert_se(pthread_once(&once, mempool_enabled_initialize) == 0);
 
-        return b;
+        return mempool_enabled_by_env;
 }
 
 #if VALGRIND
@@ -1,26 +1,72 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 #pragma once
 
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "macro.h"
+
 struct pool;
+struct mempool;
+
+/* Tiles are handed out from a small per-thread cache. Only when that runs empty, or collects too many freed
+ * tiles, a batch of tiles is moved from or to the free list shared by all threads, under the lock. Hence
+ * tiles may be freed in a different thread than the one that allocated them. */
+struct mempool_cache {
+        struct mempool *mempool;  /* set once the cache is registered for cleanup on thread exit */
+        void *freelist;
+        size_t n_free;
+
+        /* Statistics not yet added to the pool's */
+        uint64_t n_allocs;
+        uint64_t n_cache_hits;
+};
+
+typedef struct MempoolStats {
+        size_t n_pools;         /* number of chunks allocated with malloc() */
+        size_t n_tiles;         /* tiles carved out of the chunks so far */
+        size_t n_free;          /* tiles in the shared free list, not counting those in thread caches */
+        uint64_t n_allocs;      /* allocated tiles */
+        uint64_t n_cache_hits;  /* allocations served from a thread's cache, without taking the lock */
+} MempoolStats;
 
+/* Pools are used across threads, hence all pools that were used so far are locked while the process forks, via
+ * pthread_atfork(). Otherwise a child forked while another thread holds a lock deadlocks on its first
+ * allocation. This does not cover raw clone() calls, children created that way must not use any pools. */
 struct mempool {
+        pthread_mutex_t lock;   /* protects everything below, except the immutable parameters */
+        struct mempool *next_registered; /* in the list of pools used so far, protected by its own lock */
+        bool registered;
         struct pool *first_pool;
         void *freelist;
+        size_t n_free;
+        pthread_key_t cache_key;
+        bool cache_key_initialized;
+        MempoolStats stats;
+
         size_t tile_size;
         unsigned at_least;
+        struct mempool_cache* (*get_cache)(void);
 };
 
 void* mempool_alloc_tile(struct mempool *mp);
 void* mempool_alloc0_tile(struct mempool *mp);
 void mempool_free_tile(struct mempool *mp, void *p);
 
-#define DEFINE_MEMPOOL(pool_name, tile_type, alloc_at_least) \
-static struct mempool pool_name = { \
-        .tile_size = sizeof(tile_type), \
-        .at_least = alloc_at_least, \
+void mempool_get_stats(struct mempool *mp, MempoolStats *ret);
+
+#define DEFINE_MEMPOOL(pool_name, tile_type, alloc_at_least)           \
+static thread_local struct mempool_cache pool_name##_cache;             \
+static struct mempool_cache *pool_name##_get_cache(void) {              \
+        return &pool_name##_cache;                                      \
+}                                                                       \
+static struct mempool pool_name = {                                     \
+        .lock = PTHREAD_MUTEX_INITIALIZER,                              \
+        .tile_size = sizeof(tile_type),                                 \
+        .at_least = alloc_at_least,                                     \
+        .get_cache = pool_name##_get_cache,                             \
 }
 
 extern const bool mempool_use_allowed;
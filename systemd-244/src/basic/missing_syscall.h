@@ -524,3 +524,27 @@ static inline long missing_get_mempolicy(int *mode, unsigned long *nodemask,
 
 #define get_mempolicy missing_get_mempolicy
 #endif
+
+/* ======================================================================= */
+
+#if HAVE_PIDFD_OPEN
+#  include <sys/pidfd.h>
+#else
+/* may be (invalid) negative number due to libseccomp, see PR 13319 */
+#  if ! (defined __NR_pidfd_open && __NR_pidfd_open > 0)
+#    if defined __NR_pidfd_open
+#      undef __NR_pidfd_open
+#    endif
+#    if defined __alpha__
+#      define __NR_pidfd_open 544
+#    else
+#      define __NR_pidfd_open 434 /* the same on all other architectures */
+#    endif
+#  endif
+
+static inline int missing_pidfd_open(pid_t pid, unsigned flags) {
+        return syscall(__NR_pidfd_open, pid, flags);
+}
+
+#  define pidfd_open missing_pidfd_open
+#endif
@@ -0,0 +1,283 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+/*
+ * Hierarchical Timer Wheel
+ * The timer wheel orders entries by a timestamp key, and allows O(1) insertion and removal, and cheap access to the
+ * entry with the lowest key. Keys are bucketed in ticks of about a millisecond, relative to a base tick that is
+ * moved forward with timer_wheel_advance() as time passes. The wheel has a number of levels of 64 slots each: an
+ * entry is placed in the level of the highest group of 6 bits in which its tick differs from the base tick, and in
+ * the slot selected by that group. Hence all entries in a level are later than those in the levels below, and the
+ * slots of a level are in order. Entries with keys before the base tick are kept in a separate list.
+ *
+ * Finding the lowest key means scanning the first non-empty slot, the result is cached until that entry is
+ * removed. When the base tick moves into the range of a slot in a higher level, the slot's entries are
+ * redistributed to the levels below, so that the slots near the base tick, from which entries are taken, stay
+ * small.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "alloc-util.h"
+#include "timer-wheel.h"
+#include "util.h"
+
+#define TIMER_WHEEL_GRANULARITY_BITS 10U
+#define TIMER_WHEEL_SLOT_BITS 6U
+#define TIMER_WHEEL_SLOTS (1U << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVELS 9U
+
+/* Enough levels to cover all ticks */
+assert_cc(TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS >= 64U - TIMER_WHEEL_GRANULARITY_BITS);
+
+/* Slots are numbered from 1, see TIMER_WHEEL_SLOT_NULL */
+#define TIMER_WHEEL_SLOT_OVERDUE (1U + TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+
+struct TimerWheel {
+        uint64_t base; /* in ticks */
+        unsigned n_entries;
+
+        /* The entry with the lowest key, if min_dirty is false */
+        TimerWheelEntry *min;
+        bool min_dirty;
+
+        uint64_t occupied[TIMER_WHEEL_LEVELS];
+        LIST_HEAD(TimerWheelEntry, slots[TIMER_WHEEL_SLOT_OVERDUE + 1]);
+};
+
+static uint64_t usec_to_tick(usec_t u) {
+        return u >> TIMER_WHEEL_GRANULARITY_BITS;
+}
+
+static unsigned slot_level(unsigned slot) {
+        assert(slot > TIMER_WHEEL_SLOT_NULL && slot < TIMER_WHEEL_SLOT_OVERDUE);
+
+        return (slot - 1) / TIMER_WHEEL_SLOTS;
+}
+
+static unsigned slot_index(unsigned slot) {
+        assert(slot > TIMER_WHEEL_SLOT_NULL && slot < TIMER_WHEEL_SLOT_OVERDUE);
+
+        return (slot - 1) % TIMER_WHEEL_SLOTS;
+}
+
+static unsigned slot_make(unsigned level, unsigned idx) {
+        assert(level < TIMER_WHEEL_LEVELS);
+        assert(idx < TIMER_WHEEL_SLOTS);
+
+        return 1 + level * TIMER_WHEEL_SLOTS + idx;
+}
+
+static unsigned timer_wheel_slot_for_key(TimerWheel *w, usec_t key) {
+        uint64_t t = usec_to_tick(key);
+        unsigned level;
+
+        if (t < w->base)
+                return TIMER_WHEEL_SLOT_OVERDUE;
+
+        level = u64log2(t ^ w->base) / TIMER_WHEEL_SLOT_BITS;
+        return slot_make(level, (t >> (level * TIMER_WHEEL_SLOT_BITS)) & (TIMER_WHEEL_SLOTS - 1));
+}
+
+static void timer_wheel_link(TimerWheel *w, TimerWheelEntry *e) {
+        unsigned slot;
+
+        slot = timer_wheel_slot_for_key(w, e->key);
+
+        LIST_PREPEND(entries, w->slots[slot], e);
+        e->slot = slot;
+
+        if (slot != TIMER_WHEEL_SLOT_OVERDUE)
+                w->occupied[slot_level(slot)] |= UINT64_C(1) << slot_index(slot);
+}
+
+static void timer_wheel_unlink(TimerWheel *w, TimerWheelEntry *e) {
+        unsigned slot = e->slot;
+
+        assert(timer_wheel_entry_linked(e));
+
+        LIST_REMOVE(entries, w->slots[slot], e);
+        e->slot = TIMER_WHEEL_SLOT_NULL;
+
+        if (slot != TIMER_WHEEL_SLOT_OVERDUE && !w->slots[slot])
+                w->occupied[slot_level(slot)] &= ~(UINT64_C(1) << slot_index(slot));
+}
+
+TimerWheel *timer_wheel_new(void) {
+        return new0(TimerWheel, 1);
+}
+
+TimerWheel *timer_wheel_free(TimerWheel *w) {
+        unsigned slot;
+
+        if (!w)
+                return NULL;
+
+        /* Leave the entries in a sane state, the memory is owned by the caller */
+        for (slot = 1; slot <= TIMER_WHEEL_SLOT_OVERDUE; slot++) {
+                TimerWheelEntry *e;
+
+                while ((e = w->slots[slot]))
+                        timer_wheel_unlink(w, e);
+        }
+
+        return mfree(w);
+}
+
+int timer_wheel_ensure_allocated(TimerWheel **w) {
+        assert(w);
+
+        if (*w)
+                return 0;
+
+        *w = timer_wheel_new();
+        if (!*w)
+                return -ENOMEM;
+
+        return 0;
+}
+
+void timer_wheel_put(TimerWheel *w, TimerWheelEntry *e, usec_t key) {
+        assert(w);
+        assert(e);
+
+        /* Inserts the entry, or moves it if it is already in the wheel */
+
+        timer_wheel_remove(w, e);
+
+        e->key = key;
+        timer_wheel_link(w, e);
+        w->n_entries++;
+
+        if (!w->min_dirty && (!w->min || key < w->min->key))
+                w->min = e;
+}
+
+void timer_wheel_remove(TimerWheel *w, TimerWheelEntry *e) {
+        assert(w);
+        assert(e);
+
+        if (!timer_wheel_entry_linked(e))
+                return;
+
+        timer_wheel_unlink(w, e);
+
+        assert(w->n_entries > 0);
+        w->n_entries--;
+
+        if (w->min == e) {
+                w->min = NULL;
+                w->min_dirty = w->n_entries > 0;
+        }
+}
+
+static TimerWheelEntry *slot_find_min(TimerWheel *w, unsigned slot) {
+        TimerWheelEntry *e, *min = NULL;
+
+        LIST_FOREACH(entries, e, w->slots[slot])
+                if (!min || e->key < min->key)
+                        min = e;
+
+        return min;
+}
+
+TimerWheelEntry *timer_wheel_peek(TimerWheel *w) {
+        unsigned level;
+
+        if (!w)
+                return NULL;
+
+        if (!w->min_dirty)
+                return w->min;
+
+        if (w->slots[TIMER_WHEEL_SLOT_OVERDUE])
+                w->min = slot_find_min(w, TIMER_WHEEL_SLOT_OVERDUE);
+        else
+                for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+                        if (w->occupied[level] == 0)
+                                continue;
+
+                        /* All slots of a level are in order, take the first one that is used */
+                        w->min = slot_find_min(w, slot_make(level, __builtin_ctzll(w->occupied[level])));
+                        break;
+                }
+
+        assert(w->min);
+        w->min_dirty = false;
+
+        return w->min;
+}
+
+static void timer_wheel_relink_slot(TimerWheel *w, unsigned slot) {
+        LIST_HEAD(TimerWheelEntry, list);
+        TimerWheelEntry *e;
+
+        /* Detach the whole list first, as entries might end up in the same slot again */
+        list = TAKE_PTR(w->slots[slot]);
+        if (slot != TIMER_WHEEL_SLOT_OVERDUE)
+                w->occupied[slot_level(slot)] &= ~(UINT64_C(1) << slot_index(slot));
+
+        while ((e = list)) {
+                LIST_REMOVE(entries, list, e);
+                timer_wheel_link(w, e);
+        }
+}
+
+void timer_wheel_advance(TimerWheel *w, usec_t now) {
+        uint64_t t, changed;
+        unsigned level, top, idx;
+
+        if (!w)
+                return;
+
+        t = usec_to_tick(now);
+        if (t == w->base)
+                return;
+
+        if (t < w->base) {
+                unsigned slot;
+
+                /* The clock went backwards, rebuild everything. This is rare. */
+                w->base = t;
+                for (slot = 1; slot <= TIMER_WHEEL_SLOT_OVERDUE; slot++)
+                        if (w->slots[slot])
+                                timer_wheel_relink_slot(w, slot);
+
+                return;
+        }
+
+        /* Moving forward only affects the levels up to the highest one in which the base changed: in the levels
+         * below, and in the slots before the new base in that level, there can only be entries that are overdue
+         * now. The entries in the slot the new base lies in need to be moved down. Usually the caller removed the
+         * overdue entries already, hence usually this is just the one slot. */
+
+        changed = t ^ w->base;
+        top = u64log2(changed) / TIMER_WHEEL_SLOT_BITS;
+        w->base = t;
+
+        for (level = 0; level < top; level++)
+                while (w->occupied[level] != 0)
+                        timer_wheel_relink_slot(w, slot_make(level, __builtin_ctzll(w->occupied[level])));
+
+        idx = (t >> (top * TIMER_WHEEL_SLOT_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+        while (w->occupied[top] != 0) {
+                unsigned first = __builtin_ctzll(w->occupied[top]);
+
+                /* In the lowest level the slot of the base is where its entries belong anyway */
+                if (first > idx || (first == idx && top == 0))
+                        break;
+
+                timer_wheel_relink_slot(w, slot_make(top, first));
+        }
+}
+
+unsigned timer_wheel_size(TimerWheel *w) {
+        if (!w)
+                return 0;
+
+        return w->n_entries;
+}
+
+bool timer_wheel_isempty(TimerWheel *w) {
+        return timer_wheel_size(w) == 0;
+}
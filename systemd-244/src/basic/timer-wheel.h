@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include <stdbool.h>
+
+#include "list.h"
+#include "macro.h"
+#include "time-util.h"
+
+typedef struct TimerWheel TimerWheel;
+typedef struct TimerWheelEntry TimerWheelEntry;
+
+/* Slot number of an entry that is not linked into a wheel. Zero, so that zero-initialized entries are unlinked. */
+#define TIMER_WHEEL_SLOT_NULL 0U
+
+/* To be embedded in the objects put into the wheel */
+struct TimerWheelEntry {
+        usec_t key;
+        unsigned slot;
+        LIST_FIELDS(TimerWheelEntry, entries);
+};
+
+TimerWheel *timer_wheel_new(void);
+TimerWheel *timer_wheel_free(TimerWheel *w);
+DEFINE_TRIVIAL_CLEANUP_FUNC(TimerWheel*, timer_wheel_free);
+int timer_wheel_ensure_allocated(TimerWheel **w);
+
+void timer_wheel_put(TimerWheel *w, TimerWheelEntry *e, usec_t key);
+void timer_wheel_remove(TimerWheel *w, TimerWheelEntry *e);
+
+TimerWheelEntry *timer_wheel_peek(TimerWheel *w);
+void timer_wheel_advance(TimerWheel *w, usec_t now);
+
+unsigned timer_wheel_size(TimerWheel *w) _pure_;
+bool timer_wheel_isempty(TimerWheel *w) _pure_;
+
+static inline bool timer_wheel_entry_linked(const TimerWheelEntry *e) {
+        return e->slot != TIMER_WHEEL_SLOT_NULL;
+}
@@ -2305,12 +2305,14 @@ static int unit_realize_cgroup_now(Unit *u, ManagerState state) {
 unsigned manager_dispatch_cgroup_realize_queue(Manager *m) {
         ManagerState state;
         unsigned n = 0;
+        usec_t begin;
         Unit *i;
         int r;
 
         assert(m);
 
         state = manager_state(m);
+        begin = now(CLOCK_MONOTONIC);
 
         while ((i = m->cgroup_realize_queue)) {
                 assert(i->in_cgroup_realize_queue);
@@ -2328,6 +2330,7 @@ unsigned manager_dispatch_cgroup_realize_queue(Manager *m) {
                 n++;
         }
 
+        manager_record_phase(m, MANAGER_PHASE_CGROUP_REALIZE_QUEUE, begin, n);
         return n;
 }
 
@@ -4,6 +4,7 @@
 
 #include "alloc-util.h"
 #include "dbus-job.h"
+#include "dbus-manager.h"
 #include "dbus-unit.h"
 #include "dbus.h"
 #include "job.h"
@@ -188,6 +189,13 @@ void bus_job_send_change_signal(Job *j) {
                 log_debug_errno(r, "Failed to send job change signal for %u: %m", j->id);
 
         j->sent_dbus_new_signal = true;
+        j->manager->n_change_signals_emitted++;
+
+        /* Batched subscribers get the new state with the next JobsChanged signal, once per batch */
+        if (!j->in_dbus_batch_queue && bus_manager_has_batched_subscribers(j->manager)) {
+                LIST_PREPEND(dbus_batch_queue, j->manager->dbus_job_batch_queue, j);
+                j->in_dbus_batch_queue = true;
+        }
 }
 
 void bus_job_send_pending_change_signal(Job *j, bool including_new) {
@@ -245,7 +253,7 @@ void bus_job_send_removed_signal(Job *j) {
         /* Make sure that any change signal on the unit is reflected before we send out the change signal on the job */
         bus_unit_send_pending_change_signal(j->unit, true);
 
-        r = bus_foreach_bus(j->manager, j->bus_track, send_removed_signal, j);
+        r = bus_foreach_bus_full(j->manager, j->bus_track, true, send_removed_signal, j);
         if (r < 0)
                 log_debug_errno(r, "Failed to send job remove signal for %u: %m", j->id);
 }
@@ -1151,6 +1151,38 @@ static int method_subscribe(sd_bus_message *message, void *userdata, sd_bus_erro
         return sd_bus_reply_method_return(message, NULL);
 }
 
+static int method_subscribe_batched(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+        Manager *m = userdata;
+        int r;
+
+        assert(message);
+        assert(m);
+
+        /* Anyone can call this method */
+
+        r = mac_selinux_access_check(message, "status", error);
+        if (r < 0)
+                return r;
+
+        /* Direct bus connections get all signals anyway, batching is only available on the API bus */
+        if (sd_bus_message_get_bus(message) != m->api_bus)
+                return sd_bus_error_setf(error, SD_BUS_ERROR_NOT_SUPPORTED, "Batched change signals are only available on the system or user bus.");
+
+        if (!m->subscribed_batched) {
+                r = sd_bus_track_new(sd_bus_message_get_bus(message), &m->subscribed_batched, NULL, NULL);
+                if (r < 0)
+                        return r;
+        }
+
+        r = sd_bus_track_add_sender(m->subscribed_batched, message);
+        if (r < 0)
+                return r;
+        if (r == 0)
+                return sd_bus_error_setf(error, BUS_ERROR_ALREADY_SUBSCRIBED, "Client is already subscribed.");
+
+        return sd_bus_reply_method_return(message, NULL);
+}
+
 static int method_unsubscribe(sd_bus_message *message, void *userdata, sd_bus_error *error) {
         Manager *m = userdata;
         int r;
@@ -1165,10 +1197,17 @@ static int method_unsubscribe(sd_bus_message *message, void *userdata, sd_bus_er
                 return r;
 
         if (sd_bus_message_get_bus(message) == m->api_bus) {
+                int k;
+
                 r = sd_bus_track_remove_sender(m->subscribed, message);
                 if (r < 0)
                         return r;
-                if (r == 0)
+
+                k = sd_bus_track_remove_sender(m->subscribed_batched, message);
+                if (k < 0)
+                        return k;
+
+                if (r == 0 && k == 0)
                         return sd_bus_error_setf(error, BUS_ERROR_NOT_SUBSCRIBED, "Client is not subscribed.");
         }
 
@@ -1726,6 +1765,74 @@ static int method_get_dynamic_users(sd_bus_message *message, void *userdata, sd_
         return sd_bus_send(NULL, reply, NULL);
 }
 
+static int method_get_dispatch_profile(sd_bus_message *message, void *userdata, sd_bus_error *error) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+        Manager *m = userdata;
+        ManagerPhase p;
+        uint64_t i;
+        int r;
+
+        assert(message);
+        assert(m);
+
+        /* Anyone can call this method */
+
+        r = mac_selinux_access_check(message, "status", error);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_new_method_return(message, &reply);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_open_container(reply, 'a', "(stttt)");
+        if (r < 0)
+                return r;
+
+        for (p = 0; p < _MANAGER_PHASE_MAX; p++) {
+                const ManagerPhaseCounter *c = m->phase_counters + p;
+
+                r = sd_bus_message_append(reply, "(stttt)",
+                                          manager_phase_to_string(p),
+                                          c->n_spans,
+                                          c->n_items,
+                                          c->total_usec,
+                                          c->max_usec);
+                if (r < 0)
+                        return r;
+        }
+
+        r = sd_bus_message_close_container(reply);
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_open_container(reply, 'a', "(sttu)");
+        if (r < 0)
+                return r;
+
+        /* Spans in the order they ended, oldest first */
+        if (m->dispatch_spans)
+                for (i = m->n_dispatch_spans > MANAGER_DISPATCH_SPANS_MAX ? m->n_dispatch_spans - MANAGER_DISPATCH_SPANS_MAX : 0;
+                     i < m->n_dispatch_spans;
+                     i++) {
+                        const ManagerDispatchSpan *s = m->dispatch_spans + i % MANAGER_DISPATCH_SPANS_MAX;
+
+                        r = sd_bus_message_append(reply, "(sttu)",
+                                                  manager_phase_to_string(s->phase),
+                                                  s->begin,
+                                                  s->duration,
+                                                  s->n_items);
+                        if (r < 0)
+                                return r;
+                }
+
+        r = sd_bus_message_close_container(reply);
+        if (r < 0)
+                return r;
+
+        return sd_bus_send(NULL, reply, NULL);
+}
+
 static int list_unit_files_by_patterns(sd_bus_message *message, void *userdata, sd_bus_error *error, char **states, char **patterns) {
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *reply = NULL;
         Manager *m = userdata;
@@ -2404,6 +2511,8 @@ const sd_bus_vtable bus_manager_vtable[] = {
         SD_BUS_PROPERTY("NJobs", "u", property_get_hashmap_size, offsetof(Manager, jobs), 0),
         SD_BUS_PROPERTY("NInstalledJobs", "u", bus_property_get_unsigned, offsetof(Manager, n_installed_jobs), 0),
         SD_BUS_PROPERTY("NFailedJobs", "u", bus_property_get_unsigned, offsetof(Manager, n_failed_jobs), 0),
+        SD_BUS_PROPERTY("ChangeSignalsEmitted", "t", NULL, offsetof(Manager, n_change_signals_emitted), 0),
+        SD_BUS_PROPERTY("ChangeSignalsSuppressed", "t", NULL, offsetof(Manager, n_change_signals_suppressed), 0),
         SD_BUS_PROPERTY("Progress", "d", property_get_progress, 0, 0),
         SD_BUS_PROPERTY("Environment", "as", property_get_environment, 0, 0),
         SD_BUS_PROPERTY("ConfirmSpawn", "b", bus_property_get_bool, offsetof(Manager, confirm_spawn), SD_BUS_VTABLE_PROPERTY_CONST),
@@ -2506,6 +2615,7 @@ const sd_bus_vtable bus_manager_vtable[] = {
         SD_BUS_METHOD("ListUnitsByNames", "as", "a(ssssssouso)", method_list_units_by_names, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("ListJobs", NULL, "a(usssoo)", method_list_jobs, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("Subscribe", NULL, NULL, method_subscribe, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("SubscribeBatched", NULL, NULL, method_subscribe_batched, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("Unsubscribe", NULL, NULL, method_unsubscribe, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("Dump", NULL, "s", method_dump, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("DumpByFileDescriptor", NULL, "h", method_dump_by_fd, SD_BUS_VTABLE_UNPRIVILEGED),
@@ -2543,6 +2653,7 @@ const sd_bus_vtable bus_manager_vtable[] = {
         SD_BUS_METHOD("LookupDynamicUserByName", "s", "u", method_lookup_dynamic_user_by_name, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("LookupDynamicUserByUID", "u", "s", method_lookup_dynamic_user_by_uid, SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_METHOD("GetDynamicUsers", NULL, "a(us)", method_get_dynamic_users, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("GetDispatchProfile", NULL, "a(stttt)a(sttu)", method_get_dispatch_profile, SD_BUS_VTABLE_UNPRIVILEGED),
 
         SD_BUS_SIGNAL("UnitNew", "so", 0),
         SD_BUS_SIGNAL("UnitRemoved", "so", 0),
@@ -2551,6 +2662,8 @@ const sd_bus_vtable bus_manager_vtable[] = {
         SD_BUS_SIGNAL("StartupFinished", "tttttt", 0),
         SD_BUS_SIGNAL("UnitFilesChanged", NULL, 0),
         SD_BUS_SIGNAL("Reloading", "b", 0),
+        SD_BUS_SIGNAL("UnitsChanged", "a(sosss)", 0),
+        SD_BUS_SIGNAL("JobsChanged", "a(uosss)", 0),
 
         SD_BUS_VTABLE_END
 };
@@ -2648,3 +2761,141 @@ void bus_manager_send_change_signal(Manager *m) {
         if (r < 0)
                 log_debug_errno(r, "Failed to send manager change signal: %m");
 }
+
+bool bus_manager_has_batched_subscribers(Manager *m) {
+        assert(m);
+
+        return m->api_bus && sd_bus_track_count(m->subscribed_batched) > 0;
+}
+
+static int send_units_changed(sd_bus *bus, Manager *m) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *message = NULL;
+        int r;
+
+        assert(bus);
+        assert(m);
+
+        r = sd_bus_message_new_signal(bus, &message, "/org/freedesktop/systemd1", "org.freedesktop.systemd1.Manager", "UnitsChanged");
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_open_container(message, 'a', "(sosss)");
+        if (r < 0)
+                return r;
+
+        while (m->dbus_unit_batch_queue) {
+                _cleanup_free_ char *path = NULL;
+                Unit *u = m->dbus_unit_batch_queue;
+
+                LIST_REMOVE(dbus_batch_queue, m->dbus_unit_batch_queue, u);
+                u->in_dbus_batch_queue = false;
+
+                path = unit_dbus_path(u);
+                if (!path)
+                        return -ENOMEM;
+
+                r = sd_bus_message_append(
+                                message, "(sosss)",
+                                u->id,
+                                path,
+                                unit_load_state_to_string(u->load_state),
+                                unit_active_state_to_string(unit_active_state(u)),
+                                unit_sub_state_to_string(u));
+                if (r < 0)
+                        return r;
+        }
+
+        r = sd_bus_message_close_container(message);
+        if (r < 0)
+                return r;
+
+        return sd_bus_send(bus, message, NULL);
+}
+
+static int send_jobs_changed(sd_bus *bus, Manager *m) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *message = NULL;
+        int r;
+
+        assert(bus);
+        assert(m);
+
+        r = sd_bus_message_new_signal(bus, &message, "/org/freedesktop/systemd1", "org.freedesktop.systemd1.Manager", "JobsChanged");
+        if (r < 0)
+                return r;
+
+        r = sd_bus_message_open_container(message, 'a', "(uosss)");
+        if (r < 0)
+                return r;
+
+        while (m->dbus_job_batch_queue) {
+                _cleanup_free_ char *path = NULL;
+                Job *j = m->dbus_job_batch_queue;
+
+                LIST_REMOVE(dbus_batch_queue, m->dbus_job_batch_queue, j);
+                j->in_dbus_batch_queue = false;
+
+                path = job_dbus_path(j);
+                if (!path)
+                        return -ENOMEM;
+
+                r = sd_bus_message_append(
+                                message, "(uosss)",
+                                j->id,
+                                path,
+                                j->unit->id,
+                                job_type_to_string(j->type),
+                                job_state_to_string(j->state));
+                if (r < 0)
+                        return r;
+        }
+
+        r = sd_bus_message_close_container(message);
+        if (r < 0)
+                return r;
+
+        return sd_bus_send(bus, message, NULL);
+}
+
+static void bus_manager_flush_change_batch(Manager *m) {
+        Unit *u;
+        Job *j;
+
+        assert(m);
+
+        while ((u = m->dbus_unit_batch_queue)) {
+                LIST_REMOVE(dbus_batch_queue, m->dbus_unit_batch_queue, u);
+                u->in_dbus_batch_queue = false;
+        }
+
+        while ((j = m->dbus_job_batch_queue)) {
+                LIST_REMOVE(dbus_batch_queue, m->dbus_job_batch_queue, j);
+                j->in_dbus_batch_queue = false;
+        }
+}
+
+void bus_manager_send_change_batch(Manager *m) {
+        int r;
+
+        assert(m);
+
+        /* Sends out one UnitsChanged and one JobsChanged signal covering everything that changed since the last
+         * batch, to the clients on the API bus that asked for that via SubscribeBatched(). Direct connections
+         * and regular subscribers already got the individual PropertiesChanged signals. */
+
+        if (bus_manager_has_batched_subscribers(m)) {
+                if (m->dbus_unit_batch_queue) {
+                        r = send_units_changed(m->api_bus, m);
+                        if (r < 0)
+                                log_debug_errno(r, "Failed to send batched unit change signal: %m");
+                }
+
+                if (m->dbus_job_batch_queue) {
+                        r = send_jobs_changed(m->api_bus, m);
+                        if (r < 0)
+                                log_debug_errno(r, "Failed to send batched job change signal: %m");
+                }
+        }
+
+        /* Whatever is left (e.g. because sending failed, or the last batched subscriber went away) is dropped */
+        bus_manager_flush_change_batch(m);
+}
@@ -10,6 +10,8 @@ extern const sd_bus_vtable bus_manager_vtable[];
 void bus_manager_send_finished(Manager *m, usec_t firmware_usec, usec_t loader_usec, usec_t kernel_usec, usec_t initrd_usec, usec_t userspace_usec, usec_t total_usec);
 void bus_manager_send_reloading(Manager *m, bool active);
 void bus_manager_send_change_signal(Manager *m);
+void bus_manager_send_change_batch(Manager *m);
+bool bus_manager_has_batched_subscribers(Manager *m);
 
 int verify_run_space_and_log(const char *message);
 
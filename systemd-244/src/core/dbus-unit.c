@@ -8,6 +8,7 @@
 #include "cgroup-util.h"
 #include "condition.h"
 #include "dbus-job.h"
+#include "dbus-manager.h"
 #include "dbus-unit.h"
 #include "dbus-util.h"
 #include "dbus.h"
@@ -1443,6 +1444,13 @@ void bus_unit_send_change_signal(Unit *u) {
                 log_unit_debug_errno(u, r, "Failed to send unit change signal for %s: %m", u->id);
 
         u->sent_dbus_new_signal = true;
+        u->manager->n_change_signals_emitted++;
+
+        /* Batched subscribers get the new state with the next UnitsChanged signal, once per batch */
+        if (!u->in_dbus_batch_queue && bus_manager_has_batched_subscribers(u->manager)) {
+                LIST_PREPEND(dbus_batch_queue, u->manager->dbus_unit_batch_queue, u);
+                u->in_dbus_batch_queue = true;
+        }
 }
 
 void bus_unit_send_pending_change_signal(Unit *u, bool including_new) {
@@ -1505,7 +1513,7 @@ void bus_unit_send_removed_signal(Unit *u) {
         if (!u->id)
                 return;
 
-        r = bus_foreach_bus(u->manager, u->bus_track, send_removed_signal, u);
+        r = bus_foreach_bus_full(u->manager, u->bus_track, true, send_removed_signal, u);
         if (r < 0)
                 log_unit_debug_errno(u, r, "Failed to send unit remove signal for %s: %m", u->id);
 }
@@ -1063,6 +1063,8 @@ static void destroy_bus(Manager *m, sd_bus **bus) {
         /* Get rid of tracked clients on this bus */
         if (m->subscribed && sd_bus_track_get_bus(m->subscribed) == *bus)
                 m->subscribed = sd_bus_track_unref(m->subscribed);
+        if (m->subscribed_batched && sd_bus_track_get_bus(m->subscribed_batched) == *bus)
+                m->subscribed_batched = sd_bus_track_unref(m->subscribed_batched);
 
         HASHMAP_FOREACH(j, m->jobs, i)
                 if (j->bus_track && sd_bus_track_get_bus(j->bus_track) == *bus)
@@ -1115,8 +1117,10 @@ void bus_done(Manager *m) {
         bus_done_private(m);
 
         assert(!m->subscribed);
+        assert(!m->subscribed_batched);
 
         m->deserialized_subscribed = strv_free(m->deserialized_subscribed);
+        m->deserialized_subscribed_batched = strv_free(m->deserialized_subscribed_batched);
         bus_verify_polkit_async_registry_free(m->polkit_registry);
 }
 
@@ -1160,9 +1164,10 @@ int bus_fdset_add_all(Manager *m, FDSet *fds) {
         return 0;
 }
 
-int bus_foreach_bus(
+int bus_foreach_bus_full(
                 Manager *m,
                 sd_bus_track *subscribed2,
+                bool include_batched,
                 int (*send_message)(sd_bus *bus, void *userdata),
                 void *userdata) {
 
@@ -1182,10 +1187,12 @@ int bus_foreach_bus(
                         ret = r;
         }
 
-        /* Send to API bus, but only if somebody is subscribed */
+        /* Send to API bus, but only if somebody is subscribed. Batched subscribers only get the signals
+         * that are not covered by the batched ones, i.e. those announcing removal of units and jobs. */
         if (m->api_bus &&
             (sd_bus_track_count(m->subscribed) > 0 ||
-             sd_bus_track_count(subscribed2) > 0)) {
+             sd_bus_track_count(subscribed2) > 0 ||
+             (include_batched && sd_bus_track_count(m->subscribed_batched) > 0))) {
                 r = send_message(m->api_bus, userdata);
                 if (r < 0)
                         ret = r;
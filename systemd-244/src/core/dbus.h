@@ -23,7 +23,10 @@ int bus_track_coldplug(Manager *m, sd_bus_track **t, bool recursive, char **l);
 
 int manager_enqueue_sync_bus_names(Manager *m);
 
-int bus_foreach_bus(Manager *m, sd_bus_track *subscribed2, int (*send_message)(sd_bus *bus, void *userdata), void *userdata);
+int bus_foreach_bus_full(Manager *m, sd_bus_track *subscribed2, bool include_batched, int (*send_message)(sd_bus *bus, void *userdata), void *userdata);
+static inline int bus_foreach_bus(Manager *m, sd_bus_track *subscribed2, int (*send_message)(sd_bus *bus, void *userdata), void *userdata) {
+        return bus_foreach_bus_full(m, subscribed2, false, send_message, userdata);
+}
 
 int bus_verify_manage_units_async(Manager *m, sd_bus_message *call, sd_bus_error *error);
 int bus_verify_manage_unit_files_async(Manager *m, sd_bus_message *call, sd_bus_error *error);
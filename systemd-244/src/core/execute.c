@@ -3859,6 +3859,7 @@ int exec_spawn(Unit *unit,
         _cleanup_strv_free_ char **files_env = NULL;
         size_t n_storage_fds = 0, n_socket_fds = 0;
         _cleanup_free_ char *line = NULL;
+        usec_t begin;
         pid_t pid;
 
         assert(unit);
@@ -3868,6 +3869,8 @@ int exec_spawn(Unit *unit,
         assert(params);
         assert(params->fds || (params->n_socket_fds + params->n_storage_fds <= 0));
 
+        begin = now(CLOCK_MONOTONIC);
+
         if (context->std_input == EXEC_INPUT_SOCKET ||
             context->std_output == EXEC_OUTPUT_SOCKET ||
             context->std_error == EXEC_OUTPUT_SOCKET) {
@@ -3968,6 +3971,8 @@ int exec_spawn(Unit *unit,
 
         exec_status_start(&command->exec_status, pid);
 
+        manager_record_phase(unit->manager, MANAGER_PHASE_SPAWN, begin, 1);
+
         *ret = pid;
         return 0;
 }
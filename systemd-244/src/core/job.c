@@ -83,6 +83,12 @@ void job_unlink(Job *j) {
                 j->in_dbus_queue = false;
         }
 
+        /* Batched subscribers learn about the removal from the JobRemoved signal */
+        if (j->in_dbus_batch_queue) {
+                LIST_REMOVE(dbus_batch_queue, j->manager->dbus_job_batch_queue, j);
+                j->in_dbus_batch_queue = false;
+        }
+
         if (j->in_gc_queue) {
                 LIST_REMOVE(gc_queue, j->manager->gc_job_queue, j);
                 j->in_gc_queue = false;
@@ -1164,8 +1170,10 @@ void job_add_to_dbus_queue(Job *j) {
         assert(j);
         assert(j->installed);
 
-        if (j->in_dbus_queue)
+        if (j->in_dbus_queue) {
+                j->manager->n_change_signals_suppressed++;
                 return;
+        }
 
         /* We don't check if anybody is subscribed here, since this
          * job might just have been created and not yet assigned to a
@@ -117,14 +117,16 @@ struct Job {
 
         LIST_FIELDS(Job, transaction);
         LIST_FIELDS(Job, dbus_queue);
+        LIST_FIELDS(Job, dbus_batch_queue);
         LIST_FIELDS(Job, gc_queue);
 
         LIST_HEAD(JobDependency, subject_list);
         LIST_HEAD(JobDependency, object_list);
 
-        /* Used for graph algs as a "I have been here" marker */
-        Job* marker;
+        /* Used for graph algs as a "I have been here" marker, and as position in the compact ordering graph
+         * built while verifying a transaction */
         unsigned generation;
+        unsigned order_index;
 
         uint32_t id;
 
@@ -153,6 +155,7 @@ struct Job {
         bool in_run_queue:1;
         bool matters_to_anchor:1;
         bool in_dbus_queue:1;
+        bool in_dbus_batch_queue:1;
         bool sent_dbus_new_signal:1;
         bool ignore_order:1;
         bool irreversible:1;
@@ -140,6 +140,7 @@ static bool arg_default_tasks_accounting;
 static TasksMax arg_default_tasks_max;
 static sd_id128_t arg_machine_id;
 static EmergencyAction arg_cad_burst_action;
+static unsigned arg_notify_message_budget;
 static OOMPolicy arg_default_oom_policy;
 static CPUSet arg_cpu_affinity;
 static NUMAPolicy arg_numa_policy;
@@ -622,6 +623,7 @@ static int parse_config_file(void) {
                 { "Manager", "DefaultTasksAccounting",       config_parse_bool,                  0, &arg_default_tasks_accounting          },
                 { "Manager", "DefaultTasksMax",              config_parse_tasks_max,             0, &arg_default_tasks_max                 },
                 { "Manager", "CtrlAltDelBurstAction",        config_parse_emergency_action,      0, &arg_cad_burst_action                  },
+                { "Manager", "NotifyMessageBudget",          config_parse_unsigned,              0, &arg_notify_message_budget             },
                 { "Manager", "DefaultOOMPolicy",             config_parse_oom_policy,            0, &arg_default_oom_policy                },
                 {}
         };
@@ -701,6 +703,7 @@ static void set_manager_settings(Manager *m) {
         m->reboot_watchdog = arg_reboot_watchdog;
         m->kexec_watchdog = arg_kexec_watchdog;
         m->cad_burst_action = arg_cad_burst_action;
+        m->notify_budget = arg_notify_message_budget;
 
         manager_set_show_status(m, arg_show_status);
         m->status_unit_format = arg_status_unit_format;
@@ -2155,6 +2158,7 @@ static void reset_arguments(void) {
         arg_default_tasks_max = DEFAULT_TASKS_MAX;
         arg_machine_id = (sd_id128_t) {};
         arg_cad_burst_action = EMERGENCY_ACTION_REBOOT_FORCE;
+        arg_notify_message_budget = DEFAULT_NOTIFY_MESSAGE_BUDGET;
         arg_default_oom_policy = OOM_STOP;
 
         cpu_set_reset(&arg_cpu_affinity);
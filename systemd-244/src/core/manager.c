@@ -81,6 +81,12 @@
 #include "watchdog.h"
 
 #define NOTIFY_RCVBUF_SIZE (8*1024*1024)
+#define NOTIFY_EVENT_PRIORITY (SD_EVENT_PRIORITY_NORMAL-8)
+
+/* How many notification datagrams to pull off the socket with a single recvmmsg() call */
+#define NOTIFY_BATCH_SIZE 16U
+/* How long the notify event source is turned off after the per-iteration budget was used up */
+#define NOTIFY_THROTTLE_USEC (1*USEC_PER_MSEC)
 #define CGROUPS_AGENT_RCVBUF_SIZE (8*1024*1024)
 
 /* Initial delay and the interval for printing status messages about running jobs */
@@ -95,6 +101,17 @@
 /* How many units and jobs to process of the bus queue before returning to the event loop. */
 #define MANAGER_BUS_MESSAGE_BUDGET 100U
 
+struct NotifyBatch {
+        struct mmsghdr msgs[NOTIFY_BATCH_SIZE];
+        struct iovec iovecs[NOTIFY_BATCH_SIZE];
+        union {
+                struct cmsghdr cmsghdr;
+                uint8_t buf[CMSG_SPACE(sizeof(struct ucred)) +
+                            CMSG_SPACE(sizeof(int) * NOTIFY_FD_MAX)];
+        } control[NOTIFY_BATCH_SIZE];
+        char buf[NOTIFY_BATCH_SIZE][NOTIFY_BUFFER_MAX+1];
+};
+
 static int manager_dispatch_notify_fd(sd_event_source *source, int fd, uint32_t revents, void *userdata);
 static int manager_dispatch_cgroups_agent_fd(sd_event_source *source, int fd, uint32_t revents, void *userdata);
 static int manager_dispatch_signal_fd(sd_event_source *source, int fd, uint32_t revents, void *userdata);
@@ -771,6 +788,7 @@ int manager_new(UnitFileScope scope, ManagerTestRunFlags test_run_flags, Manager
                 .original_log_target = _LOG_TARGET_INVALID,
 
                 .notify_fd = -1,
+                .notify_budget = DEFAULT_NOTIFY_MESSAGE_BUDGET,
                 .cgroups_agent_fd = -1,
                 .signal_fd = -1,
                 .time_change_fd = -1,
@@ -817,6 +835,9 @@ int manager_new(UnitFileScope scope, ManagerTestRunFlags test_run_flags, Manager
         /* Reboot immediately if the user hits C-A-D more often than 7x per 2s */
         m->ctrl_alt_del_ratelimit = (RateLimit) { .interval = 2 * USEC_PER_SEC, .burst = 7 };
 
+        /* Coalesce /proc/self/mountinfo rescans if there are more than 10 changes per 1s */
+        m->mountinfo_ratelimit = (RateLimit) { .interval = 1 * USEC_PER_SEC, .burst = 10 };
+
         r = manager_default_environment(m);
         if (r < 0)
                 return r;
@@ -902,7 +923,7 @@ int manager_new(UnitFileScope scope, ManagerTestRunFlags test_run_flags, Manager
 static int manager_setup_notify(Manager *m) {
         int r;
 
-        if (MANAGER_IS_TEST_RUN(m))
+        if (MANAGER_IS_TEST_RUN(m) && !(m->test_run_flags & MANAGER_TEST_RUN_NOTIFY))
                 return 0;
 
         if (m->notify_fd < 0) {
@@ -951,10 +972,16 @@ static int manager_setup_notify(Manager *m) {
 
                 /* Process notification messages a bit earlier than SIGCHLD, so that we can still identify to which
                  * service an exit message belongs. */
-                r = sd_event_source_set_priority(m->notify_event_source, SD_EVENT_PRIORITY_NORMAL-8);
+                r = sd_event_source_set_priority(m->notify_event_source, NOTIFY_EVENT_PRIORITY);
                 if (r < 0)
                         return log_error_errno(r, "Failed to set priority of notify event source: %m");
 
+                /* A new notify event source is not throttled. The throttle timer only exists once the budget was
+                 * used up for the first time. */
+                m->notify_throttled = false;
+                if (m->notify_throttle_event_source)
+                        (void) sd_event_source_set_enabled(m->notify_throttle_event_source, SD_EVENT_OFF);
+
                 (void) sd_event_source_set_description(m->notify_event_source, "manager-notify");
         }
 
@@ -1358,6 +1385,9 @@ Manager* manager_free(Manager *m) {
         sd_event_source_unref(m->signal_event_source);
         sd_event_source_unref(m->sigchld_event_source);
         sd_event_source_unref(m->notify_event_source);
+        sd_event_source_unref(m->notify_throttle_event_source);
+        free(m->notify_batch);
+        free(m->dispatch_spans);
         sd_event_source_unref(m->cgroups_agent_event_source);
         sd_event_source_unref(m->time_change_event_source);
         sd_event_source_unref(m->timezone_change_event_source);
@@ -1698,6 +1728,11 @@ int manager_startup(Manager *m, FILE *serialization, FDSet *fds) {
                         log_warning_errno(r, "Failed to deserialized tracked clients, ignoring: %m");
                 m->deserialized_subscribed = strv_free(m->deserialized_subscribed);
 
+                r = bus_track_coldplug(m, &m->subscribed_batched, false, m->deserialized_subscribed_batched);
+                if (r < 0)
+                        log_warning_errno(r, "Failed to deserialize batched tracked clients, ignoring: %m");
+                m->deserialized_subscribed_batched = strv_free(m->deserialized_subscribed_batched);
+
                 /* Third, fire things up! */
                 manager_coldplug(m);
 
@@ -1725,6 +1760,7 @@ int manager_add_job(
                 Job **ret) {
 
         Transaction *tr;
+        usec_t begin;
         int r;
 
         assert(m);
@@ -1745,6 +1781,8 @@ int manager_add_job(
 
         type = job_type_collapse(type, unit);
 
+        begin = now(CLOCK_MONOTONIC);
+
         tr = transaction_new(mode == JOB_REPLACE_IRREVERSIBLY);
         if (!tr)
                 return -ENOMEM;
@@ -1779,11 +1817,13 @@ int manager_add_job(
                 *ret = tr->anchor_job;
 
         transaction_free(tr);
+        manager_record_phase(m, MANAGER_PHASE_TRANSACTION, begin, 1);
         return 0;
 
 tr_abort:
         transaction_abort(tr);
         transaction_free(tr);
+        manager_record_phase(m, MANAGER_PHASE_TRANSACTION, begin, 1);
         return r;
 }
 
@@ -1904,8 +1944,9 @@ static int manager_dispatch_target_deps_queue(Manager *m) {
 }
 
 unsigned manager_dispatch_load_queue(Manager *m) {
-        Unit *u;
         unsigned n = 0;
+        usec_t begin;
+        Unit *u;
 
         assert(m);
 
@@ -1914,6 +1955,7 @@ unsigned manager_dispatch_load_queue(Manager *m) {
                 return 0;
 
         m->dispatching_load_queue = true;
+        begin = now(CLOCK_MONOTONIC);
 
         /* Dispatches the load queue. Takes a unit from the queue and
          * tries to load its data until the queue is empty */
@@ -1931,6 +1973,7 @@ unsigned manager_dispatch_load_queue(Manager *m) {
          * should be loaded and have aliases resolved */
         (void) manager_dispatch_target_deps_queue(m);
 
+        manager_record_phase(m, MANAGER_PHASE_LOAD_QUEUE, begin, n);
         return n;
 }
 
@@ -2143,18 +2186,25 @@ void manager_unwatch_pid(Manager *m, pid_t pid) {
 
 static int manager_dispatch_run_queue(sd_event_source *source, void *userdata) {
         Manager *m = userdata;
+        unsigned n = 0;
+        usec_t begin;
         Job *j;
 
         assert(source);
         assert(m);
 
+        begin = now(CLOCK_MONOTONIC);
+
         while ((j = prioq_peek(m->run_queue))) {
                 assert(j->installed);
                 assert(j->in_run_queue);
 
                 (void) job_run_and_invalidate(j);
+                n++;
         }
 
+        manager_record_phase(m, MANAGER_PHASE_RUN_QUEUE, begin, n);
+
         if (m->n_running_jobs > 0)
                 manager_watch_jobs_in_progress(m);
 
@@ -2166,6 +2216,7 @@ static int manager_dispatch_run_queue(sd_event_source *source, void *userdata) {
 
 static unsigned manager_dispatch_dbus_queue(Manager *m) {
         unsigned n = 0, budget;
+        usec_t begin;
         Unit *u;
         Job *j;
 
@@ -2199,6 +2250,8 @@ static unsigned manager_dispatch_dbus_queue(Manager *m) {
                 budget = MANAGER_BUS_MESSAGE_BUDGET;
         }
 
+        begin = now(CLOCK_MONOTONIC);
+
         while (budget != 0 && (u = m->dbus_unit_queue)) {
 
                 assert(u->in_dbus_queue);
@@ -2220,6 +2273,12 @@ static unsigned manager_dispatch_dbus_queue(Manager *m) {
                         budget--;
         }
 
+        /* Summarize everything sent out above in one signal each for batched subscribers */
+        if (m->dbus_unit_batch_queue || m->dbus_job_batch_queue) {
+                bus_manager_send_change_batch(m);
+                n++;
+        }
+
         if (m->send_reloading_done) {
                 m->send_reloading_done = false;
                 bus_manager_send_reloading(m, false);
@@ -2231,6 +2290,7 @@ static unsigned manager_dispatch_dbus_queue(Manager *m) {
                 n++;
         }
 
+        manager_record_phase(m, MANAGER_PHASE_DBUS_QUEUE, begin, n);
         return n;
 }
 
@@ -2267,33 +2327,27 @@ static void manager_invoke_notify_message(
                 Manager *m,
                 Unit *u,
                 const struct ucred *ucred,
-                const char *buf,
+                char **tags,
                 FDSet *fds) {
 
         assert(m);
         assert(u);
         assert(ucred);
-        assert(buf);
+        assert(tags);
 
         if (u->notifygen == m->notifygen) /* Already invoked on this same unit in this same iteration? */
                 return;
         u->notifygen = m->notifygen;
 
-        if (UNIT_VTABLE(u)->notify_message) {
-                _cleanup_strv_free_ char **tags = NULL;
-
-                tags = strv_split(buf, NEWLINE);
-                if (!tags) {
-                        log_oom();
-                        return;
-                }
-
+        if (UNIT_VTABLE(u)->notify_message)
                 UNIT_VTABLE(u)->notify_message(u, ucred, tags, fds);
 
-        } else if (DEBUG_LOGGING) {
-                _cleanup_free_ char *x = NULL, *y = NULL;
+        else if (DEBUG_LOGGING) {
+                _cleanup_free_ char *joined = NULL, *x = NULL, *y = NULL;
 
-                x = ellipsize(buf, 20, 90);
+                joined = strv_join(tags, "\n");
+                if (joined)
+                        x = ellipsize(joined, 20, 90);
                 if (x)
                         y = cescape(x);
 
@@ -2301,56 +2355,49 @@ static void manager_invoke_notify_message(
         }
 }
 
-static int manager_dispatch_notify_fd(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
+static char **notify_split_tags(char *buf, char **tags) {
+        char **t = tags, *p = buf;
 
-        _cleanup_fdset_free_ FDSet *fds = NULL;
-        Manager *m = userdata;
-        char buf[NOTIFY_BUFFER_MAX+1];
-        struct iovec iovec = {
-                .iov_base = buf,
-                .iov_len = sizeof(buf)-1,
-        };
-        union {
-                struct cmsghdr cmsghdr;
-                uint8_t buf[CMSG_SPACE(sizeof(struct ucred)) +
-                            CMSG_SPACE(sizeof(int) * NOTIFY_FD_MAX)];
-        } control = {};
-        struct msghdr msghdr = {
-                .msg_iov = &iovec,
-                .msg_iovlen = 1,
-                .msg_control = &control,
-                .msg_controllen = sizeof(control),
-        };
+        assert(buf);
+        assert(tags);
+
+        /* Splits the message into its newline separated assignments in place, skipping empty lines, i.e. the
+         * same as strv_split(buf, NEWLINE) but without allocating anything. The caller has to provide room for
+         * strlen(buf)/2 + 2 entries. */
+
+        for (;;) {
+                p += strspn(p, NEWLINE);
+                if (*p == 0)
+                        break;
+
+                *(t++) = p;
+
+                p += strcspn(p, NEWLINE);
+                if (*p == 0)
+                        break;
+
+                *(p++) = 0;
+        }
 
+        *t = NULL;
+        return tags;
+}
+
+static void manager_process_notify_message(Manager *m, struct msghdr *msghdr, size_t n) {
+        _cleanup_fdset_free_ FDSet *fds = NULL;
         struct cmsghdr *cmsg;
         struct ucred *ucred = NULL;
         _cleanup_free_ Unit **array_copy = NULL;
         Unit *u1, *u2, **array;
+        char *buf, **tags;
         int r, *fd_array = NULL;
         size_t n_fds = 0;
         bool found = false;
-        ssize_t n;
 
         assert(m);
-        assert(m->notify_fd == fd);
+        assert(msghdr);
 
-        if (revents != EPOLLIN) {
-                log_warning("Got unexpected poll event for notify fd.");
-                return 0;
-        }
-
-        n = recvmsg(m->notify_fd, &msghdr, MSG_DONTWAIT|MSG_CMSG_CLOEXEC|MSG_TRUNC);
-        if (n < 0) {
-                if (IN_SET(errno, EAGAIN, EINTR))
-                        return 0; /* Spurious wakeup, try again */
-
-                /* If this is any other, real error, then let's stop processing this socket. This of course means we
-                 * won't take notification messages anymore, but that's still better than busy looping around this:
-                 * being woken up over and over again but being unable to actually read the message off the socket. */
-                return log_error_errno(errno, "Failed to receive notification message: %m");
-        }
-
-        CMSG_FOREACH(cmsg, &msghdr) {
+        CMSG_FOREACH(cmsg, msghdr) {
                 if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
 
                         fd_array = (int*) CMSG_DATA(cmsg);
@@ -2371,30 +2418,35 @@ static int manager_dispatch_notify_fd(sd_event_source *source, int fd, uint32_t
                 if (r < 0) {
                         close_many(fd_array, n_fds);
                         log_oom();
-                        return 0;
+                        return;
                 }
         }
 
         if (!ucred || !pid_is_valid(ucred->pid)) {
                 log_warning("Received notify message without valid credentials. Ignoring.");
-                return 0;
+                return;
         }
 
-        if ((size_t) n >= sizeof(buf) || (msghdr.msg_flags & MSG_TRUNC)) {
+        if (msghdr->msg_flags & MSG_TRUNC) {
                 log_warning("Received notify message exceeded maximum size. Ignoring.");
-                return 0;
+                return;
         }
 
+        buf = msghdr->msg_iov->iov_base;
+
         /* As extra safety check, let's make sure the string we get doesn't contain embedded NUL bytes. We permit one
          * trailing NUL byte in the message, but don't expect it. */
         if (n > 1 && memchr(buf, 0, n-1)) {
                 log_warning("Received notify message with embedded NUL bytes. Ignoring.");
-                return 0;
+                return;
         }
 
         /* Make sure it's NUL-terminated. */
         buf[n] = 0;
 
+        /* Split the message up once, the resulting array is shared by all units we pass it to below. */
+        tags = notify_split_tags(buf, newa(char*, n / 2 + 2));
+
         /* Increase the generation counter used for filtering out duplicate unit invocations. */
         m->notifygen++;
 
@@ -2415,16 +2467,16 @@ static int manager_dispatch_notify_fd(sd_event_source *source, int fd, uint32_t
         /* And now invoke the per-unit callbacks. Note that manager_invoke_notify_message() will handle duplicate units
          * make sure we only invoke each unit's handler once. */
         if (u1) {
-                manager_invoke_notify_message(m, u1, ucred, buf, fds);
+                manager_invoke_notify_message(m, u1, ucred, tags, fds);
                 found = true;
         }
         if (u2) {
-                manager_invoke_notify_message(m, u2, ucred, buf, fds);
+                manager_invoke_notify_message(m, u2, ucred, tags, fds);
                 found = true;
         }
         if (array_copy)
                 for (size_t i = 0; array_copy[i]; i++) {
-                        manager_invoke_notify_message(m, array_copy[i], ucred, buf, fds);
+                        manager_invoke_notify_message(m, array_copy[i], ucred, tags, fds);
                         found = true;
                 }
 
@@ -2433,7 +2485,152 @@ static int manager_dispatch_notify_fd(sd_event_source *source, int fd, uint32_t
 
         if (fdset_size(fds) > 0)
                 log_warning("Got extra auxiliary fds with notification message, closing them.");
+}
+
+static int manager_dispatch_notify_throttle(sd_event_source *source, usec_t usec, void *userdata);
+
+static void manager_set_notify_throttled(Manager *m, bool b) {
+        int r;
+
+        assert(m);
+
+        if (m->notify_throttled == b)
+                return;
+
+        if (!b) {
+                r = sd_event_source_set_enabled(m->notify_event_source, SD_EVENT_ON);
+                if (r < 0)
+                        log_warning_errno(r, "Failed to enable notify event source, ignoring: %m");
+
+                (void) sd_event_source_set_enabled(m->notify_throttle_event_source, SD_EVENT_OFF);
+                m->notify_throttled = false;
+                return;
+        }
 
+        /* While throttled, the notify event source is turned off for a short time, so that everything else that
+         * is pending, including the run queue, gets dispatched. We do not lower its priority instead: it needs
+         * to stay above SIGCHLD, and a lower priority would let a busy manager starve WATCHDOG=1 messages. */
+        if (!m->notify_throttle_event_source) {
+                r = sd_event_add_time(
+                                m->event,
+                                &m->notify_throttle_event_source,
+                                CLOCK_MONOTONIC,
+                                usec_add(now(CLOCK_MONOTONIC), NOTIFY_THROTTLE_USEC), 1,
+                                manager_dispatch_notify_throttle, m);
+                if (r < 0) {
+                        log_warning_errno(r, "Failed to allocate notify throttle event source, ignoring: %m");
+                        return;
+                }
+
+                r = sd_event_source_set_priority(m->notify_throttle_event_source, NOTIFY_EVENT_PRIORITY);
+                if (r < 0)
+                        log_warning_errno(r, "Failed to set priority of notify throttle event source, ignoring: %m");
+
+                (void) sd_event_source_set_description(m->notify_throttle_event_source, "manager-notify-throttle");
+        } else {
+                r = sd_event_source_set_time(m->notify_throttle_event_source, usec_add(now(CLOCK_MONOTONIC), NOTIFY_THROTTLE_USEC));
+                if (r < 0) {
+                        log_warning_errno(r, "Failed to set time of notify throttle event source, ignoring: %m");
+                        return;
+                }
+
+                r = sd_event_source_set_enabled(m->notify_throttle_event_source, SD_EVENT_ONESHOT);
+                if (r < 0) {
+                        log_warning_errno(r, "Failed to enable notify throttle event source, ignoring: %m");
+                        return;
+                }
+        }
+
+        r = sd_event_source_set_enabled(m->notify_event_source, SD_EVENT_OFF);
+        if (r < 0) {
+                log_warning_errno(r, "Failed to disable notify event source, ignoring: %m");
+                (void) sd_event_source_set_enabled(m->notify_throttle_event_source, SD_EVENT_OFF);
+                return;
+        }
+
+        m->notify_throttled = true;
+}
+
+static int manager_dispatch_notify_throttle(sd_event_source *source, usec_t usec, void *userdata) {
+        Manager *m = userdata;
+
+        assert(m);
+
+        manager_set_notify_throttled(m, false);
+        return 0;
+}
+
+/* Returns > 0 if the budget was used up and there might be more messages queued */
+static int manager_receive_notify_messages(Manager *m, unsigned budget) {
+        NotifyBatch *b;
+
+        assert(m);
+
+        if (!m->notify_batch) {
+                m->notify_batch = new(NotifyBatch, 1);
+                if (!m->notify_batch)
+                        return log_oom();
+        }
+        b = m->notify_batch;
+
+        while (budget > 0) {
+                unsigned n_batch = MIN(budget, NOTIFY_BATCH_SIZE);
+                int n;
+
+                for (unsigned i = 0; i < n_batch; i++) {
+                        b->iovecs[i] = IOVEC_MAKE(b->buf[i], sizeof(b->buf[i]) - 1);
+                        b->msgs[i] = (struct mmsghdr) {
+                                .msg_hdr.msg_iov = &b->iovecs[i],
+                                .msg_hdr.msg_iovlen = 1,
+                                .msg_hdr.msg_control = &b->control[i],
+                                .msg_hdr.msg_controllen = sizeof(b->control[i]),
+                        };
+                }
+
+                n = recvmmsg(m->notify_fd, b->msgs, n_batch, MSG_DONTWAIT|MSG_CMSG_CLOEXEC, NULL);
+                if (n < 0) {
+                        if (IN_SET(errno, EAGAIN, EINTR))
+                                return 0; /* Spurious wakeup or drained, try again */
+
+                        /* If this is any other, real error, then let's stop processing this socket. This of course
+                         * means we won't take notification messages anymore, but that's still better than busy
+                         * looping around this: being woken up over and over again but being unable to actually read
+                         * the message off the socket. */
+                        return log_error_errno(errno, "Failed to receive notification message: %m");
+                }
+
+                for (int i = 0; i < n; i++)
+                        manager_process_notify_message(m, &b->msgs[i].msg_hdr, b->msgs[i].msg_len);
+
+                if ((unsigned) n < n_batch)
+                        return 0; /* Nothing more queued right now */
+
+                budget -= n;
+        }
+
+        return 1;
+}
+
+static int manager_dispatch_notify_fd(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
+        Manager *m = userdata;
+        int r;
+
+        assert(m);
+        assert(m->notify_fd == fd);
+
+        if (revents != EPOLLIN) {
+                log_warning("Got unexpected poll event for notify fd.");
+                return 0;
+        }
+
+        r = manager_receive_notify_messages(m, m->notify_budget > 0 ? m->notify_budget : UINT_MAX);
+        if (r <= 0)
+                return r;
+
+        /* We used up our budget, and there might be more messages queued. Let's make sure the run queue and
+         * everything else gets a chance to run before we continue, so that a notification storm cannot starve
+         * job processing. */
+        manager_set_notify_throttled(m, true);
         return 0;
 }
 
@@ -2466,6 +2663,14 @@ static int manager_dispatch_sigchld(sd_event_source *source, void *userdata) {
         assert(source);
         assert(m);
 
+        /* Notification messages are processed before SIGCHLD, so that we can still identify to which service they
+         * belong. If the notify event source is throttled right now, catch up with the queued ones first, so that
+         * the final STATUS= or READY= of a service is not lost once its exit was processed. */
+        if (m->notify_throttled) {
+                manager_set_notify_throttled(m, false);
+                (void) manager_receive_notify_messages(m, UINT_MAX);
+        }
+
         /* First we call waitid() for a PID and do not reap the zombie. That way we can still access /proc/$PID for it
          * while it is a zombie. */
 
@@ -3201,6 +3406,7 @@ int manager_serialize(
         }
 
         bus_track_serialize(m->subscribed, f, "subscribed");
+        bus_track_serialize(m->subscribed_batched, f, "subscribed-batched");
 
         r = dynamic_user_serialize(m, f, fds);
         if (r < 0)
@@ -3468,6 +3674,11 @@ int manager_deserialize(Manager *m, FILE *f, FDSet *fds) {
                         if (strv_extend(&m->deserialized_subscribed, val) < 0)
                                 return -ENOMEM;
 
+                } else if ((val = startswith(l, "subscribed-batched="))) {
+
+                        if (strv_extend(&m->deserialized_subscribed_batched, val) < 0)
+                                return -ENOMEM;
+
                 } else {
                         ManagerTimestamp q;
 
@@ -3849,6 +4060,7 @@ static int manager_run_environment_generators(Manager *m) {
 static int manager_run_generators(Manager *m) {
         _cleanup_strv_free_ char **paths = NULL;
         const char *argv[5];
+        usec_t begin;
         int r;
 
         assert(m);
@@ -3875,10 +4087,14 @@ static int manager_run_generators(Manager *m) {
         argv[3] = m->lookup_paths.generator_late;
         argv[4] = NULL;
 
+        begin = now(CLOCK_MONOTONIC);
+
         RUN_WITH_UMASK(0022)
                 (void) execute_directories((const char* const*) paths, DEFAULT_TIMEOUT_USEC, NULL, NULL,
                                            (char**) argv, m->transient_environment, EXEC_DIR_PARALLEL | EXEC_DIR_IGNORE_ERRORS);
 
+        manager_record_phase(m, MANAGER_PHASE_GENERATORS, begin, 1);
+
         r = 0;
 
 finish:
@@ -4681,6 +4897,42 @@ void manager_restore_original_log_target(Manager *m) {
         m->log_target_overridden = false;
 }
 
+void manager_record_phase(Manager *m, ManagerPhase phase, usec_t begin, unsigned n_items) {
+        ManagerPhaseCounter *c;
+        usec_t d;
+
+        assert(m);
+        assert(phase >= 0 && phase < _MANAGER_PHASE_MAX);
+
+        /* Records that we spent the time since 'begin' (CLOCK_MONOTONIC) in the specified phase, processing
+         * n_items objects. Dispatches that found nothing to do are not worth recording, they'd just push the
+         * interesting spans out of the ring buffer. */
+
+        if (n_items == 0)
+                return;
+
+        d = usec_sub_unsigned(now(CLOCK_MONOTONIC), begin);
+
+        c = m->phase_counters + phase;
+        c->n_spans++;
+        c->n_items += n_items;
+        c->total_usec += d;
+        c->max_usec = MAX(c->max_usec, d);
+
+        if (!m->dispatch_spans) {
+                m->dispatch_spans = new(ManagerDispatchSpan, MANAGER_DISPATCH_SPANS_MAX);
+                if (!m->dispatch_spans)
+                        return; /* Not fatal, we'll just keep the counters */
+        }
+
+        m->dispatch_spans[m->n_dispatch_spans++ % MANAGER_DISPATCH_SPANS_MAX] = (ManagerDispatchSpan) {
+                .begin = begin,
+                .duration = d,
+                .phase = phase,
+                .n_items = n_items,
+        };
+}
+
 ManagerTimestamp manager_timestamp_initrd_mangle(ManagerTimestamp s) {
         if (in_initrd() &&
             s >= MANAGER_TIMESTAMP_SECURITY_START &&
@@ -4723,6 +4975,18 @@ static const char *const manager_timestamp_table[_MANAGER_TIMESTAMP_MAX] = {
 
 DEFINE_STRING_TABLE_LOOKUP(manager_timestamp, ManagerTimestamp);
 
+static const char *const manager_phase_table[_MANAGER_PHASE_MAX] = {
+        [MANAGER_PHASE_LOAD_QUEUE] = "load-queue",
+        [MANAGER_PHASE_RUN_QUEUE] = "run-queue",
+        [MANAGER_PHASE_CGROUP_REALIZE_QUEUE] = "cgroup-realize-queue",
+        [MANAGER_PHASE_DBUS_QUEUE] = "dbus-queue",
+        [MANAGER_PHASE_GENERATORS] = "generators",
+        [MANAGER_PHASE_TRANSACTION] = "transaction",
+        [MANAGER_PHASE_SPAWN] = "spawn",
+};
+
+DEFINE_STRING_TABLE_LOOKUP(manager_phase, ManagerPhase);
+
 static const char* const oom_policy_table[_OOM_POLICY_MAX] = {
         [OOM_CONTINUE] = "continue",
         [OOM_STOP] = "stop",
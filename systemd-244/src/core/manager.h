@@ -24,6 +24,7 @@ typedef struct Unit Unit;
 #define MANAGER_MAX_NAMES 131072 /* 128K */
 
 typedef struct Manager Manager;
+typedef struct NotifyBatch NotifyBatch;
 
 /* An externally visible state. We don't actually maintain this as state variable, but derive it from various fields
  * when requested */
@@ -112,6 +113,36 @@ typedef enum ManagerTimestamp {
         _MANAGER_TIMESTAMP_INVALID = -1,
 } ManagerTimestamp;
 
+/* Phases of work PID 1 does itself, for which we keep timing counters and a ring buffer of recent dispatch spans, see
+ * manager_record_phase() */
+typedef enum ManagerPhase {
+        MANAGER_PHASE_LOAD_QUEUE,
+        MANAGER_PHASE_RUN_QUEUE,
+        MANAGER_PHASE_CGROUP_REALIZE_QUEUE,
+        MANAGER_PHASE_DBUS_QUEUE,
+        MANAGER_PHASE_GENERATORS,
+        MANAGER_PHASE_TRANSACTION,
+        MANAGER_PHASE_SPAWN,
+        _MANAGER_PHASE_MAX,
+        _MANAGER_PHASE_INVALID = -1,
+} ManagerPhase;
+
+typedef struct ManagerPhaseCounter {
+        uint64_t n_spans;
+        uint64_t n_items;
+        usec_t total_usec;
+        usec_t max_usec;
+} ManagerPhaseCounter;
+
+typedef struct ManagerDispatchSpan {
+        usec_t begin;      /* CLOCK_MONOTONIC */
+        usec_t duration;
+        ManagerPhase phase;
+        unsigned n_items;  /* units, jobs, … processed in this span */
+} ManagerDispatchSpan;
+
+#define MANAGER_DISPATCH_SPANS_MAX 1024U
+
 #include "execute.h"
 #include "job.h"
 #include "path-lookup.h"
@@ -124,6 +155,7 @@ typedef enum ManagerTestRunFlags {
         MANAGER_TEST_RUN_BASIC          = 1 << 1,  /* interact with the environment */
         MANAGER_TEST_RUN_ENV_GENERATORS = 1 << 2,  /* also run env generators  */
         MANAGER_TEST_RUN_GENERATORS     = 1 << 3,  /* also run unit generators */
+        MANAGER_TEST_RUN_NOTIFY         = 1 << 4,  /* also set up the notification socket */
         MANAGER_TEST_FULL = MANAGER_TEST_RUN_BASIC | MANAGER_TEST_RUN_ENV_GENERATORS | MANAGER_TEST_RUN_GENERATORS,
 } ManagerTestRunFlags;
 
@@ -156,6 +188,11 @@ struct Manager {
         LIST_HEAD(Unit, dbus_unit_queue);
         LIST_HEAD(Job, dbus_job_queue);
 
+        /* Units and jobs that have changed since the last batched change signal, only maintained if
+         * anybody subscribed to those. Each unit and job is listed at most once per batch. */
+        LIST_HEAD(Unit, dbus_unit_batch_queue);
+        LIST_HEAD(Job, dbus_job_batch_queue);
+
         /* Units to remove */
         LIST_HEAD(Unit, cleanup_queue);
 
@@ -200,6 +237,14 @@ struct Manager {
         char *notify_socket;
         int notify_fd;
         sd_event_source *notify_event_source;
+        NotifyBatch *notify_batch;
+
+        /* The maximum number of notification messages to process per event loop iteration, 0 for unlimited. If
+         * it is hit, the notify event source is turned off for a moment, and turned on again by the throttle
+         * event source, or when SIGCHLD is processed. */
+        unsigned notify_budget;
+        bool notify_throttled;
+        sd_event_source *notify_throttle_event_source;
 
         int cgroups_agent_fd;
         sd_event_source *cgroups_agent_event_source;
@@ -244,6 +289,10 @@ struct Manager {
         /* Data specific to the mount subsystem */
         struct libmnt_monitor *mount_monitor;
         sd_event_source *mount_event_source;
+        Hashmap *mountinfo_by_id;  /* mount ID => last seen line of /proc/self/mountinfo */
+        RateLimit mountinfo_ratelimit;
+        sd_event_source *mountinfo_rescan_event_source;
+        bool mountinfo_rescan_pending;
 
         /* Data specific to the swap filesystem */
         FILE *proc_swaps;
@@ -263,6 +312,11 @@ struct Manager {
         sd_bus_track *subscribed;
         char **deserialized_subscribed;
 
+        /* Clients on the API bus that want to be informed about unit and job changes via one batched
+         * UnitsChanged/JobsChanged signal per event loop iteration instead. */
+        sd_bus_track *subscribed_batched;
+        char **deserialized_subscribed_batched;
+
         /* This is used during reloading: before the reload we queue
          * the reply message here, and afterwards we send it */
         sd_bus_message *pending_reload_message;
@@ -368,6 +422,16 @@ struct Manager {
         unsigned n_installed_jobs;
         unsigned n_failed_jobs;
 
+        /* Time spent in the various phases of PID 1's own work, and the most recent spans of it. The latter is a
+         * ring buffer, allocated on first use, n_dispatch_spans counts all spans ever recorded. */
+        ManagerPhaseCounter phase_counters[_MANAGER_PHASE_MAX];
+        ManagerDispatchSpan *dispatch_spans;
+        uint64_t n_dispatch_spans;
+
+        /* Unit and job change signals sent out, and changes that were coalesced into an already queued one */
+        uint64_t n_change_signals_emitted;
+        uint64_t n_change_signals_suppressed;
+
         /* Jobs in progress watching */
         unsigned n_running_jobs;
         unsigned n_on_console;
@@ -553,5 +617,10 @@ const char *manager_timestamp_to_string(ManagerTimestamp m) _const_;
 ManagerTimestamp manager_timestamp_from_string(const char *s) _pure_;
 ManagerTimestamp manager_timestamp_initrd_mangle(ManagerTimestamp s);
 
+const char *manager_phase_to_string(ManagerPhase p) _const_;
+ManagerPhase manager_phase_from_string(const char *s) _pure_;
+
+void manager_record_phase(Manager *m, ManagerPhase phase, usec_t begin, unsigned n_items);
+
 const char* oom_policy_to_string(OOMPolicy i) _const_;
 OOMPolicy oom_policy_from_string(const char *s) _pure_;
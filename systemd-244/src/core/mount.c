@@ -34,6 +34,10 @@
 
 #define RETRY_UMOUNT_MAX 32
 
+/* How long to delay processing of /proc/self/mountinfo changes once they come in faster than the rate limit
+ * allows, so that a storm of them is coalesced into one rescan */
+#define MOUNTINFO_RESCAN_COALESCE_USEC (100 * USEC_PER_MSEC)
+
 static const UnitActiveState state_translation_table[_MOUNT_STATE_MAX] = {
         [MOUNT_DEAD] = UNIT_INACTIVE,
         [MOUNT_MOUNTING] = UNIT_ACTIVATING,
@@ -51,6 +55,7 @@ static const UnitActiveState state_translation_table[_MOUNT_STATE_MAX] = {
 
 static int mount_dispatch_timer(sd_event_source *source, usec_t usec, void *userdata);
 static int mount_dispatch_io(sd_event_source *source, int fd, uint32_t revents, void *userdata);
+static int mount_dispatch_rescan(sd_event_source *source, usec_t usec, void *userdata);
 static int mount_process_proc_self_mountinfo(Manager *m);
 
 static bool MOUNT_STATE_WITH_PROCESS(MountState state) {
@@ -1652,17 +1657,135 @@ static int mount_setup_unit(
         return 0;
 }
 
+/* One line of /proc/self/mountinfo as we saw it when we processed it the last time. These are kept in
+ * Manager.mountinfo_by_id, indexed by mount ID, so that on the next change we only need to look at the lines
+ * that were added, removed or changed. */
+typedef struct MountInfoEntry {
+        char *what;
+        char *where;
+        char *options;
+        char *fstype;
+} MountInfoEntry;
+
+static MountInfoEntry* mount_info_entry_free(MountInfoEntry *e) {
+        if (!e)
+                return NULL;
+
+        free(e->what);
+        free(e->where);
+        free(e->options);
+        free(e->fstype);
+
+        return mfree(e);
+}
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(MountInfoEntry*, mount_info_entry_free);
+
+DEFINE_PRIVATE_HASH_OPS_WITH_VALUE_DESTRUCTOR(mount_info_entry_hash_ops, void, trivial_hash_func, trivial_compare_func,
+                                              MountInfoEntry, mount_info_entry_free);
+
+static int mount_info_entry_new(
+                const char *what,
+                const char *where,
+                const char *options,
+                const char *fstype,
+                MountInfoEntry **ret) {
+
+        _cleanup_(mount_info_entry_freep) MountInfoEntry *e = NULL;
+
+        assert(what);
+        assert(where);
+        assert(ret);
+
+        e = new0(MountInfoEntry, 1);
+        if (!e)
+                return -ENOMEM;
+
+        e->what = strdup(what);
+        e->where = strdup(where);
+        if (!e->what || !e->where)
+                return -ENOMEM;
+
+        if (options) {
+                e->options = strdup(options);
+                if (!e->options)
+                        return -ENOMEM;
+        }
+
+        if (fstype) {
+                e->fstype = strdup(fstype);
+                if (!e->fstype)
+                        return -ENOMEM;
+        }
+
+        *ret = TAKE_PTR(e);
+        return 0;
+}
+
+static bool mount_info_entry_equal(
+                const MountInfoEntry *e,
+                const char *what,
+                const char *where,
+                const char *options,
+                const char *fstype) {
+
+        assert(e);
+
+        return streq(e->what, what) &&
+                streq(e->where, where) &&
+                streq_ptr(e->options, options) &&
+                streq_ptr(e->fstype, fstype);
+}
+
+static int mount_info_put(Hashmap *h, struct libmnt_fs *fs, const char *what, const char *where, const char *options, const char *fstype) {
+        _cleanup_(mount_info_entry_freep) MountInfoEntry *e = NULL;
+        int id, r;
+
+        assert(h);
+        assert(fs);
+
+        id = mnt_fs_get_id(fs);
+        if (id <= 0)
+                return -EBADMSG;
+
+        r = mount_info_entry_new(what, where, options, fstype, &e);
+        if (r < 0)
+                return r;
+
+        r = hashmap_put(h, INT_TO_PTR(id), e);
+        if (r < 0)
+                return r;
+
+        TAKE_PTR(e);
+        return 0;
+}
+
+static void mount_info_flush(Manager *m) {
+        assert(m);
+
+        /* Forget what we know about the previous table, the next change will be processed in full */
+        m->mountinfo_by_id = hashmap_free(m->mountinfo_by_id);
+}
+
 static int mount_load_proc_self_mountinfo(Manager *m, bool set_flags) {
         _cleanup_(mnt_free_tablep) struct libmnt_table *table = NULL;
         _cleanup_(mnt_free_iterp) struct libmnt_iter *iter = NULL;
+        _cleanup_hashmap_free_ Hashmap *by_id = NULL;
         int r;
 
         assert(m);
 
+        mount_info_flush(m);
+
         r = libmount_parse(NULL, NULL, &table, &iter);
         if (r < 0)
                 return log_error_errno(r, "Failed to parse /proc/self/mountinfo: %m");
 
+        /* When processing changes, remember the table, so that we can process the next change incrementally. If
+         * that doesn't work out for some reason, we'll simply process the next change in full again. */
+        if (set_flags)
+                by_id = hashmap_new(&mount_info_entry_hash_ops);
+
         for (;;) {
                 struct libmnt_fs *fs;
                 const char *device, *path, *options, *fstype;
@@ -1684,8 +1807,130 @@ static int mount_load_proc_self_mountinfo(Manager *m, bool set_flags) {
                 device_found_node(m, device, DEVICE_FOUND_MOUNT, DEVICE_FOUND_MOUNT);
 
                 (void) mount_setup_unit(m, device, path, options, fstype, set_flags);
+
+                if (by_id && mount_info_put(by_id, fs, device, path, options, fstype) < 0)
+                        by_id = hashmap_free(by_id);
         }
 
+        m->mountinfo_by_id = TAKE_PTR(by_id);
+        return 0;
+}
+
+static int mount_load_proc_self_mountinfo_incremental(Manager *m, Set **ret_dirty) {
+        _cleanup_(mnt_free_tablep) struct libmnt_table *table = NULL;
+        _cleanup_(mnt_free_iterp) struct libmnt_iter *iter = NULL;
+        _cleanup_hashmap_free_ Hashmap *by_id = NULL;
+        _cleanup_set_free_free_ Set *dirty = NULL;
+        MountInfoEntry *e;
+        Iterator i;
+        int r;
+
+        assert(m);
+        assert(m->mountinfo_by_id);
+        assert(ret_dirty);
+
+        /* Compares the current /proc/self/mountinfo with the table we saw last time, and sets up only the
+         * mount units whose mount point showed up in a line that was added, removed or changed. Returns the
+         * set of these mount points. */
+
+        r = libmount_parse(NULL, NULL, &table, &iter);
+        if (r < 0)
+                return log_error_errno(r, "Failed to parse /proc/self/mountinfo: %m");
+
+        by_id = hashmap_new(&mount_info_entry_hash_ops);
+        dirty = set_new(&path_hash_ops);
+        if (!by_id || !dirty)
+                return log_oom();
+
+        for (;;) {
+                _cleanup_(mount_info_entry_freep) MountInfoEntry *old = NULL;
+                struct libmnt_fs *fs;
+                const char *device, *path, *options, *fstype;
+                int id;
+
+                r = mnt_table_next_fs(table, iter, &fs);
+                if (r == 1)
+                        break;
+                if (r < 0)
+                        return log_error_errno(r, "Failed to get next entry from /proc/self/mountinfo: %m");
+
+                device = mnt_fs_get_source(fs);
+                path = mnt_fs_get_target(fs);
+                options = mnt_fs_get_options(fs);
+                fstype = mnt_fs_get_fstype(fs);
+
+                if (!device || !path)
+                        continue;
+
+                id = mnt_fs_get_id(fs);
+                if (id <= 0)
+                        return log_debug_errno(SYNTHETIC_ERRNO(EBADMSG), "Mount entry for '%s' without mount ID, cannot process changes incrementally.", path);
+
+                old = hashmap_remove(m->mountinfo_by_id, INT_TO_PTR(id));
+                if (old && mount_info_entry_equal(old, device, path, options, fstype)) {
+                        /* Unchanged, just carry it over into the new table */
+                        r = hashmap_put(by_id, INT_TO_PTR(id), old);
+                        if (r < 0)
+                                return log_oom();
+
+                        TAKE_PTR(old);
+                        continue;
+                }
+
+                /* If an existing mount moved or changed, the unit of the old mount point needs a look too */
+                if (old && set_put_strdup(dirty, old->where) < 0)
+                        return log_oom();
+
+                if (set_put_strdup(dirty, path) < 0)
+                        return log_oom();
+
+                r = mount_info_put(by_id, fs, device, path, options, fstype);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to record mount entry for '%s': %m", path);
+        }
+
+        /* Everything that is left over in the old table is gone now */
+        HASHMAP_FOREACH(e, m->mountinfo_by_id, i)
+                if (set_put_strdup(dirty, e->where) < 0)
+                        return log_oom();
+
+        hashmap_free(m->mountinfo_by_id);
+        m->mountinfo_by_id = TAKE_PTR(by_id);
+
+        if (set_isempty(dirty)) {
+                *ret_dirty = NULL;
+                return 0;
+        }
+
+        /* Now set up the units for all lines of all affected mount points, in the order of the table, so that
+         * for over-mounted mount points the last line wins, as with a full scan. */
+        mnt_reset_iter(iter, MNT_ITER_FORWARD);
+
+        for (;;) {
+                struct libmnt_fs *fs;
+                const char *device, *path;
+
+                r = mnt_table_next_fs(table, iter, &fs);
+                if (r == 1)
+                        break;
+                if (r < 0)
+                        return log_error_errno(r, "Failed to get next entry from /proc/self/mountinfo: %m");
+
+                device = mnt_fs_get_source(fs);
+                path = mnt_fs_get_target(fs);
+
+                if (!device || !path)
+                        continue;
+
+                if (!set_contains(dirty, path))
+                        continue;
+
+                device_found_node(m, device, DEVICE_FOUND_MOUNT, DEVICE_FOUND_MOUNT);
+
+                (void) mount_setup_unit(m, device, path, mnt_fs_get_options(fs), mnt_fs_get_fstype(fs), true);
+        }
+
+        *ret_dirty = TAKE_PTR(dirty);
         return 0;
 }
 
@@ -1693,6 +1938,10 @@ static void mount_shutdown(Manager *m) {
         assert(m);
 
         m->mount_event_source = sd_event_source_unref(m->mount_event_source);
+        m->mountinfo_rescan_event_source = sd_event_source_unref(m->mountinfo_rescan_event_source);
+        m->mountinfo_rescan_pending = false;
+
+        mount_info_flush(m);
 
         mnt_unref_monitor(m->mount_monitor);
         m->mount_monitor = NULL;
@@ -1797,6 +2046,8 @@ static void mount_enumerate(Manager *m) {
                 (void) sd_event_source_set_description(m->mount_event_source, "mount-monitor-dispatch");
         }
 
+        /* The units are set up from scratch or from the serialized state here, hence make sure the first change
+         * we see afterwards is processed in full again. */
         r = mount_load_proc_self_mountinfo(m, false);
         if (r < 0)
                 goto fail;
@@ -1830,8 +2081,90 @@ static int drain_libmount(Manager *m) {
         return rescan;
 }
 
-static int mount_process_proc_self_mountinfo(Manager *m) {
-        _cleanup_set_free_free_ Set *around = NULL, *gone = NULL;
+static void mount_process_proc_self_mountinfo_one(Mount *mount, Set **gone, Set **around) {
+        Unit *u = UNIT(mount);
+
+        assert(mount);
+        assert(gone);
+        assert(around);
+
+        if (!mount_is_mounted(mount)) {
+
+                /* A mount point is not around right now. It
+                 * might be gone, or might never have
+                 * existed. */
+
+                if (mount->from_proc_self_mountinfo &&
+                    mount->parameters_proc_self_mountinfo.what) {
+
+                        /* Remember that this device might just have disappeared */
+                        if (set_ensure_allocated(gone, &path_hash_ops) < 0 ||
+                            set_put_strdup(*gone, mount->parameters_proc_self_mountinfo.what) < 0)
+                                log_oom(); /* we don't care too much about OOM here... */
+                }
+
+                mount->from_proc_self_mountinfo = false;
+                assert_se(update_parameters_proc_self_mountinfo(mount, NULL, NULL, NULL) >= 0);
+
+                switch (mount->state) {
+
+                case MOUNT_MOUNTED:
+                        /* This has just been unmounted by somebody else, follow the state change. */
+                        mount_enter_dead(mount, MOUNT_SUCCESS);
+                        break;
+
+                default:
+                        break;
+                }
+
+        } else if (mount->proc_flags & (MOUNT_PROC_JUST_MOUNTED|MOUNT_PROC_JUST_CHANGED)) {
+
+                /* A mount point was added or changed */
+
+                switch (mount->state) {
+
+                case MOUNT_DEAD:
+                case MOUNT_FAILED:
+
+                        /* This has just been mounted by somebody else, follow the state change, but let's
+                         * generate a new invocation ID for this implicitly and automatically. */
+                        (void) unit_acquire_invocation_id(u);
+                        mount_cycle_clear(mount);
+                        mount_enter_mounted(mount, MOUNT_SUCCESS);
+                        break;
+
+                case MOUNT_MOUNTING:
+                        mount_set_state(mount, MOUNT_MOUNTING_DONE);
+                        break;
+
+                default:
+                        /* Nothing really changed, but let's
+                         * issue an notification call
+                         * nonetheless, in case somebody is
+                         * waiting for this. (e.g. file system
+                         * ro/rw remounts.) */
+                        mount_set_state(mount, mount->state);
+                        break;
+                }
+        }
+
+        if (mount_is_mounted(mount) &&
+            mount->from_proc_self_mountinfo &&
+            mount->parameters_proc_self_mountinfo.what) {
+                /* Track devices currently used */
+
+                if (set_ensure_allocated(around, &path_hash_ops) < 0 ||
+                    set_put_strdup(*around, mount->parameters_proc_self_mountinfo.what) < 0)
+                        log_oom();
+        }
+
+        /* Reset the flags for later calls */
+        mount->proc_flags = 0;
+}
+
+static int mount_rescan_proc_self_mountinfo(Manager *m) {
+        _cleanup_set_free_free_ Set *around = NULL, *gone = NULL, *dirty = NULL;
+        bool incremental;
         const char *what;
         Iterator i;
         Unit *u;
@@ -1839,12 +2172,18 @@ static int mount_process_proc_self_mountinfo(Manager *m) {
 
         assert(m);
 
-        r = drain_libmount(m);
-        if (r <= 0)
-                return r;
+        m->mountinfo_rescan_pending = false;
+        if (m->mountinfo_rescan_event_source)
+                (void) sd_event_source_set_enabled(m->mountinfo_rescan_event_source, SD_EVENT_OFF);
 
-        r = mount_load_proc_self_mountinfo(m, true);
+        incremental = m->mountinfo_by_id;
+        if (incremental)
+                r = mount_load_proc_self_mountinfo_incremental(m, &dirty);
+        else
+                r = mount_load_proc_self_mountinfo(m, true);
         if (r < 0) {
+                mount_info_flush(m);
+
                 /* Reset flags, just in case, for later calls */
                 LIST_FOREACH(units_by_type, u, m->units_by_type[UNIT_MOUNT])
                         MOUNT(u)->proc_flags = 0;
@@ -1854,101 +2193,131 @@ static int mount_process_proc_self_mountinfo(Manager *m) {
 
         manager_dispatch_load_queue(m);
 
-        LIST_FOREACH(units_by_type, u, m->units_by_type[UNIT_MOUNT]) {
-                Mount *mount = MOUNT(u);
+        if (incremental) {
+                const char *where;
 
-                if (!mount_is_mounted(mount)) {
+                /* Only the mount points that showed up in added, removed or changed lines need a look */
+                SET_FOREACH(where, dirty, i) {
+                        _cleanup_free_ char *e = NULL;
 
-                        /* A mount point is not around right now. It
-                         * might be gone, or might never have
-                         * existed. */
+                        if (unit_name_from_path(where, ".mount", &e) < 0)
+                                continue;
 
-                        if (mount->from_proc_self_mountinfo &&
-                            mount->parameters_proc_self_mountinfo.what) {
+                        u = manager_get_unit(m, e);
+                        if (!u || u->type != UNIT_MOUNT)
+                                continue;
 
-                                /* Remember that this device might just have disappeared */
-                                if (set_ensure_allocated(&gone, &path_hash_ops) < 0 ||
-                                    set_put_strdup(gone, mount->parameters_proc_self_mountinfo.what) < 0)
-                                        log_oom(); /* we don't care too much about OOM here... */
-                        }
+                        mount_process_proc_self_mountinfo_one(MOUNT(u), &gone, &around);
+                }
 
-                        mount->from_proc_self_mountinfo = false;
-                        assert_se(update_parameters_proc_self_mountinfo(mount, NULL, NULL, NULL) >= 0);
+                /* We only looked at some of the units, hence check the remaining mounts too before
+                 * declaring a device unused. */
+                if (!set_isempty(gone)) {
+                        MountInfoEntry *e;
 
-                        switch (mount->state) {
+                        HASHMAP_FOREACH(e, m->mountinfo_by_id, i)
+                                free(set_remove(gone, e->what));
+                }
+        } else
+                LIST_FOREACH(units_by_type, u, m->units_by_type[UNIT_MOUNT])
+                        mount_process_proc_self_mountinfo_one(MOUNT(u), &gone, &around);
 
-                        case MOUNT_MOUNTED:
-                                /* This has just been unmounted by somebody else, follow the state change. */
-                                mount_enter_dead(mount, MOUNT_SUCCESS);
-                                break;
+        SET_FOREACH(what, gone, i) {
+                if (set_contains(around, what))
+                        continue;
 
-                        default:
-                                break;
-                        }
+                /* Let the device units know that the device is no longer mounted */
+                device_found_node(m, what, 0, DEVICE_FOUND_MOUNT);
+        }
 
-                } else if (mount->proc_flags & (MOUNT_PROC_JUST_MOUNTED|MOUNT_PROC_JUST_CHANGED)) {
+        return 0;
+}
 
-                        /* A mount point was added or changed */
+static int mount_process_proc_self_mountinfo(Manager *m) {
+        int r;
 
-                        switch (mount->state) {
+        assert(m);
 
-                        case MOUNT_DEAD:
-                        case MOUNT_FAILED:
+        r = drain_libmount(m);
+        if (r < 0)
+                return r;
+        if (r == 0 && !m->mountinfo_rescan_pending)
+                return 0;
 
-                                /* This has just been mounted by somebody else, follow the state change, but let's
-                                 * generate a new invocation ID for this implicitly and automatically. */
-                                (void) unit_acquire_invocation_id(u);
-                                mount_cycle_clear(mount);
-                                mount_enter_mounted(mount, MOUNT_SUCCESS);
-                                break;
+        return mount_rescan_proc_self_mountinfo(m);
+}
 
-                        case MOUNT_MOUNTING:
-                                mount_set_state(mount, MOUNT_MOUNTING_DONE);
-                                break;
+static int mount_schedule_rescan(Manager *m) {
+        usec_t usec;
+        int r;
 
-                        default:
-                                /* Nothing really changed, but let's
-                                 * issue an notification call
-                                 * nonetheless, in case somebody is
-                                 * waiting for this. (e.g. file system
-                                 * ro/rw remounts.) */
-                                mount_set_state(mount, mount->state);
-                                break;
-                        }
-                }
+        assert(m);
 
-                if (mount_is_mounted(mount) &&
-                    mount->from_proc_self_mountinfo &&
-                    mount->parameters_proc_self_mountinfo.what) {
-                        /* Track devices currently used */
+        m->mountinfo_rescan_pending = true;
 
-                        if (set_ensure_allocated(&around, &path_hash_ops) < 0 ||
-                            set_put_strdup(around, mount->parameters_proc_self_mountinfo.what) < 0)
-                                log_oom();
-                }
+        if (m->mountinfo_rescan_event_source) {
+                int enabled;
 
-                /* Reset the flags for later calls */
-                mount->proc_flags = 0;
+                r = sd_event_source_get_enabled(m->mountinfo_rescan_event_source, &enabled);
+                if (r >= 0 && enabled != SD_EVENT_OFF)
+                        return 0; /* Already scheduled, this change will be picked up with that */
         }
 
-        SET_FOREACH(what, gone, i) {
-                if (set_contains(around, what))
-                        continue;
+        usec = usec_add(now(CLOCK_MONOTONIC), MOUNTINFO_RESCAN_COALESCE_USEC);
 
-                /* Let the device units know that the device is no longer mounted */
-                device_found_node(m, what, 0, DEVICE_FOUND_MOUNT);
+        if (m->mountinfo_rescan_event_source) {
+                r = sd_event_source_set_time(m->mountinfo_rescan_event_source, usec);
+                if (r < 0)
+                        return r;
+
+                return sd_event_source_set_enabled(m->mountinfo_rescan_event_source, SD_EVENT_ONESHOT);
         }
 
+        r = sd_event_add_time(m->event, &m->mountinfo_rescan_event_source, CLOCK_MONOTONIC, usec, 0, mount_dispatch_rescan, m);
+        if (r < 0)
+                return r;
+
+        r = sd_event_source_set_priority(m->mountinfo_rescan_event_source, SD_EVENT_PRIORITY_NORMAL-10);
+        if (r < 0)
+                return r;
+
+        (void) sd_event_source_set_description(m->mountinfo_rescan_event_source, "mount-monitor-rescan");
         return 0;
 }
 
 static int mount_dispatch_io(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
         Manager *m = userdata;
+        int r;
 
         assert(m);
         assert(revents & EPOLLIN);
 
-        return mount_process_proc_self_mountinfo(m);
+        r = drain_libmount(m);
+        if (r <= 0)
+                return r;
+
+        /* During storms of mount events (e.g. many containers starting or stopping at once), don't rescan
+         * the table for each of them, but coalesce them into one rescan a bit later. */
+        if (!ratelimit_below(&m->mountinfo_ratelimit)) {
+                r = mount_schedule_rescan(m);
+                if (r >= 0)
+                        return 0;
+
+                log_warning_errno(r, "Failed to schedule rescan of /proc/self/mountinfo, rescanning right-away: %m");
+        }
+
+        return mount_rescan_proc_self_mountinfo(m);
+}
+
+static int mount_dispatch_rescan(sd_event_source *source, usec_t usec, void *userdata) {
+        Manager *m = userdata;
+
+        assert(m);
+
+        if (!m->mountinfo_rescan_pending)
+                return 0;
+
+        return mount_rescan_proc_self_mountinfo(m);
 }
 
 static void mount_reset_failed(Unit *u) {
@@ -3945,9 +3945,10 @@ static void service_notify_message(
                 }
         }
 
-        /* Interpret STATUS= */
+        /* Interpret STATUS=. Services tend to send the same status text over and over again, hence shortcut
+         * things early if it didn't change. */
         e = strv_find_startswith(tags, "STATUS=");
-        if (e) {
+        if (e && !streq_ptr(s->status_text, empty_to_null(e))) {
                 _cleanup_free_ char *t = NULL;
 
                 if (!isempty(e)) {
@@ -45,29 +45,49 @@ void transaction_abort(Transaction *tr) {
         assert(hashmap_isempty(tr->jobs));
 }
 
-static void transaction_find_jobs_that_matter_to_anchor(Job *j, unsigned generation) {
-        JobDependency *l;
+static int transaction_find_jobs_that_matter_to_anchor(Job *anchor, unsigned generation) {
+        _cleanup_free_ Job **stack = NULL;
+        size_t n_stack = 0, n_allocated = 0;
 
-        /* A recursive sweep through the graph that marks all units
-         * that matter to the anchor job, i.e. are directly or
-         * indirectly a dependency of the anchor job via paths that
-         * are fully marked as mattering. */
+        assert(anchor);
 
-        j->matters_to_anchor = true;
-        j->generation = generation;
+        /* A sweep through the graph that marks all units that matter to the anchor job, i.e. are directly
+         * or indirectly a dependency of the anchor job via paths that are fully marked as mattering. This
+         * uses an explicit stack rather than recursion, since dependency chains may be very long. */
 
-        LIST_FOREACH(subject, l, j->subject_list) {
+        if (!GREEDY_REALLOC(stack, n_allocated, 1))
+                return -ENOMEM;
 
-                /* This link does not matter */
-                if (!l->matters)
-                        continue;
+        anchor->matters_to_anchor = true;
+        anchor->generation = generation;
+        stack[n_stack++] = anchor;
 
-                /* This unit has already been marked */
-                if (l->object->generation == generation)
-                        continue;
+        while (n_stack > 0) {
+                JobDependency *l;
+                Job *j;
+
+                j = stack[--n_stack];
 
-                transaction_find_jobs_that_matter_to_anchor(l->object, generation);
+                LIST_FOREACH(subject, l, j->subject_list) {
+
+                        /* This link does not matter */
+                        if (!l->matters)
+                                continue;
+
+                        /* This unit has already been marked */
+                        if (l->object->generation == generation)
+                                continue;
+
+                        if (!GREEDY_REALLOC(stack, n_allocated, n_stack + 1))
+                                return -ENOMEM;
+
+                        l->object->matters_to_anchor = true;
+                        l->object->generation = generation;
+                        stack[n_stack++] = l->object;
+                }
         }
+
+        return 0;
 }
 
 static void transaction_merge_and_delete_job(Transaction *tr, Job *j, Job *other, JobType t) {
@@ -349,158 +369,285 @@ static char* merge_unit_ids(const char* unit_log_field, char **pairs) {
         return ans;
 }
 
-static int transaction_verify_order_one(Transaction *tr, Job *j, Job *from, unsigned generation, sd_bus_error *e) {
-        Iterator i;
-        Unit *u;
-        void *v;
-        int r;
+/* A compact snapshot of the job ordering graph, built once per verification pass. Nodes are the jobs of the
+ * transaction plus any installed jobs reachable from them, each job's position is stored in Job.order_index.
+ * Edges point along the actual job execution order and are kept in one flat array of node indexes, with
+ * edges_offset[i] pointing to the first edge of node i. This way the cycle check itself walks a few contiguous
+ * arrays instead of hopping through per-unit dependency hashmaps and the transaction hashmap for each edge. */
+typedef struct OrderGraph {
+        Job **nodes;
+        size_t n_nodes, n_nodes_allocated;
+        size_t n_roots;
+
+        size_t *edges_offset;
+        size_t n_edges_offset_allocated;
+
+        unsigned *edges;
+        size_t n_edges, n_edges_allocated;
+} OrderGraph;
+
+static void order_graph_done(OrderGraph *g) {
+        assert(g);
+
+        g->nodes = mfree(g->nodes);
+        g->edges_offset = mfree(g->edges_offset);
+        g->edges = mfree(g->edges);
+}
+
+static int order_graph_add_node(OrderGraph *g, Job *j, unsigned generation, unsigned *ret) {
+        assert(g);
+        assert(j);
+        assert(ret);
+
+        /* The generation tells us whether the job has already been assigned a node in this pass */
+        if (j->generation == generation) {
+                *ret = j->order_index;
+                return 0;
+        }
+
+        if (g->n_nodes >= UINT_MAX)
+                return -E2BIG;
+
+        if (!GREEDY_REALLOC(g->nodes, g->n_nodes_allocated, g->n_nodes + 1))
+                return -ENOMEM;
+
+        j->generation = generation;
+        j->order_index = g->n_nodes;
+        g->nodes[g->n_nodes++] = j;
+
+        *ret = j->order_index;
+        return 0;
+}
+
+static int order_graph_build(OrderGraph *g, Transaction *tr, unsigned generation) {
         static const UnitDependency directions[] = {
                 UNIT_BEFORE,
                 UNIT_AFTER,
         };
-        size_t d;
+        Iterator i;
+        unsigned idx;
+        size_t k;
+        Job *j;
+        int r;
 
+        assert(g);
         assert(tr);
-        assert(j);
-        assert(!j->transaction_prev);
 
-        /* Does a recursive sweep through the ordering graph, looking
-         * for a cycle. If we find a cycle we try to break it. */
+        HASHMAP_FOREACH(j, tr->jobs, i) {
+                assert(!j->transaction_prev);
 
-        /* Have we seen this before? */
-        if (j->generation == generation) {
-                Job *k, *delete = NULL;
-                _cleanup_free_ char **array = NULL, *unit_ids = NULL;
-                char **unit_id, **job_type;
-
-                /* If the marker is NULL we have been here already and
-                 * decided the job was loop-free from here. Hence
-                 * shortcut things and return right-away. */
-                if (!j->marker)
-                        return 0;
+                r = order_graph_add_node(g, j, generation, &idx);
+                if (r < 0)
+                        return r;
+        }
 
-                /* So, the marker is not NULL and we already have been here. We have
-                 * a cycle. Let's try to break it. We go backwards in our path and
-                 * try to find a suitable job to remove. We use the marker to find
-                 * our way back, since smart how we are we stored our way back in
-                 * there. */
+        g->n_roots = g->n_nodes;
 
-                for (k = from; k; k = ((k->generation == generation && k->marker != k) ? k->marker : NULL)) {
+        /* Note that g->n_nodes grows while we iterate, as installed jobs are discovered */
+        for (k = 0; k < g->n_nodes; k++) {
+                size_t d;
 
-                        /* For logging below */
-                        if (strv_push_pair(&array, k->unit->id, (char*) job_type_to_string(k->type)) < 0)
-                                log_oom();
+                if (!GREEDY_REALLOC(g->edges_offset, g->n_edges_offset_allocated, k + 1))
+                        return -ENOMEM;
 
-                        if (!delete && hashmap_get(tr->jobs, k->unit) && !unit_matters_to_anchor(k->unit, k))
-                                /* Ok, we can drop this one, so let's do so. */
-                                delete = k;
+                g->edges_offset[k] = g->n_edges;
+                j = g->nodes[k];
+
+                /* Actual ordering of jobs depends on the unit ordering dependency and job types. We need to
+                 * record the 'before' edges in the actual job execution order. We look at both unit ordering
+                 * dependencies and we test with job_compare() whether it is the 'before' edge in the job
+                 * execution ordering. */
+                for (d = 0; d < ELEMENTSOF(directions); d++) {
+                        Unit *u;
+                        void *v;
+
+                        HASHMAP_FOREACH_KEY(v, u, j->unit->dependencies[directions[d]], i) {
+                                Job *o;
+
+                                /* Is there a job for this unit? */
+                                o = hashmap_get(tr->jobs, u);
+                                if (!o) {
+                                        /* Ok, there is no job for this in the
+                                         * transaction, but maybe there is already one
+                                         * running? */
+                                        o = u->job;
+                                        if (!o)
+                                                continue;
+                                }
 
-                        /* Check if this in fact was the beginning of the cycle */
-                        if (k == j)
-                                break;
-                }
+                                /* Skip the edge if the job j is not really *before* o. */
+                                if (job_compare(j, o, directions[d]) >= 0)
+                                        continue;
 
-                unit_ids = merge_unit_ids(j->manager->unit_log_field, array); /* ignore error */
-
-                STRV_FOREACH_PAIR(unit_id, job_type, array)
-                        /* logging for j not k here to provide a consistent narrative */
-                        log_struct(LOG_WARNING,
-                                   "MESSAGE=%s: Found %s on %s/%s",
-                                   j->unit->id,
-                                   unit_id == array ? "ordering cycle" : "dependency",
-                                   *unit_id, *job_type,
-                                   unit_ids);
-
-                if (delete) {
-                        const char *status;
-                        /* logging for j not k here to provide a consistent narrative */
-                        log_struct(LOG_ERR,
-                                   "MESSAGE=%s: Job %s/%s deleted to break ordering cycle starting with %s/%s",
-                                   j->unit->id, delete->unit->id, job_type_to_string(delete->type),
-                                   j->unit->id, job_type_to_string(j->type),
-                                   unit_ids);
-
-                        if (log_get_show_color())
-                                status = ANSI_HIGHLIGHT_RED " SKIP " ANSI_NORMAL;
-                        else
-                                status = " SKIP ";
+                                r = order_graph_add_node(g, o, generation, &idx);
+                                if (r < 0)
+                                        return r;
+
+                                if (!GREEDY_REALLOC(g->edges, g->n_edges_allocated, g->n_edges + 1))
+                                        return -ENOMEM;
 
-                        unit_status_printf(delete->unit, status,
-                                           "Ordering cycle found, skipping %s");
-                        transaction_delete_unit(tr, delete->unit);
-                        return -EAGAIN;
+                                g->edges[g->n_edges++] = idx;
+                        }
                 }
+        }
 
-                log_struct(LOG_ERR,
-                           "MESSAGE=%s: Unable to break cycle starting with %s/%s",
-                           j->unit->id, j->unit->id, job_type_to_string(j->type),
-                           unit_ids);
+        /* Terminating entry, so that the edges of node k are always edges_offset[k]…edges_offset[k+1] */
+        if (!GREEDY_REALLOC(g->edges_offset, g->n_edges_offset_allocated, g->n_nodes + 1))
+                return -ENOMEM;
+
+        g->edges_offset[g->n_nodes] = g->n_edges;
+        return 0;
+}
+
+static int transaction_break_order_cycle(
+                Transaction *tr,
+                const OrderGraph *g,
+                const unsigned *parent,
+                unsigned start,
+                unsigned from,
+                sd_bus_error *e) {
+
+        _cleanup_free_ char **array = NULL, *unit_ids = NULL;
+        char **unit_id, **job_type;
+        Job *j, *delete = NULL;
+        unsigned k;
+
+        assert(tr);
+        assert(g);
+        assert(parent);
 
-                return sd_bus_error_setf(e, BUS_ERROR_TRANSACTION_ORDER_IS_CYCLIC,
-                                         "Transaction order is cyclic. See system logs for details.");
+        /* We found a cycle. Let's try to break it. We go backwards in our path and try to find a suitable
+         * job to remove. The parent array tells us our way back, the node 'start' is the one we reached
+         * twice on the current path. */
+
+        j = g->nodes[start];
+
+        for (k = from; k != UINT_MAX; k = parent[k]) {
+                Job *c = g->nodes[k];
+
+                /* For logging below */
+                if (strv_push_pair(&array, c->unit->id, (char*) job_type_to_string(c->type)) < 0)
+                        log_oom();
+
+                if (!delete && hashmap_get(tr->jobs, c->unit) && !unit_matters_to_anchor(c->unit, c))
+                        /* Ok, we can drop this one, so let's do so. */
+                        delete = c;
+
+                /* Check if this in fact was the beginning of the cycle */
+                if (k == start)
+                        break;
         }
 
-        /* Make the marker point to where we come from, so that we can
-         * find our way backwards if we want to break a cycle. We use
-         * a special marker for the beginning: we point to
-         * ourselves. */
-        j->marker = from ? from : j;
-        j->generation = generation;
+        unit_ids = merge_unit_ids(j->manager->unit_log_field, array); /* ignore error */
 
-        /* Actual ordering of jobs depends on the unit ordering dependency and job types. We need to traverse
-         * the graph over 'before' edges in the actual job execution order. We traverse over both unit
-         * ordering dependencies and we test with job_compare() whether it is the 'before' edge in the job
-         * execution ordering. */
-        for (d = 0; d < ELEMENTSOF(directions); d++) {
-                HASHMAP_FOREACH_KEY(v, u, j->unit->dependencies[directions[d]], i) {
-                        Job *o;
-
-                        /* Is there a job for this unit? */
-                        o = hashmap_get(tr->jobs, u);
-                        if (!o) {
-                                /* Ok, there is no job for this in the
-                                 * transaction, but maybe there is already one
-                                 * running? */
-                                o = u->job;
-                                if (!o)
-                                        continue;
-                        }
+        STRV_FOREACH_PAIR(unit_id, job_type, array)
+                /* logging for j not k here to provide a consistent narrative */
+                log_struct(LOG_WARNING,
+                           "MESSAGE=%s: Found %s on %s/%s",
+                           j->unit->id,
+                           unit_id == array ? "ordering cycle" : "dependency",
+                           *unit_id, *job_type,
+                           unit_ids);
 
-                        /* Cut traversing if the job j is not really *before* o. */
-                        if (job_compare(j, o, directions[d]) >= 0)
-                                continue;
+        if (delete) {
+                const char *status;
+                /* logging for j not k here to provide a consistent narrative */
+                log_struct(LOG_ERR,
+                           "MESSAGE=%s: Job %s/%s deleted to break ordering cycle starting with %s/%s",
+                           j->unit->id, delete->unit->id, job_type_to_string(delete->type),
+                           j->unit->id, job_type_to_string(j->type),
+                           unit_ids);
 
-                        r = transaction_verify_order_one(tr, o, j, generation, e);
-                        if (r < 0)
-                                return r;
-                }
+                if (log_get_show_color())
+                        status = ANSI_HIGHLIGHT_RED " SKIP " ANSI_NORMAL;
+                else
+                        status = " SKIP ";
+
+                unit_status_printf(delete->unit, status,
+                                   "Ordering cycle found, skipping %s");
+                transaction_delete_unit(tr, delete->unit);
+                return -EAGAIN;
         }
 
-        /* Ok, let's backtrack, and remember that this entry is not on
-         * our path anymore. */
-        j->marker = NULL;
+        log_struct(LOG_ERR,
+                   "MESSAGE=%s: Unable to break cycle starting with %s/%s",
+                   j->unit->id, j->unit->id, job_type_to_string(j->type),
+                   unit_ids);
 
-        return 0;
+        return sd_bus_error_setf(e, BUS_ERROR_TRANSACTION_ORDER_IS_CYCLIC,
+                                 "Transaction order is cyclic. See system logs for details.");
 }
 
+enum {
+        ORDER_NODE_UNVISITED,
+        ORDER_NODE_ON_PATH,
+        ORDER_NODE_DONE,
+};
+
 static int transaction_verify_order(Transaction *tr, unsigned *generation, sd_bus_error *e) {
-        Job *j;
+        _cleanup_(order_graph_done) OrderGraph g = {};
+        _cleanup_free_ unsigned *parent = NULL;
+        _cleanup_free_ size_t *next_edge = NULL;
+        _cleanup_free_ uint8_t *state = NULL;
+        size_t root;
         int r;
-        Iterator i;
-        unsigned g;
 
         assert(tr);
         assert(generation);
 
-        /* Check if the ordering graph is cyclic. If it is, try to fix
-         * that up by dropping one of the jobs. */
+        /* Check if the ordering graph is cyclic. If it is, try to fix that up by dropping one of the
+         * jobs. This is an iterative depth-first search over the compact ordering graph: the path we are
+         * currently on is linked up through parent[], and next_edge[] remembers for each node on the path
+         * which of its edges to follow next. */
+
+        r = order_graph_build(&g, tr, (*generation)++);
+        if (r < 0)
+                return r;
 
-        g = (*generation)++;
+        if (g.n_nodes == 0)
+                return 0;
 
-        HASHMAP_FOREACH(j, tr->jobs, i) {
-                r = transaction_verify_order_one(tr, j, NULL, g, e);
-                if (r < 0)
-                        return r;
+        parent = new(unsigned, g.n_nodes);
+        next_edge = newdup(size_t, g.edges_offset, g.n_nodes);
+        state = new0(uint8_t, g.n_nodes);
+        if (!parent || !next_edge || !state)
+                return -ENOMEM;
+
+        for (root = 0; root < g.n_roots; root++) {
+                unsigned c;
+
+                if (state[root] != ORDER_NODE_UNVISITED)
+                        continue;
+
+                c = root;
+                parent[c] = UINT_MAX;
+                state[c] = ORDER_NODE_ON_PATH;
+
+                while (c != UINT_MAX) {
+                        unsigned t;
+
+                        if (next_edge[c] >= g.edges_offset[c + 1]) {
+                                /* Ok, let's backtrack, and remember that this entry is not on our path
+                                 * anymore, and was found to be loop-free. */
+                                state[c] = ORDER_NODE_DONE;
+                                c = parent[c];
+                                continue;
+                        }
+
+                        t = g.edges[next_edge[c]++];
+
+                        /* We have been here already and decided the job was loop-free from here. */
+                        if (state[t] == ORDER_NODE_DONE)
+                                continue;
+
+                        /* We have been here already and it is still on our path: we have a cycle. */
+                        if (state[t] == ORDER_NODE_ON_PATH)
+                                return transaction_break_order_cycle(tr, &g, parent, t, c, e);
+
+                        parent[t] = c;
+                        state[t] = ORDER_NODE_ON_PATH;
+                        c = t;
+                }
         }
 
         return 0;
@@ -714,14 +861,16 @@ int transaction_activate(
         /* This applies the changes recorded in tr->jobs to
          * the actual list of jobs, if possible. */
 
-        /* Reset the generation counter of all installed jobs. The detection of cycles
-         * looks at installed jobs. If they had a non-zero generation from some previous
+        /* Reset the generation counter of all installed jobs. The ordering graph used for the
+         * detection of cycles includes installed jobs. If they had a non-zero generation from some previous
          * walk of the graph, the algorithm would break. */
         HASHMAP_FOREACH(j, m->jobs, i)
                 j->generation = 0;
 
         /* First step: figure out which jobs matter */
-        transaction_find_jobs_that_matter_to_anchor(tr->anchor_job, generation++);
+        r = transaction_find_jobs_that_matter_to_anchor(tr->anchor_job, generation++);
+        if (r < 0)
+                return log_oom();
 
         /* Second step: Try not to stop any running services if
          * we don't have to. Don't try to reverse running
@@ -830,7 +979,7 @@ static Job* transaction_add_one_job(Transaction *tr, JobType type, Unit *unit, b
                 return NULL;
 
         j->generation = 0;
-        j->marker = NULL;
+        j->order_index = 0;
         j->matters_to_anchor = false;
         j->irreversible = tr->irreversible;
 
@@ -443,11 +443,18 @@ void unit_add_to_dbus_queue(Unit *u) {
         assert(u);
         assert(u->type != _UNIT_TYPE_INVALID);
 
-        if (u->load_state == UNIT_STUB || u->in_dbus_queue)
+        if (u->load_state == UNIT_STUB)
                 return;
 
+        if (u->in_dbus_queue) {
+                /* Already queued, this change will be covered by the signal sent out for it */
+                u->manager->n_change_signals_suppressed++;
+                return;
+        }
+
         /* Shortcut things if nobody cares */
         if (sd_bus_track_count(u->manager->subscribed) <= 0 &&
+            sd_bus_track_count(u->manager->subscribed_batched) <= 0 &&
             sd_bus_track_count(u->bus_track) <= 0 &&
             set_isempty(u->manager->private_buses)) {
                 u->sent_dbus_new_signal = true;
@@ -663,6 +670,10 @@ void unit_free(Unit *u) {
         if (u->in_dbus_queue)
                 LIST_REMOVE(dbus_queue, u->manager->dbus_unit_queue, u);
 
+        /* Batched subscribers learn about the removal from the UnitRemoved signal */
+        if (u->in_dbus_batch_queue)
+                LIST_REMOVE(dbus_batch_queue, u->manager->dbus_unit_batch_queue, u);
+
         if (u->in_gc_queue)
                 LIST_REMOVE(gc_queue, u->manager->gc_unit_queue, u);
 
@@ -189,6 +189,7 @@ typedef struct Unit {
 
         /* D-Bus queue */
         LIST_FIELDS(Unit, dbus_queue);
+        LIST_FIELDS(Unit, dbus_batch_queue);
 
         /* Cleanup queue */
         LIST_FIELDS(Unit, cleanup_queue);
@@ -335,6 +336,7 @@ typedef struct Unit {
         /* Booleans indicating membership of this unit in the various queues */
         bool in_load_queue:1;
         bool in_dbus_queue:1;
+        bool in_dbus_batch_queue:1;
         bool in_cleanup_queue:1;
         bool in_gc_queue:1;
         bool in_cgroup_realize_queue:1;
@@ -16,13 +16,14 @@
 static const char *arg_hwdb_bin_dir = NULL;
 static const char *arg_root = NULL;
 static bool arg_strict = false;
+static bool arg_incremental = false;
 
 static int verb_query(int argc, char *argv[], void *userdata) {
         return hwdb_query(argv[1]);
 }
 
 static int verb_update(int argc, char *argv[], void *userdata) {
-        return hwdb_update(arg_root, arg_hwdb_bin_dir, arg_strict, false);
+        return hwdb_update(arg_root, arg_hwdb_bin_dir, arg_strict, false, arg_incremental);
 }
 
 static int help(void) {
@@ -42,6 +43,8 @@ static int help(void) {
                "  -h --help       Show this help\n"
                "     --version    Show package version\n"
                "  -s --strict     When updating, return non-zero exit value on any parsing error\n"
+               "     --incremental\n"
+               "                  When updating, do nothing if no source file changed\n"
                "     --usr        Generate in " UDEVLIBEXECDIR " instead of /etc/udev\n"
                "  -r --root=PATH  Alternative root path in the filesystem\n\n"
                "\nSee the %s for details.\n"
@@ -58,14 +61,16 @@ static int parse_argv(int argc, char *argv[]) {
         enum {
                 ARG_VERSION = 0x100,
                 ARG_USR,
+                ARG_INCREMENTAL,
         };
 
         static const struct option options[] = {
-                { "help",     no_argument,       NULL, 'h'         },
-                { "version",  no_argument,       NULL, ARG_VERSION },
-                { "usr",      no_argument,       NULL, ARG_USR     },
-                { "strict",   no_argument,       NULL, 's'         },
-                { "root",     required_argument, NULL, 'r'         },
+                { "help",        no_argument,       NULL, 'h'             },
+                { "version",     no_argument,       NULL, ARG_VERSION     },
+                { "usr",         no_argument,       NULL, ARG_USR         },
+                { "strict",      no_argument,       NULL, 's'             },
+                { "incremental", no_argument,       NULL, ARG_INCREMENTAL },
+                { "root",        required_argument, NULL, 'r'             },
                 {}
         };
 
@@ -91,6 +96,10 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_strict = true;
                         break;
 
+                case ARG_INCREMENTAL:
+                        arg_incremental = true;
+                        break;
+
                 case 'r':
                         arg_root = optarg;
                         break;
@@ -8,6 +8,7 @@
 #include "fd-util.h"
 #include "fileio.h"
 #include "hexdecoct.h"
+#include "random-util.h"
 #include "sort-util.h"
 #include "string-util.h"
 #include "strv.h"
@@ -46,18 +47,234 @@
  *  ` BUS_MATCH_SENDER
  *    ` BUS_MATCH_VALUE: value == miau
  *      ` BUS_MATCH_LEAF: E
+ *
+ * The values of the compares on header fields (sender, destination, interface, member, path, path_namespace) are
+ * interned in a string pool attached to the root node, and the hash tables of these compares are keyed by the
+ * interned pointers. When running the tree on a message, each header field is then looked up in the pool only
+ * once, and the result is cached on the message, so that every further compare on it is a pointer lookup, and a
+ * field whose value no match refers to is skipped right away. For path_namespace the namespaces the path lies
+ * in are looked up instead. Well-known names in sender compares cannot be looked up like that (as a message
+ * carries the unique name of its sender), hence these are kept in the child list of the compare node and
+ * tested one by one.
  */
 
+/* Bit in struct bus_match_cache's resolved field marking the path prefixes as looked up */
+#define BUS_MATCH_CACHE_PATH_PREFIXES (1U << 5)
+
+struct bus_match_string {
+        unsigned n_ref;
+        char str[];
+};
+
 static bool BUS_MATCH_IS_COMPARE(enum bus_match_node_type t) {
         return t >= BUS_MATCH_SENDER && t <= BUS_MATCH_ARG_HAS_LAST;
 }
 
 static bool BUS_MATCH_CAN_HASH(enum bus_match_node_type t) {
-        return (t >= BUS_MATCH_MESSAGE_TYPE && t <= BUS_MATCH_PATH) ||
+        return (t >= BUS_MATCH_SENDER && t <= BUS_MATCH_PATH_NAMESPACE) ||
                 (t >= BUS_MATCH_ARG && t <= BUS_MATCH_ARG_LAST) ||
                 (t >= BUS_MATCH_ARG_HAS && t <= BUS_MATCH_ARG_HAS_LAST);
 }
 
+static bool BUS_MATCH_CAN_INTERN(enum bus_match_node_type t) {
+        return t >= BUS_MATCH_SENDER && t <= BUS_MATCH_PATH_NAMESPACE && t != BUS_MATCH_MESSAGE_TYPE;
+}
+
+static bool bus_match_value_is_hashed(enum bus_match_node_type t, const char *value_str) {
+        /* Well-known names in sender compares need to be tested against the message, see above */
+        return BUS_MATCH_CAN_HASH(t) && (t != BUS_MATCH_SENDER || value_str[0] == ':');
+}
+
+static struct bus_match_node *bus_match_node_root(struct bus_match_node *node) {
+        assert(node);
+
+        while (node->parent)
+                node = node->parent;
+
+        assert(node->type == BUS_MATCH_ROOT);
+        return node;
+}
+
+static int bus_match_string_intern(struct bus_match_node *root, const char *s, char **ret) {
+        struct bus_match_string *e;
+        size_t l;
+        int r;
+
+        assert(root);
+        assert(root->type == BUS_MATCH_ROOT);
+        assert(s);
+        assert(ret);
+
+        /* Returns the pooled copy of s, with a reference taken on it */
+
+        e = hashmap_get(root->root.strings, s);
+        if (e) {
+                e->n_ref++;
+                *ret = e->str;
+                return 0;
+        }
+
+        if (!root->root.strings) {
+                root->root.strings = hashmap_new(&string_hash_ops);
+                if (!root->root.strings)
+                        return -ENOMEM;
+
+                /* Start at a random point, so that a cache that still refers to a freed pool at the same
+                 * address is never mistaken as valid */
+                root->root.generation = random_u64();
+        }
+
+        l = strlen(s);
+        e = malloc(offsetof(struct bus_match_string, str) + l + 1);
+        if (!e)
+                return -ENOMEM;
+
+        e->n_ref = 1;
+        memcpy(e->str, s, l + 1);
+
+        r = hashmap_put(root->root.strings, e->str, e);
+        if (r < 0) {
+                free(e);
+                return r;
+        }
+
+        root->root.generation++;
+
+        *ret = e->str;
+        return 1;
+}
+
+static void bus_match_string_unref(struct bus_match_node *root, char *s) {
+        struct bus_match_string *e;
+
+        assert(root);
+        assert(root->type == BUS_MATCH_ROOT);
+
+        if (!s)
+                return;
+
+        e = (struct bus_match_string*) (s - offsetof(struct bus_match_string, str));
+
+        assert(e->n_ref > 0);
+        if (--e->n_ref > 0)
+                return;
+
+        assert_se(hashmap_remove(root->root.strings, e->str) == e);
+        free(e);
+
+        root->root.generation++;
+}
+
+static const char *bus_match_string_lookup(struct bus_match_node *root, const char *s) {
+        struct bus_match_string *e;
+
+        assert(root);
+
+        if (!s)
+                return NULL;
+
+        e = hashmap_get(root->root.strings, s);
+        return e ? e->str : NULL;
+}
+
+static void bus_match_cache_prepare(struct bus_match_cache *c, struct bus_match_node *root) {
+        assert(c);
+        assert(root);
+
+        if (c->root == root && c->generation == root->root.generation)
+                return;
+
+        free(c->path_prefixes);
+
+        *c = (struct bus_match_cache) {
+                .root = root,
+                .generation = root->root.generation,
+        };
+}
+
+static const char *bus_match_cache_get(sd_bus_message *m, enum bus_match_node_type t, const char *s) {
+        struct bus_match_cache *c = &m->match_cache;
+        unsigned i;
+
+        assert(c->root);
+        assert(BUS_MATCH_CAN_INTERN(t) && t != BUS_MATCH_PATH_NAMESPACE);
+
+        i = t == BUS_MATCH_SENDER ? 0 : t - BUS_MATCH_DESTINATION + 1;
+        assert(i < ELEMENTSOF(c->interned));
+
+        if (!FLAGS_SET(c->resolved, 1U << i)) {
+                c->interned[i] = bus_match_string_lookup(c->root, s);
+                c->resolved |= 1U << i;
+        }
+
+        return c->interned[i];
+}
+
+static int bus_match_cache_add_path_prefix(struct bus_match_cache *c, char *p, size_t n, size_t *allocated) {
+        const char *interned;
+        char saved;
+
+        saved = p[n];
+        p[n] = 0;
+        interned = bus_match_string_lookup(c->root, p);
+        p[n] = saved;
+
+        if (!interned)
+                return 0;
+
+        /* The candidates are generated by increasing length, hence duplicates are always adjacent */
+        if (c->n_path_prefixes > 0 && c->path_prefixes[c->n_path_prefixes - 1] == interned)
+                return 0;
+
+        if (!GREEDY_REALLOC(c->path_prefixes, *allocated, c->n_path_prefixes + 1))
+                return -ENOMEM;
+
+        c->path_prefixes[c->n_path_prefixes++] = interned;
+        return 0;
+}
+
+static int bus_match_cache_resolve_path_prefixes(sd_bus_message *m) {
+        struct bus_match_cache *c = &m->match_cache;
+        _cleanup_free_ char *p = NULL;
+        size_t allocated = 0, l, i;
+        int r;
+
+        assert(c->root);
+
+        if (FLAGS_SET(c->resolved, BUS_MATCH_CACHE_PATH_PREFIXES))
+                return 0;
+
+        /* Looks up all patterns path_simple_pattern() would accept for the path of the message: the path
+         * itself, and for each '/' in it the part before it, as well as the part including it. */
+
+        if (m->path && !hashmap_isempty(c->root->root.strings)) {
+                p = strdup(m->path);
+                if (!p)
+                        return -ENOMEM;
+
+                l = strlen(p);
+                for (i = 0; i < l; i++) {
+                        if (p[i] != '/')
+                                continue;
+
+                        r = bus_match_cache_add_path_prefix(c, p, i, &allocated);
+                        if (r < 0)
+                                return r;
+
+                        r = bus_match_cache_add_path_prefix(c, p, i + 1, &allocated);
+                        if (r < 0)
+                                return r;
+                }
+
+                r = bus_match_cache_add_path_prefix(c, p, l, &allocated);
+                if (r < 0)
+                        return r;
+        }
+
+        c->resolved |= BUS_MATCH_CACHE_PATH_PREFIXES;
+        return 0;
+}
+
 static void bus_match_node_free(struct bus_match_node *node) {
         assert(node);
         assert(node->parent);
@@ -65,7 +282,7 @@ static void bus_match_node_free(struct bus_match_node *node) {
         assert(node->type != BUS_MATCH_ROOT);
         assert(node->type < _BUS_MATCH_NODE_TYPE_MAX);
 
-        if (node->parent->child) {
+        if (node->prev || node->parent->child == node) {
                 /* We are apparently linked into the parent's child
                  * list. Let's remove us from there. */
                 if (node->prev) {
@@ -87,9 +304,12 @@ static void bus_match_node_free(struct bus_match_node *node) {
                 if (node->parent->type == BUS_MATCH_MESSAGE_TYPE)
                         hashmap_remove(node->parent->compare.children, UINT_TO_PTR(node->value.u8));
                 else if (BUS_MATCH_CAN_HASH(node->parent->type) && node->value.str)
-                        hashmap_remove(node->parent->compare.children, node->value.str);
+                        hashmap_remove_value(node->parent->compare.children, node->value.str, node);
 
-                free(node->value.str);
+                if (BUS_MATCH_CAN_INTERN(node->parent->type))
+                        bus_match_string_unref(bus_match_node_root(node), node->value.str);
+                else
+                        free(node->value.str);
         }
 
         if (BUS_MATCH_IS_COMPARE(node->type)) {
@@ -272,6 +492,7 @@ int bus_match_run(
                  * we won't call any. The children of the root node
                  * are compares or leaves, they will automatically
                  * call their siblings. */
+                bus_match_cache_prepare(&m->match_cache, node);
                 return bus_match_run(bus, node->child, m);
 
         case BUS_MATCH_VALUE:
@@ -379,12 +600,45 @@ int bus_match_run(
                 assert_not_reached("Unknown match type.");
         }
 
-        if (BUS_MATCH_CAN_HASH(node->type)) {
+        if (node->type == BUS_MATCH_PATH_NAMESPACE) {
+                size_t i;
+
+                /* Look up each namespace the path is in. Note that the cache might be reset by a nested run,
+                 * hence don't hold on to the array. */
+
+                r = bus_match_cache_resolve_path_prefixes(m);
+                if (r < 0)
+                        return r;
+
+                for (i = 0; i < m->match_cache.n_path_prefixes; i++) {
+                        struct bus_match_node *found;
+
+                        found = hashmap_get(node->compare.children, m->match_cache.path_prefixes[i]);
+                        if (!found)
+                                continue;
+
+                        r = bus_match_run(bus, found, m);
+                        if (r != 0)
+                                return r;
+
+                        if (bus && bus->match_callbacks_modified)
+                                return 0;
+                }
+
+        } else if (BUS_MATCH_CAN_HASH(node->type)) {
                 struct bus_match_node *found;
 
                 /* Lookup via hash table, nice! So let's jump directly. */
 
-                if (test_str)
+                if (BUS_MATCH_CAN_INTERN(node->type)) {
+                        const char *interned;
+
+                        /* Header fields are looked up in the pool once, the hash table is keyed by the
+                         * interned strings */
+                        interned = bus_match_cache_get(m, node->type, test_str);
+                        found = interned ? hashmap_get(node->compare.children, interned) : NULL;
+
+                } else if (test_str)
                         found = hashmap_get(node->compare.children, test_str);
                 else if (test_strv) {
                         char **i;
@@ -409,10 +663,15 @@ int bus_match_run(
                         if (r != 0)
                                 return r;
                 }
-        } else {
+        }
+
+        if (node->child) {
                 struct bus_match_node *c;
 
-                /* No hash table, so let's iterate manually... */
+                /* Not in the hash table, so let's iterate manually... */
+
+                if (bus && bus->match_callbacks_modified)
+                        return 0;
 
                 for (c = node->child; c; c = c->next) {
                         if (!value_node_test(c, node->type, test_u8, test_str, test_strv, m))
@@ -435,6 +694,7 @@ int bus_match_run(
 }
 
 static int bus_match_add_compare_value(
+                struct bus_match_node *root,
                 struct bus_match_node *where,
                 enum bus_match_node_type t,
                 uint8_t value_u8,
@@ -442,13 +702,26 @@ static int bus_match_add_compare_value(
                 struct bus_match_node **ret) {
 
         struct bus_match_node *c = NULL, *n = NULL;
+        char *interned = NULL;
+        const char *key = value_str;
         int r;
 
+        assert(root);
         assert(where);
         assert(IN_SET(where->type, BUS_MATCH_ROOT, BUS_MATCH_VALUE));
         assert(BUS_MATCH_IS_COMPARE(t));
         assert(ret);
 
+        if (BUS_MATCH_CAN_INTERN(t)) {
+                assert(value_str);
+
+                r = bus_match_string_intern(root, value_str, &interned);
+                if (r < 0)
+                        return r;
+
+                key = interned;
+        }
+
         for (c = where->child; c && c->type != t; c = c->next)
                 ;
 
@@ -458,14 +731,15 @@ static int bus_match_add_compare_value(
 
                 if (t == BUS_MATCH_MESSAGE_TYPE)
                         n = hashmap_get(c->compare.children, UINT_TO_PTR(value_u8));
-                else if (BUS_MATCH_CAN_HASH(t))
-                        n = hashmap_get(c->compare.children, value_str);
+                else if (bus_match_value_is_hashed(t, value_str))
+                        n = hashmap_get(c->compare.children, key);
                 else {
                         for (n = c->child; n && !value_node_same(n, t, value_u8, value_str); n = n->next)
                                 ;
                 }
 
                 if (n) {
+                        bus_match_string_unref(root, interned);
                         *ret = n;
                         return 0;
                 }
@@ -486,7 +760,8 @@ static int bus_match_add_compare_value(
                         c->next->prev = c;
                 where->child = c;
 
-                if (t == BUS_MATCH_MESSAGE_TYPE) {
+                if (t == BUS_MATCH_MESSAGE_TYPE || BUS_MATCH_CAN_INTERN(t)) {
+                        /* Keyed by the interned pointers for header fields */
                         c->compare.children = hashmap_new(NULL);
                         if (!c->compare.children) {
                                 r = -ENOMEM;
@@ -509,7 +784,9 @@ static int bus_match_add_compare_value(
 
         n->type = BUS_MATCH_VALUE;
         n->value.u8 = value_u8;
-        if (value_str) {
+        if (interned)
+                n->value.str = interned;
+        else if (value_str) {
                 n->value.str = strdup(value_str);
                 if (!n->value.str) {
                         r = -ENOMEM;
@@ -518,21 +795,19 @@ static int bus_match_add_compare_value(
         }
 
         n->parent = c;
-        if (c->compare.children) {
-
-                if (t == BUS_MATCH_MESSAGE_TYPE)
-                        r = hashmap_put(c->compare.children, UINT_TO_PTR(value_u8), n);
-                else
-                        r = hashmap_put(c->compare.children, n->value.str, n);
-
-                if (r < 0)
-                        goto fail;
-        } else {
+        if (t == BUS_MATCH_MESSAGE_TYPE)
+                r = hashmap_put(c->compare.children, UINT_TO_PTR(value_u8), n);
+        else if (bus_match_value_is_hashed(t, value_str))
+                r = hashmap_put(c->compare.children, n->value.str, n);
+        else {
                 n->next = c->child;
                 if (n->next)
                         n->next->prev = n;
                 c->child = n;
+                r = 0;
         }
+        if (r < 0)
+                goto fail;
 
         *ret = n;
         return 1;
@@ -542,10 +817,12 @@ fail:
                 bus_match_node_maybe_free(c);
 
         if (n) {
-                free(n->value.str);
+                if (!interned)
+                        free(n->value.str);
                 free(n);
         }
 
+        bus_match_string_unref(root, interned);
         return r;
 }
 
@@ -912,7 +1189,7 @@ int bus_match_add(
         n = root;
         for (i = 0; i < n_components; i++) {
                 r = bus_match_add_compare_value(
-                                n, components[i].type,
+                                root, n, components[i].type,
                                 components[i].value_u8, components[i].value_str, &n);
                 if (r < 0)
                         return r;
@@ -974,6 +1251,11 @@ void bus_match_free(struct bus_match_node *node) {
 
         if (node->type != BUS_MATCH_ROOT)
                 bus_match_node_free(node);
+        else {
+                /* All interned strings are released with the value nodes referencing them */
+                assert(hashmap_isempty(node->root.strings));
+                node->root.strings = hashmap_free(node->root.strings);
+        }
 }
 
 const char* bus_match_node_type_to_string(enum bus_match_node_type t, char buf[], size_t l) {
@@ -43,12 +43,32 @@ struct bus_match_node {
                         struct match_callback *callback;
                 } leaf;
                 struct {
-                        /* If this is set, then the child is NULL */
+                        /* If this is set, then the child is NULL, except for BUS_MATCH_SENDER, where values
+                         * that are unique names are hashed, and well-known names are kept in the list */
                         Hashmap *children;
                 } compare;
+                struct {
+                        /* Pool of the strings values of header field compares are interned in, so that each
+                         * header field of a message has to be looked up only once per run */
+                        Hashmap *strings;
+                        uint64_t generation;
+                } root;
         };
 };
 
+/* The interned versions of a message's header fields, as looked up in the pool of a match tree. Embedded in the
+ * message, and only valid as long as the pool doesn't change. */
+struct bus_match_cache {
+        struct bus_match_node *root;
+        uint64_t generation;
+
+        unsigned resolved;
+        const char *interned[5];    /* sender, destination, interface, member, path */
+
+        const char **path_prefixes; /* Interned namespaces the path is in, for path_namespace= */
+        size_t n_path_prefixes;
+};
+
 struct bus_match_component {
         enum bus_match_node_type type;
         uint8_t value_u8;
@@ -134,6 +134,7 @@ static sd_bus_message* message_free(sd_bus_message *m) {
         message_free_last_container(m);
 
         bus_creds_done(&m->creds);
+        free(m->match_cache.path_prefixes);
         return mfree(m);
 }
 
@@ -349,6 +350,59 @@ static int message_append_field_uint32(sd_bus_message *m, uint64_t h, uint32_t x
         return 0;
 }
 
+static int message_append_field_memfds(sd_bus_message *m) {
+        struct bus_body_part *part;
+        size_t n = 0, begin = 0;
+        uint64_t *q;
+        uint8_t *p;
+        unsigned i;
+
+        assert(m);
+        assert(!BUS_MESSAGE_IS_GVARIANT(m));
+
+        /* Body parts the caller passed in as sealed memfd are left out of the byte stream, and the memfd is
+         * passed instead, as long as the file descriptor limit of the receiver isn't hit. */
+        MESSAGE_FOREACH_PART(part, i, m)
+                if (part->memfd >= 0 && part->sealed && m->n_fds + n < BUS_FDS_MAX)
+                        n++;
+
+        if (n == 0)
+                return 0;
+
+        /* (field id byte + (signature length + signature "at" + NUL) + padding +
+         *  (array length + padding + (body offset, memfd offset, size) triplets)) */
+        p = message_extend_fields(m, 8, 4 + 4 + 4 + 4 + n * 3 * sizeof(uint64_t), false);
+        if (!p)
+                return -ENOMEM;
+
+        p[0] = BUS_MESSAGE_HEADER_MEMFDS;
+        p[1] = 2;
+        p[2] = SD_BUS_TYPE_ARRAY;
+        p[3] = SD_BUS_TYPE_UINT64;
+        p[4] = 0;
+        memzero(p + 5, 3);
+
+        ((uint32_t*) p)[2] = n * 3 * sizeof(uint64_t);
+        memzero(p + 12, 4);
+
+        q = (uint64_t*) (p + 16);
+        MESSAGE_FOREACH_PART(part, i, m) {
+                if (m->n_memfd_parts < n && part->memfd >= 0 && part->sealed) {
+                        *(q++) = begin;
+                        *(q++) = part->memfd_offset;
+                        *(q++) = part->size;
+
+                        part->pass_memfd = true;
+                        m->n_memfd_parts++;
+                        m->memfd_parts_size += part->size;
+                }
+
+                begin += part->size;
+        }
+
+        return 0;
+}
+
 static int message_append_field_uint64(sd_bus_message *m, uint64_t h, uint64_t x) {
         uint8_t *p;
 
@@ -2921,8 +2975,15 @@ _public_ int sd_bus_message_seal(sd_bus_message *m, uint64_t cookie, uint64_t ti
                         return r;
         }
 
-        if (m->n_fds > 0) {
-                r = message_append_field_uint32(m, BUS_MESSAGE_HEADER_UNIX_FDS, m->n_fds);
+        if (!BUS_MESSAGE_IS_GVARIANT(m) && m->bus->can_memfd) {
+                r = message_append_field_memfds(m);
+                if (r < 0)
+                        return r;
+        }
+
+        /* The memfds are transferred like any other file descriptor, hence are included in the count */
+        if (m->n_fds + m->n_memfd_parts > 0) {
+                r = message_append_field_uint32(m, BUS_MESSAGE_HEADER_UNIX_FDS, m->n_fds + m->n_memfd_parts);
                 if (r < 0)
                         return r;
         }
@@ -2938,6 +2999,12 @@ _public_ int sd_bus_message_seal(sd_bus_message *m, uint64_t cookie, uint64_t ti
 
         m->timeout = m->header->flags & BUS_MESSAGE_NO_REPLY_EXPECTED ? 0 : timeout_usec;
 
+        /* The header that goes on the wire only covers the part of the body that isn't passed as memfd */
+        if (m->n_memfd_parts > 0) {
+                m->wire_header = *m->header;
+                m->wire_header.dbus1.body_size = m->body_size - m->memfd_parts_size;
+        }
+
         /* Add padding at the end of the fields part, since we know
          * the body needs to start at an 8 byte alignment. We made
          * sure we allocated enough space for this, so all we need to
@@ -4886,6 +4953,38 @@ static int message_peek_field_uint64(
         return 0;
 }
 
+static int message_peek_field_memfds(
+                sd_bus_message *m,
+                size_t *ri,
+                const uint64_t **ret,
+                size_t *ret_n) {
+
+        uint32_t l;
+        void *q;
+        int r;
+
+        assert(m);
+        assert(ri);
+        assert(ret);
+        assert(ret_n);
+        assert(!BUS_MESSAGE_IS_GVARIANT(m));
+
+        r = message_peek_field_uint32(m, ri, 4, &l);
+        if (r < 0)
+                return r;
+
+        if (l == 0 || l % (3 * sizeof(uint64_t)) != 0)
+                return -EBADMSG;
+
+        r = message_peek_fields(m, ri, 8, l, &q);
+        if (r < 0)
+                return r;
+
+        *ret = q;
+        *ret_n = l / (3 * sizeof(uint64_t));
+        return 0;
+}
+
 static int message_peek_field_string(
                 sd_bus_message *m,
                 bool (*validate)(const char *p),
@@ -5125,11 +5224,129 @@ static int message_skip_fields(
         }
 }
 
+static int message_splice_memfds(sd_bus_message *m, const uint64_t *triplets, size_t n) {
+        struct bus_body_part *part;
+        size_t wire_size, wire_index = 0, n_parts = 0, i;
+        uint64_t end = 0, total;
+        uint8_t *wire;
+        int r;
+
+        assert(m);
+        assert(!BUS_MESSAGE_IS_GVARIANT(m));
+        assert(triplets);
+        assert(n > 0);
+        assert(m->n_body_parts <= 1);
+
+        /* The body we received lacks the payload that was passed as memfds in the last n file descriptors.
+         * Reassemble it from the received bytes and the memfds, so that it can be read like any other. */
+
+        if (n > m->n_fds)
+                return -EBADMSG;
+
+        wire = m->n_body_parts > 0 ? m->body.data : NULL;
+        wire_size = m->body_size;
+
+        /* First, validate everything and count the parts we need */
+        for (i = 0; i < n; i++) {
+                uint64_t begin, offset, size, real_size;
+                int fd = m->fds[m->n_fds - n + i];
+
+                begin = BUS_MESSAGE_BSWAP64(m, triplets[i*3]);
+                offset = BUS_MESSAGE_BSWAP64(m, triplets[i*3+1]);
+                size = BUS_MESSAGE_BSWAP64(m, triplets[i*3+2]);
+
+                if (begin < end || begin - end > wire_size - wire_index)
+                        return -EBADMSG;
+                if (size == 0 || size > UINT32_MAX)
+                        return -EBADMSG;
+
+                /* Only accept memfds that can't be modified anymore after we validated them */
+                r = memfd_get_sealed(fd);
+                if (r <= 0)
+                        return -EBADMSG;
+
+                r = memfd_get_size(fd, &real_size);
+                if (r < 0)
+                        return -EBADMSG;
+                if (offset > real_size || size > real_size - offset)
+                        return -EBADMSG;
+
+                n_parts += (begin > end) + 1;
+                wire_index += begin - end;
+                end = begin + size;
+        }
+
+        total = end + (wire_size - wire_index);
+        if (total > UINT32_MAX)
+                return -EBADMSG;
+
+        if (wire_index < wire_size)
+                n_parts++;
+
+        /* Then allocate all parts, before any of the file descriptors is handed over to them */
+        m->n_body_parts = 0;
+        m->body_end = NULL;
+        for (i = 0; i < n_parts; i++)
+                if (!message_append_part(m))
+                        return -ENOMEM;
+
+        part = &m->body;
+        wire_index = 0;
+        end = 0;
+
+        for (i = 0; i < n; i++) {
+                uint64_t begin = BUS_MESSAGE_BSWAP64(m, triplets[i*3]);
+
+                if (begin > end) {
+                        part->data = wire + wire_index;
+                        part->size = begin - end;
+                        part->sealed = true;
+                        wire_index += part->size;
+                        part = part->next;
+                }
+
+                part->memfd = m->fds[m->n_fds - n + i];
+                part->memfd_offset = BUS_MESSAGE_BSWAP64(m, triplets[i*3+1]);
+                part->size = BUS_MESSAGE_BSWAP64(m, triplets[i*3+2]);
+                part->sealed = true;
+                part->pass_memfd = true;
+                end = begin + part->size;
+                part = part->next;
+        }
+
+        if (wire_index < wire_size) {
+                part->data = wire + wire_index;
+                part->size = wire_size - wire_index;
+                part->sealed = true;
+        }
+
+        /* The memfds are owned by the body parts now */
+        m->n_fds -= n;
+
+        m->n_memfd_parts = n;
+        m->memfd_parts_size = total - wire_size;
+        m->body_size = m->user_body_size = total;
+
+        /* Keep the header as received for the wire, and make ours describe the full body */
+        m->wire_header = *m->header;
+        m->header->dbus1.body_size = BUS_MESSAGE_BSWAP32(m, (uint32_t) total);
+
+        /* The iovec set up for the received buffer is stale now, it is rebuilt from the parts if needed */
+        if (m->iovec != m->iovec_fixed)
+                free(m->iovec);
+        m->iovec = NULL;
+        m->n_iovec = 0;
+
+        return 0;
+}
+
 int bus_message_parse_fields(sd_bus_message *m) {
         size_t ri;
         int r;
         uint32_t unix_fds = 0;
         bool unix_fds_set = false;
+        const uint64_t *memfds = NULL;
+        size_t n_memfds = 0;
         void *offsets = NULL;
         unsigned n_offsets = 0;
         size_t sz = 0;
@@ -5428,6 +5645,24 @@ int bus_message_parse_fields(sd_bus_message *m) {
                         unix_fds_set = true;
                         break;
 
+                case BUS_MESSAGE_HEADER_MEMFDS:
+
+                        /* Only understood if agreed on, otherwise this is just like any other unknown field */
+                        if (BUS_MESSAGE_IS_GVARIANT(m) || !m->bus->can_memfd) {
+                                if (!BUS_MESSAGE_IS_GVARIANT(m))
+                                        r = message_skip_fields(m, &ri, (uint32_t) -1, (const char **) &signature);
+                                break;
+                        }
+
+                        if (memfds)
+                                return -EBADMSG;
+
+                        if (!streq(signature, "at"))
+                                return -EBADMSG;
+
+                        r = message_peek_field_memfds(m, &ri, &memfds, &n_memfds);
+                        break;
+
                 default:
                         if (!BUS_MESSAGE_IS_GVARIANT(m))
                                 r = message_skip_fields(m, &ri, (uint32_t) -1, (const char **) &signature);
@@ -5484,6 +5719,13 @@ int bus_message_parse_fields(sd_bus_message *m) {
         if (streq_ptr(m->sender, "org.freedesktop.DBus.Local"))
                 return -EBADMSG;
 
+        /* Do this last, as the memfds are owned by the message from now on */
+        if (memfds) {
+                r = message_splice_memfds(m, memfds, n_memfds);
+                if (r < 0)
+                        return r;
+        }
+
         m->root_container.end = m->user_body_size;
 
         if (BUS_MESSAGE_IS_GVARIANT(m)) {
@@ -8,6 +8,7 @@
 #include "sd-bus.h"
 
 #include "bus-creds.h"
+#include "bus-match.h"
 #include "bus-protocol.h"
 #include "macro.h"
 #include "time-util.h"
@@ -45,6 +46,7 @@ struct bus_body_part {
         bool munmap_this:1;
         bool sealed:1;
         bool is_zero:1;
+        bool pass_memfd:1; /* Passed to the peer as file descriptor, not as part of the byte stream */
 };
 
 struct sd_bus_message {
@@ -109,6 +111,12 @@ struct sd_bus_message {
         uint32_t n_fds;
         int *fds;
 
+        /* Body parts that are passed as memfds on the socket transport. Their descriptors are sent after the
+         * n_fds ones above, and the header that goes on the wire only covers the remaining body. */
+        unsigned n_memfd_parts;
+        size_t memfd_parts_size;
+        struct bus_header wire_header;
+
         struct bus_container root_container, *containers;
         size_t n_containers;
         size_t containers_allocated;
@@ -130,6 +138,9 @@ struct sd_bus_message {
         unsigned n_header_offsets;
 
         uint64_t read_counter;
+
+        /* Header fields as interned by the match tree the message was last dispatched against */
+        struct bus_match_cache match_cache;
 };
 
 static inline bool BUS_MESSAGE_NEED_BSWAP(sd_bus_message *m) {
@@ -162,6 +173,10 @@ static inline size_t BUS_MESSAGE_SIZE(sd_bus_message *m) {
                 m->body_size;
 }
 
+static inline size_t BUS_MESSAGE_WIRE_SIZE(sd_bus_message *m) {
+        return BUS_MESSAGE_SIZE(m) - m->memfd_parts_size;
+}
+
 static inline size_t BUS_MESSAGE_BODY_BEGIN(sd_bus_message *m) {
         return
                 sizeof(struct bus_header) +
@@ -72,7 +72,12 @@ enum {
         BUS_MESSAGE_HEADER_SENDER,
         BUS_MESSAGE_HEADER_SIGNATURE,
         BUS_MESSAGE_HEADER_UNIX_FDS,
-        _BUS_MESSAGE_HEADER_MAX
+        _BUS_MESSAGE_HEADER_MAX,
+
+        /* sd-bus extension, only sent to peers that agreed to NEGOTIATE_MEMFD during authentication. Lists
+         * (body offset, memfd offset, size) triplets of payload that has been cut out of the body and is
+         * passed as sealed memfd instead, in the last file descriptors attached to the message. */
+        BUS_MESSAGE_HEADER_MEMFDS = 0x80,
 };
 
 /* RequestName parameters */
@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
 #include <endian.h>
+#include <limits.h>
 #include <poll.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -26,11 +27,16 @@
 #include "signal-util.h"
 #include "stdio-util.h"
 #include "string-util.h"
+#include "unaligned.h"
 #include "user-util.h"
 #include "utf8.h"
 
 #define SNDBUF_SIZE (8*1024*1024)
 
+/* How much to read from the socket at once if the current message is smaller than this. Whatever follows it in the
+ * chunk is split off into further messages right away. */
+#define RBUFFER_CHUNK_SIZE (64U*1024U)
+
 static void iovec_advance(struct iovec iov[], unsigned *idx, size_t size) {
 
         while (size > 0) {
@@ -73,7 +79,9 @@ static int bus_message_setup_iovec(sd_bus_message *m) {
 
         assert(!m->iovec);
 
-        n = 1 + m->n_body_parts;
+        /* Body parts passed as memfd are left out of the byte stream. In that case the fixed header is sent
+         * from a copy that carries the size of the remaining body. */
+        n = 1 + (m->n_memfd_parts > 0) + m->n_body_parts - m->n_memfd_parts;
         if (n < ELEMENTSOF(m->iovec_fixed))
                 m->iovec = m->iovec_fixed;
         else {
@@ -84,11 +92,21 @@ static int bus_message_setup_iovec(sd_bus_message *m) {
                 }
         }
 
-        r = append_iovec(m, m->header, BUS_MESSAGE_BODY_BEGIN(m));
+        if (m->n_memfd_parts > 0) {
+                r = append_iovec(m, &m->wire_header, sizeof(m->wire_header));
+                if (r < 0)
+                        goto fail;
+
+                r = append_iovec(m, BUS_MESSAGE_FIELDS(m), BUS_MESSAGE_BODY_BEGIN(m) - sizeof(struct bus_header));
+        } else
+                r = append_iovec(m, m->header, BUS_MESSAGE_BODY_BEGIN(m));
         if (r < 0)
                 goto fail;
 
         MESSAGE_FOREACH_PART(part, i, m)  {
+                if (part->pass_memfd)
+                        continue;
+
                 r = bus_body_part_map(part);
                 if (r < 0)
                         goto fail;
@@ -157,17 +175,18 @@ static int bus_socket_write_auth(sd_bus *b) {
 }
 
 static int bus_socket_auth_verify_client(sd_bus *b) {
-        char *d, *e, *f, *start;
+        char *d, *e, *f, *g, *start;
         sd_id128_t peer;
         int r;
 
         assert(b);
 
         /*
-         * We expect three response lines:
+         * We expect up to four response lines:
          *   "DATA\r\n"
          *   "OK <server-id>\r\n"
          *   "AGREE_UNIX_FD\r\n"        (optional)
+         *   "AGREE_MEMFD\r\n"          (optional)
          */
 
         d = memmem_safe(b->rbuffer, b->rbuffer_size, "\r\n", 2);
@@ -189,6 +208,15 @@ static int bus_socket_auth_verify_client(sd_bus *b) {
                 start = e + 2;
         }
 
+        if (f && b->accept_memfd) {
+                g = memmem(f + 2, b->rbuffer_size - (f - (char*) b->rbuffer) - 2, "\r\n", 2);
+                if (!g)
+                        return 0;
+
+                start = g + 2;
+        } else
+                g = NULL;
+
         /* Nice! We got all the lines we need. First check the DATA line. */
 
         if (d - (char*) b->rbuffer == 4) {
@@ -234,7 +262,7 @@ static int bus_socket_auth_verify_client(sd_bus *b) {
 
         b->server_id = peer;
 
-        /* And possibly check the third line, too */
+        /* And possibly check the third and fourth line, too */
 
         if (f)
                 b->can_fds =
@@ -242,6 +270,13 @@ static int bus_socket_auth_verify_client(sd_bus *b) {
                         memcmp(e + 2, "AGREE_UNIX_FD",
                                STRLEN("AGREE_UNIX_FD")) == 0;
 
+        if (g)
+                b->can_memfd =
+                        b->can_fds &&
+                        (g - f == STRLEN("\r\nAGREE_MEMFD")) &&
+                        memcmp(f + 2, "AGREE_MEMFD",
+                               STRLEN("AGREE_MEMFD")) == 0;
+
         b->rbuffer_size -= (start - (char*) b->rbuffer);
         memmove(b->rbuffer, start, b->rbuffer_size);
 
@@ -491,6 +526,15 @@ static int bus_socket_auth_verify_server(sd_bus *b) {
                                 b->can_fds = true;
                                 r = bus_socket_auth_write(b, "AGREE_UNIX_FD\r\n");
                         }
+                } else if (line_equals(line, l, "NEGOTIATE_MEMFD")) {
+                        /* Payload passed as memfd travels as file descriptor, hence requires fd passing to
+                         * be agreed on first */
+                        if (b->auth == _BUS_AUTH_INVALID || !b->can_fds || !b->accept_memfd)
+                                r = bus_socket_auth_write(b, "ERROR\r\n");
+                        else {
+                                b->can_memfd = true;
+                                r = bus_socket_auth_write(b, "AGREE_MEMFD\r\n");
+                        }
                 } else
                         r = bus_socket_auth_write(b, "ERROR\r\n");
 
@@ -650,6 +694,9 @@ static int bus_socket_start_auth_client(sd_bus *b) {
         static const char sasl_negotiate_unix_fd[] = {
                 "NEGOTIATE_UNIX_FD\r\n"
         };
+        static const char sasl_negotiate_memfd[] = {
+                "NEGOTIATE_MEMFD\r\n"
+        };
         static const char sasl_begin[] = {
                 "BEGIN\r\n"
         };
@@ -662,9 +709,13 @@ static int bus_socket_start_auth_client(sd_bus *b) {
         else
                 b->auth_iovec[i++] = IOVEC_MAKE((char*) sasl_auth_external, sizeof(sasl_auth_external) - 1);
 
-        if (b->accept_fd)
+        if (b->accept_fd) {
                 b->auth_iovec[i++] = IOVEC_MAKE_STRING(sasl_negotiate_unix_fd);
 
+                if (b->accept_memfd)
+                        b->auth_iovec[i++] = IOVEC_MAKE_STRING(sasl_negotiate_memfd);
+        }
+
         b->auth_iovec[i++] = IOVEC_MAKE_STRING(sasl_begin);
 
         return bus_socket_write_auth(b);
@@ -993,74 +1044,123 @@ int bus_socket_take_fd(sd_bus *b) {
         return bus_socket_start_auth(b);
 }
 
-int bus_socket_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
+int bus_socket_write_messages(sd_bus *bus, sd_bus_message **messages, size_t n_messages, size_t idx, size_t *ret_written) {
+        sd_bus_message *first;
         struct iovec *iov;
+        size_t n, n_iov = 0, i;
+        unsigned j = 0;
         ssize_t k;
-        size_t n;
-        unsigned j;
         int r;
 
         assert(bus);
-        assert(m);
-        assert(idx);
+        assert(messages);
+        assert(n_messages > 0);
+        assert(ret_written);
         assert(IN_SET(bus->state, BUS_RUNNING, BUS_HELLO));
 
-        if (*idx >= BUS_MESSAGE_SIZE(m))
+        first = messages[0];
+
+        if (idx >= BUS_MESSAGE_WIRE_SIZE(first)) {
+                *ret_written = 0;
                 return 0;
+        }
 
-        r = bus_message_setup_iovec(m);
-        if (r < 0)
-                return r;
+        /* Figure out how many of the queued messages we can write with a single syscall. File descriptors are
+         * passed along with the first byte of the message they belong to, hence any message carrying some has
+         * to start a new write. */
+        for (n = 0; n < n_messages; n++) {
+                sd_bus_message *m = messages[n];
+
+                if (n > 0 && m->n_fds + m->n_memfd_parts > 0)
+                        break;
 
-        n = m->n_iovec * sizeof(struct iovec);
-        iov = newa(struct iovec, n);
-        memcpy_safe(iov, m->iovec, n);
+                r = bus_message_setup_iovec(m);
+                if (r < 0) {
+                        if (n > 0)
+                                break; /* Let's write what we have, and fail on the next iteration */
+                        return r;
+                }
+
+                if (n > 0 && n_iov + m->n_iovec > IOV_MAX)
+                        break;
 
-        j = 0;
-        iovec_advance(iov, &j, *idx);
+                n_iov += m->n_iovec;
+        }
+
+        iov = newa(struct iovec, n_iov);
+        for (i = 0, n_iov = 0; i < n; i++) {
+                memcpy(iov + n_iov, messages[i]->iovec, messages[i]->n_iovec * sizeof(struct iovec));
+                n_iov += messages[i]->n_iovec;
+        }
+
+        iovec_advance(iov, &j, idx);
 
         if (bus->prefer_writev)
-                k = writev(bus->output_fd, iov, m->n_iovec);
+                k = writev(bus->output_fd, iov, n_iov);
         else {
                 struct msghdr mh = {
                         .msg_iov = iov,
-                        .msg_iovlen = m->n_iovec,
+                        .msg_iovlen = n_iov,
                 };
 
-                if (m->n_fds > 0 && *idx == 0) {
+                if (first->n_fds + first->n_memfd_parts > 0 && idx == 0) {
+                        size_t n_fds = first->n_fds + first->n_memfd_parts;
+                        struct bus_body_part *part;
                         struct cmsghdr *control;
+                        int *fds;
 
-                        mh.msg_control = control = alloca(CMSG_SPACE(sizeof(int) * m->n_fds));
-                        mh.msg_controllen = control->cmsg_len = CMSG_LEN(sizeof(int) * m->n_fds);
+                        mh.msg_control = control = alloca(CMSG_SPACE(sizeof(int) * n_fds));
+                        mh.msg_controllen = control->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
                         control->cmsg_level = SOL_SOCKET;
                         control->cmsg_type = SCM_RIGHTS;
-                        memcpy(CMSG_DATA(control), m->fds, sizeof(int) * m->n_fds);
+
+                        /* The memfds of the body parts follow the regular fds, in the order of the parts */
+                        fds = (int*) CMSG_DATA(control);
+                        if (first->n_fds > 0)
+                                fds = mempcpy(fds, first->fds, sizeof(int) * first->n_fds);
+                        MESSAGE_FOREACH_PART(part, i, first)
+                                if (part->pass_memfd)
+                                        *(fds++) = part->memfd;
                 }
 
                 k = sendmsg(bus->output_fd, &mh, MSG_DONTWAIT|MSG_NOSIGNAL);
                 if (k < 0 && errno == ENOTSOCK) {
                         bus->prefer_writev = true;
-                        k = writev(bus->output_fd, iov, m->n_iovec);
+                        k = writev(bus->output_fd, iov, n_iov);
                 }
         }
 
         if (k < 0)
                 return errno == EAGAIN ? 0 : -errno;
 
-        *idx += (size_t) k;
+        *ret_written = (size_t) k;
+        return 1;
+}
+
+int bus_socket_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
+        size_t k;
+        int r;
+
+        assert(m);
+        assert(idx);
+
+        r = bus_socket_write_messages(bus, &m, 1, *idx, &k);
+        if (r <= 0)
+                return r;
+
+        *idx += k;
         return 1;
 }
 
-static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
+static int bus_socket_read_message_need(const void *p, size_t size, size_t *need) {
         uint32_t a, b;
         uint8_t e;
         uint64_t sum;
 
-        assert(bus);
+        assert(p || size == 0);
         assert(need);
-        assert(IN_SET(bus->state, BUS_RUNNING, BUS_HELLO));
 
-        if (bus->rbuffer_size < sizeof(struct bus_header)) {
+        if (size < sizeof(struct bus_header)) {
                 *need = sizeof(struct bus_header) + 8;
 
                 /* Minimum message size:
@@ -1082,16 +1182,14 @@ static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
                 return 0;
         }
 
-        a = ((const uint32_t*) bus->rbuffer)[1];
-        b = ((const uint32_t*) bus->rbuffer)[3];
-
-        e = ((const uint8_t*) bus->rbuffer)[0];
+        /* Messages following each other in the read buffer are not necessarily aligned */
+        e = ((const uint8_t*) p)[0];
         if (e == BUS_LITTLE_ENDIAN) {
-                a = le32toh(a);
-                b = le32toh(b);
+                a = unaligned_read_le32((const uint8_t*) p + 4);
+                b = unaligned_read_le32((const uint8_t*) p + 12);
         } else if (e == BUS_BIG_ENDIAN) {
-                a = be32toh(a);
-                b = be32toh(b);
+                a = unaligned_read_be32((const uint8_t*) p + 4);
+                b = unaligned_read_be32((const uint8_t*) p + 12);
         } else
                 return -EBADMSG;
 
@@ -1103,46 +1201,56 @@ static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
         return 0;
 }
 
-static int bus_socket_make_message(sd_bus *bus, size_t size) {
+static int bus_socket_make_message(sd_bus *bus, size_t offset, size_t size) {
         sd_bus_message *t = NULL;
         void *b;
         int r;
 
         assert(bus);
-        assert(bus->rbuffer_size >= size);
+        assert(bus->rbuffer_size >= offset + size);
         assert(IN_SET(bus->state, BUS_RUNNING, BUS_HELLO));
 
         r = bus_rqueue_make_room(bus);
         if (r < 0)
                 return r;
 
-        if (bus->rbuffer_size > size) {
-                b = memdup((const uint8_t*) bus->rbuffer + size,
-                           bus->rbuffer_size - size);
+        /* If the message makes up a big read buffer on its own, pass ownership of the buffer on to it. Otherwise
+         * copy it out, so that small messages don't pin a whole read chunk each. */
+        if (offset == 0 && size == bus->rbuffer_size && size >= RBUFFER_CHUNK_SIZE)
+                b = bus->rbuffer;
+        else {
+                b = memdup((const uint8_t*) bus->rbuffer + offset, size);
                 if (!b)
                         return -ENOMEM;
-        } else
-                b = NULL;
+        }
 
-        r = bus_message_from_malloc(bus,
-                                    bus->rbuffer, size,
-                                    bus->fds, bus->n_fds,
-                                    NULL,
-                                    &t);
+        if (bus->n_fds > 0) {
+                /* We don't know which of the messages in the buffer the file descriptors we received belong to,
+                 * but it's the first one declaring any: all others parse fine without, the right one doesn't. */
+                r = bus_message_from_malloc(bus, b, size, NULL, 0, NULL, &t);
+                if (r == -EBADMSG)
+                        r = bus_message_from_malloc(bus, b, size, bus->fds, bus->n_fds, NULL, &t);
+                /* The memfds of the body parts count as consumed too, even if no regular fds are left */
+                if (r >= 0 && (t->n_fds > 0 || t->n_memfd_parts > 0)) {
+                        bus->fds = NULL;
+                        bus->n_fds = 0;
+                }
+        } else
+                r = bus_message_from_malloc(bus, b, size, NULL, 0, NULL, &t);
         if (r == -EBADMSG) {
                 log_debug_errno(r, "Received invalid message from connection %s, dropping.", strna(bus->description));
-                free(bus->rbuffer); /* We want to drop current rbuffer and proceed with whatever remains in b */
-        } else if (r < 0) {
                 free(b);
+        } else if (r < 0) {
+                if (b != bus->rbuffer)
+                        free(b);
                 return r;
         }
 
-        /* rbuffer ownership was either transferred to t, or we got EBADMSG and dropped it. */
-        bus->rbuffer = b;
-        bus->rbuffer_size -= size;
-
-        bus->fds = NULL;
-        bus->n_fds = 0;
+        /* The buffer is now owned by t, or we got EBADMSG and dropped it. */
+        if (b == bus->rbuffer) {
+                bus->rbuffer = NULL;
+                bus->rbuffer_size = 0;
+        }
 
         if (t) {
                 t->read_counter = ++bus->read_counter;
@@ -1153,11 +1261,62 @@ static int bus_socket_make_message(sd_bus *bus, size_t size) {
         return 1;
 }
 
+static int bus_socket_split_messages(sd_bus *bus) {
+        size_t offset = 0, need;
+        int r, ret = 0;
+
+        assert(bus);
+
+        /* Turns all complete messages in the read buffer into message objects, and moves what remains to the
+         * front of the buffer. */
+
+        for (;;) {
+                r = bus_socket_read_message_need((const uint8_t*) bus->rbuffer + offset, bus->rbuffer_size - offset, &need);
+                if (r < 0)
+                        break;
+
+                if (bus->rbuffer_size - offset < need)
+                        break;
+
+                r = bus_socket_make_message(bus, offset, need);
+                if (r < 0)
+                        break;
+
+                ret = 1;
+
+                if (!bus->rbuffer) /* Handed over as a whole */
+                        break;
+
+                offset += need;
+        }
+
+        if (offset > 0) {
+                bus->rbuffer_size -= offset;
+                memmove(bus->rbuffer, (const uint8_t*) bus->rbuffer + offset, bus->rbuffer_size);
+        }
+
+        if (bus->rbuffer_size == 0) {
+                bus->rbuffer = mfree(bus->rbuffer);
+
+                /* File descriptors arrive with the first byte of the message they belong to, hence if there's no
+                 * partial message left, nobody is going to claim them anymore. */
+                if (bus->n_fds > 0) {
+                        log_debug("Got %zu file descriptors without a message declaring them on connection %s, closing.",
+                                  bus->n_fds, strna(bus->description));
+                        close_many(bus->fds, bus->n_fds);
+                        bus->fds = mfree(bus->fds);
+                        bus->n_fds = 0;
+                }
+        }
+
+        return r < 0 ? r : ret;
+}
+
 int bus_socket_read_message(sd_bus *bus) {
         struct msghdr mh;
         struct iovec iov = {};
         ssize_t k;
-        size_t need;
+        size_t need, size;
         int r;
         void *b;
         union {
@@ -1169,20 +1328,27 @@ int bus_socket_read_message(sd_bus *bus) {
         assert(bus);
         assert(IN_SET(bus->state, BUS_RUNNING, BUS_HELLO));
 
-        r = bus_socket_read_message_need(bus, &need);
+        /* Anything left over from authentication? */
+        r = bus_socket_split_messages(bus);
+        if (r != 0)
+                return r;
+
+        r = bus_socket_read_message_need(bus->rbuffer, bus->rbuffer_size, &need);
         if (r < 0)
                 return r;
 
-        if (bus->rbuffer_size >= need)
-                return bus_socket_make_message(bus, need);
+        /* Read the rest of the current message, and as many of the following ones as fit into one chunk. If we
+         * already have file descriptors for the current message, we stop exactly at its end however, so that no
+         * descriptors of the next message are mixed in before the current one claimed its own. */
+        size = bus->n_fds > 0 ? need : MAX(need, RBUFFER_CHUNK_SIZE);
 
-        b = realloc(bus->rbuffer, need);
+        b = realloc(bus->rbuffer, size);
         if (!b)
                 return -ENOMEM;
 
         bus->rbuffer = b;
 
-        iov = IOVEC_MAKE((uint8_t *)bus->rbuffer + bus->rbuffer_size, need - bus->rbuffer_size);
+        iov = IOVEC_MAKE((uint8_t *)bus->rbuffer + bus->rbuffer_size, size - bus->rbuffer_size);
 
         if (bus->prefer_readv)
                 k = readv(bus->input_fd, &iov, 1);
@@ -1240,13 +1406,10 @@ int bus_socket_read_message(sd_bus *bus) {
                                           cmsg->cmsg_level, cmsg->cmsg_type);
         }
 
-        r = bus_socket_read_message_need(bus, &need);
+        r = bus_socket_split_messages(bus);
         if (r < 0)
                 return r;
 
-        if (bus->rbuffer_size >= need)
-                return bus_socket_make_message(bus, need);
-
         return 1;
 }
 
@@ -1,5 +1,6 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -11,12 +12,21 @@
 #include "bus-util.h"
 #include "def.h"
 #include "fd-util.h"
+#include "memfd-util.h"
 #include "missing_resource.h"
 #include "time-util.h"
 #include "util.h"
 
 #define MAX_SIZE (2*1024*1024)
 
+/* How many signals to queue up before flushing them out in throughput mode */
+#define THROUGHPUT_BATCH 256U
+#define THROUGHPUT_MAX_SIZE (64*1024)
+
+/* Range of payload sizes to compare copying and memfd passing for */
+#define MEMFD_MIN_PAYLOAD (1024*1024)
+#define MEMFD_MAX_PAYLOAD (64*1024*1024)
+
 static usec_t arg_loop_usec = 100 * USEC_PER_MSEC;
 
 typedef enum Type {
@@ -73,6 +83,24 @@ static void transaction(sd_bus *b, size_t sz, const char *server_name) {
         assert_se(sd_bus_call(b, m, 0, NULL, &reply) >= 0);
 }
 
+static void transaction_copy(sd_bus *b, const void *p, size_t sz, const char *server_name) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL, *reply = NULL;
+
+        assert_se(sd_bus_message_new_method_call(b, &m, server_name, "/", "benchmark.server", "Work") >= 0);
+        assert_se(sd_bus_message_append_array(m, 'y', p, sz) >= 0);
+
+        assert_se(sd_bus_call(b, m, 0, NULL, &reply) >= 0);
+}
+
+static void transaction_memfd(sd_bus *b, int memfd, size_t sz, const char *server_name) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL, *reply = NULL;
+
+        assert_se(sd_bus_message_new_method_call(b, &m, server_name, "/", "benchmark.server", "Work") >= 0);
+        assert_se(sd_bus_message_append_array_memfd(m, 'y', memfd, 0, sz) >= 0);
+
+        assert_se(sd_bus_call(b, m, 0, NULL, &reply) >= 0);
+}
+
 static void client_bisect(const char *address, const char *server_name) {
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *x = NULL;
         size_t lsize, rsize, csize;
@@ -147,6 +175,150 @@ static void client_bisect(const char *address, const char *server_name) {
         sd_bus_unref(b);
 }
 
+static sd_bus *client_connect(Type type, const char *address, const char *server_name, int fd) {
+        sd_bus *b;
+        int r;
+
+        r = sd_bus_new(&b);
+        assert_se(r >= 0);
+
+        r = sd_bus_negotiate_memfd(b, true);
+        assert_se(r >= 0);
+
+        if (type == TYPE_DIRECT) {
+                r = sd_bus_set_fd(b, fd, fd);
+                assert_se(r >= 0);
+        } else {
+                r = sd_bus_set_address(b, address);
+                assert_se(r >= 0);
+
+                r = sd_bus_set_bus_client(b, true);
+                assert_se(r >= 0);
+        }
+
+        r = sd_bus_start(b);
+        assert_se(r >= 0);
+
+        r = sd_bus_call_method(b, server_name, "/", "benchmark.server", "Ping", NULL, NULL, NULL);
+        assert_se(r >= 0);
+
+        return b;
+}
+
+static void client_throughput(Type type, const char *address, const char *server_name, int fd) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *x = NULL;
+        size_t csize;
+        sd_bus *b;
+
+        /* Queues up lots of small to medium sized signals at once, so that they are written out in batches, and
+         * the server reads several of them per syscall. The final Ping round trip makes sure the server
+         * processed everything before we stop the clock. */
+
+        b = client_connect(type, address, server_name, fd);
+
+        printf("SIZE\tMSGS/s\tMB/s\n");
+
+        for (csize = 8; csize <= THROUGHPUT_MAX_SIZE; csize *= 4) {
+                uint64_t n_messages = 0;
+                usec_t t, elapsed;
+
+                t = now(CLOCK_MONOTONIC);
+                do {
+                        unsigned i;
+
+                        for (i = 0; i < THROUGHPUT_BATCH; i++) {
+                                _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+                                uint8_t *p;
+
+                                assert_se(sd_bus_message_new_signal(b, &m, "/", "benchmark.server", "Data") >= 0);
+                                if (server_name)
+                                        assert_se(sd_bus_message_set_destination(m, server_name) >= 0);
+                                assert_se(sd_bus_message_append_array_space(m, 'y', csize, (void**) &p) >= 0);
+                                memset(p, 0x80, csize);
+
+                                assert_se(sd_bus_send(b, m, NULL) >= 0);
+                        }
+
+                        assert_se(sd_bus_flush(b) >= 0);
+                        n_messages += THROUGHPUT_BATCH;
+                } while (now(CLOCK_MONOTONIC) < t + arg_loop_usec);
+
+                assert_se(sd_bus_call_method(b, server_name, "/", "benchmark.server", "Ping", NULL, NULL, NULL) >= 0);
+                elapsed = now(CLOCK_MONOTONIC) - t;
+
+                printf("%zu\t%" PRIu64 "\t%" PRIu64 "\n",
+                       csize,
+                       n_messages * USEC_PER_SEC / elapsed,
+                       n_messages * csize * USEC_PER_SEC / elapsed / (1024 * 1024));
+        }
+
+        assert_se(sd_bus_message_new_method_call(b, &x, server_name, "/", "benchmark.server", "Exit") >= 0);
+        assert_se(sd_bus_message_append(x, "t", csize) >= 0);
+        assert_se(sd_bus_send(b, x, NULL) >= 0);
+
+        sd_bus_unref(b);
+}
+
+static void client_memfd(Type type, const char *address, const char *server_name, int fd) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *x = NULL;
+        size_t csize;
+        sd_bus *b;
+
+        /* Compares the throughput of large payloads that are copied into the message with the same payload
+         * passed as sealed memfd. The latter is only passed as such if the peer agreed on it, which only
+         * sd-bus peers do, i.e. on direct connections. */
+
+        b = client_connect(type, address, server_name, fd);
+
+        printf("memfd passing %s\n", b->can_memfd ? "negotiated" : "not negotiated, payload is copied");
+        printf("SIZE\tCOPY MB/s\tMEMFD MB/s\n");
+
+        for (csize = MEMFD_MIN_PAYLOAD; csize <= MEMFD_MAX_PAYLOAD; csize *= 2) {
+                _cleanup_close_ int memfd = -1;
+                _cleanup_free_ void *buf = NULL;
+                unsigned n_copying, n_memfd;
+                usec_t t, copy_usec, memfd_usec;
+                void *p;
+
+                buf = malloc(csize);
+                assert_se(buf);
+                memset(buf, 0x80, csize);
+
+                /* Fill the memfd once, it is sealed when it is appended the first time and then reused */
+                memfd = memfd_new_and_map("benchmark", csize, &p);
+                assert_se(memfd >= 0);
+                memcpy(p, buf, csize);
+                assert_se(munmap(p, csize) >= 0);
+
+                t = now(CLOCK_MONOTONIC);
+                for (n_copying = 1;; n_copying++) {
+                        transaction_copy(b, buf, csize, server_name);
+                        if (now(CLOCK_MONOTONIC) >= t + arg_loop_usec)
+                                break;
+                }
+                copy_usec = now(CLOCK_MONOTONIC) - t;
+
+                t = now(CLOCK_MONOTONIC);
+                for (n_memfd = 1;; n_memfd++) {
+                        transaction_memfd(b, memfd, csize, server_name);
+                        if (now(CLOCK_MONOTONIC) >= t + arg_loop_usec)
+                                break;
+                }
+                memfd_usec = now(CLOCK_MONOTONIC) - t;
+
+                printf("%zu\t%" PRIu64 "\t\t%" PRIu64 "\n",
+                       csize,
+                       (uint64_t) n_copying * csize * USEC_PER_SEC / copy_usec / (1024 * 1024),
+                       (uint64_t) n_memfd * csize * USEC_PER_SEC / memfd_usec / (1024 * 1024));
+        }
+
+        assert_se(sd_bus_message_new_method_call(b, &x, server_name, "/", "benchmark.server", "Exit") >= 0);
+        assert_se(sd_bus_message_append(x, "t", csize) >= 0);
+        assert_se(sd_bus_send(b, x, NULL) >= 0);
+
+        sd_bus_unref(b);
+}
+
 static void client_chart(Type type, const char *address, const char *server_name, int fd) {
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *x = NULL;
         size_t csize;
@@ -210,6 +382,8 @@ int main(int argc, char *argv[]) {
         enum {
                 MODE_BISECT,
                 MODE_CHART,
+                MODE_THROUGHPUT,
+                MODE_MEMFD,
         } mode = MODE_BISECT;
         Type type = TYPE_LEGACY;
         int i, pair[2] = { -1, -1 };
@@ -226,6 +400,12 @@ int main(int argc, char *argv[]) {
                 if (streq(argv[i], "chart")) {
                         mode = MODE_CHART;
                         continue;
+                } else if (streq(argv[i], "throughput")) {
+                        mode = MODE_THROUGHPUT;
+                        continue;
+                } else if (streq(argv[i], "memfd")) {
+                        mode = MODE_MEMFD;
+                        continue;
                 } else if (streq(argv[i], "legacy")) {
                         type = TYPE_LEGACY;
                         continue;
@@ -252,6 +432,9 @@ int main(int argc, char *argv[]) {
         r = sd_bus_new(&b);
         assert_se(r >= 0);
 
+        r = sd_bus_negotiate_memfd(b, true);
+        assert_se(r >= 0);
+
         if (type == TYPE_DIRECT) {
                 assert_se(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) >= 0);
 
@@ -301,6 +484,14 @@ int main(int argc, char *argv[]) {
                 case MODE_CHART:
                         client_chart(type, address, server_name, pair[1]);
                         break;
+
+                case MODE_THROUGHPUT:
+                        client_throughput(type, address, server_name, pair[1]);
+                        break;
+
+                case MODE_MEMFD:
+                        client_memfd(type, address, server_name, pair[1]);
+                        break;
                 }
 
                 _exit(EXIT_SUCCESS);
@@ -1,5 +1,6 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include "alloc-util.h"
 #include "bus-match.h"
 #include "bus-message.h"
 #include "bus-slot.h"
@@ -8,6 +9,11 @@
 #include "macro.h"
 #include "memory-util.h"
 #include "tests.h"
+#include "time-util.h"
+
+#define BENCHMARK_MATCHES 1000U
+#define BENCHMARK_SIGNALS 100000U
+#define BENCHMARK_BATCH 1000U
 
 static bool mask[32];
 
@@ -59,6 +65,93 @@ static int match_add(sd_bus_slot *slots, struct bus_match_node *root, const char
         return r;
 }
 
+static int count_filter(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        unsigned *n = userdata;
+
+        (*n)++;
+        return 0;
+}
+
+static void test_match_benchmark(sd_bus *bus) {
+        struct bus_match_node root = {
+                .type = BUS_MATCH_ROOT,
+        };
+        _cleanup_free_ sd_bus_slot *slots = NULL;
+        sd_bus_message *batch[BENCHMARK_BATCH];
+        char ts[FORMAT_TIMESPAN_MAX];
+        unsigned i, j, n_called = 0, n_expected = 0;
+        usec_t t = 0;
+
+        /* Models what a client watching all units of the service manager does: one PropertiesChanged match
+         * per unit object, and a stream of signals for these, some of which are for objects nobody is
+         * interested in. */
+
+        assert_se(slots = new0(sd_bus_slot, BENCHMARK_MATCHES));
+
+        for (i = 0; i < BENCHMARK_MATCHES; i++) {
+                struct bus_match_component *components = NULL;
+                _cleanup_free_ char *match = NULL;
+                unsigned n_components = 0;
+
+                assert_se(asprintf(&match,
+                                   "type='signal',"
+                                   "sender='org.freedesktop.systemd1',"
+                                   "interface='org.freedesktop.DBus.Properties',"
+                                   "member='PropertiesChanged',"
+                                   "path='/org/freedesktop/systemd1/unit/unit_%u'", i) >= 0);
+
+                assert_se(bus_match_parse(match, &components, &n_components) >= 0);
+
+                slots[i].userdata = &n_called;
+                slots[i].match_callback.callback = count_filter;
+
+                assert_se(bus_match_add(&root, components, n_components, &slots[i].match_callback) >= 0);
+                bus_match_parse_free(components, n_components);
+        }
+
+        for (i = 0; i < BENCHMARK_SIGNALS; i += BENCHMARK_BATCH) {
+                usec_t start;
+
+                for (j = 0; j < BENCHMARK_BATCH; j++) {
+                        _cleanup_free_ char *path = NULL;
+                        unsigned k = i + j;
+
+                        if (k % 4 == 3)
+                                assert_se(asprintf(&path, "/org/freedesktop/systemd1/job/%u", k) >= 0);
+                        else {
+                                assert_se(asprintf(&path, "/org/freedesktop/systemd1/unit/unit_%u", k % BENCHMARK_MATCHES) >= 0);
+                                n_expected++;
+                        }
+
+                        assert_se(sd_bus_message_new_signal(bus, batch + j, path, "org.freedesktop.DBus.Properties", "PropertiesChanged") >= 0);
+                        assert_se(sd_bus_message_append(batch[j], "sa{sv}as", "org.freedesktop.systemd1.Unit", 0, 0) >= 0);
+                        assert_se(sd_bus_message_set_sender(batch[j], ":1.1") >= 0);
+                        assert_se(sd_bus_message_seal(batch[j], k + 1, 0) >= 0);
+                }
+
+                start = now(CLOCK_MONOTONIC);
+                for (j = 0; j < BENCHMARK_BATCH; j++)
+                        assert_se(bus_match_run(NULL, &root, batch[j]) == 0);
+                t += now(CLOCK_MONOTONIC) - start;
+
+                for (j = 0; j < BENCHMARK_BATCH; j++)
+                        sd_bus_message_unref(batch[j]);
+        }
+
+        assert_se(n_called == n_expected);
+
+        log_info("Dispatched %u signals against %u matches in %s, %.0f signals/s.",
+                 BENCHMARK_SIGNALS, BENCHMARK_MATCHES,
+                 format_timespan(ts, sizeof(ts), t, USEC_PER_MSEC / 10),
+                 t > 0 ? (double) BENCHMARK_SIGNALS * USEC_PER_SEC / t : 0.0);
+
+        for (i = 0; i < BENCHMARK_MATCHES; i++)
+                assert_se(bus_match_remove(&root, &slots[i].match_callback) > 0);
+
+        assert_se(!root.child);
+        bus_match_free(&root);
+}
+
 static void test_match_scope(const char *match, enum bus_match_scope scope) {
         struct bus_match_component *components = NULL;
         unsigned n_components = 0;
@@ -137,6 +230,8 @@ int main(int argc, char *argv[]) {
 
         bus_match_free(&root);
 
+        test_match_benchmark(bus);
+
         test_match_scope("interface='foobar'", BUS_MATCH_GENERIC);
         test_match_scope("", BUS_MATCH_GENERIC);
         test_match_scope("interface='org.freedesktop.DBus.Local'", BUS_MATCH_LOCAL);
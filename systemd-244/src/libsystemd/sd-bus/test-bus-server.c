@@ -1,26 +1,46 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
 #include "sd-bus.h"
 
 #include "bus-internal.h"
+#include "bus-message.h"
 #include "bus-util.h"
+#include "fd-util.h"
 #include "log.h"
 #include "macro.h"
+#include "memfd-util.h"
 #include "memory-util.h"
 
+#define PAYLOAD_SIZE (256*1024)
+
 struct context {
         int fds[2];
 
         bool client_negotiate_unix_fds;
         bool server_negotiate_unix_fds;
 
+        bool client_negotiate_memfd;
+        bool server_negotiate_memfd;
+
         bool client_anonymous_auth;
         bool server_anonymous_auth;
 };
 
+static void check_payload(sd_bus_message *m) {
+        const uint8_t *data;
+        size_t sz, i;
+
+        assert_se(sd_bus_message_read_array(m, 'y', (const void**) &data, &sz) > 0);
+        assert_se(sz == PAYLOAD_SIZE);
+        for (i = 0; i < sz; i++)
+                assert_se(data[i] == (uint8_t) i);
+}
+
 static void *server(void *p) {
         struct context *c = p;
         sd_bus *bus = NULL;
@@ -35,6 +55,7 @@ static void *server(void *p) {
         assert_se(sd_bus_set_server(bus, 1, id) >= 0);
         assert_se(sd_bus_set_anonymous(bus, c->server_anonymous_auth) >= 0);
         assert_se(sd_bus_negotiate_fds(bus, c->server_negotiate_unix_fds) >= 0);
+        assert_se(sd_bus_negotiate_memfd(bus, c->server_negotiate_memfd) >= 0);
         assert_se(sd_bus_start(bus) >= 0);
 
         while (!quit) {
@@ -62,10 +83,24 @@ static void *server(void *p) {
                 log_info("Got message! member=%s", strna(sd_bus_message_get_member(m)));
 
                 if (sd_bus_message_is_method_call(m, "org.freedesktop.systemd.test", "Exit")) {
+                        bool memfd_expected;
 
                         assert_se((sd_bus_can_send(bus, 'h') >= 1) ==
                                   (c->server_negotiate_unix_fds && c->client_negotiate_unix_fds));
 
+                        /* The payload arrives the same way, regardless whether it was passed as memfd or not */
+                        memfd_expected = c->server_negotiate_unix_fds && c->client_negotiate_unix_fds &&
+                                         c->server_negotiate_memfd && c->client_negotiate_memfd;
+                        assert_se(bus->can_memfd == memfd_expected);
+                        assert_se((m->n_memfd_parts > 0) == memfd_expected);
+                        assert_se(m->n_fds == 0);
+
+                        /* The memfds are owned by the message, none may stay behind on the connection */
+                        assert_se(!bus->fds);
+                        assert_se(bus->n_fds == 0);
+
+                        check_payload(m);
+
                         r = sd_bus_message_new_method_return(m, &reply);
                         if (r < 0) {
                                 log_error_errno(r, "Failed to allocate return: %m");
@@ -74,6 +109,23 @@ static void *server(void *p) {
 
                         quit = true;
 
+                } else if (sd_bus_message_is_method_call(m, "org.freedesktop.systemd.test", "PayloadAndFd")) {
+                        int fd;
+
+                        /* A regular fd in front of the memfds */
+                        check_payload(m);
+                        assert_se(sd_bus_message_read(m, "h", &fd) > 0);
+                        assert_se(fcntl(fd, F_GETFD) >= 0);
+                        assert_se(m->n_fds == 1);
+                        assert_se(!bus->fds);
+                        assert_se(bus->n_fds == 0);
+
+                        r = sd_bus_message_new_method_return(m, &reply);
+                        if (r < 0) {
+                                log_error_errno(r, "Failed to allocate return: %m");
+                                goto fail;
+                        }
+
                 } else if (sd_bus_message_is_method_call(m, NULL, NULL)) {
                         r = sd_bus_message_new_method_error(
                                         m,
@@ -109,14 +161,52 @@ static int client(struct context *c) {
         _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL, *reply = NULL;
         _cleanup_(sd_bus_unrefp) sd_bus *bus = NULL;
         sd_bus_error error = SD_BUS_ERROR_NULL;
+        _cleanup_close_ int memfd = -1;
+        uint8_t *p;
+        size_t i;
         int r;
 
+        memfd = memfd_new_and_map("test-bus-server", PAYLOAD_SIZE, (void**) &p);
+        assert_se(memfd >= 0);
+        for (i = 0; i < PAYLOAD_SIZE; i++)
+                p[i] = (uint8_t) i;
+        assert_se(munmap(p, PAYLOAD_SIZE) >= 0);
+
         assert_se(sd_bus_new(&bus) >= 0);
         assert_se(sd_bus_set_fd(bus, c->fds[1], c->fds[1]) >= 0);
         assert_se(sd_bus_negotiate_fds(bus, c->client_negotiate_unix_fds) >= 0);
+        assert_se(sd_bus_negotiate_memfd(bus, c->client_negotiate_memfd) >= 0);
         assert_se(sd_bus_set_anonymous(bus, c->client_anonymous_auth) >= 0);
         assert_se(sd_bus_start(bus) >= 0);
 
+        if (sd_bus_can_send(bus, 'h') > 0) {
+                r = sd_bus_message_new_method_call(
+                                bus,
+                                &m,
+                                "org.freedesktop.systemd.test",
+                                "/",
+                                "org.freedesktop.systemd.test",
+                                "PayloadAndFd");
+                if (r < 0)
+                        return log_error_errno(r, "Failed to allocate method call: %m");
+
+                r = sd_bus_message_append_array_memfd(m, 'y', memfd, 0, PAYLOAD_SIZE);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to append payload: %m");
+
+                r = sd_bus_message_append(m, "h", STDERR_FILENO);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to append fd: %m");
+
+                r = sd_bus_call(bus, m, 0, &error, &reply);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to issue method call: %s", bus_error_message(&error, -r));
+
+                m = sd_bus_message_unref(m);
+                reply = sd_bus_message_unref(reply);
+        }
+
+        /* Only memfds, no regular fds */
         r = sd_bus_message_new_method_call(
                         bus,
                         &m,
@@ -127,6 +217,10 @@ static int client(struct context *c) {
         if (r < 0)
                 return log_error_errno(r, "Failed to allocate method call: %m");
 
+        r = sd_bus_message_append_array_memfd(m, 'y', memfd, 0, PAYLOAD_SIZE);
+        if (r < 0)
+                return log_error_errno(r, "Failed to append payload: %m");
+
         r = sd_bus_call(bus, m, 0, &error, &reply);
         if (r < 0)
                 return log_error_errno(r, "Failed to issue method call: %s", bus_error_message(&error, -r));
@@ -135,7 +229,8 @@ static int client(struct context *c) {
 }
 
 static int test_one(bool client_negotiate_unix_fds, bool server_negotiate_unix_fds,
-                    bool client_anonymous_auth, bool server_anonymous_auth) {
+                    bool client_anonymous_auth, bool server_anonymous_auth,
+                    bool client_negotiate_memfd, bool server_negotiate_memfd) {
 
         struct context c;
         pthread_t s;
@@ -150,6 +245,8 @@ static int test_one(bool client_negotiate_unix_fds, bool server_negotiate_unix_f
         c.server_negotiate_unix_fds = server_negotiate_unix_fds;
         c.client_anonymous_auth = client_anonymous_auth;
         c.server_anonymous_auth = server_anonymous_auth;
+        c.client_negotiate_memfd = client_negotiate_memfd;
+        c.server_negotiate_memfd = server_negotiate_memfd;
 
         r = pthread_create(&s, NULL, server, &c);
         if (r != 0)
@@ -173,26 +270,38 @@ static int test_one(bool client_negotiate_unix_fds, bool server_negotiate_unix_f
 int main(int argc, char *argv[]) {
         int r;
 
-        r = test_one(true, true, false, false);
+        r = test_one(true, true, false, false, false, false);
         assert_se(r >= 0);
 
-        r = test_one(true, false, false, false);
+        r = test_one(true, false, false, false, false, false);
         assert_se(r >= 0);
 
-        r = test_one(false, true, false, false);
+        r = test_one(false, true, false, false, false, false);
         assert_se(r >= 0);
 
-        r = test_one(false, false, false, false);
+        r = test_one(false, false, false, false, false, false);
         assert_se(r >= 0);
 
-        r = test_one(true, true, true, true);
+        r = test_one(true, true, true, true, false, false);
         assert_se(r >= 0);
 
-        r = test_one(true, true, false, true);
+        r = test_one(true, true, false, true, false, false);
         assert_se(r >= 0);
 
-        r = test_one(true, true, true, false);
+        r = test_one(true, true, true, false, false, false);
         assert_se(r == -EPERM);
 
+        r = test_one(true, true, false, false, true, true);
+        assert_se(r >= 0);
+
+        r = test_one(true, true, false, false, true, false);
+        assert_se(r >= 0);
+
+        r = test_one(true, true, false, false, false, true);
+        assert_se(r >= 0);
+
+        r = test_one(false, true, false, false, true, true);
+        assert_se(r >= 0);
+
         return EXIT_SUCCESS;
 }
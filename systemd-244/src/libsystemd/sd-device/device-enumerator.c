@@ -1,6 +1,8 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 
 #include "sd-device.h"
@@ -10,6 +12,8 @@
 #include "device-util.h"
 #include "dirent-util.h"
 #include "fd-util.h"
+#include "fs-util.h"
+#include "path-util.h"
 #include "set.h"
 #include "sort-util.h"
 #include "string-util.h"
@@ -32,6 +36,10 @@ struct sd_device_enumerator {
         size_t n_devices, n_allocated, current_device_index;
         bool scan_uptodate;
 
+        /* Number of threads scanning subsystem directories, adding to devices under devices_lock */
+        unsigned n_threads;
+        pthread_mutex_t devices_lock;
+
         Set *match_subsystem;
         Set *nomatch_subsystem;
         Hashmap *match_sysattr;
@@ -55,6 +63,8 @@ _public_ int sd_device_enumerator_new(sd_device_enumerator **ret) {
         *enumerator = (sd_device_enumerator) {
                 .n_ref = 1,
                 .type = _DEVICE_ENUMERATION_TYPE_INVALID,
+                .n_threads = 1,
+                .devices_lock = PTHREAD_MUTEX_INITIALIZER,
         };
 
         *ret = TAKE_PTR(enumerator);
@@ -79,6 +89,7 @@ static sd_device_enumerator *device_enumerator_free(sd_device_enumerator *enumer
         set_free_free(enumerator->match_sysname);
         set_free_free(enumerator->match_tag);
         set_free_free(enumerator->match_parent);
+        (void) pthread_mutex_destroy(&enumerator->devices_lock);
 
         return mfree(enumerator);
 }
@@ -266,6 +277,16 @@ _public_ int sd_device_enumerator_allow_uninitialized(sd_device_enumerator *enum
         return 0;
 }
 
+int device_enumerator_set_n_threads(sd_device_enumerator *enumerator, unsigned n_threads) {
+        assert_return(enumerator, -EINVAL);
+
+        enumerator->n_threads = MAX(n_threads, 1U);
+
+        enumerator->scan_uptodate = false;
+
+        return 0;
+}
+
 int device_enumerator_add_match_is_initialized(sd_device_enumerator *enumerator) {
         assert_return(enumerator, -EINVAL);
 
@@ -276,14 +297,16 @@ int device_enumerator_add_match_is_initialized(sd_device_enumerator *enumerator)
         return 0;
 }
 
-static int device_compare(sd_device * const *_a, sd_device * const *_b) {
-        sd_device *a = *(sd_device **)_a, *b = *(sd_device **)_b;
-        const char *devpath_a, *devpath_b, *sound_a;
-        bool delay_a, delay_b;
-        int r;
+/* The sort key of a device, so that the comparison function does not need to look it up again and again */
+typedef struct DeviceSortEntry {
+        sd_device *device;
+        const char *devpath;
+        bool delay;
+} DeviceSortEntry;
 
-        assert_se(sd_device_get_devpath(a, &devpath_a) >= 0);
-        assert_se(sd_device_get_devpath(b, &devpath_b) >= 0);
+static int device_compare(const DeviceSortEntry *a, const DeviceSortEntry *b) {
+        const char *devpath_a = a->devpath, *devpath_b = b->devpath, *sound_a;
+        int r;
 
         sound_a = strstr(devpath_a, "/sound/card");
         if (sound_a) {
@@ -319,9 +342,7 @@ static int device_compare(sd_device * const *_a, sd_device * const *_b) {
         }
 
         /* md and dm devices are enumerated after all other devices */
-        delay_a = strstr(devpath_a, "/block/md") || strstr(devpath_a, "/block/dm-");
-        delay_b = strstr(devpath_b, "/block/md") || strstr(devpath_b, "/block/dm-");
-        r = CMP(delay_a, delay_b);
+        r = CMP(a->delay, b->delay);
         if (r != 0)
                 return r;
 
@@ -340,6 +361,16 @@ int device_enumerator_add_device(sd_device_enumerator *enumerator, sd_device *de
         return 0;
 }
 
+static int enumerator_add_device_locked(sd_device_enumerator *enumerator, sd_device *device) {
+        int r;
+
+        assert_se(pthread_mutex_lock(&enumerator->devices_lock) == 0);
+        r = device_enumerator_add_device(enumerator, device);
+        assert_se(pthread_mutex_unlock(&enumerator->devices_lock) == 0);
+
+        return r;
+}
+
 static bool match_sysattr_value(sd_device *device, const char *sysattr, const char *match_value) {
         const char *value;
         int r;
@@ -541,7 +572,7 @@ static int enumerator_scan_dir_and_add_devices(sd_device_enumerator *enumerator,
                 if (!match_sysattr(enumerator, device))
                         continue;
 
-                k = device_enumerator_add_device(enumerator, device);
+                k = enumerator_add_device_locked(enumerator, device);
                 if (k < 0)
                         r = k;
         }
@@ -572,11 +603,44 @@ static bool match_subsystem(sd_device_enumerator *enumerator, const char *subsys
         return false;
 }
 
+typedef struct EnumeratorScanJob {
+        sd_device_enumerator *enumerator;
+        const char *basedir;
+        char **subdirs;
+        size_t n_subdirs;
+        const char *subdir;
+        size_t next;
+        int r;
+} EnumeratorScanJob;
+
+static void *enumerator_scan_thread(void *userdata) {
+        EnumeratorScanJob *job = userdata;
+
+        for (;;) {
+                size_t i;
+                int k;
+
+                i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+                if (i >= job->n_subdirs)
+                        break;
+
+                k = enumerator_scan_dir_and_add_devices(job->enumerator, job->basedir, job->subdirs[i], job->subdir);
+                if (k < 0)
+                        __atomic_store_n(&job->r, k, __ATOMIC_RELAXED);
+        }
+
+        return NULL;
+}
+
 static int enumerator_scan_dir(sd_device_enumerator *enumerator, const char *basedir, const char *subdir, const char *subsystem) {
+        _cleanup_strv_free_ char **subdirs = NULL;
         _cleanup_closedir_ DIR *dir = NULL;
-        char *path;
+        _cleanup_free_ pthread_t *threads = NULL;
+        EnumeratorScanJob job;
+        unsigned n_threads = 0, i;
         struct dirent *dent;
-        int r = 0;
+        char *path;
+        int r;
 
         path = strjoina("/sys/", basedir);
 
@@ -586,21 +650,93 @@ static int enumerator_scan_dir(sd_device_enumerator *enumerator, const char *bas
 
         log_debug("sd-device-enumerator: Scanning %s", path);
 
+        /* Skip subsystems we are not interested in before looking at any of their devices */
         FOREACH_DIRENT_ALL(dent, dir, return -errno) {
-                int k;
-
                 if (dent->d_name[0] == '.')
                         continue;
 
                 if (!match_subsystem(enumerator, subsystem ? : dent->d_name))
                         continue;
 
-                k = enumerator_scan_dir_and_add_devices(enumerator, basedir, dent->d_name, subdir);
-                if (k < 0)
-                        r = k;
+                r = strv_extend(&subdirs, dent->d_name);
+                if (r < 0)
+                        return r;
         }
 
-        return r;
+        job = (EnumeratorScanJob) {
+                .enumerator = enumerator,
+                .basedir = basedir,
+                .subdirs = subdirs,
+                .n_subdirs = strv_length(subdirs),
+                .subdir = subdir,
+        };
+
+        /* The subsystems are independent of each other, so scan them in parallel if asked to. The calling
+         * thread does its share of the work, too, and everything is done if thread creation fails. */
+        if (enumerator->n_threads > 1 && job.n_subdirs > 1) {
+                unsigned n_jobs;
+
+                n_jobs = (unsigned) MIN((size_t) enumerator->n_threads, job.n_subdirs);
+
+                threads = new(pthread_t, n_jobs - 1);
+                if (threads)
+                        for (i = 0; i < n_jobs - 1; i++) {
+                                if (pthread_create(threads + n_threads, NULL, enumerator_scan_thread, &job) != 0)
+                                        break;
+                                n_threads++;
+                        }
+        }
+
+        (void) enumerator_scan_thread(&job);
+
+        for (i = 0; i < n_threads; i++)
+                (void) pthread_join(threads[i], NULL);
+
+        return job.r;
+}
+
+static bool match_device_id(sd_device_enumerator *enumerator, const char *id) {
+        const char *subsystem, *sysname = NULL, *p;
+
+        assert(enumerator);
+        assert(id);
+
+        /* Some device IDs tell the subsystem and sysname of the device, see device_get_id_filename(), which
+         * allows us to skip devices without creating an sd_device object for them. */
+
+        switch (id[0]) {
+
+        case 'b':
+                subsystem = "block";
+                break;
+
+        case 'n':
+                subsystem = "net";
+                break;
+
+        case '+':
+                p = strchr(id + 1, ':');
+                if (!p)
+                        return true;
+
+                subsystem = strndupa(id + 1, p - id - 1);
+
+                /* Drivers also carry the subsystem of the driver in the ID */
+                if (!streq(subsystem, "drivers"))
+                        sysname = p + 1;
+                break;
+
+        default:
+                return true;
+        }
+
+        if (!match_subsystem(enumerator, subsystem))
+                return false;
+
+        if (sysname && !match_sysname(enumerator, sysname))
+                return false;
+
+        return true;
 }
 
 static int enumerator_scan_devices_tag(sd_device_enumerator *enumerator, const char *tag) {
@@ -621,8 +757,6 @@ static int enumerator_scan_devices_tag(sd_device_enumerator *enumerator, const c
                 return 0;
         }
 
-        /* TODO: filter away subsystems? */
-
         FOREACH_DIRENT_ALL(dent, dir, return -errno) {
                 _cleanup_(sd_device_unrefp) sd_device *device = NULL;
                 const char *subsystem, *sysname;
@@ -631,6 +765,9 @@ static int enumerator_scan_devices_tag(sd_device_enumerator *enumerator, const c
                 if (dent->d_name[0] == '.')
                         continue;
 
+                if (!match_device_id(enumerator, dent->d_name))
+                        continue;
+
                 k = sd_device_new_from_device_id(&device, dent->d_name);
                 if (k < 0) {
                         if (k != -ENODEV)
@@ -738,6 +875,32 @@ static int parent_add_child(sd_device_enumerator *enumerator, const char *path)
         return 1;
 }
 
+static bool parent_child_may_match(sd_device_enumerator *enumerator, const char *path, int dir_fd, const char *name) {
+        _cleanup_free_ char *subsystem = NULL;
+
+        assert(enumerator);
+        assert(path);
+        assert(dir_fd >= 0);
+        assert(name);
+
+        /* Checks what we can tell from the directory, before creating an sd_device object for it. Below
+         * /sys/devices/ only directories with an uevent file are devices, and their subsystem is the
+         * target of the subsystem symlink, see device_set_syspath() and sd_device_get_subsystem(). */
+
+        if (path_startswith(path, "/sys/devices/") &&
+            faccessat(dir_fd, strjoina(name, "/uevent"), F_OK, 0) < 0 &&
+            errno == ENOENT)
+                return false;
+
+        if (set_isempty(enumerator->match_subsystem) && set_isempty(enumerator->nomatch_subsystem))
+                return true;
+
+        if (readlinkat_malloc(dir_fd, strjoina(name, "/subsystem"), &subsystem) < 0)
+                return true;
+
+        return match_subsystem(enumerator, basename(subsystem));
+}
+
 static int parent_crawl_children(sd_device_enumerator *enumerator, const char *path, unsigned maxdepth) {
         _cleanup_closedir_ DIR *dir = NULL;
         struct dirent *dent;
@@ -761,9 +924,11 @@ static int parent_crawl_children(sd_device_enumerator *enumerator, const char *p
                 if (!child)
                         return -ENOMEM;
 
-                k = parent_add_child(enumerator, child);
-                if (k < 0)
-                        r = k;
+                if (parent_child_may_match(enumerator, path, dirfd(dir), dent->d_name)) {
+                        k = parent_add_child(enumerator, child);
+                        if (k < 0)
+                                r = k;
+                }
 
                 if (maxdepth > 0)
                         parent_crawl_children(enumerator, child, maxdepth - 1);
@@ -821,31 +986,48 @@ static int enumerator_scan_devices_all(sd_device_enumerator *enumerator) {
         return r;
 }
 
-static void device_enumerator_dedup_devices(sd_device_enumerator *enumerator) {
-        sd_device **a, **b, **end;
+static int device_enumerator_sort_devices(sd_device_enumerator *enumerator) {
+        _cleanup_free_ DeviceSortEntry *entries = NULL;
+        size_t i, n = 0;
 
         assert(enumerator);
 
         if (enumerator->n_devices <= 1)
-                return;
+                return 0;
+
+        entries = new(DeviceSortEntry, enumerator->n_devices);
+        if (!entries)
+                return -ENOMEM;
 
-        a = enumerator->devices + 1;
-        b = enumerator->devices;
-        end = enumerator->devices + enumerator->n_devices;
+        for (i = 0; i < enumerator->n_devices; i++) {
+                const char *devpath;
 
-        for (; a < end; a++) {
-                const char *devpath_a, *devpath_b;
+                assert_se(sd_device_get_devpath(enumerator->devices[i], &devpath) >= 0);
 
-                assert_se(sd_device_get_devpath(*a, &devpath_a) >= 0);
-                assert_se(sd_device_get_devpath(*b, &devpath_b) >= 0);
+                entries[i] = (DeviceSortEntry) {
+                        .device = enumerator->devices[i],
+                        .devpath = devpath,
+                        .delay = strstr(devpath, "/block/md") || strstr(devpath, "/block/dm-"),
+                };
+        }
 
-                if (path_equal(devpath_a, devpath_b))
-                        sd_device_unref(*a);
-                else
-                        *(++b) = *a;
+        typesafe_qsort(entries, enumerator->n_devices, device_compare);
+
+        /* Drop duplicates, which we get if the same device is found through more than one directory */
+        for (i = 0; i < enumerator->n_devices; i++) {
+                if (n > 0 && path_equal(entries[i].devpath, entries[n - 1].devpath)) {
+                        sd_device_unref(entries[i].device);
+                        continue;
+                }
+
+                entries[n++] = entries[i];
         }
 
-        enumerator->n_devices = b - enumerator->devices + 1;
+        for (i = 0; i < n; i++)
+                enumerator->devices[i] = entries[i].device;
+        enumerator->n_devices = n;
+
+        return 0;
 }
 
 int device_enumerator_scan_devices(sd_device_enumerator *enumerator) {
@@ -877,8 +1059,9 @@ int device_enumerator_scan_devices(sd_device_enumerator *enumerator) {
                         r = k;
         }
 
-        typesafe_qsort(enumerator->devices, enumerator->n_devices, device_compare);
-        device_enumerator_dedup_devices(enumerator);
+        k = device_enumerator_sort_devices(enumerator);
+        if (k < 0)
+                r = k;
 
         enumerator->scan_uptodate = true;
         enumerator->type = DEVICE_ENUMERATION_TYPE_DEVICES;
@@ -962,8 +1145,9 @@ int device_enumerator_scan_subsystems(sd_device_enumerator *enumerator) {
                 }
         }
 
-        typesafe_qsort(enumerator->devices, enumerator->n_devices, device_compare);
-        device_enumerator_dedup_devices(enumerator);
+        k = device_enumerator_sort_devices(enumerator);
+        if (k < 0)
+                r = k;
 
         enumerator->scan_uptodate = true;
         enumerator->type = DEVICE_ENUMERATION_TYPE_SUBSYSTEMS;
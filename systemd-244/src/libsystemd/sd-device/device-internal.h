@@ -24,6 +24,7 @@ struct sd_device {
         OrderedHashmap *properties_db;
 
         Hashmap *sysattr_values; /* cached sysattr values */
+        int syspath_fd; /* O_PATH fd of the syspath directory to read sysattrs through, opened lazily */
 
         Set *sysattrs; /* names of sysattrs */
         Iterator sysattrs_iterator;
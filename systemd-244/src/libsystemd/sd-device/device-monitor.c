@@ -35,6 +35,9 @@ struct sd_device_monitor {
         Set *tag_filter;
         bool filter_uptodate;
 
+        /* Buffers for receiving several messages with one recvmmsg(), allocated when first needed */
+        struct monitor_batch *batch;
+
         sd_event *event;
         sd_event_source *event_source;
         sd_device_monitor_handler_t callback;
@@ -62,6 +65,24 @@ typedef struct monitor_netlink_header {
         unsigned filter_tag_bloom_lo;
 } monitor_netlink_header;
 
+typedef union monitor_message {
+        monitor_netlink_header nlh;
+        char raw[8192];
+} monitor_message;
+
+/* Only used when dispatching from the event loop, where all received messages are processed before
+ * returning. Users of device_monitor_receive_device() poll() the socket between messages, hence must not
+ * find messages queued in userspace. */
+#define MONITOR_BATCH_SIZE 8U
+
+typedef struct monitor_batch {
+        monitor_message buf[MONITOR_BATCH_SIZE];
+        union sockaddr_union snl[MONITOR_BATCH_SIZE];
+        char cred_msg[MONITOR_BATCH_SIZE][CMSG_SPACE(sizeof(struct ucred))];
+        struct iovec iov[MONITOR_BATCH_SIZE];
+        struct mmsghdr msgs[MONITOR_BATCH_SIZE];
+} monitor_batch;
+
 static int monitor_set_nl_address(sd_device_monitor *m) {
         union sockaddr_union snl;
         socklen_t addrlen;
@@ -184,17 +205,306 @@ _public_ int sd_device_monitor_stop(sd_device_monitor *m) {
         return 0;
 }
 
-static int device_monitor_event_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+static void message_get_properties(
+                const char *nulstr,
+                size_t len,
+                const char **ret_devpath,
+                const char **ret_subsystem,
+                const char **ret_devtype,
+                const char **ret_tags) {
+
+        const char *devpath = NULL, *subsystem = NULL, *devtype = NULL, *tags = NULL;
+        size_t i = 0;
+
+        /* Picks the properties needed for filtering out of a received message, without parsing it into an
+         * sd_device object. Invalid messages are reported when they are parsed later on. */
+
+        while (i < len) {
+                const char *key, *end, *v;
+
+                key = nulstr + i;
+                end = memchr(key, '\0', len - i);
+                if (!end)
+                        break;
+                i += end - key + 1;
+
+                if ((v = startswith(key, "DEVPATH=")))
+                        devpath = v;
+                else if ((v = startswith(key, "SUBSYSTEM=")))
+                        subsystem = v;
+                else if ((v = startswith(key, "DEVTYPE=")))
+                        devtype = v;
+                else if ((v = startswith(key, "TAGS=")))
+                        tags = v;
+        }
+
+        *ret_devpath = devpath;
+        *ret_subsystem = subsystem;
+        *ret_devtype = devtype;
+        *ret_tags = tags;
+}
+
+static bool tags_contain(const char *tags, const char *tag) {
+        size_t n;
+
+        assert(tag);
+
+        if (!tags)
+                return false;
+
+        /* The tags are stored as ":tag1:tag2:" */
+        n = strlen(tag);
+        for (;;) {
+                size_t l;
+
+                tags += strspn(tags, ":");
+                if (*tags == '\0')
+                        return false;
+
+                l = strcspn(tags, ":");
+                if (l == n && strneq(tags, tag, n))
+                        return true;
+
+                tags += l;
+        }
+}
+
+static bool passes_filter(sd_device_monitor *m, const char *s, const char *d, const char *tags) {
+        const char *tag, *subsystem, *devtype;
+        Iterator i;
+
+        assert(m);
+
+        if (hashmap_isempty(m->subsystem_filter))
+                goto tag;
+
+        if (!s)
+                return false;
+
+        HASHMAP_FOREACH_KEY(devtype, subsystem, m->subsystem_filter, i) {
+                if (!streq(s, subsystem))
+                        continue;
+
+                if (!devtype)
+                        goto tag;
+
+                if (!d)
+                        continue;
+
+                if (streq(d, devtype))
+                        goto tag;
+        }
+
+        return false;
+
+tag:
+        if (set_isempty(m->tag_filter))
+                return true;
+
+        SET_FOREACH(tag, m->tag_filter, i)
+                if (tags_contain(tags, tag))
+                        return true;
+
+        return false;
+}
+
+static int device_monitor_process_message(sd_device_monitor *m, struct msghdr *smsg, ssize_t buflen, sd_device **ret) {
         _cleanup_(sd_device_unrefp) sd_device *device = NULL;
-        sd_device_monitor *m = userdata;
+        const char *devpath, *subsystem, *devtype, *tags;
+        union sockaddr_union *snl;
+        monitor_message *buf;
+        struct cmsghdr *cmsg;
+        struct ucred *cred;
+        ssize_t bufpos;
+        bool is_initialized = false;
+        int r;
 
         assert(m);
+        assert(smsg);
+        assert(ret);
 
-        if (device_monitor_receive_device(m, &device) <= 0)
+        buf = smsg->msg_iov[0].iov_base;
+        snl = smsg->msg_name;
+
+        if (buflen < 32 || (smsg->msg_flags & MSG_TRUNC))
+                return log_debug_errno(SYNTHETIC_ERRNO(EINVAL),
+                                       "sd-device-monitor: Invalid message length.");
+
+        if (snl->nl.nl_groups == MONITOR_GROUP_NONE) {
+                /* unicast message, check if we trust the sender */
+                if (m->snl_trusted_sender.nl.nl_pid == 0 ||
+                    snl->nl.nl_pid != m->snl_trusted_sender.nl.nl_pid)
+                        return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
+                                               "sd-device-monitor: Unicast netlink message ignored.");
+
+        } else if (snl->nl.nl_groups == MONITOR_GROUP_KERNEL) {
+                if (snl->nl.nl_pid > 0)
+                        return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
+                                               "sd-device-monitor: Multicast kernel netlink message from PID %"PRIu32" ignored.", snl->nl.nl_pid);
+        }
+
+        cmsg = CMSG_FIRSTHDR(smsg);
+        if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS)
+                return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
+                                       "sd-device-monitor: No sender credentials received, message ignored.");
+
+        cred = (struct ucred*) CMSG_DATA(cmsg);
+        if (cred->uid != 0)
+                return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
+                                       "sd-device-monitor: Sender uid="UID_FMT", message ignored.", cred->uid);
+
+        if (streq(buf->raw, "libudev")) {
+                /* udev message needs proper version magic */
+                if (buf->nlh.magic != htobe32(UDEV_MONITOR_MAGIC))
+                        return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
+                                               "sd-device-monitor: Invalid message signature (%x != %x)",
+                                               buf->nlh.magic, htobe32(UDEV_MONITOR_MAGIC));
+
+                if (buf->nlh.properties_off+32 > (size_t) buflen)
+                        return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
+                                               "sd-device-monitor: Invalid message length (%u > %zd)",
+                                               buf->nlh.properties_off+32, buflen);
+
+                bufpos = buf->nlh.properties_off;
+
+                /* devices received from udev are always initialized */
+                is_initialized = true;
+
+        } else {
+                /* kernel message with header */
+                bufpos = strlen(buf->raw) + 1;
+                if ((size_t) bufpos < sizeof("a@/d") || bufpos >= buflen)
+                        return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
+                                               "sd-device-monitor: Invalid message length");
+
+                /* check message header */
+                if (!strstr(buf->raw, "@/"))
+                        return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
+                                               "sd-device-monitor: Invalid message header");
+        }
+
+        message_get_properties(&buf->raw[bufpos], buflen - bufpos, &devpath, &subsystem, &devtype, &tags);
+
+        /* Whatever we knew about the sysattrs of the device might be outdated now */
+        if (devpath)
+                device_sysattr_cache_invalidate(strjoina("/sys", devpath));
+
+        /* Skip device, if it does not pass the current filter. The socket filter only looks at hashes, and
+         * does not see kernel messages at all, hence check the strings here, before parsing the message. */
+        if (!passes_filter(m, subsystem, devtype, tags)) {
+                log_debug("sd-device-monitor: Received device %s does not pass filter, ignoring", strna(devpath));
                 return 0;
+        }
+
+        r = device_new_from_nulstr(&device, (uint8_t*) &buf->raw[bufpos], buflen - bufpos);
+        if (r < 0)
+                return log_debug_errno(r, "sd-device-monitor: Failed to create device from received message: %m");
+
+        if (is_initialized)
+                device_set_is_initialized(device);
+
+        *ret = TAKE_PTR(device);
+        return 1;
+}
 
-        if (m->callback)
-                return m->callback(m, device, m->userdata);
+int device_monitor_receive_device(sd_device_monitor *m, sd_device **ret) {
+        monitor_message buf;
+        struct iovec iov = {
+                .iov_base = &buf,
+                .iov_len = sizeof(buf)
+        };
+        char cred_msg[CMSG_SPACE(sizeof(struct ucred))];
+        union sockaddr_union snl;
+        struct msghdr smsg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = cred_msg,
+                .msg_controllen = sizeof(cred_msg),
+                .msg_name = &snl,
+                .msg_namelen = sizeof(snl),
+        };
+        ssize_t buflen;
+
+        assert(m);
+        assert(ret);
+
+        buflen = recvmsg(m->sock, &smsg, 0);
+        if (buflen < 0) {
+                if (errno != EINTR)
+                        log_debug_errno(errno, "sd-device-monitor: Failed to receive message: %m");
+                return -errno;
+        }
+
+        return device_monitor_process_message(m, &smsg, buflen, ret);
+}
+
+static int device_monitor_receive_batch(sd_device_monitor *m) {
+        monitor_batch *b;
+        unsigned i;
+        int n;
+
+        assert(m);
+
+        if (!m->batch) {
+                m->batch = new(monitor_batch, 1);
+                if (!m->batch)
+                        return -ENOMEM;
+        }
+
+        b = m->batch;
+
+        for (i = 0; i < MONITOR_BATCH_SIZE; i++) {
+                b->iov[i] = IOVEC_MAKE(b->buf + i, sizeof(b->buf[i]));
+                b->msgs[i] = (struct mmsghdr) {
+                        .msg_hdr.msg_iov = b->iov + i,
+                        .msg_hdr.msg_iovlen = 1,
+                        .msg_hdr.msg_control = b->cred_msg[i],
+                        .msg_hdr.msg_controllen = sizeof(b->cred_msg[i]),
+                        .msg_hdr.msg_name = b->snl + i,
+                        .msg_hdr.msg_namelen = sizeof(b->snl[i]),
+                };
+        }
+
+        n = recvmmsg(m->sock, b->msgs, MONITOR_BATCH_SIZE, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+                if (!IN_SET(errno, EINTR, EAGAIN))
+                        log_debug_errno(errno, "sd-device-monitor: Failed to receive messages: %m");
+                return -errno;
+        }
+
+        return n;
+}
+
+static int device_monitor_event_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        _cleanup_(sd_device_monitor_unrefp) sd_device_monitor *m = NULL;
+        int i, n, r;
+
+        assert(userdata);
+
+        /* The callback might drop the last reference */
+        m = sd_device_monitor_ref(userdata);
+
+        n = device_monitor_receive_batch(m);
+        if (n <= 0)
+                return 0;
+
+        for (i = 0; i < n; i++) {
+                _cleanup_(sd_device_unrefp) sd_device *device = NULL;
+
+                if (device_monitor_process_message(m, &m->batch->msgs[i].msg_hdr, m->batch->msgs[i].msg_len, &device) <= 0)
+                        continue;
+
+                if (!m->callback)
+                        continue;
+
+                r = m->callback(m, device, m->userdata);
+                if (r < 0)
+                        return r;
+
+                /* Drop the rest if the callback stopped the monitor */
+                if (m->event_source != s)
+                        break;
+        }
 
         return 0;
 }
@@ -299,169 +609,13 @@ static sd_device_monitor *device_monitor_free(sd_device_monitor *m) {
 
         hashmap_free_free_free(m->subsystem_filter);
         set_free_free(m->tag_filter);
+        free(m->batch);
 
         return mfree(m);
 }
 
 DEFINE_PUBLIC_TRIVIAL_REF_UNREF_FUNC(sd_device_monitor, sd_device_monitor, device_monitor_free);
 
-static int passes_filter(sd_device_monitor *m, sd_device *device) {
-        const char *tag, *subsystem, *devtype, *s, *d = NULL;
-        Iterator i;
-        int r;
-
-        assert_return(m, -EINVAL);
-        assert_return(device, -EINVAL);
-
-        if (hashmap_isempty(m->subsystem_filter))
-                goto tag;
-
-        r = sd_device_get_subsystem(device, &s);
-        if (r < 0)
-                return r;
-
-        r = sd_device_get_devtype(device, &d);
-        if (r < 0 && r != -ENOENT)
-                return r;
-
-        HASHMAP_FOREACH_KEY(devtype, subsystem, m->subsystem_filter, i) {
-                if (!streq(s, subsystem))
-                        continue;
-
-                if (!devtype)
-                        goto tag;
-
-                if (!d)
-                        continue;
-
-                if (streq(d, devtype))
-                        goto tag;
-        }
-
-        return 0;
-
-tag:
-        if (set_isempty(m->tag_filter))
-                return 1;
-
-        SET_FOREACH(tag, m->tag_filter, i)
-                if (sd_device_has_tag(device, tag) > 0)
-                        return 1;
-
-        return 0;
-}
-
-int device_monitor_receive_device(sd_device_monitor *m, sd_device **ret) {
-        _cleanup_(sd_device_unrefp) sd_device *device = NULL;
-        union {
-                monitor_netlink_header nlh;
-                char raw[8192];
-        } buf;
-        struct iovec iov = {
-                .iov_base = &buf,
-                .iov_len = sizeof(buf)
-        };
-        char cred_msg[CMSG_SPACE(sizeof(struct ucred))];
-        union sockaddr_union snl;
-        struct msghdr smsg = {
-                .msg_iov = &iov,
-                .msg_iovlen = 1,
-                .msg_control = cred_msg,
-                .msg_controllen = sizeof(cred_msg),
-                .msg_name = &snl,
-                .msg_namelen = sizeof(snl),
-        };
-        struct cmsghdr *cmsg;
-        struct ucred *cred;
-        ssize_t buflen, bufpos;
-        bool is_initialized = false;
-        int r;
-
-        assert(ret);
-
-        buflen = recvmsg(m->sock, &smsg, 0);
-        if (buflen < 0) {
-                if (errno != EINTR)
-                        log_debug_errno(errno, "sd-device-monitor: Failed to receive message: %m");
-                return -errno;
-        }
-
-        if (buflen < 32 || (smsg.msg_flags & MSG_TRUNC))
-                return log_debug_errno(SYNTHETIC_ERRNO(EINVAL),
-                                       "sd-device-monitor: Invalid message length.");
-
-        if (snl.nl.nl_groups == MONITOR_GROUP_NONE) {
-                /* unicast message, check if we trust the sender */
-                if (m->snl_trusted_sender.nl.nl_pid == 0 ||
-                    snl.nl.nl_pid != m->snl_trusted_sender.nl.nl_pid)
-                        return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
-                                               "sd-device-monitor: Unicast netlink message ignored.");
-
-        } else if (snl.nl.nl_groups == MONITOR_GROUP_KERNEL) {
-                if (snl.nl.nl_pid > 0)
-                        return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
-                                               "sd-device-monitor: Multicast kernel netlink message from PID %"PRIu32" ignored.", snl.nl.nl_pid);
-        }
-
-        cmsg = CMSG_FIRSTHDR(&smsg);
-        if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS)
-                return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
-                                       "sd-device-monitor: No sender credentials received, message ignored.");
-
-        cred = (struct ucred*) CMSG_DATA(cmsg);
-        if (cred->uid != 0)
-                return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
-                                       "sd-device-monitor: Sender uid="UID_FMT", message ignored.", cred->uid);
-
-        if (streq(buf.raw, "libudev")) {
-                /* udev message needs proper version magic */
-                if (buf.nlh.magic != htobe32(UDEV_MONITOR_MAGIC))
-                        return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
-                                               "sd-device-monitor: Invalid message signature (%x != %x)",
-                                               buf.nlh.magic, htobe32(UDEV_MONITOR_MAGIC));
-
-                if (buf.nlh.properties_off+32 > (size_t) buflen)
-                        return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
-                                               "sd-device-monitor: Invalid message length (%u > %zd)",
-                                               buf.nlh.properties_off+32, buflen);
-
-                bufpos = buf.nlh.properties_off;
-
-                /* devices received from udev are always initialized */
-                is_initialized = true;
-
-        } else {
-                /* kernel message with header */
-                bufpos = strlen(buf.raw) + 1;
-                if ((size_t) bufpos < sizeof("a@/d") || bufpos >= buflen)
-                        return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
-                                               "sd-device-monitor: Invalid message length");
-
-                /* check message header */
-                if (!strstr(buf.raw, "@/"))
-                        return log_debug_errno(SYNTHETIC_ERRNO(EAGAIN),
-                                               "sd-device-monitor: Invalid message header");
-        }
-
-        r = device_new_from_nulstr(&device, (uint8_t*) &buf.raw[bufpos], buflen - bufpos);
-        if (r < 0)
-                return log_debug_errno(r, "sd-device-monitor: Failed to create device from received message: %m");
-
-        if (is_initialized)
-                device_set_is_initialized(device);
-
-        /* Skip device, if it does not pass the current filter */
-        r = passes_filter(m, device);
-        if (r < 0)
-                return log_device_debug_errno(device, r, "sd-device-monitor: Failed to check received device passing filter: %m");
-        if (r == 0)
-                log_device_debug(device, "sd-device-monitor: Received device does not pass filter, ignoring");
-        else
-                *ret = TAKE_PTR(device);
-
-        return r;
-}
-
 static uint32_t string_hash32(const char *str) {
         return MurmurHash2(str, strlen(str), 0);
 }
@@ -603,8 +757,9 @@ _public_ int sd_device_monitor_filter_update(sd_device_monitor *m) {
         bpf_stmt(ins, &i, BPF_LD|BPF_W|BPF_ABS, offsetof(monitor_netlink_header, magic));
         /* jump if magic matches */
         bpf_jmp(ins, &i, BPF_JMP|BPF_JEQ|BPF_K, UDEV_MONITOR_MAGIC, 1, 0);
-        /* wrong magic, pass packet */
-        bpf_stmt(ins, &i, BPF_RET|BPF_K, 0xffffffff);
+        /* wrong magic, i.e. a kernel message, which never carries tags. Drop it if we filter by tags,
+         * otherwise pass it and leave the subsystem match to userspace. */
+        bpf_stmt(ins, &i, BPF_RET|BPF_K, set_isempty(m->tag_filter) ? 0xffffffff : 0);
 
         if (!set_isempty(m->tag_filter)) {
                 int tag_matches = set_size(m->tag_filter);
@@ -73,6 +73,24 @@ static inline int device_read_db(sd_device *device) {
         return device_read_db_internal(device, false);
 }
 
+/* An optional process-wide cache of sysattr values, shared by all sd_device objects of the same syspath. Entries
+ * are dropped by device_sysattr_cache_invalidate(), which the device monitor calls for every event it receives,
+ * and by sd_device_set_sysattr_value(). If a generation function is set, an entry is also dropped once the
+ * generation of its syspath changed since it was filled, which allows invalidation across processes. */
+typedef uint64_t (*device_sysattr_cache_generation_t)(const char *syspath);
+
+typedef struct DeviceSysattrCacheStats {
+        uint64_t n_lookups;
+        uint64_t n_hits;
+        uint64_t n_invalidations;
+        size_t n_devices;
+} DeviceSysattrCacheStats;
+
+void device_sysattr_cache_enable(bool b);
+void device_sysattr_cache_set_generation_func(device_sysattr_cache_generation_t func);
+void device_sysattr_cache_invalidate(const char *syspath);
+void device_sysattr_cache_get_stats(DeviceSysattrCacheStats *ret);
+
 DeviceAction device_action_from_string(const char *s) _pure_;
 const char *device_action_to_string(DeviceAction a) _const_;
 void dump_device_action_table(void);
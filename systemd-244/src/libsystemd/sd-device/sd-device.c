@@ -2,6 +2,7 @@
 
 #include <ctype.h>
 #include <net/if.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 
@@ -16,6 +17,7 @@
 #include "fileio.h"
 #include "fs-util.h"
 #include "hashmap.h"
+#include "list.h"
 #include "macro.h"
 #include "parse-util.h"
 #include "path-util.h"
@@ -40,6 +42,7 @@ int device_new_aux(sd_device **ret) {
         *device = (sd_device) {
                 .n_ref = 1,
                 .watch_handle = -1,
+                .syspath_fd = -1,
                 .devmode = (mode_t) -1,
                 .devuid = (uid_t) -1,
                 .devgid = (gid_t) -1,
@@ -50,9 +53,25 @@ int device_new_aux(sd_device **ret) {
         return 0;
 }
 
+/* At most this many sd_device objects keep their syspath directory open, so that keeping lots of devices around,
+ * e.g. in an enumerator, does not eat up all file descriptors. The others read sysattrs through the full path. */
+#define SYSPATH_FDS_MAX 64U
+
+static unsigned n_syspath_fds = 0;
+
+static void device_close_syspath_fd(sd_device *device) {
+        if (device->syspath_fd < 0)
+                return;
+
+        device->syspath_fd = safe_close(device->syspath_fd);
+        (void) __atomic_sub_fetch(&n_syspath_fds, 1, __ATOMIC_RELAXED);
+}
+
 static sd_device *device_free(sd_device *device) {
         assert(device);
 
+        device_close_syspath_fd(device);
+
         sd_device_unref(device->parent);
         free(device->syspath);
         free(device->sysname);
@@ -209,6 +228,7 @@ int device_set_syspath(sd_device *device, const char *_syspath, bool verify) {
         if (r < 0)
                 return r;
 
+        device_close_syspath_fd(device);
         free_and_replace(device->syspath, syspath);
         device->devpath = devpath;
         return 0;
@@ -1727,13 +1747,286 @@ static int device_get_sysattr_value(sd_device *device, const char *_key, const c
         return 0;
 }
 
+#define SYSATTR_CACHE_DEVICES_MAX 4096U
+
+typedef struct SysattrCacheEntry SysattrCacheEntry;
+
+struct SysattrCacheEntry {
+        char *syspath;
+        uint64_t generation;
+        Hashmap *values; /* sysattr → value, NULL if the sysattr does not exist */
+        LIST_FIELDS(SysattrCacheEntry, lru);
+};
+
+typedef struct SysattrCacheToken {
+        bool enabled;
+        uint64_t epoch;
+        uint64_t generation;
+} SysattrCacheToken;
+
+static pthread_mutex_t sysattr_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool sysattr_cache_enabled = false;
+static Hashmap *sysattr_cache = NULL;
+static LIST_HEAD(SysattrCacheEntry, sysattr_cache_lru);
+static SysattrCacheEntry *sysattr_cache_lru_tail = NULL;
+static uint64_t sysattr_cache_epoch = 0; /* bumped by every invalidation, so that racing stores are dropped */
+static device_sysattr_cache_generation_t sysattr_cache_generation = NULL;
+static DeviceSysattrCacheStats sysattr_cache_stats = {};
+
+/* Called with the lock taken */
+static void sysattr_cache_entry_drop(SysattrCacheEntry *e) {
+        if (!e)
+                return;
+
+        hashmap_remove(sysattr_cache, e->syspath);
+
+        if (sysattr_cache_lru_tail == e)
+                sysattr_cache_lru_tail = e->lru_prev;
+        LIST_REMOVE(lru, sysattr_cache_lru, e);
+
+        hashmap_free_free_free(e->values);
+        free(e->syspath);
+        free(e);
+}
+
+/* Called with the lock taken */
+static void sysattr_cache_flush(void) {
+        while (sysattr_cache_lru)
+                sysattr_cache_entry_drop(sysattr_cache_lru);
+
+        sysattr_cache = hashmap_free(sysattr_cache);
+}
+
+/* Called with the lock taken */
+static void sysattr_cache_entry_touch(SysattrCacheEntry *e) {
+        if (sysattr_cache_lru == e)
+                return;
+
+        if (sysattr_cache_lru_tail == e)
+                sysattr_cache_lru_tail = e->lru_prev;
+        LIST_REMOVE(lru, sysattr_cache_lru, e);
+        LIST_PREPEND(lru, sysattr_cache_lru, e);
+        if (!sysattr_cache_lru_tail)
+                sysattr_cache_lru_tail = e;
+}
+
+void device_sysattr_cache_enable(bool b) {
+        assert_se(pthread_mutex_lock(&sysattr_cache_lock) == 0);
+
+        sysattr_cache_enabled = b;
+        if (!b)
+                sysattr_cache_flush();
+
+        assert_se(pthread_mutex_unlock(&sysattr_cache_lock) == 0);
+}
+
+void device_sysattr_cache_set_generation_func(device_sysattr_cache_generation_t func) {
+        assert_se(pthread_mutex_lock(&sysattr_cache_lock) == 0);
+
+        sysattr_cache_generation = func;
+        sysattr_cache_flush();
+
+        assert_se(pthread_mutex_unlock(&sysattr_cache_lock) == 0);
+}
+
+void device_sysattr_cache_invalidate(const char *syspath) {
+        assert_se(pthread_mutex_lock(&sysattr_cache_lock) == 0);
+
+        if (sysattr_cache_enabled) {
+                sysattr_cache_epoch++;
+                sysattr_cache_stats.n_invalidations++;
+
+                if (syspath)
+                        sysattr_cache_entry_drop(hashmap_get(sysattr_cache, syspath));
+                else
+                        sysattr_cache_flush();
+        }
+
+        assert_se(pthread_mutex_unlock(&sysattr_cache_lock) == 0);
+}
+
+void device_sysattr_cache_get_stats(DeviceSysattrCacheStats *ret) {
+        assert(ret);
+
+        assert_se(pthread_mutex_lock(&sysattr_cache_lock) == 0);
+
+        *ret = sysattr_cache_stats;
+        ret->n_devices = hashmap_size(sysattr_cache);
+
+        assert_se(pthread_mutex_unlock(&sysattr_cache_lock) == 0);
+}
+
+/* Returns > 0 on hits, with a copy of the value in *ret_value, or NULL if the sysattr does not exist. On misses,
+ * *ret_token is initialized to be passed to sysattr_cache_store() once the value was read. */
+static int sysattr_cache_lookup(const char *syspath, const char *sysattr, char **ret_value, SysattrCacheToken *ret_token) {
+        SysattrCacheEntry *e;
+        void *key = NULL;
+        char *v;
+        int r = 0;
+
+        assert_se(pthread_mutex_lock(&sysattr_cache_lock) == 0);
+
+        *ret_token = (SysattrCacheToken) {
+                .enabled = sysattr_cache_enabled,
+                .epoch = sysattr_cache_epoch,
+        };
+
+        if (!sysattr_cache_enabled)
+                goto finish;
+
+        /* Get the generation before the value is read, so that a value read after the generation changed is not
+         * stored under the old generation */
+        if (sysattr_cache_generation)
+                ret_token->generation = sysattr_cache_generation(syspath);
+
+        sysattr_cache_stats.n_lookups++;
+
+        e = hashmap_get(sysattr_cache, syspath);
+        if (!e)
+                goto finish;
+
+        if (e->generation != ret_token->generation) {
+                sysattr_cache_entry_drop(e);
+                goto finish;
+        }
+
+        v = hashmap_get2(e->values, sysattr, &key);
+        if (!key)
+                goto finish;
+
+        sysattr_cache_entry_touch(e);
+        sysattr_cache_stats.n_hits++;
+
+        if (v) {
+                v = strdup(v);
+                if (!v) {
+                        r = -ENOMEM;
+                        goto finish;
+                }
+        }
+
+        *ret_value = v;
+        r = 1;
+
+finish:
+        assert_se(pthread_mutex_unlock(&sysattr_cache_lock) == 0);
+        return r;
+}
+
+/* Called with the lock taken */
+static SysattrCacheEntry *sysattr_cache_entry_get(const char *syspath, uint64_t generation) {
+        SysattrCacheEntry *e;
+
+        e = hashmap_get(sysattr_cache, syspath);
+        if (e) {
+                if (e->generation != generation) {
+                        hashmap_clear_free_free(e->values);
+                        e->generation = generation;
+                }
+
+                sysattr_cache_entry_touch(e);
+                return e;
+        }
+
+        if (hashmap_size(sysattr_cache) >= SYSATTR_CACHE_DEVICES_MAX)
+                sysattr_cache_entry_drop(sysattr_cache_lru_tail);
+
+        if (hashmap_ensure_allocated(&sysattr_cache, &string_hash_ops) < 0)
+                return NULL;
+
+        e = new0(SysattrCacheEntry, 1);
+        if (!e)
+                return NULL;
+
+        e->syspath = strdup(syspath);
+        if (!e->syspath || hashmap_put(sysattr_cache, e->syspath, e) < 0) {
+                free(e->syspath);
+                return mfree(e);
+        }
+
+        e->generation = generation;
+        LIST_PREPEND(lru, sysattr_cache_lru, e);
+        if (!sysattr_cache_lru_tail)
+                sysattr_cache_lru_tail = e;
+
+        return e;
+}
+
+static void sysattr_cache_store(const SysattrCacheToken *token, const char *syspath, const char *sysattr, const char *value) {
+        _cleanup_free_ char *k = NULL, *v = NULL;
+        SysattrCacheEntry *e;
+
+        if (!token->enabled)
+                return;
+
+        k = strdup(sysattr);
+        if (!k)
+                return;
+
+        if (value) {
+                v = strdup(value);
+                if (!v)
+                        return;
+        }
+
+        assert_se(pthread_mutex_lock(&sysattr_cache_lock) == 0);
+
+        /* Something was invalidated since we looked, which might have been this device. Don't store what might
+         * be outdated already. */
+        if (!sysattr_cache_enabled || token->epoch != sysattr_cache_epoch)
+                goto finish;
+
+        e = sysattr_cache_entry_get(syspath, token->generation);
+        if (!e)
+                goto finish;
+
+        if (hashmap_ensure_allocated(&e->values, &string_hash_ops) < 0)
+                goto finish;
+
+        if (hashmap_put(e->values, k, v) >= 0) {
+                TAKE_PTR(k);
+                TAKE_PTR(v);
+        }
+
+finish:
+        assert_se(pthread_mutex_unlock(&sysattr_cache_lock) == 0);
+}
+
+static int device_get_syspath_fd(sd_device *device) {
+        const char *syspath;
+        int fd, r;
+
+        assert(device);
+
+        if (device->syspath_fd >= 0)
+                return device->syspath_fd;
+
+        r = sd_device_get_syspath(device, &syspath);
+        if (r < 0)
+                return r;
+
+        if (__atomic_add_fetch(&n_syspath_fds, 1, __ATOMIC_RELAXED) > SYSPATH_FDS_MAX) {
+                (void) __atomic_sub_fetch(&n_syspath_fds, 1, __ATOMIC_RELAXED);
+                return -EMFILE;
+        }
+
+        fd = open(syspath, O_PATH|O_DIRECTORY|O_CLOEXEC);
+        if (fd < 0) {
+                (void) __atomic_sub_fetch(&n_syspath_fds, 1, __ATOMIC_RELAXED);
+                return -errno;
+        }
+
+        return device->syspath_fd = fd;
+}
+
 /* We cache all sysattr lookups. If an attribute does not exist, it is stored
  * with a NULL value in the cache, otherwise the returned string is stored */
 _public_ int sd_device_get_sysattr_value(sd_device *device, const char *sysattr, const char **_value) {
         _cleanup_free_ char *value = NULL;
-        const char *path, *syspath, *cached_value = NULL;
+        const char *path, *syspath, *cached_value = NULL, *name;
+        SysattrCacheToken token;
         struct stat statbuf;
-        int r;
+        int r, dir_fd;
 
         assert_return(device, -EINVAL);
         assert_return(sysattr, -EINVAL);
@@ -1758,14 +2051,45 @@ _public_ int sd_device_get_sysattr_value(sd_device *device, const char *sysattr,
         if (r < 0)
                 return r;
 
+        /* maybe another sd_device object for the same device read it before */
+        r = sysattr_cache_lookup(syspath, sysattr, &value, &token);
+        if (r < 0)
+                return r;
+        if (r > 0) {
+                r = device_add_sysattr_value(device, sysattr, value);
+                if (r < 0)
+                        return r;
+
+                if (!value)
+                        return -ENOENT;
+
+                if (_value)
+                        *_value = value;
+                TAKE_PTR(value);
+
+                return 0;
+        }
+
         path = prefix_roota(syspath, sysattr);
-        r = lstat(path, &statbuf);
+
+        /* read through the directory fd if we can, to avoid resolving the syspath again and again */
+        dir_fd = sysattr[0] != '/' ? device_get_syspath_fd(device) : -EINVAL;
+        if (dir_fd >= 0)
+                name = sysattr;
+        else {
+                dir_fd = AT_FDCWD;
+                name = path;
+        }
+
+        r = fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW);
         if (r < 0) {
                 /* remember that we could not access the sysattr */
                 r = device_add_sysattr_value(device, sysattr, NULL);
                 if (r < 0)
                         return r;
 
+                sysattr_cache_store(&token, syspath, sysattr, NULL);
+
                 return -ENOENT;
         } else if (S_ISLNK(statbuf.st_mode)) {
                 /* Some core links return only the last element of the target path,
@@ -1786,7 +2110,7 @@ _public_ int sd_device_get_sysattr_value(sd_device *device, const char *sysattr,
                 size_t size;
 
                 /* read attribute value */
-                r = read_full_virtual_file(path, &value, &size);
+                r = read_full_virtual_file_at(dir_fd, name, &value, &size);
                 if (r < 0)
                         return r;
 
@@ -1795,11 +2119,15 @@ _public_ int sd_device_get_sysattr_value(sd_device *device, const char *sysattr,
                         value[size] = '\0';
         }
 
+        sysattr_cache_store(&token, syspath, sysattr, value);
+
         r = device_add_sysattr_value(device, sysattr, value);
         if (r < 0)
                 return r;
 
-        *_value = TAKE_PTR(value);
+        if (_value)
+                *_value = value;
+        TAKE_PTR(value);
 
         return 0;
 }
@@ -1849,6 +2177,9 @@ _public_ int sd_device_set_sysattr_value(sd_device *device, const char *sysattr,
         if (!value)
                 return -ENOMEM;
 
+        /* other sd_device objects must not see the old value anymore, whether writing succeeds or not */
+        device_sysattr_cache_invalidate(syspath);
+
         r = write_string_file(path, value, WRITE_STRING_FILE_DISABLE_BUFFER | WRITE_STRING_FILE_NOFOLLOW);
         if (r < 0) {
                 if (r == -ELOOP)
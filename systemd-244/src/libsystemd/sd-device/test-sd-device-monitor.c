@@ -11,6 +11,7 @@
 #include "device-util.h"
 #include "macro.h"
 #include "string-util.h"
+#include "strv.h"
 #include "tests.h"
 #include "util.h"
 #include "virt.h"
@@ -157,6 +158,67 @@ static void test_sd_device_monitor_filter_remove(sd_device *device) {
         assert_se(sd_event_loop(sd_device_monitor_get_event(monitor_client)) == 100);
 }
 
+typedef struct BatchData {
+        const char *syspath;
+        unsigned n_received;
+        unsigned n_expected;
+} BatchData;
+
+static int monitor_batch_handler(sd_device_monitor *m, sd_device *d, void *userdata) {
+        BatchData *data = userdata;
+        const char *s;
+
+        assert_se(sd_device_get_syspath(d, &s) >= 0);
+        assert_se(streq(s, data->syspath));
+
+        if (++data->n_received < data->n_expected)
+                return 0;
+
+        return sd_event_exit(sd_device_monitor_get_event(m), 100);
+}
+
+static void test_receive_batch(sd_device *device) {
+        _cleanup_(sd_device_monitor_unrefp) sd_device_monitor *monitor_server = NULL, *monitor_client = NULL;
+        _cleanup_(sd_device_unrefp) sd_device *hoge = NULL;
+        _cleanup_strv_free_ char **properties = NULL;
+        const char *subsystem;
+        BatchData data = {
+                .n_expected = 20,
+        };
+        unsigned i;
+
+        log_device_info(device, "/* %s */", __func__);
+
+        assert_se(sd_device_get_syspath(device, &data.syspath) >= 0);
+        assert_se(sd_device_get_subsystem(device, &subsystem) >= 0);
+
+        /* device_new_from_strv() modifies the strings, hence they must not be literals */
+        assert_se(properties = strv_new("ACTION=add", "SUBSYSTEM=hoge", "DEVPATH=/devices/virtual/hoge", "SEQNUM=1"));
+        assert_se(device_new_from_strv(&hoge, properties) >= 0);
+
+        assert_se(device_monitor_new_full(&monitor_server, MONITOR_GROUP_NONE, -1) >= 0);
+        assert_se(sd_device_monitor_start(monitor_server, NULL, NULL) >= 0);
+        assert_se(sd_event_source_set_description(sd_device_monitor_get_event_source(monitor_server), "sender") >= 0);
+
+        assert_se(device_monitor_new_full(&monitor_client, MONITOR_GROUP_NONE, -1) >= 0);
+        assert_se(device_monitor_allow_unicast_sender(monitor_client, monitor_server) >= 0);
+        assert_se(sd_device_monitor_set_receive_buffer_size(monitor_client, 1024 * 1024) >= 0);
+        assert_se(sd_device_monitor_start(monitor_client, monitor_batch_handler, &data) >= 0);
+        assert_se(sd_event_source_set_description(sd_device_monitor_get_event_source(monitor_client), "receiver") >= 0);
+
+        /* Not installed as socket filter, hence the other device has to be dropped in userspace */
+        assert_se(sd_device_monitor_filter_add_match_subsystem_devtype(monitor_client, subsystem, NULL) >= 0);
+
+        /* Queue up more messages than are received at once, all of them must be dispatched */
+        for (i = 0; i < data.n_expected; i++) {
+                assert_se(device_monitor_send_device(monitor_server, monitor_client, hoge) >= 0);
+                assert_se(device_monitor_send_device(monitor_server, monitor_client, device) >= 0);
+        }
+
+        assert_se(sd_event_loop(sd_device_monitor_get_event(monitor_client)) == 100);
+        assert_se(data.n_received == data.n_expected);
+}
+
 static void test_device_copy_properties(sd_device *device) {
         _cleanup_(sd_device_unrefp) sd_device *copy = NULL;
 
@@ -195,6 +257,7 @@ int main(int argc, char *argv[]) {
 
         test_subsystem_filter(loopback);
         test_sd_device_monitor_filter_remove(loopback);
+        test_receive_batch(loopback);
         test_device_copy_properties(loopback);
 
         r = sd_device_new_from_subsystem_sysname(&sda, "block", "sda");
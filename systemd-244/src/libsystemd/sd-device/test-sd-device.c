@@ -4,7 +4,9 @@
 #include "device-private.h"
 #include "device-util.h"
 #include "hashmap.h"
+#include "process-util.h"
 #include "string-util.h"
+#include "strv.h"
 #include "tests.h"
 #include "time-util.h"
 
@@ -145,12 +147,283 @@ static void test_sd_device_enumerator_filter_subsystem(void) {
         }
 }
 
+static char **enumerate_devpaths(sd_device_enumerator *e, bool subsystems) {
+        char **l = NULL;
+        sd_device *d;
+
+        for (d = subsystems ? sd_device_enumerator_get_subsystem_first(e) : sd_device_enumerator_get_device_first(e);
+             d;
+             d = subsystems ? sd_device_enumerator_get_subsystem_next(e) : sd_device_enumerator_get_device_next(e)) {
+                const char *devpath;
+
+                assert_se(sd_device_get_devpath(d, &devpath) >= 0);
+                assert_se(strv_extend(&l, devpath) >= 0);
+        }
+
+        return l;
+}
+
+static void test_sd_device_enumerator_threads_one(const char *subsystem, bool subsystems) {
+        _cleanup_(sd_device_enumerator_unrefp) sd_device_enumerator *e = NULL;
+        char buf[FORMAT_TIMESPAN_MAX];
+        unsigned attempt;
+        bool equal = false;
+
+        assert_se(sd_device_enumerator_new(&e) >= 0);
+        assert_se(sd_device_enumerator_allow_uninitialized(e) >= 0);
+        if (subsystem)
+                assert_se(sd_device_enumerator_add_match_subsystem(e, subsystem, true) >= 0);
+
+        /* Devices may come and go between the two scans, hence retry a few times, but the same devices in the
+         * same order must be found eventually */
+        for (attempt = 0; attempt < 5 && !equal; attempt++) {
+                _cleanup_strv_free_ char **a = NULL, **b = NULL;
+                usec_t ts;
+
+                assert_se(device_enumerator_set_n_threads(e, 1) >= 0);
+
+                ts = now(CLOCK_MONOTONIC);
+                a = enumerate_devpaths(e, subsystems);
+                log_info("%s %s with 1 thread: %zu entries, %s", subsystems ? "subsystems" : "devices", strna(subsystem),
+                         strv_length(a), format_timespan(buf, sizeof buf, now(CLOCK_MONOTONIC) - ts, 1));
+
+                assert_se(device_enumerator_set_n_threads(e, 4) >= 0);
+
+                ts = now(CLOCK_MONOTONIC);
+                b = enumerate_devpaths(e, subsystems);
+                log_info("%s %s with 4 threads: %zu entries, %s", subsystems ? "subsystems" : "devices", strna(subsystem),
+                         strv_length(b), format_timespan(buf, sizeof buf, now(CLOCK_MONOTONIC) - ts, 1));
+
+                equal = strv_equal(a, b);
+                if (!equal)
+                        log_notice("Enumerated devices differ, did devices change in the meantime? Retrying.");
+        }
+
+        assert_se(equal);
+}
+
+static void test_sd_device_enumerator_threads(void) {
+        log_info("/* %s */", __func__);
+
+        test_sd_device_enumerator_threads_one(NULL, false);
+        test_sd_device_enumerator_threads_one("net", false);
+        test_sd_device_enumerator_threads_one(NULL, true);
+}
+
+static void test_sd_device_enumerator_threads_fresh_child(void) {
+        _cleanup_(sd_device_enumerator_unrefp) sd_device_enumerator *e = NULL;
+        unsigned n = 0;
+        sd_device *d;
+
+        /* Nothing allocated a hash table yet, hence the scanning threads allocate the first ones */
+        assert_se(sd_device_enumerator_new(&e) >= 0);
+        assert_se(sd_device_enumerator_allow_uninitialized(e) >= 0);
+        assert_se(device_enumerator_set_n_threads(e, 4) >= 0);
+        assert_se(device_enumerator_scan_devices(e) >= 0);
+
+        /* Lookups in the hash tables they allocated must still work */
+        FOREACH_DEVICE_AND_SUBSYSTEM(e, d) {
+                const char *devpath, *value;
+
+                assert_se(sd_device_get_devpath(d, &devpath) >= 0);
+                assert_se(sd_device_get_property_value(d, "DEVPATH", &value) >= 0);
+                assert_se(streq(devpath, value));
+                n++;
+        }
+
+        log_info("Scanned %u devices with 4 threads in a fresh process.", n);
+}
+
+static void test_sd_device_enumerator_threads_fresh(void) {
+        int r;
+
+        log_info("/* %s */", __func__);
+
+        /* Run in a new process image, so that nothing was set up by the other tests yet */
+        r = safe_fork("(threads-fresh)", FORK_DEATHSIG|FORK_LOG|FORK_WAIT, NULL);
+        assert_se(r >= 0);
+        if (r == 0) {
+                (void) execl("/proc/self/exe", program_invocation_short_name, "--threads-fresh", NULL);
+                log_error_errno(errno, "Failed to execute test: %m");
+                _exit(EXIT_FAILURE);
+        }
+}
+
+static void test_sd_device_enumerator_parent_subsystem(void) {
+        _cleanup_(sd_device_enumerator_unrefp) sd_device_enumerator *e = NULL, *all = NULL, *filtered = NULL;
+        const char *subsystem = NULL;
+        sd_device *d, *parent = NULL, *f;
+
+        log_info("/* %s */", __func__);
+
+        /* Find a device with a child with a subsystem */
+        assert_se(sd_device_enumerator_new(&e) >= 0);
+        assert_se(sd_device_enumerator_allow_uninitialized(e) >= 0);
+        FOREACH_DEVICE(e, d)
+                if (sd_device_get_subsystem(d, &subsystem) >= 0 && sd_device_get_parent(d, &parent) >= 0)
+                        break;
+        if (!d) {
+                log_info("No device with parent found, skipping");
+                return;
+        }
+
+        assert_se(sd_device_enumerator_new(&all) >= 0);
+        assert_se(sd_device_enumerator_allow_uninitialized(all) >= 0);
+        assert_se(sd_device_enumerator_add_match_parent(all, parent) >= 0);
+
+        assert_se(sd_device_enumerator_new(&filtered) >= 0);
+        assert_se(sd_device_enumerator_allow_uninitialized(filtered) >= 0);
+        assert_se(sd_device_enumerator_add_match_parent(filtered, parent) >= 0);
+        assert_se(sd_device_enumerator_add_match_subsystem(filtered, subsystem, true) >= 0);
+
+        /* The subsystem is checked before devices are created, the result must be the same */
+        f = sd_device_enumerator_get_device_first(filtered);
+        FOREACH_DEVICE(all, d) {
+                const char *s, *syspath, *syspath_f;
+
+                if (sd_device_get_subsystem(d, &s) < 0 || !streq(s, subsystem))
+                        continue;
+
+                assert_se(f);
+                assert_se(sd_device_get_syspath(d, &syspath) >= 0);
+                assert_se(sd_device_get_syspath(f, &syspath_f) >= 0);
+                assert_se(streq(syspath, syspath_f));
+
+                f = sd_device_enumerator_get_device_next(filtered);
+        }
+        assert_se(!f);
+}
+
+static void test_sd_device_sysattr_cache_one(const char *syspath) {
+        _cleanup_(sd_device_unrefp) sd_device *a = NULL, *b = NULL, *c = NULL;
+        DeviceSysattrCacheStats stats;
+        const char *x, *y;
+        uint64_t n_hits;
+        int r;
+
+        assert_se(sd_device_new_from_syspath(&a, syspath) >= 0);
+        assert_se(sd_device_new_from_syspath(&b, syspath) >= 0);
+        assert_se(sd_device_new_from_syspath(&c, syspath) >= 0);
+
+        /* Another object for the same device gets the same value, and the same error for missing sysattrs */
+        r = sd_device_get_sysattr_value(a, "uevent", &x);
+        assert_se(r >= 0 || IN_SET(r, -EPERM, -EACCES));
+        if (r >= 0) {
+                device_sysattr_cache_get_stats(&stats);
+                n_hits = stats.n_hits;
+
+                assert_se(sd_device_get_sysattr_value(b, "uevent", &y) >= 0);
+                assert_se(streq(x, y));
+
+                device_sysattr_cache_get_stats(&stats);
+                assert_se(stats.n_hits == n_hits + 1);
+        }
+
+        assert_se(sd_device_get_sysattr_value(a, "no-such-sysattr", NULL) == -ENOENT);
+        assert_se(sd_device_get_sysattr_value(b, "no-such-sysattr", NULL) == -ENOENT);
+
+        /* After invalidation, the value is read again */
+        device_sysattr_cache_invalidate(syspath);
+        device_sysattr_cache_get_stats(&stats);
+        n_hits = stats.n_hits;
+
+        assert_se(sd_device_get_sysattr_value(c, "no-such-sysattr", NULL) == -ENOENT);
+
+        device_sysattr_cache_get_stats(&stats);
+        assert_se(stats.n_hits == n_hits);
+}
+
+static void test_sd_device_sysattr_cache(void) {
+        _cleanup_(sd_device_enumerator_unrefp) sd_device_enumerator *e = NULL;
+        sd_device *d;
+        unsigned n = 0;
+
+        log_info("/* %s */", __func__);
+
+        device_sysattr_cache_enable(true);
+
+        assert_se(sd_device_enumerator_new(&e) >= 0);
+        assert_se(sd_device_enumerator_allow_uninitialized(e) >= 0);
+        FOREACH_DEVICE(e, d) {
+                const char *syspath;
+
+                assert_se(sd_device_get_syspath(d, &syspath) >= 0);
+                test_sd_device_sysattr_cache_one(syspath);
+
+                if (++n >= 32)
+                        break;
+        }
+
+        device_sysattr_cache_enable(false);
+}
+
+static void test_sd_device_sysattr_cache_coldplug_one(sd_device_enumerator *e, bool cache) {
+        static const char * const attrs[] = {
+                "vendor", "device", "model", "serial", "idVendor", "idProduct", "manufacturer", "product",
+        };
+        char buf[FORMAT_TIMESPAN_MAX];
+        DeviceSysattrCacheStats before, after;
+        sd_device *d;
+        usec_t ts;
+
+        device_sysattr_cache_enable(cache);
+        device_sysattr_cache_get_stats(&before);
+        ts = now(CLOCK_MONOTONIC);
+
+        /* Every event gets fresh device objects, and rules look at the sysattrs of all parents with ATTRS{} */
+        FOREACH_DEVICE(e, d) {
+                _cleanup_(sd_device_unrefp) sd_device *dev = NULL;
+                const char *syspath;
+                sd_device *p;
+                size_t i;
+
+                assert_se(sd_device_get_syspath(d, &syspath) >= 0);
+                if (sd_device_new_from_syspath(&dev, syspath) < 0)
+                        continue;
+
+                p = dev;
+                do
+                        for (i = 0; i < ELEMENTSOF(attrs); i++)
+                                (void) sd_device_get_sysattr_value(p, attrs[i], NULL);
+                while (sd_device_get_parent(p, &p) >= 0);
+        }
+
+        device_sysattr_cache_get_stats(&after);
+        log_info("coldplug %s sysattr cache: %s, %"PRIu64" lookups, %"PRIu64" hits",
+                 cache ? "with" : "without", format_timespan(buf, sizeof buf, now(CLOCK_MONOTONIC) - ts, 1),
+                 after.n_lookups - before.n_lookups, after.n_hits - before.n_hits);
+
+        device_sysattr_cache_enable(false);
+}
+
+static void test_sd_device_sysattr_cache_coldplug(void) {
+        _cleanup_(sd_device_enumerator_unrefp) sd_device_enumerator *e = NULL;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(sd_device_enumerator_new(&e) >= 0);
+        assert_se(sd_device_enumerator_allow_uninitialized(e) >= 0);
+
+        test_sd_device_sysattr_cache_coldplug_one(e, false);
+        test_sd_device_sysattr_cache_coldplug_one(e, true);
+}
+
 int main(int argc, char **argv) {
+        if (argc > 1 && streq(argv[1], "--threads-fresh")) {
+                test_sd_device_enumerator_threads_fresh_child();
+                return 0;
+        }
+
         test_setup_logging(LOG_INFO);
 
         test_sd_device_enumerator_devices();
         test_sd_device_enumerator_subsystems();
         test_sd_device_enumerator_filter_subsystem();
+        test_sd_device_enumerator_threads();
+        test_sd_device_enumerator_threads_fresh();
+        test_sd_device_enumerator_parent_subsystem();
+        test_sd_device_sysattr_cache();
+        test_sd_device_sysattr_cache_coldplug();
 
         return 0;
 }
@@ -11,6 +11,7 @@
 #include "hashmap.h"
 #include "list.h"
 #include "prioq.h"
+#include "timer-wheel.h"
 
 typedef enum EventSourceType {
         SOURCE_IO,
@@ -43,6 +44,7 @@ typedef enum WakeupType {
 } WakeupType;
 
 struct inode_data;
+struct uring_op;
 
 struct sd_event_source {
         WakeupType wakeup;
@@ -60,6 +62,7 @@ struct sd_event_source {
         bool pending:1;
         bool dispatching:1;
         bool floating:1;
+        bool from_pool:1;
 
         int64_t priority;
         unsigned pending_index;
@@ -79,12 +82,23 @@ struct sd_event_source {
                         uint32_t revents;
                         bool registered:1;
                         bool owned:1;
+
+                        /* The operation in the io_uring, see SD_EVENT_IO_URING */
+                        struct uring_op *uring_op;
+
+                        /* See sd_event_source_set_io_read_size() */
+                        size_t read_size;
+                        void *read_buffer;
+                        ssize_t read_result;
+                        bool read_ready:1;
                 } io;
                 struct {
                         sd_event_time_handler_t callback;
                         usec_t next, accuracy;
                         unsigned earliest_index;
                         unsigned latest_index;
+                        TimerWheelEntry earliest_entry;
+                        TimerWheelEntry latest_entry;
                 } time;
                 struct {
                         sd_event_signal_handler_t callback;
@@ -129,11 +143,35 @@ struct clock_data {
 
         Prioq *earliest;
         Prioq *latest;
+
+        /* The same when timer wheels are used instead, see SD_EVENT_TIMER_WHEEL. These only contain the sources
+         * that are enabled and not pending. */
+        TimerWheel *earliest_wheel;
+        TimerWheel *latest_wheel;
+
         usec_t next;
 
         bool needs_rearm:1;
 };
 
+/* An operation of an io source in the io_uring. Its address is the user data of the submission, hence it has to
+ * stay around until the kernel is done with it, even if the event source goes away before. */
+struct uring_op {
+        sd_event_source *source; /* NULL once orphaned */
+        int fd;                  /* The fd the operation was submitted for */
+        uint32_t events;
+
+        bool in_flight:1;
+        bool multishot:1;
+        bool read:1;
+        bool wait_readable:1;    /* A read found nothing, poll for input before reading again */
+
+        /* The read buffer of an orphaned read, the kernel might still write into it */
+        void *buffer;
+
+        LIST_FIELDS(struct uring_op, orphans);
+};
+
 struct signal_data {
         WakeupType wakeup;
 
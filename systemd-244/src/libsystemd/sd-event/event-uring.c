@@ -0,0 +1,391 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include "alloc-util.h"
+#include "event-uring.h"
+#include "fd-util.h"
+
+#if HAVE_LINUX_IO_URING_H
+
+/* Number of submission queue entries. Submissions are flushed early when the queue is full, hence this only
+ * limits how much is submitted with one syscall. */
+#define EVENT_URING_ENTRIES 256U
+
+/* The completion queue is larger, as multishot polls may complete many times per submission. Overflowing
+ * completions are not lost (IORING_FEAT_NODROP), but are slower to get at. */
+#define EVENT_URING_CQ_ENTRIES 4096U
+
+struct EventUring {
+        int fd;
+        bool multishot;
+
+        /* Both rings are in the same mapping (IORING_FEAT_SINGLE_MMAP) */
+        void *ring;
+        size_t ring_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+
+        unsigned *sq_head, *sq_tail, *sq_flags, *sq_array;
+        unsigned sq_mask, sq_entries;
+        unsigned *cq_head, *cq_tail;
+        unsigned cq_mask;
+        struct io_uring_cqe *cqes;
+
+        /* Our copy of the submission queue tail, only published to the kernel when submitting */
+        unsigned sqe_tail;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+        return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+        return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+int event_uring_new(EventUring **ret) {
+        _cleanup_(event_uring_freep) EventUring *u = NULL;
+        struct io_uring_params p = {
+                .flags = IORING_SETUP_CQSIZE,
+                .cq_entries = EVENT_URING_CQ_ENTRIES,
+        };
+
+        assert(ret);
+
+        u = new(EventUring, 1);
+        if (!u)
+                return -ENOMEM;
+
+        *u = (EventUring) {
+                .fd = -1,
+                .ring = MAP_FAILED,
+                .sqes = MAP_FAILED,
+        };
+
+        u->fd = io_uring_setup(EVENT_URING_ENTRIES, &p);
+        if (u->fd < 0)
+                return -errno;
+
+        u->fd = fd_move_above_stdio(u->fd);
+
+        /* We need timeouts when waiting (5.11), and completions must not get lost */
+        if (!FLAGS_SET(p.features, IORING_FEAT_EXT_ARG|IORING_FEAT_NODROP|IORING_FEAT_SINGLE_MMAP))
+                return -EOPNOTSUPP;
+
+#ifdef IORING_POLL_ADD_MULTI
+        /* Multishot polls came later (5.13), we find out whether they work on the first completion */
+        u->multishot = true;
+#endif
+
+        u->ring_size = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                           p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+        u->ring = mmap(NULL, u->ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+        if (u->ring == MAP_FAILED)
+                return -errno;
+
+        u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        u->sqes = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+        if (u->sqes == MAP_FAILED)
+                return -errno;
+
+        u->sq_head = (unsigned*) ((uint8_t*) u->ring + p.sq_off.head);
+        u->sq_tail = (unsigned*) ((uint8_t*) u->ring + p.sq_off.tail);
+        u->sq_flags = (unsigned*) ((uint8_t*) u->ring + p.sq_off.flags);
+        u->sq_array = (unsigned*) ((uint8_t*) u->ring + p.sq_off.array);
+        u->sq_mask = *(unsigned*) ((uint8_t*) u->ring + p.sq_off.ring_mask);
+        u->sq_entries = p.sq_entries;
+
+        u->cq_head = (unsigned*) ((uint8_t*) u->ring + p.cq_off.head);
+        u->cq_tail = (unsigned*) ((uint8_t*) u->ring + p.cq_off.tail);
+        u->cq_mask = *(unsigned*) ((uint8_t*) u->ring + p.cq_off.ring_mask);
+        u->cqes = (struct io_uring_cqe*) ((uint8_t*) u->ring + p.cq_off.cqes);
+
+        u->sqe_tail = *u->sq_tail;
+
+        *ret = TAKE_PTR(u);
+        return 0;
+}
+
+EventUring *event_uring_free(EventUring *u) {
+        if (!u)
+                return NULL;
+
+        if (u->sqes != MAP_FAILED)
+                (void) munmap(u->sqes, u->sqes_size);
+        if (u->ring != MAP_FAILED)
+                (void) munmap(u->ring, u->ring_size);
+
+        safe_close(u->fd);
+
+        return mfree(u);
+}
+
+int event_uring_get_fd(EventUring *u) {
+        assert(u);
+
+        return u->fd;
+}
+
+bool event_uring_has_multishot(EventUring *u) {
+        assert(u);
+
+        return u->multishot;
+}
+
+void event_uring_disable_multishot(EventUring *u) {
+        assert(u);
+
+        u->multishot = false;
+}
+
+static unsigned uring_sq_pending(EventUring *u) {
+        return u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static int uring_get_sqe(EventUring *u, struct io_uring_sqe **ret) {
+        unsigned idx;
+        int r;
+
+        assert(u);
+        assert(ret);
+
+        if (uring_sq_pending(u) >= u->sq_entries) {
+                /* Full, hand what we have to the kernel right away */
+                r = event_uring_submit(u);
+                if (r < 0)
+                        return r;
+
+                if (uring_sq_pending(u) >= u->sq_entries)
+                        return -EBUSY;
+        }
+
+        idx = u->sqe_tail & u->sq_mask;
+        u->sq_array[idx] = idx;
+        u->sqe_tail++;
+
+        *ret = u->sqes + idx;
+        return 0;
+}
+
+int event_uring_poll_add(EventUring *u, int fd, uint32_t events, bool multishot, uint64_t user_data) {
+        struct io_uring_sqe *sqe;
+        int r;
+
+        assert(u);
+        assert(fd >= 0);
+        assert(!multishot || u->multishot);
+
+        r = uring_get_sqe(u, &sqe);
+        if (r < 0)
+                return r;
+
+        *sqe = (struct io_uring_sqe) {
+                .opcode = IORING_OP_POLL_ADD,
+                .fd = fd,
+                .user_data = user_data,
+        };
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+        /* The kernel swaps the 16-bit halves of the mask, for compatibility with the old 16-bit field */
+        events = (events << 16) | (events >> 16);
+#endif
+        sqe->poll32_events = events;
+
+#ifdef IORING_POLL_ADD_MULTI
+        if (multishot)
+                sqe->len = IORING_POLL_ADD_MULTI;
+#endif
+
+        return 0;
+}
+
+int event_uring_read(EventUring *u, int fd, void *buf, size_t size, uint64_t user_data) {
+        struct io_uring_sqe *sqe;
+        int r;
+
+        assert(u);
+        assert(fd >= 0);
+        assert(buf);
+        assert(size > 0 && size <= UINT32_MAX);
+
+        r = uring_get_sqe(u, &sqe);
+        if (r < 0)
+                return r;
+
+        /* Read from the current position, as read() would */
+        *sqe = (struct io_uring_sqe) {
+                .opcode = IORING_OP_READ,
+                .fd = fd,
+                .off = (uint64_t) -1,
+                .addr = PTR_TO_UINT64(buf),
+                .len = size,
+                .user_data = user_data,
+        };
+
+        return 0;
+}
+
+int event_uring_cancel(EventUring *u, uint64_t user_data) {
+        struct io_uring_sqe *sqe;
+        int r;
+
+        assert(u);
+        assert(user_data != EVENT_URING_TAG_NONE);
+
+        r = uring_get_sqe(u, &sqe);
+        if (r < 0)
+                return r;
+
+        *sqe = (struct io_uring_sqe) {
+                .opcode = IORING_OP_ASYNC_CANCEL,
+                .fd = -1,
+                .addr = user_data,
+                .user_data = EVENT_URING_TAG_NONE,
+        };
+
+        return 0;
+}
+
+int event_uring_submit(EventUring *u) {
+        unsigned n;
+
+        assert(u);
+
+        __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+
+        n = uring_sq_pending(u);
+        if (n == 0)
+                return 0;
+
+        if (io_uring_enter(u->fd, n, 0, 0, NULL, 0) < 0)
+                return -errno;
+
+        return 0;
+}
+
+int event_uring_wait(EventUring *u, usec_t timeout) {
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg = {
+                .sigmask_sz = _NSIG / 8,
+        };
+        unsigned n, flags = 0;
+
+        assert(u);
+
+        /* Submits everything queued, and waits until there is at least one completion or the timeout elapsed */
+
+        __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+        n = uring_sq_pending(u);
+
+        /* Don't wait if there's something to process already */
+        if (__atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) != *u->cq_head)
+                timeout = 0;
+
+        if (timeout != 0) {
+                flags |= IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG;
+
+                if (timeout != USEC_INFINITY) {
+                        ts = (struct __kernel_timespec) {
+                                .tv_sec = timeout / USEC_PER_SEC,
+                                .tv_nsec = (timeout % USEC_PER_SEC) * NSEC_PER_USEC,
+                        };
+                        arg.ts = PTR_TO_UINT64(&ts);
+                }
+        } else if (__atomic_load_n(u->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)
+                /* Completions overflowed, let the kernel move them to the ring */
+                flags |= IORING_ENTER_GETEVENTS;
+
+        if (n == 0 && flags == 0)
+                return 0;
+
+        if (io_uring_enter(u->fd, n, timeout != 0, flags,
+                           FLAGS_SET(flags, IORING_ENTER_EXT_ARG) ? &arg : NULL, sizeof(arg)) < 0 &&
+            errno != ETIME)
+                return -errno;
+
+        return 0;
+}
+
+bool event_uring_next(EventUring *u, uint64_t *ret_user_data, int32_t *ret_res, bool *ret_more) {
+        struct io_uring_cqe *cqe;
+        unsigned head;
+
+        assert(u);
+        assert(ret_user_data);
+        assert(ret_res);
+        assert(ret_more);
+
+        head = *u->cq_head;
+        if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+                return false;
+
+        cqe = u->cqes + (head & u->cq_mask);
+        *ret_user_data = cqe->user_data;
+        *ret_res = cqe->res;
+#ifdef IORING_CQE_F_MORE
+        *ret_more = cqe->flags & IORING_CQE_F_MORE;
+#else
+        *ret_more = false;
+#endif
+
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+}
+
+#else
+
+int event_uring_new(EventUring **ret) {
+        return -EOPNOTSUPP;
+}
+
+EventUring *event_uring_free(EventUring *u) {
+        assert(!u);
+        return NULL;
+}
+
+int event_uring_get_fd(EventUring *u) {
+        assert_not_reached("io_uring support not compiled in");
+}
+
+bool event_uring_has_multishot(EventUring *u) {
+        return false;
+}
+
+void event_uring_disable_multishot(EventUring *u) {
+}
+
+int event_uring_poll_add(EventUring *u, int fd, uint32_t events, bool multishot, uint64_t user_data) {
+        return -EOPNOTSUPP;
+}
+
+int event_uring_read(EventUring *u, int fd, void *buf, size_t size, uint64_t user_data) {
+        return -EOPNOTSUPP;
+}
+
+int event_uring_cancel(EventUring *u, uint64_t user_data) {
+        return -EOPNOTSUPP;
+}
+
+int event_uring_submit(EventUring *u) {
+        return -EOPNOTSUPP;
+}
+
+int event_uring_wait(EventUring *u, usec_t timeout) {
+        return -EOPNOTSUPP;
+}
+
+bool event_uring_next(EventUring *u, uint64_t *ret_user_data, int32_t *ret_res, bool *ret_more) {
+        return false;
+}
+
+#endif
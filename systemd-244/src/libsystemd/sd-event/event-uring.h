@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "macro.h"
+#include "time-util.h"
+
+/* A minimal io_uring wrapper, just what the io_uring backend of sd-event needs. The operations only queue
+ * submissions, they are handed to the kernel with the next event_uring_wait() or when the submission queue is
+ * full. */
+
+typedef struct EventUring EventUring;
+
+/* User data of operations whose completions are of no interest */
+#define EVENT_URING_TAG_NONE UINT64_C(0)
+
+int event_uring_new(EventUring **ret);
+EventUring *event_uring_free(EventUring *u);
+DEFINE_TRIVIAL_CLEANUP_FUNC(EventUring*, event_uring_free);
+
+int event_uring_get_fd(EventUring *u);
+bool event_uring_has_multishot(EventUring *u);
+void event_uring_disable_multishot(EventUring *u);
+
+int event_uring_poll_add(EventUring *u, int fd, uint32_t events, bool multishot, uint64_t user_data);
+int event_uring_read(EventUring *u, int fd, void *buf, size_t size, uint64_t user_data);
+int event_uring_cancel(EventUring *u, uint64_t user_data);
+
+int event_uring_submit(EventUring *u);
+int event_uring_wait(EventUring *u, usec_t timeout);
+bool event_uring_next(EventUring *u, uint64_t *ret_user_data, int32_t *ret_res, bool *ret_more);
@@ -9,13 +9,16 @@
 #include "sd-id128.h"
 
 #include "alloc-util.h"
+#include "env-util.h"
 #include "event-source.h"
+#include "event-uring.h"
 #include "fd-util.h"
 #include "fs-util.h"
 #include "hashmap.h"
 #include "list.h"
 #include "macro.h"
 #include "memory-util.h"
+#include "mempool.h"
 #include "missing_syscall.h"
 #include "prioq.h"
 #include "process-util.h"
@@ -28,6 +31,13 @@
 
 #define DEFAULT_ACCURACY_USEC (250 * USEC_PER_MSEC)
 
+/* The maximum number of events we fetch from the kernel in one go. If more are ready the rest is left for the next
+ * wakeup: epoll moves the events it reported to the end of its ready list, hence no source is starved. */
+#define EPOLL_QUEUE_MAX 512U
+
+/* User data of the poll on the epoll fd in the io_uring. Never the address of a struct uring_op. */
+#define URING_TAG_EPOLL UINT64_C(1)
+
 static const char* const event_source_type_table[_SOURCE_EVENT_SOURCE_TYPE_MAX] = {
         [SOURCE_IO] = "io",
         [SOURCE_TIME_REALTIME] = "realtime",
@@ -46,6 +56,8 @@ static const char* const event_source_type_table[_SOURCE_EVENT_SOURCE_TYPE_MAX]
 
 DEFINE_PRIVATE_STRING_TABLE_LOOKUP_TO_STRING(event_source_type, int);
 
+DEFINE_MEMPOOL(event_source_pool, sd_event_source, 64);
+
 #define EVENT_SOURCE_IS_TIME(t) IN_SET((t), SOURCE_TIME_REALTIME, SOURCE_TIME_BOOTTIME, SOURCE_TIME_MONOTONIC, SOURCE_TIME_REALTIME_ALARM, SOURCE_TIME_BOOTTIME_ALARM)
 
 struct sd_event {
@@ -96,6 +108,9 @@ struct sd_event {
         bool need_process_child:1;
         bool watchdog:1;
         bool profile_delays:1;
+        bool timer_wheel:1;
+        bool uring_embedded:1;
+        bool uring_epoll_armed:1;
 
         int exit_code;
 
@@ -110,17 +125,39 @@ struct sd_event {
 
         usec_t last_run, last_log;
         unsigned delays[sizeof(usec_t) * 8];
+
+        /* Reused by each sd_event_wait(), grows up to EPOLL_QUEUE_MAX entries */
+        struct epoll_event *event_queue;
+        size_t event_queue_allocated;
+
+        /* Statistics, see sd_event_get_wakeups() and sd_event_get_dispatch_time() */
+        uint64_t n_wakeups;
+        uint64_t n_wakeup_events;
+        uint64_t n_wakeups_full;
+        usec_t dispatch_usec;
+
+        /* The io_uring, if SD_EVENT_IO_URING is set. IO sources are then polled through the ring, and so is the
+         * epoll fd, which still carries all other sources. Unless the epoll fd is handed out via
+         * sd_event_get_fd(), in which case the ring fd is added to it instead. */
+        EventUring *uring;
+        LIST_HEAD(struct uring_op, uring_orphans);
 };
 
 static thread_local sd_event *default_event = NULL;
 
 static void source_disconnect(sd_event_source *s);
 static void event_gc_inode_data(sd_event *e, struct inode_data *d);
+static void event_drain_uring(sd_event *e);
+static int source_set_pending(sd_event_source *s, bool b);
 
 static sd_event *event_resolve(sd_event *e) {
         return e == SD_EVENT_DEFAULT ? default_event : e;
 }
 
+static usec_t pending_time(const sd_event_source *s) {
+        return EVENT_SOURCE_IS_TIME(s->type) ? s->time.next : USEC_INFINITY;
+}
+
 static int pending_prioq_compare(const void *a, const void *b) {
         const sd_event_source *x = a, *y = b;
         int r;
@@ -140,7 +177,13 @@ static int pending_prioq_compare(const void *a, const void *b) {
                 return r;
 
         /* Older entries first */
-        return CMP(x->pending_iteration, y->pending_iteration);
+        r = CMP(x->pending_iteration, y->pending_iteration);
+        if (r != 0)
+                return r;
+
+        /* Of the timers that elapsed in the same iteration, the earlier ones first, so that they are dispatched in
+         * the order they elapsed in, whichever way the timers are kept */
+        return CMP(pending_time(x), pending_time(y));
 }
 
 static int prepare_prioq_compare(const void *a, const void *b) {
@@ -238,6 +281,8 @@ static void free_clock_data(struct clock_data *d) {
         safe_close(d->fd);
         prioq_free(d->earliest);
         prioq_free(d->latest);
+        timer_wheel_free(d->earliest_wheel);
+        timer_wheel_free(d->latest_wheel);
 }
 
 static sd_event *event_free(sd_event *e) {
@@ -256,6 +301,9 @@ static sd_event *event_free(sd_event *e) {
         if (e->default_event_ptr)
                 *(e->default_event_ptr) = NULL;
 
+        event_drain_uring(e);
+        event_uring_free(e->uring);
+
         safe_close(e->epoll_fd);
         safe_close(e->watchdog_fd);
 
@@ -277,6 +325,8 @@ static sd_event *event_free(sd_event *e) {
         hashmap_free(e->child_sources);
         set_free(e->post_sources);
 
+        free(e->event_queue);
+
         return mfree(e);
 }
 
@@ -330,6 +380,19 @@ _public_ int sd_event_new(sd_event** ret) {
                 e->profile_delays = true;
         }
 
+        if (getenv_bool_secure("SD_EVENT_TIMER_WHEEL") > 0) {
+                log_debug("Event loop uses timer wheels for time event sources.");
+                e->timer_wheel = true;
+        }
+
+        if (getenv_bool_secure("SD_EVENT_IO_URING") > 0) {
+                r = event_uring_new(&e->uring);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to set up io_uring, falling back to epoll: %m");
+                else
+                        log_debug("Event loop uses io_uring for io event sources.");
+        }
+
         *ret = e;
         return 0;
 
@@ -355,6 +418,147 @@ static bool event_pid_changed(sd_event *e) {
         return e->original_pid != getpid_cached();
 }
 
+static uint32_t source_io_events(sd_event_source *s, uint32_t events) {
+        /* Sources that read for the caller only wait for input */
+        if (s->io.read_size > 0)
+                return EPOLLIN | (events & EPOLLET);
+
+        return events;
+}
+
+static bool source_io_uring_multishot(sd_event_source *s, int enabled, uint32_t events) {
+        return s->io.read_size == 0 && (events & EPOLLET) && enabled != SD_EVENT_ONESHOT &&
+                event_uring_has_multishot(s->event->uring);
+}
+
+static int source_io_uring_arm(sd_event_source *s, int enabled, uint32_t events) {
+        struct uring_op *op;
+        int r;
+
+        assert(s);
+        assert(s->event->uring);
+
+        /* Don't read more before the data we have is dispatched */
+        if (s->io.read_ready)
+                return 0;
+
+        op = s->io.uring_op;
+        if (!op) {
+                op = new0(struct uring_op, 1);
+                if (!op)
+                        return -ENOMEM;
+
+                op->source = s;
+                s->io.uring_op = op;
+        }
+
+        assert(!op->in_flight);
+
+        if (s->io.read_size > 0 && op->wait_readable) {
+                /* A read of a non-blocking fd completes with -EAGAIN right away, wait until there is
+                 * something to read, instead of reading over and over again */
+                op->read = false;
+                op->multishot = false;
+
+                r = event_uring_poll_add(s->event->uring, s->io.fd, EPOLLIN, false, PTR_TO_UINT64(op));
+        } else if (s->io.read_size > 0) {
+                if (!s->io.read_buffer) {
+                        s->io.read_buffer = malloc(s->io.read_size);
+                        if (!s->io.read_buffer)
+                                return -ENOMEM;
+                }
+
+                op->read = true;
+                op->multishot = false;
+
+                r = event_uring_read(s->event->uring, s->io.fd, s->io.read_buffer, s->io.read_size, PTR_TO_UINT64(op));
+        } else {
+                /* Level-triggered sources are polled once, and polled again after each dispatch, which gives the
+                 * same semantics as epoll. Edge-triggered ones stay armed. */
+                op->read = false;
+                op->multishot = source_io_uring_multishot(s, enabled, events);
+
+                r = event_uring_poll_add(s->event->uring, s->io.fd, events & ~(EPOLLET|EPOLLONESHOT),
+                                         op->multishot, PTR_TO_UINT64(op));
+        }
+        if (r < 0)
+                return r;
+
+        op->fd = s->io.fd;
+        op->events = events;
+        op->in_flight = true;
+
+        return 0;
+}
+
+static void source_io_uring_disarm(sd_event_source *s) {
+        struct uring_op *op;
+        int r;
+
+        assert(s);
+        assert(s->event->uring);
+
+        op = s->io.uring_op;
+        if (!op || !op->in_flight)
+                return;
+
+        /* The kernel might still complete the operation, and write into the read buffer. Hence hand both over to
+         * the list of orphans, they are freed with the last completion. */
+        r = event_uring_cancel(s->event->uring, PTR_TO_UINT64(op));
+        if (r < 0)
+                log_debug_errno(r, "Failed to cancel io_uring operation of source %s, ignoring: %m",
+                                strna(s->description));
+
+        op->source = NULL;
+        if (op->read)
+                op->buffer = TAKE_PTR(s->io.read_buffer);
+
+        LIST_PREPEND(orphans, s->event->uring_orphans, op);
+        s->io.uring_op = NULL;
+}
+
+static int source_io_uring_register(sd_event_source *s, int enabled, uint32_t events) {
+        struct uring_op *op;
+        int r;
+
+        assert(s);
+
+        op = s->io.uring_op;
+        if (op && op->in_flight) {
+                /* Nothing changes for what is in flight already, whether the source is oneshot only matters when
+                 * it completes. If the fd changed, the operation for the old one needs to be cancelled though. */
+                if (!op->read && s->io.read_size == 0 && op->fd == s->io.fd && op->events == events &&
+                    op->multishot == source_io_uring_multishot(s, enabled, events))
+                        return 0;
+
+                source_io_uring_disarm(s);
+        }
+
+        r = source_io_uring_arm(s, enabled, events);
+        if (r < 0)
+                return r;
+
+        /* The data read before the source was disabled is still there, don't lose it */
+        if (s->io.read_ready) {
+                s->io.revents = EPOLLIN;
+                return source_set_pending(s, true);
+        }
+
+        return 0;
+}
+
+static int source_io_uring_rearm(sd_event_source *s) {
+        assert(s);
+
+        if (!s->event->uring || !s->io.registered || s->enabled != SD_EVENT_ON)
+                return 0;
+
+        if (s->io.uring_op && s->io.uring_op->in_flight)
+                return 0;
+
+        return source_io_uring_arm(s, s->enabled, source_io_events(s, s->io.events));
+}
+
 static void source_io_unregister(sd_event_source *s) {
         int r;
 
@@ -367,6 +571,12 @@ static void source_io_unregister(sd_event_source *s) {
         if (!s->io.registered)
                 return;
 
+        if (s->event->uring) {
+                source_io_uring_disarm(s);
+                s->io.registered = false;
+                return;
+        }
+
         r = epoll_ctl(s->event->epoll_fd, EPOLL_CTL_DEL, s->io.fd, NULL);
         if (r < 0)
                 log_debug_errno(errno, "Failed to remove source %s (type %s) from epoll: %m",
@@ -387,6 +597,17 @@ static int source_io_register(
         assert(s->type == SOURCE_IO);
         assert(enabled != SD_EVENT_OFF);
 
+        events = source_io_events(s, events);
+
+        if (s->event->uring) {
+                r = source_io_uring_register(s, enabled, events);
+                if (r < 0)
+                        return r;
+
+                s->io.registered = true;
+                return 0;
+        }
+
         ev = (struct epoll_event) {
                 .events = events | (enabled == SD_EVENT_ONESHOT ? EPOLLONESHOT : 0),
                 .data.ptr = s,
@@ -477,6 +698,53 @@ static struct clock_data* event_get_clock_data(sd_event *e, EventSourceType t) {
         }
 }
 
+static void event_source_time_reshuffle(sd_event_source *s) {
+        struct clock_data *d;
+
+        assert(s);
+        assert(EVENT_SOURCE_IS_TIME(s->type));
+
+        /* Call whenever the time, accuracy, enabled or pending state of a time event source changed */
+
+        d = event_get_clock_data(s->event, s->type);
+        assert(d);
+
+        if (s->event->timer_wheel) {
+                if (s->enabled != SD_EVENT_OFF && !s->pending) {
+                        timer_wheel_put(d->earliest_wheel, &s->time.earliest_entry, s->time.next);
+                        timer_wheel_put(d->latest_wheel, &s->time.latest_entry, time_event_source_latest(s));
+                } else {
+                        timer_wheel_remove(d->earliest_wheel, &s->time.earliest_entry);
+                        timer_wheel_remove(d->latest_wheel, &s->time.latest_entry);
+                }
+        } else {
+                prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
+                prioq_reshuffle(d->latest, s, &s->time.latest_index);
+        }
+
+        d->needs_rearm = true;
+}
+
+static sd_event_source* event_peek_earliest(sd_event *e, struct clock_data *d) {
+        TimerWheelEntry *w;
+
+        if (!e->timer_wheel)
+                return prioq_peek(d->earliest);
+
+        w = timer_wheel_peek(d->earliest_wheel);
+        return w ? container_of(w, sd_event_source, time.earliest_entry) : NULL;
+}
+
+static sd_event_source* event_peek_latest(sd_event *e, struct clock_data *d) {
+        TimerWheelEntry *w;
+
+        if (!e->timer_wheel)
+                return prioq_peek(d->latest);
+
+        w = timer_wheel_peek(d->latest_wheel);
+        return w ? container_of(w, sd_event_source, time.latest_entry) : NULL;
+}
+
 static void event_free_signal_data(sd_event *e, struct signal_data *d) {
         assert(e);
 
@@ -684,6 +952,10 @@ static void source_disconnect(sd_event_source *s) {
 
                 prioq_remove(d->earliest, s, &s->time.earliest_index);
                 prioq_remove(d->latest, s, &s->time.latest_index);
+                if (d->earliest_wheel) {
+                        timer_wheel_remove(d->earliest_wheel, &s->time.earliest_entry);
+                        timer_wheel_remove(d->latest_wheel, &s->time.latest_entry);
+                }
                 d->needs_rearm = true;
                 break;
         }
@@ -787,14 +1059,25 @@ static void source_free(sd_event_source *s) {
 
         source_disconnect(s);
 
-        if (s->type == SOURCE_IO && s->io.owned)
-                s->io.fd = safe_close(s->io.fd);
+        if (s->type == SOURCE_IO) {
+                if (s->io.owned)
+                        s->io.fd = safe_close(s->io.fd);
+
+                /* Anything still in flight was orphaned when disconnecting */
+                assert(!s->io.uring_op || !s->io.uring_op->in_flight);
+                free(s->io.uring_op);
+                free(s->io.read_buffer);
+        }
 
         if (s->destroy_callback)
                 s->destroy_callback(s->userdata);
 
         free(s->description);
-        free(s);
+
+        if (s->from_pool)
+                mempool_free_tile(&event_source_pool, s);
+        else
+                free(s);
 }
 DEFINE_TRIVIAL_CLEANUP_FUNC(sd_event_source*, source_free);
 
@@ -820,16 +1103,8 @@ static int source_set_pending(sd_event_source *s, bool b) {
         } else
                 assert_se(prioq_remove(s->event->pending, s, &s->pending_index));
 
-        if (EVENT_SOURCE_IS_TIME(s->type)) {
-                struct clock_data *d;
-
-                d = event_get_clock_data(s->event, s->type);
-                assert(d);
-
-                prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
-                prioq_reshuffle(d->latest, s, &s->time.latest_index);
-                d->needs_rearm = true;
-        }
+        if (EVENT_SOURCE_IS_TIME(s->type))
+                event_source_time_reshuffle(s);
 
         if (s->type == SOURCE_SIGNAL && !b) {
                 struct signal_data *d;
@@ -857,10 +1132,14 @@ static int source_set_pending(sd_event_source *s, bool b) {
 
 static sd_event_source *source_new(sd_event *e, bool floating, EventSourceType type) {
         sd_event_source *s;
+        bool up;
 
         assert(e);
 
-        s = new(sd_event_source, 1);
+        /* Event sources come and go all the time, take them from a pool if we may */
+        up = mempool_enabled();
+
+        s = up ? mempool_alloc_tile(&event_source_pool) : new(sd_event_source, 1);
         if (!s)
                 return NULL;
 
@@ -868,6 +1147,7 @@ static sd_event_source *source_new(sd_event *e, bool floating, EventSourceType t
                 .n_ref = 1,
                 .event = e,
                 .floating = floating,
+                .from_pool = up,
                 .type = type,
                 .pending_index = PRIOQ_IDX_NULL,
                 .prepare_index = PRIOQ_IDX_NULL,
@@ -1016,13 +1296,23 @@ _public_ int sd_event_add_time(
         d = event_get_clock_data(e, type);
         assert(d);
 
-        r = prioq_ensure_allocated(&d->earliest, earliest_time_prioq_compare);
-        if (r < 0)
-                return r;
+        if (e->timer_wheel) {
+                r = timer_wheel_ensure_allocated(&d->earliest_wheel);
+                if (r < 0)
+                        return r;
 
-        r = prioq_ensure_allocated(&d->latest, latest_time_prioq_compare);
-        if (r < 0)
-                return r;
+                r = timer_wheel_ensure_allocated(&d->latest_wheel);
+                if (r < 0)
+                        return r;
+        } else {
+                r = prioq_ensure_allocated(&d->earliest, earliest_time_prioq_compare);
+                if (r < 0)
+                        return r;
+
+                r = prioq_ensure_allocated(&d->latest, latest_time_prioq_compare);
+                if (r < 0)
+                        return r;
+        }
 
         if (d->fd < 0) {
                 r = event_setup_timer_fd(e, d, clock);
@@ -1041,15 +1331,20 @@ _public_ int sd_event_add_time(
         s->userdata = userdata;
         s->enabled = SD_EVENT_ONESHOT;
 
-        d->needs_rearm = true;
+        if (e->timer_wheel)
+                /* Nothing to allocate here */
+                event_source_time_reshuffle(s);
+        else {
+                d->needs_rearm = true;
 
-        r = prioq_put(d->earliest, s, &s->time.earliest_index);
-        if (r < 0)
-                return r;
+                r = prioq_put(d->earliest, s, &s->time.earliest_index);
+                if (r < 0)
+                        return r;
 
-        r = prioq_put(d->latest, s, &s->time.latest_index);
-        if (r < 0)
-                return r;
+                r = prioq_put(d->latest, s, &s->time.latest_index);
+                if (r < 0)
+                        return r;
+        }
 
         if (ret)
                 *ret = s;
@@ -1765,7 +2060,9 @@ _public_ int sd_event_source_set_io_fd(sd_event_source *s, int fd) {
                         return r;
                 }
 
-                epoll_ctl(s->event->epoll_fd, EPOLL_CTL_DEL, saved_fd, NULL);
+                /* With io_uring the old operation was cancelled by registering the new fd */
+                if (!s->event->uring)
+                        epoll_ctl(s->event->epoll_fd, EPOLL_CTL_DEL, saved_fd, NULL);
         }
 
         return 0;
@@ -1835,6 +2132,65 @@ _public_ int sd_event_source_get_io_revents(sd_event_source *s, uint32_t* revent
         return 0;
 }
 
+_public_ int sd_event_source_get_io_read_size(sd_event_source *s, size_t *ret) {
+        assert_return(s, -EINVAL);
+        assert_return(ret, -EINVAL);
+        assert_return(s->type == SOURCE_IO, -EDOM);
+        assert_return(!event_pid_changed(s->event), -ECHILD);
+
+        *ret = s->io.read_size;
+        return 0;
+}
+
+_public_ int sd_event_source_set_io_read_size(sd_event_source *s, size_t size) {
+        int r;
+
+        assert_return(s, -EINVAL);
+        assert_return(s->type == SOURCE_IO, -EDOM);
+        assert_return(size <= INT32_MAX, -ERANGE);
+        assert_return(!event_pid_changed(s->event), -ECHILD);
+
+        if (s->io.read_size == size)
+                return 0;
+
+        /* Don't drop data that was read already */
+        if (s->io.read_ready)
+                return -EBUSY;
+
+        if (s->event->uring)
+                source_io_uring_disarm(s);
+
+        s->io.read_buffer = mfree(s->io.read_buffer);
+        s->io.read_size = size;
+
+        if (s->enabled != SD_EVENT_OFF) {
+                r = source_io_register(s, s->enabled, s->io.events);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+_public_ int sd_event_source_get_io_read_data(sd_event_source *s, const void **ret_data, size_t *ret_size) {
+        assert_return(s, -EINVAL);
+        assert_return(s->type == SOURCE_IO, -EDOM);
+        assert_return(s->io.read_size > 0, -ENOTTY);
+        assert_return(!event_pid_changed(s->event), -ECHILD);
+
+        if (!s->io.read_ready)
+                return -ENODATA;
+        if (s->io.read_result < 0)
+                return (int) s->io.read_result;
+
+        if (ret_data)
+                *ret_data = s->io.read_buffer;
+        if (ret_size)
+                *ret_size = (size_t) s->io.read_result;
+
+        return 0;
+}
+
 _public_ int sd_event_source_get_signal(sd_event_source *s) {
         assert_return(s, -EINVAL);
         assert_return(s->type == SOURCE_SIGNAL, -EDOM);
@@ -2001,18 +2357,10 @@ _public_ int sd_event_source_set_enabled(sd_event_source *s, int m) {
                 case SOURCE_TIME_BOOTTIME:
                 case SOURCE_TIME_MONOTONIC:
                 case SOURCE_TIME_REALTIME_ALARM:
-                case SOURCE_TIME_BOOTTIME_ALARM: {
-                        struct clock_data *d;
-
+                case SOURCE_TIME_BOOTTIME_ALARM:
                         s->enabled = m;
-                        d = event_get_clock_data(s->event, s->type);
-                        assert(d);
-
-                        prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
-                        prioq_reshuffle(d->latest, s, &s->time.latest_index);
-                        d->needs_rearm = true;
+                        event_source_time_reshuffle(s);
                         break;
-                }
 
                 case SOURCE_SIGNAL:
                         s->enabled = m;
@@ -2067,18 +2415,10 @@ _public_ int sd_event_source_set_enabled(sd_event_source *s, int m) {
                 case SOURCE_TIME_BOOTTIME:
                 case SOURCE_TIME_MONOTONIC:
                 case SOURCE_TIME_REALTIME_ALARM:
-                case SOURCE_TIME_BOOTTIME_ALARM: {
-                        struct clock_data *d;
-
+                case SOURCE_TIME_BOOTTIME_ALARM:
                         s->enabled = m;
-                        d = event_get_clock_data(s->event, s->type);
-                        assert(d);
-
-                        prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
-                        prioq_reshuffle(d->latest, s, &s->time.latest_index);
-                        d->needs_rearm = true;
+                        event_source_time_reshuffle(s);
                         break;
-                }
 
                 case SOURCE_SIGNAL:
 
@@ -2146,7 +2486,6 @@ _public_ int sd_event_source_get_time(sd_event_source *s, uint64_t *usec) {
 }
 
 _public_ int sd_event_source_set_time(sd_event_source *s, uint64_t usec) {
-        struct clock_data *d;
         int r;
 
         assert_return(s, -EINVAL);
@@ -2160,13 +2499,7 @@ _public_ int sd_event_source_set_time(sd_event_source *s, uint64_t usec) {
 
         s->time.next = usec;
 
-        d = event_get_clock_data(s->event, s->type);
-        assert(d);
-
-        prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
-        prioq_reshuffle(d->latest, s, &s->time.latest_index);
-        d->needs_rearm = true;
-
+        event_source_time_reshuffle(s);
         return 0;
 }
 
@@ -2181,7 +2514,6 @@ _public_ int sd_event_source_get_time_accuracy(sd_event_source *s, uint64_t *use
 }
 
 _public_ int sd_event_source_set_time_accuracy(sd_event_source *s, uint64_t usec) {
-        struct clock_data *d;
         int r;
 
         assert_return(s, -EINVAL);
@@ -2199,12 +2531,7 @@ _public_ int sd_event_source_set_time_accuracy(sd_event_source *s, uint64_t usec
 
         s->time.accuracy = usec;
 
-        d = event_get_clock_data(s->event, s->type);
-        assert(d);
-
-        prioq_reshuffle(d->latest, s, &s->time.latest_index);
-        d->needs_rearm = true;
-
+        event_source_time_reshuffle(s);
         return 0;
 }
 
@@ -2384,7 +2711,7 @@ static int event_arm_timer(
         else
                 d->needs_rearm = false;
 
-        a = prioq_peek(d->earliest);
+        a = event_peek_earliest(e, d);
         if (!a || a->enabled == SD_EVENT_OFF || a->time.next == USEC_INFINITY) {
 
                 if (d->fd < 0)
@@ -2402,7 +2729,7 @@ static int event_arm_timer(
                 return 0;
         }
 
-        b = prioq_peek(d->latest);
+        b = event_peek_latest(e, d);
         assert_se(b && b->enabled != SD_EVENT_OFF);
 
         t = sleep_between(e, a->time.next, time_event_source_latest(b));
@@ -2445,6 +2772,205 @@ static int process_io(sd_event *e, sd_event_source *s, uint32_t revents) {
         return source_set_pending(s, true);
 }
 
+static int process_uring_op(sd_event *e, struct uring_op *op, int32_t res) {
+        sd_event_source *s = op->source;
+
+        assert(e);
+        assert(s);
+
+        if (op->read) {
+                if (res == -EAGAIN) {
+                        op->wait_readable = true;
+                        return source_io_uring_rearm(s);
+                }
+
+                s->io.read_result = res;
+                s->io.read_ready = true;
+
+                return process_io(e, s, EPOLLIN);
+        }
+
+        if (op->wait_readable) {
+                op->wait_readable = false;
+
+                /* Readable, or hung up, let the read tell which */
+                if (res >= 0)
+                        return source_io_uring_rearm(s);
+
+                s->io.read_result = res;
+                s->io.read_ready = true;
+
+                return process_io(e, s, EPOLLIN);
+        }
+
+        if (res == -EINVAL && op->multishot) {
+                log_debug("Kernel does not support multishot polls in io_uring, polling again each time.");
+                event_uring_disable_multishot(e->uring);
+
+                return source_io_uring_rearm(s);
+        }
+
+        if (res < 0) {
+                /* Not polled again, as this will most likely fail the same way */
+                log_debug_errno(res, "Failed to poll source %s (type %s) with io_uring: %m",
+                                strna(s->description), event_source_type_to_string(s->type));
+
+                return process_io(e, s, EPOLLERR);
+        }
+
+        /* Single-shot polls are submitted again after dispatching, see source_dispatch(). Doing that right away
+         * would just make a source that stays ready complete over and over again. */
+        return process_io(e, s, (uint32_t) res);
+}
+
+static int process_uring(sd_event *e, bool *ret_epoll) {
+        uint64_t tag;
+        int32_t res;
+        bool more, epoll = false;
+        int r;
+
+        assert(e);
+        assert(e->uring);
+
+        while (event_uring_next(e->uring, &tag, &res, &more)) {
+                struct uring_op *op;
+
+                e->n_wakeup_events++;
+
+                if (tag == EVENT_URING_TAG_NONE)
+                        continue;
+
+                if (tag == URING_TAG_EPOLL) {
+                        e->uring_epoll_armed = false;
+                        epoll = epoll || res >= 0;
+                        continue;
+                }
+
+                op = UINT64_TO_PTR(tag);
+                if (!more)
+                        op->in_flight = false;
+
+                if (!op->source) {
+                        /* The source is gone, free the operation once the kernel is done with it */
+                        if (!op->in_flight) {
+                                LIST_REMOVE(orphans, e->uring_orphans, op);
+                                free(op->buffer);
+                                free(op);
+                        }
+
+                        continue;
+                }
+
+                r = process_uring_op(e, op, res);
+                if (r < 0)
+                        return r;
+        }
+
+        if (ret_epoll)
+                *ret_epoll = epoll;
+
+        return 0;
+}
+
+static int event_wait_uring(sd_event *e, struct epoll_event *ev_queue, size_t ev_queue_max, usec_t timeout) {
+        bool epoll;
+        int r, m = 0;
+
+        assert(e);
+        assert(e->uring);
+        assert(!e->uring_embedded);
+
+        /* Everything that is not an io source is still in the epoll fd, which is polled through the ring, too */
+        if (!e->uring_epoll_armed) {
+                r = event_uring_poll_add(e->uring, e->epoll_fd, EPOLLIN, false, URING_TAG_EPOLL);
+                if (r < 0)
+                        return r;
+
+                e->uring_epoll_armed = true;
+        }
+
+        r = event_uring_wait(e->uring, timeout);
+        if (r < 0)
+                return r;
+
+        r = process_uring(e, &epoll);
+        if (r < 0)
+                return r;
+
+        if (epoll) {
+                m = epoll_wait(e->epoll_fd, ev_queue, ev_queue_max, 0);
+                if (m < 0)
+                        return -errno;
+        }
+
+        return m;
+}
+
+static int event_embed_uring(sd_event *e) {
+        struct epoll_event ev;
+        int r;
+
+        assert(e);
+
+        if (!e->uring || e->uring_embedded)
+                return 0;
+
+        /* Whoever polls the epoll fd needs to be woken up for completions in the ring, too. Hence add the ring fd
+         * to it, and stop polling the epoll fd through the ring. */
+
+        ev = (struct epoll_event) {
+                .events = EPOLLIN,
+                .data.ptr = e->uring,
+        };
+
+        if (epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, event_uring_get_fd(e->uring), &ev) < 0)
+                return -errno;
+
+        if (e->uring_epoll_armed) {
+                r = event_uring_cancel(e->uring, URING_TAG_EPOLL);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to cancel poll on epoll fd, ignoring: %m");
+        }
+
+        e->uring_embedded = true;
+        return 0;
+}
+
+static void event_drain_uring(sd_event *e) {
+        struct uring_op *op;
+
+        assert(e);
+
+        if (!e->uring || event_pid_changed(e))
+                goto finish;
+
+        /* Orphaned reads might still write into their buffers, hence wait until the kernel let go of everything */
+        LIST_FOREACH(orphans, op, e->uring_orphans)
+                (void) event_uring_cancel(e->uring, PTR_TO_UINT64(op));
+
+        while (e->uring_orphans) {
+                int r;
+
+                r = event_uring_wait(e->uring, USEC_INFINITY);
+                if (r == -EINTR)
+                        continue;
+                if (r < 0) {
+                        /* Rather leak the buffers than have the kernel write into freed memory */
+                        log_debug_errno(r, "Failed to wait for io_uring operations to finish, leaking their buffers: %m");
+                        return;
+                }
+
+                (void) process_uring(e, NULL);
+        }
+
+finish:
+        while ((op = e->uring_orphans)) {
+                LIST_REMOVE(orphans, e->uring_orphans, op);
+                free(op->buffer);
+                free(op);
+        }
+}
+
 static int flush_timer(sd_event *e, int fd, uint32_t events, usec_t *next) {
         uint64_t x;
         ssize_t ss;
@@ -2483,7 +3009,7 @@ static int process_timer(
         assert(d);
 
         for (;;) {
-                s = prioq_peek(d->earliest);
+                s = event_peek_earliest(e, d);
                 if (!s ||
                     s->time.next > n ||
                     s->enabled == SD_EVENT_OFF ||
@@ -2494,9 +3020,13 @@ static int process_timer(
                 if (r < 0)
                         return r;
 
-                prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
-                prioq_reshuffle(d->latest, s, &s->time.latest_index);
-                d->needs_rearm = true;
+                event_source_time_reshuffle(s);
+        }
+
+        /* Everything up to now is out of the wheels, move them on */
+        if (e->timer_wheel) {
+                timer_wheel_advance(d->earliest_wheel, n);
+                timer_wheel_advance(d->latest_wheel, n);
         }
 
         return 0;
@@ -2782,6 +3312,40 @@ static int process_inotify(sd_event *e) {
         return done;
 }
 
+static int source_io_read(sd_event_source *s) {
+        ssize_t n;
+
+        assert(s);
+        assert(s->type == SOURCE_IO);
+
+        /* Returns > 0 if the source shall be dispatched, 0 if there's nothing to read after all */
+
+        if (s->io.read_size == 0 || s->io.read_ready)
+                return 1;
+
+        /* With epoll the data is read right before dispatching, so that callers see the same as with io_uring */
+
+        if (!s->io.read_buffer) {
+                s->io.read_buffer = malloc(s->io.read_size);
+                if (!s->io.read_buffer)
+                        return -ENOMEM;
+        }
+
+        n = read(s->io.fd, s->io.read_buffer, s->io.read_size);
+        if (n < 0) {
+                if (IN_SET(errno, EAGAIN, EINTR))
+                        return 0;
+
+                n = -errno;
+        }
+
+        s->io.read_result = n;
+        s->io.read_ready = true;
+        s->io.revents = EPOLLIN;
+
+        return 1;
+}
+
 static int source_dispatch(sd_event_source *s) {
         EventSourceType saved_type;
         int r = 0;
@@ -2827,7 +3391,11 @@ static int source_dispatch(sd_event_source *s) {
         switch (s->type) {
 
         case SOURCE_IO:
-                r = s->io.callback(s, s->io.fd, s->io.revents, s->userdata);
+                r = source_io_read(s);
+                if (r > 0)
+                        r = s->io.callback(s, s->io.fd, s->io.revents, s->userdata);
+
+                s->io.read_ready = false;
                 break;
 
         case SOURCE_TIME_REALTIME:
@@ -2906,6 +3474,13 @@ static int source_dispatch(sd_event_source *s) {
                 source_free(s);
         else if (r < 0)
                 sd_event_source_set_enabled(s, SD_EVENT_OFF);
+        else if (s->type == SOURCE_IO) {
+                /* With io_uring, poll or read again now that the source was dispatched. Like with epoll, a
+                 * level-triggered source that is still ready hence is reported again in the next iteration. */
+                r = source_io_uring_rearm(s);
+                if (r < 0)
+                        return r;
+        }
 
         return 1;
 }
@@ -3085,6 +3660,13 @@ _public_ int sd_event_prepare(sd_event *e) {
 
         event_close_inode_data_fds(e);
 
+        /* When somebody else polls our fd, this is the last chance to hand the queued operations to the kernel */
+        if (e->uring_embedded) {
+                r = event_uring_submit(e->uring);
+                if (r < 0)
+                        return r;
+        }
+
         if (event_next_pending(e) || e->need_process_child)
                 goto pending;
 
@@ -3103,7 +3685,7 @@ pending:
 
 _public_ int sd_event_wait(sd_event *e, uint64_t timeout) {
         struct epoll_event *ev_queue;
-        unsigned ev_queue_max;
+        size_t ev_queue_max;
         int r, m, i;
 
         assert_return(e, -EINVAL);
@@ -3117,31 +3699,56 @@ _public_ int sd_event_wait(sd_event *e, uint64_t timeout) {
                 return 1;
         }
 
-        ev_queue_max = MAX(e->n_sources, 1u);
-        ev_queue = newa(struct epoll_event, ev_queue_max);
+        ev_queue_max = CLAMP(e->n_sources, 1U, EPOLL_QUEUE_MAX);
+        if (!GREEDY_REALLOC(e->event_queue, e->event_queue_allocated, ev_queue_max))
+                return -ENOMEM;
+
+        /* Use all the space we got anyway */
+        ev_queue_max = MIN(e->event_queue_allocated, EPOLL_QUEUE_MAX);
+        ev_queue = e->event_queue;
 
         /* If we still have inotify data buffered, then query the other fds, but don't wait on it */
         if (e->inotify_data_buffered)
                 timeout = 0;
 
-        m = epoll_wait(e->epoll_fd, ev_queue, ev_queue_max,
-                       timeout == (uint64_t) -1 ? -1 : (int) DIV_ROUND_UP(timeout, USEC_PER_MSEC));
+        if (e->uring && !e->uring_embedded)
+                m = event_wait_uring(e, ev_queue, ev_queue_max, timeout);
+        else {
+                if (e->uring) {
+                        /* Whatever was queued in the ring needs to be in the kernel before we go to sleep */
+                        r = event_uring_submit(e->uring);
+                        if (r < 0)
+                                goto finish;
+                }
+
+                m = epoll_wait(e->epoll_fd, ev_queue, ev_queue_max,
+                               timeout == (uint64_t) -1 ? -1 : (int) DIV_ROUND_UP(timeout, USEC_PER_MSEC));
+                if (m < 0)
+                        m = -errno;
+        }
         if (m < 0) {
-                if (errno == EINTR) {
+                if (m == -EINTR) {
                         e->state = SD_EVENT_PENDING;
                         return 1;
                 }
 
-                r = -errno;
+                r = m;
                 goto finish;
         }
 
         triple_timestamp_get(&e->timestamp);
 
+        e->n_wakeups++;
+        e->n_wakeup_events += m;
+        if ((size_t) m >= ev_queue_max)
+                e->n_wakeups_full++;
+
         for (i = 0; i < m; i++) {
 
                 if (ev_queue[i].data.ptr == INT_TO_PTR(SOURCE_WATCHDOG))
                         r = flush_timer(e, e->watchdog_fd, ev_queue[i].events, NULL);
+                else if (e->uring && ev_queue[i].data.ptr == e->uring)
+                        r = process_uring(e, NULL);
                 else {
                         WakeupType *t = ev_queue[i].data.ptr;
 
@@ -3237,10 +3844,13 @@ _public_ int sd_event_dispatch(sd_event *e) {
         p = event_next_pending(e);
         if (p) {
                 _cleanup_(sd_event_unrefp) sd_event *ref = NULL;
+                usec_t start;
 
                 ref = sd_event_ref(e);
                 e->state = SD_EVENT_RUNNING;
+                start = now(CLOCK_MONOTONIC);
                 r = source_dispatch(p);
+                e->dispatch_usec += now(CLOCK_MONOTONIC) - start;
                 e->state = SD_EVENT_INITIAL;
                 return r;
         }
@@ -3329,11 +3939,16 @@ _public_ int sd_event_loop(sd_event *e) {
 }
 
 _public_ int sd_event_get_fd(sd_event *e) {
+        int r;
 
         assert_return(e, -EINVAL);
         assert_return(e = event_resolve(e), -ENOPKG);
         assert_return(!event_pid_changed(e), -ECHILD);
 
+        r = event_embed_uring(e);
+        if (r < 0)
+                return r;
+
         return e->epoll_fd;
 }
 
@@ -3506,6 +4121,31 @@ _public_ int sd_event_get_iteration(sd_event *e, uint64_t *ret) {
         return 0;
 }
 
+_public_ int sd_event_get_wakeups(sd_event *e, uint64_t *ret_wakeups, uint64_t *ret_events, uint64_t *ret_full) {
+        assert_return(e, -EINVAL);
+        assert_return(e = event_resolve(e), -ENOPKG);
+        assert_return(!event_pid_changed(e), -ECHILD);
+
+        if (ret_wakeups)
+                *ret_wakeups = e->n_wakeups;
+        if (ret_events)
+                *ret_events = e->n_wakeup_events;
+        if (ret_full)
+                *ret_full = e->n_wakeups_full;
+
+        return 0;
+}
+
+_public_ int sd_event_get_dispatch_time(sd_event *e, uint64_t *ret) {
+        assert_return(e, -EINVAL);
+        assert_return(e = event_resolve(e), -ENOPKG);
+        assert_return(!event_pid_changed(e), -ECHILD);
+        assert_return(ret, -EINVAL);
+
+        *ret = e->dispatch_usec;
+        return 0;
+}
+
 _public_ int sd_event_source_set_destroy_callback(sd_event_source *s, sd_event_destroy_t callback) {
         assert_return(s, -EINVAL);
 
@@ -1,5 +1,7 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/wait.h>
 
 #include "sd-event.h"
@@ -7,16 +9,20 @@
 #include "alloc-util.h"
 #include "fd-util.h"
 #include "fs-util.h"
+#include "io-util.h"
 #include "log.h"
 #include "macro.h"
 #include "parse-util.h"
 #include "path-util.h"
 #include "process-util.h"
+#include "random-util.h"
+#include "rlimit-util.h"
 #include "rm-rf.h"
 #include "signal-util.h"
 #include "stdio-util.h"
 #include "string-util.h"
 #include "tests.h"
+#include "time-util.h"
 #include "tmpfile-util.h"
 #include "util.h"
 
@@ -161,7 +167,7 @@ static int post_handler(sd_event_source *s, void *userdata) {
         return 2;
 }
 
-static void test_basic(void) {
+static void test_basic(bool uring) {
         sd_event *e = NULL;
         sd_event_source *w = NULL, *x = NULL, *y = NULL, *z = NULL, *q = NULL, *t = NULL;
         static const char ch = 'x';
@@ -174,9 +180,16 @@ static void test_basic(void) {
         assert_se(pipe(d) >= 0);
         assert_se(pipe(k) >= 0);
 
+        log_info("/* %s(%s) */", __func__, uring ? "io_uring" : "epoll");
+
+        assert_se(setenv("SD_EVENT_IO_URING", one_zero(uring), 1) >= 0);
         assert_se(sd_event_default(&e) >= 0);
+        assert_se(unsetenv("SD_EVENT_IO_URING") >= 0);
         assert_se(sd_event_now(e, CLOCK_MONOTONIC, &event_now) > 0);
 
+        /* This runs once for each backend */
+        do_quit = false, got_post = false, got_exit = false;
+
         assert_se(sd_event_set_watchdog(e, true) >= 0);
 
         /* Test whether we cleanly can destroy an io event source from its own handler */
@@ -482,15 +495,484 @@ static void test_inotify(unsigned n_create_events) {
         sd_event_unref(e);
 }
 
+static int scaling_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        unsigned *n_left = userdata;
+
+        assert_se(revents & EPOLLIN);
+        assert_se(sd_event_source_set_enabled(s, SD_EVENT_OFF) >= 0);
+
+        if (--(*n_left) == 0)
+                assert_se(sd_event_exit(sd_event_source_get_event(s), 0) >= 0);
+
+        return 1;
+}
+
+static void test_io_scaling(bool uring, unsigned n_sources) {
+        _cleanup_close_ int efd = -1;
+        sd_event_source **sources;
+        sd_event *e = NULL;
+        uint64_t n_wakeups, n_events, n_full, dispatch, iterations;
+        char ts[FORMAT_TIMESPAN_MAX], ds[FORMAT_TIMESPAN_MAX];
+        struct rlimit rl;
+        unsigned i, n_left;
+        usec_t start, t;
+
+        /* Adds a lot of io sources that are all ready at the same time, and runs the loop until each was dispatched
+         * once, to check that all get their turn even though only a bounded number of events is fetched per
+         * wakeup. */
+
+        (void) rlimit_nofile_bump(-1);
+        assert_se(getrlimit(RLIMIT_NOFILE, &rl) >= 0);
+        if (rl.rlim_cur < 128) {
+                log_notice("RLIMIT_NOFILE too low, skipping io scaling test.");
+                return;
+        }
+        if (rl.rlim_cur - 64 < n_sources) {
+                log_notice("RLIMIT_NOFILE is %ju, reducing number of io sources to %ju.",
+                           (uintmax_t) rl.rlim_cur, (uintmax_t) rl.rlim_cur - 64);
+                n_sources = rl.rlim_cur - 64;
+        }
+
+        log_info("/* %s(%s) */", __func__, uring ? "io_uring" : "epoll");
+
+        assert_se(setenv("SD_EVENT_IO_URING", one_zero(uring), 1) >= 0);
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(unsetenv("SD_EVENT_IO_URING") >= 0);
+
+        /* All fds refer to the same eventfd, hence all become readable with a single write */
+        efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        assert_se(efd >= 0);
+
+        sources = new(sd_event_source*, n_sources);
+        assert_se(sources);
+
+        n_left = n_sources;
+        for (i = 0; i < n_sources; i++) {
+                int fd;
+
+                fd = fcntl(efd, F_DUPFD_CLOEXEC, 3);
+                assert_se(fd >= 0);
+
+                assert_se(sd_event_add_io(e, sources + i, fd, EPOLLIN, scaling_handler, &n_left) >= 0);
+                assert_se(sd_event_source_set_io_fd_own(sources[i], true) >= 0);
+        }
+
+        assert_se(eventfd_write(efd, 1) >= 0);
+
+        start = now(CLOCK_MONOTONIC);
+        assert_se(sd_event_loop(e) >= 0);
+        t = now(CLOCK_MONOTONIC) - start;
+
+        assert_se(n_left == 0);
+
+        assert_se(sd_event_get_iteration(e, &iterations) >= 0);
+        assert_se(sd_event_get_wakeups(e, &n_wakeups, &n_events, &n_full) >= 0);
+        assert_se(sd_event_get_dispatch_time(e, &dispatch) >= 0);
+        assert_se(n_wakeups > 0);
+        assert_se(n_events >= n_sources);
+        assert_se(n_full <= n_wakeups);
+        assert_se(dispatch <= t);
+
+        log_info("%u io sources: %s, %" PRIu64 " iterations, %" PRIu64 " wakeups (%" PRIu64 " with full batch), %.1f events per wakeup, %s dispatching.",
+                 n_sources, format_timespan(ts, sizeof(ts), t, USEC_PER_MSEC),
+                 iterations, n_wakeups, n_full, (double) n_events / n_wakeups,
+                 format_timespan(ds, sizeof(ds), dispatch, USEC_PER_MSEC));
+
+        for (i = 0; i < n_sources; i++)
+                sd_event_source_unref(sources[i]);
+        free(sources);
+
+        sd_event_unref(e);
+}
+
+struct read_context {
+        uint8_t data[4099];
+        size_t n_read;
+        unsigned n_reads;
+        bool eof;
+};
+
+static int read_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        struct read_context *c = userdata;
+        const void *p;
+        size_t n;
+
+        /* Same in both modes: only input, and the data was read for us already */
+        assert_se(revents == EPOLLIN);
+        assert_se(sd_event_source_get_io_read_data(s, &p, &n) >= 0);
+
+        if (n == 0) {
+                c->eof = true;
+                assert_se(sd_event_source_set_enabled(s, SD_EVENT_OFF) >= 0);
+                return sd_event_exit(sd_event_source_get_event(s), 0);
+        }
+
+        assert_se(n <= 7);
+        assert_se(c->n_read + n <= sizeof(c->data));
+        assert_se(memcmp(c->data + c->n_read, p, n) == 0);
+
+        c->n_read += n;
+        c->n_reads++;
+
+        return 0;
+}
+
+static void test_io_read(bool uring, bool embedded) {
+        struct read_context c = {};
+        sd_event_source *s = NULL;
+        sd_event *e = NULL;
+        int p[2] = { -1, -1 };
+        size_t size;
+
+        log_info("/* %s(%s%s) */", __func__, uring ? "io_uring" : "epoll", embedded ? ", embedded" : "");
+
+        random_bytes(c.data, sizeof(c.data));
+
+        assert_se(pipe2(p, O_CLOEXEC|O_NONBLOCK) >= 0);
+        assert_se(write(p[1], c.data, sizeof(c.data)) == sizeof(c.data));
+        p[1] = safe_close(p[1]);
+
+        assert_se(setenv("SD_EVENT_IO_URING", one_zero(uring), 1) >= 0);
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(unsetenv("SD_EVENT_IO_URING") >= 0);
+
+        /* An odd size, so that the data is read in many small chunks */
+        assert_se(sd_event_add_io(e, &s, p[0], EPOLLIN, read_handler, &c) >= 0);
+        assert_se(sd_event_source_set_io_read_size(s, 7) >= 0);
+        assert_se(sd_event_source_get_io_read_size(s, &size) >= 0);
+        assert_se(size == 7);
+        assert_se(sd_event_source_get_io_read_data(s, NULL, NULL) == -ENODATA);
+
+        if (embedded) {
+                int fd;
+
+                /* Drive the loop like somebody who integrates it into another event loop */
+                fd = sd_event_get_fd(e);
+                assert_se(fd >= 0);
+
+                while (!c.eof) {
+                        int r;
+
+                        r = sd_event_prepare(e);
+                        assert_se(r >= 0);
+                        if (r == 0) {
+                                assert_se(fd_wait_for_event(fd, POLLIN, USEC_INFINITY) > 0);
+                                r = sd_event_wait(e, 0);
+                                assert_se(r >= 0);
+                        }
+                        if (r > 0)
+                                assert_se(sd_event_dispatch(e) >= 0);
+                }
+        } else
+                assert_se(sd_event_loop(e) >= 0);
+
+        assert_se(c.eof);
+        assert_se(c.n_read == sizeof(c.data));
+        assert_se(c.n_reads == DIV_ROUND_UP(sizeof(c.data), 7U));
+        assert_se(sd_event_source_get_io_read_data(s, NULL, NULL) == -ENODATA);
+
+        sd_event_source_unref(s);
+        sd_event_unref(e);
+        safe_close(p[0]);
+}
+
+struct read_idle_context {
+        struct read_context read;
+        int fd;
+        uint64_t iterations;
+};
+
+static int read_idle_time_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        struct read_idle_context *c = userdata;
+
+        /* Nothing was there to read so far, hence the loop should have been idle */
+        assert_se(sd_event_get_iteration(sd_event_source_get_event(s), &c->iterations) >= 0);
+        assert_se(c->read.n_reads == 0);
+
+        assert_se(write(c->fd, c->read.data, sizeof(c->read.data)) == sizeof(c->read.data));
+        c->fd = safe_close(c->fd);
+
+        return 0;
+}
+
+static void test_io_read_idle(bool uring) {
+        struct read_idle_context c = {};
+        sd_event_source *s = NULL, *t = NULL;
+        sd_event *e = NULL;
+        int p[2] = { -1, -1 };
+
+        log_info("/* %s(%s) */", __func__, uring ? "io_uring" : "epoll");
+
+        random_bytes(c.read.data, sizeof(c.read.data));
+
+        assert_se(pipe2(p, O_CLOEXEC|O_NONBLOCK) >= 0);
+        c.fd = p[1];
+
+        assert_se(setenv("SD_EVENT_IO_URING", one_zero(uring), 1) >= 0);
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(unsetenv("SD_EVENT_IO_URING") >= 0);
+
+        /* The data is only written once the loop runs, reading the empty pipe must not make it spin */
+        assert_se(sd_event_add_io(e, &s, p[0], EPOLLIN, read_handler, &c.read) >= 0);
+        assert_se(sd_event_source_set_io_read_size(s, 7) >= 0);
+        assert_se(sd_event_add_time(e, &t, CLOCK_MONOTONIC, now(CLOCK_MONOTONIC) + 100 * USEC_PER_MSEC, 0,
+                                    read_idle_time_handler, &c) >= 0);
+
+        assert_se(sd_event_loop(e) >= 0);
+
+        log_info("%" PRIu64 " iterations before the data was written.", c.iterations);
+        assert_se(c.iterations <= 10);
+        assert_se(c.read.eof);
+        assert_se(c.read.n_read == sizeof(c.read.data));
+
+        sd_event_source_unref(t);
+        sd_event_source_unref(s);
+        sd_event_unref(e);
+        safe_close(p[0]);
+}
+
+struct set_fd_context {
+        int fd;
+        unsigned n_calls;
+};
+
+static int set_fd_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        struct set_fd_context *c = userdata;
+        char buf[1];
+
+        assert_se(revents & EPOLLIN);
+
+        /* Reading fails if we are woken up for the old fd */
+        assert_se(fd == c->fd);
+        assert_se(read(fd, buf, sizeof(buf)) == 1);
+
+        c->n_calls++;
+        return 0;
+}
+
+static void test_io_set_fd(bool uring, bool edge) {
+        struct set_fd_context c = {};
+        sd_event_source *s = NULL;
+        sd_event *e = NULL;
+        int a[2] = { -1, -1 }, b[2] = { -1, -1 };
+
+        log_info("/* %s(%s%s) */", __func__, uring ? "io_uring" : "epoll", edge ? ", edge triggered" : "");
+
+        assert_se(pipe2(a, O_CLOEXEC|O_NONBLOCK) >= 0);
+        assert_se(pipe2(b, O_CLOEXEC|O_NONBLOCK) >= 0);
+
+        assert_se(setenv("SD_EVENT_IO_URING", one_zero(uring), 1) >= 0);
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(unsetenv("SD_EVENT_IO_URING") >= 0);
+
+        c.fd = a[0];
+        assert_se(sd_event_add_io(e, &s, a[0], EPOLLIN | (edge ? EPOLLET : 0), set_fd_handler, &c) >= 0);
+
+        /* Make sure the source is armed for the first fd */
+        assert_se(sd_event_run(e, 0) >= 0);
+        assert_se(write(a[1], "x", 1) == 1);
+        while (c.n_calls < 1)
+                assert_se(sd_event_run(e, USEC_INFINITY) >= 0);
+
+        /* Switch over, the first fd must not wake us up anymore, the second one must */
+        c.fd = b[0];
+        assert_se(sd_event_source_set_io_fd(s, b[0]) >= 0);
+        assert_se(write(a[1], "x", 1) == 1);
+        assert_se(sd_event_run(e, 10 * USEC_PER_MSEC) >= 0);
+        assert_se(c.n_calls == 1);
+
+        assert_se(write(b[1], "x", 1) == 1);
+        while (c.n_calls < 2)
+                assert_se(sd_event_run(e, USEC_INFINITY) >= 0);
+
+        sd_event_source_unref(s);
+        sd_event_unref(e);
+        safe_close_pair(a);
+        safe_close_pair(b);
+}
+
+struct time_order_context {
+        usec_t usec[100];
+        int64_t priority[100];
+        unsigned n, n_left;
+};
+
+static int time_order_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        struct time_order_context *c = userdata;
+
+        /* Never early */
+        assert_se(now(CLOCK_MONOTONIC) >= usec);
+
+        assert_se(c->n < ELEMENTSOF(c->usec));
+        c->usec[c->n] = usec;
+        assert_se(sd_event_source_get_priority(s, c->priority + c->n) >= 0);
+        c->n++;
+
+        if (--c->n_left == 0)
+                assert_se(sd_event_exit(sd_event_source_get_event(s), 0) >= 0);
+
+        return 0;
+}
+
+static void time_order_check(const struct time_order_context *c, unsigned n) {
+        unsigned i;
+
+        assert_se(c->n == n);
+        assert_se(c->n_left == 0);
+
+        /* In the order they elapsed in, and by priority if they elapsed at the same time */
+        for (i = 1; i < c->n; i++)
+                assert_se(c->usec[i-1] < c->usec[i] ||
+                          (c->usec[i-1] == c->usec[i] && c->priority[i-1] <= c->priority[i]));
+}
+
+static sd_event *time_order_event_new(bool wheel) {
+        sd_event *e = NULL;
+
+        assert_se(setenv("SD_EVENT_TIMER_WHEEL", one_zero(wheel), 1) >= 0);
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(unsetenv("SD_EVENT_TIMER_WHEEL") >= 0);
+
+        return e;
+}
+
+static void test_time_order(bool wheel) {
+        sd_event_source *sources[100];
+        struct time_order_context c = {
+                .n_left = ELEMENTSOF(sources),
+        };
+        sd_event *e;
+        unsigned i;
+        usec_t base;
+
+        log_info("/* %s(%s) */", __func__, wheel ? "timer wheel" : "prioq");
+
+        e = time_order_event_new(wheel);
+        base = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < ELEMENTSOF(sources); i++)
+                assert_se(sd_event_add_time(e, sources + i, CLOCK_MONOTONIC,
+                                            base + random_u64() % (200 * USEC_PER_MSEC), 1,
+                                            time_order_handler, &c) >= 0);
+
+        /* Move some around, and turn one off and on again */
+        for (i = 0; i < ELEMENTSOF(sources); i += 7)
+                assert_se(sd_event_source_set_time(sources[i], base + random_u64() % (200 * USEC_PER_MSEC)) >= 0);
+        assert_se(sd_event_source_set_enabled(sources[3], SD_EVENT_OFF) >= 0);
+        assert_se(sd_event_source_set_time_accuracy(sources[3], USEC_PER_MSEC) >= 0);
+        assert_se(sd_event_source_set_enabled(sources[3], SD_EVENT_ONESHOT) >= 0);
+
+        assert_se(sd_event_loop(e) >= 0);
+        time_order_check(&c, ELEMENTSOF(sources));
+
+        for (i = 0; i < ELEMENTSOF(sources); i++)
+                sd_event_source_unref(sources[i]);
+        sd_event_unref(e);
+
+        /* Now in groups that elapse at the same time, with shuffled priorities within each group. Later groups get
+         * lower priorities, so that the order is the same even if a group elapses while the one before is still
+         * being dispatched. */
+        c = (struct time_order_context) {
+                .n_left = ELEMENTSOF(sources),
+        };
+        e = time_order_event_new(wheel);
+        base = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < ELEMENTSOF(sources); i++) {
+                assert_se(sd_event_add_time(e, sources + i, CLOCK_MONOTONIC,
+                                            base + (i % 10) * 5 * USEC_PER_MSEC, 1,
+                                            time_order_handler, &c) >= 0);
+                assert_se(sd_event_source_set_priority(sources[i], (i % 10) * 3 + random_u64() % 3) >= 0);
+        }
+
+        assert_se(sd_event_loop(e) >= 0);
+        time_order_check(&c, ELEMENTSOF(sources));
+
+        for (i = 0; i < ELEMENTSOF(sources); i++)
+                sd_event_source_unref(sources[i]);
+
+        sd_event_unref(e);
+}
+
+static int time_never_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        assert_not_reached("Timer that is always re-armed elapsed");
+}
+
+static void test_time_rearm(bool wheel, unsigned n_sources, unsigned n_rearm) {
+        _cleanup_free_ sd_event_source **sources = NULL;
+        char ts[FORMAT_TIMESPAN_MAX];
+        sd_event *e = NULL;
+        usec_t base, start, t;
+        unsigned i;
+
+        /* Re-arms timers over and over, as done for timeouts of requests that are sent or answered all the
+         * time. Lets the loop arm its timers every now and then in between, as it would between dispatches. */
+
+        assert_se(setenv("SD_EVENT_TIMER_WHEEL", one_zero(wheel), 1) >= 0);
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(unsetenv("SD_EVENT_TIMER_WHEEL") >= 0);
+
+        assert_se(sources = new(sd_event_source*, n_sources));
+
+        base = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n_sources; i++)
+                assert_se(sd_event_add_time(e, sources + i, CLOCK_MONOTONIC,
+                                            base + USEC_PER_MINUTE + random_u64() % USEC_PER_HOUR, 0,
+                                            time_never_handler, NULL) >= 0);
+
+        start = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < n_rearm; i++) {
+                assert_se(sd_event_source_set_time(sources[i % n_sources],
+                                                   base + USEC_PER_MINUTE + random_u64() % USEC_PER_HOUR) >= 0);
+
+                if (i % 100 == 99)
+                        assert_se(sd_event_run(e, 0) == 0);
+        }
+
+        t = now(CLOCK_MONOTONIC) - start;
+
+        log_info("Re-armed %u timers %u times using %s: %s",
+                 n_sources, n_rearm, wheel ? "timer wheels" : "priority queues",
+                 format_timespan(ts, sizeof(ts), t, USEC_PER_MSEC));
+
+        for (i = 0; i < n_sources; i++)
+                sd_event_source_unref(sources[i]);
+
+        sd_event_unref(e);
+}
+
 int main(int argc, char *argv[]) {
         test_setup_logging(LOG_INFO);
 
-        test_basic();
+        test_basic(false);
+        test_basic(true);
         test_sd_event_now();
         test_rtqueue();
 
         test_inotify(100); /* should work without overflow */
         test_inotify(33000); /* should trigger a q overflow */
 
+        test_io_scaling(false, slow_tests_enabled() ? 100000 : 10000);
+        test_io_scaling(true, slow_tests_enabled() ? 100000 : 10000);
+
+        test_io_read(false, false);
+        test_io_read(true, false);
+        test_io_read(false, true);
+        test_io_read(true, true);
+        test_io_read_idle(false);
+        test_io_read_idle(true);
+
+        test_io_set_fd(false, false);
+        test_io_set_fd(true, false);
+        test_io_set_fd(false, true);
+        test_io_set_fd(true, true);
+
+        test_time_order(false);
+        test_time_order(true);
+
+        test_time_rearm(false, 10000, slow_tests_enabled() ? 1000000 : 100000);
+        test_time_rearm(true, 10000, slow_tests_enabled() ? 1000000 : 100000);
+
         return 0;
 }
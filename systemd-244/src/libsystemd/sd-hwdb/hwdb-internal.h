@@ -27,6 +27,12 @@ struct trie_header_f {
         /* size of the nodes and string section */
         le64_t nodes_len;
         le64_t strings_len;
+
+        /* table of the source files the database was built from, follows the string section; only
+         * present if header_size covers these fields */
+        le64_t sources_off;
+        le64_t sources_count;
+        le64_t source_entry_size;
 } _packed_;
 
 struct trie_node_f {
@@ -63,3 +69,11 @@ struct trie_value_entry2_f {
         le16_t file_priority;
         le16_t padding;
 } _packed_;
+
+/* array of source file entries, used to tell whether the database needs to be rebuilt */
+struct trie_source_entry_f {
+        le64_t filename_off;
+        le64_t size;
+        /* siphash24 of the file contents */
+        le64_t hash;
+} _packed_;
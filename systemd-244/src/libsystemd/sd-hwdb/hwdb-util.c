@@ -1,7 +1,11 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "alloc-util.h"
@@ -14,12 +18,16 @@
 #include "label.h"
 #include "mkdir.h"
 #include "path-util.h"
+#include "siphash24.h"
 #include "sort-util.h"
 #include "strbuf.h"
 #include "string-util.h"
 #include "strv.h"
 #include "tmpfile-util.h"
 
+/* The source files are read and parsed in parallel, using at most this many threads */
+#define HWDB_JOBS_MAX 8U
+
 static const char *default_hwdb_bin_dir = "/etc/udev";
 static const char * const conf_file_dirs[] = {
         "/etc/udev/hwdb.d",
@@ -70,6 +78,39 @@ struct trie_value_entry {
         uint16_t file_priority;
 };
 
+/* a source file, read and parsed before the trie is built */
+struct hwdb_source {
+        const char *filename;
+        uint16_t file_priority;
+        size_t filename_off;
+
+        char *contents;
+        size_t size;
+        uint64_t hash;
+
+        /* the match lines of all records, each property refers to the ones of its record */
+        char **matches;
+        size_t n_matches;
+        size_t n_matches_allocated;
+
+        struct hwdb_property *properties;
+        size_t n_properties;
+        size_t n_properties_allocated;
+
+        int r;
+};
+
+struct hwdb_property {
+        size_t matches_first;
+        size_t matches_count;
+
+        /* key and value point into line */
+        char *line;
+        const char *key;
+        const char *value;
+        uint32_t line_number;
+};
+
 static int trie_children_cmp(const struct trie_child_entry *a, const struct trie_child_entry *b) {
         return CMP(a->c, b->c);
 }
@@ -359,7 +400,8 @@ static int64_t trie_store_nodes(struct trie_f *trie, struct trie_node *node, boo
         return node_off;
 }
 
-static int trie_store(struct trie *trie, const char *filename, bool compat) {
+static int trie_store(struct trie *trie, const char *filename, bool compat,
+                      const struct hwdb_source *sources, size_t n_sources) {
         struct trie_f t = {
                 .trie = trie,
         };
@@ -374,7 +416,9 @@ static int trie_store(struct trie *trie, const char *filename, bool compat) {
                 .node_size = htole64(sizeof(struct trie_node_f)),
                 .child_entry_size = htole64(sizeof(struct trie_child_entry_f)),
                 .value_entry_size = htole64(compat ? sizeof(struct trie_value_entry_f) : sizeof(struct trie_value_entry2_f)),
+                .source_entry_size = htole64(sizeof(struct trie_source_entry_f)),
         };
+        size_t i;
         int r;
 
         /* calculate size of header, nodes, children entries, value entries */
@@ -399,6 +443,19 @@ static int trie_store(struct trie *trie, const char *filename, bool compat) {
         fwrite(trie->strings->buf, trie->strings->len, 1, t.f);
         h.strings_len = htole64(trie->strings->len);
 
+        /* write source file table */
+        h.sources_off = htole64(ftello(t.f));
+        h.sources_count = htole64(n_sources);
+        for (i = 0; i < n_sources; i++) {
+                struct trie_source_entry_f e = {
+                        .filename_off = htole64(t.strings_off + sources[i].filename_off),
+                        .size = htole64(sources[i].size),
+                        .hash = htole64(sources[i].hash),
+                };
+
+                fwrite(&e, sizeof(struct trie_source_entry_f), 1, t.f);
+        }
+
         /* write header */
         size = ftello(t.f);
         h.file_size = htole64(size);
@@ -429,6 +486,8 @@ static int trie_store(struct trie *trie, const char *filename, bool compat) {
                   t.values_count * (compat ? sizeof(struct trie_value_entry_f) : sizeof(struct trie_value_entry2_f)), t.values_count);
         log_debug("string store:     %8zu bytes", trie->strings->len);
         log_debug("strings start:    %8"PRIu64, t.strings_off);
+        log_debug("source files:     %8zu bytes (%8zu)",
+                  n_sources * sizeof(struct trie_source_entry_f), n_sources);
         return 0;
 
  error_fclose:
@@ -438,49 +497,94 @@ static int trie_store(struct trie *trie, const char *filename, bool compat) {
         return r;
 }
 
-static int insert_data(struct trie *trie, char **match_list, char *line, const char *filename,
-                       uint16_t file_priority, uint32_t line_number, bool compat) {
-        char *value, **entry;
+static struct hwdb_source *hwdb_sources_free(struct hwdb_source *sources, size_t n_sources) {
+        size_t i, j;
+
+        for (i = 0; i < n_sources; i++) {
+                struct hwdb_source *s = sources + i;
+
+                free(s->contents);
+                strv_free(s->matches);
+                for (j = 0; j < s->n_properties; j++)
+                        free(s->properties[j].line);
+                free(s->properties);
+        }
+
+        return mfree(sources);
+}
+
+static int hwdb_source_add_match(struct hwdb_source *s, char **line) {
+        assert(s);
+        assert(line);
+
+        if (!GREEDY_REALLOC(s->matches, s->n_matches_allocated, s->n_matches + 2))
+                return -ENOMEM;
+
+        s->matches[s->n_matches++] = TAKE_PTR(*line);
+        s->matches[s->n_matches] = NULL;
+
+        return 0;
+}
+
+static int hwdb_source_add_property(struct hwdb_source *s, size_t matches_first, char **line, uint32_t line_number) {
+        char *key, *value;
 
-        assert(line[0] == ' ');
+        assert(s);
+        assert(line);
 
-        value = strchr(line, '=');
+        key = *line;
+        assert(key[0] == ' ');
+
+        value = strchr(key, '=');
         if (!value)
-                return log_syntax(NULL, LOG_WARNING, filename, line_number, EINVAL,
-                                  "Key-value pair expected but got \"%s\", ignoring", line);
+                return log_syntax(NULL, LOG_WARNING, s->filename, line_number, EINVAL,
+                                  "Key-value pair expected but got \"%s\", ignoring", key);
 
         value[0] = '\0';
         value++;
 
         /* Replace multiple leading spaces by a single space */
-        while (isblank(line[0]) && isblank(line[1]))
-                line++;
+        while (isblank(key[0]) && isblank(key[1]))
+                key++;
 
-        if (isempty(line + 1) || isempty(value))
-                return log_syntax(NULL, LOG_WARNING, filename, line_number, EINVAL,
+        if (isempty(key + 1) || isempty(value))
+                return log_syntax(NULL, LOG_WARNING, s->filename, line_number, EINVAL,
                                   "Empty %s in \"%s=%s\", ignoring",
-                                  isempty(line + 1) ? "key" : "value",
-                                  line, value);
+                                  isempty(key + 1) ? "key" : "value",
+                                  key, value);
+
+        if (!GREEDY_REALLOC(s->properties, s->n_properties_allocated, s->n_properties + 1))
+                return -ENOMEM;
 
-        STRV_FOREACH(entry, match_list)
-                trie_insert(trie, trie->root, *entry, line, value, filename, file_priority, line_number, compat);
+        s->properties[s->n_properties++] = (struct hwdb_property) {
+                .matches_first = matches_first,
+                .matches_count = s->n_matches - matches_first,
+                .line = TAKE_PTR(*line),
+                .key = key,
+                .value = value,
+                .line_number = line_number,
+        };
 
         return 0;
 }
 
-static int import_file(struct trie *trie, const char *filename, uint16_t file_priority, bool compat) {
+static int hwdb_source_parse(struct hwdb_source *s) {
         enum {
                 HW_NONE,
                 HW_MATCH,
                 HW_DATA,
         } state = HW_NONE;
         _cleanup_fclose_ FILE *f = NULL;
-        _cleanup_strv_free_ char **match_list = NULL;
         uint32_t line_number = 0;
-        char *match = NULL;
+        size_t matches_first = 0;
         int r = 0, err;
 
-        f = fopen(filename, "re");
+        assert(s);
+
+        if (s->size == 0)
+                return 0;
+
+        f = fmemopen_unlocked(s->contents, s->size, "re");
         if (!f)
                 return -errno;
 
@@ -518,7 +622,7 @@ static int import_file(struct trie *trie, const char *filename, uint16_t file_pr
                                 break;
 
                         if (line[0] == ' ') {
-                                log_syntax(NULL, LOG_WARNING, filename, line_number, EINVAL,
+                                log_syntax(NULL, LOG_WARNING, s->filename, line_number, EINVAL,
                                            "Match expected but got indented property \"%s\", ignoring line", line);
                                 r = -EINVAL;
                                 break;
@@ -526,12 +630,9 @@ static int import_file(struct trie *trie, const char *filename, uint16_t file_pr
 
                         /* start of record, first match */
                         state = HW_MATCH;
+                        matches_first = s->n_matches;
 
-                        match = strdup(line);
-                        if (!match)
-                                return -ENOMEM;
-
-                        err = strv_consume(&match_list, match);
+                        err = hwdb_source_add_match(s, &line);
                         if (err < 0)
                                 return err;
 
@@ -539,21 +640,16 @@ static int import_file(struct trie *trie, const char *filename, uint16_t file_pr
 
                 case HW_MATCH:
                         if (len == 0) {
-                                log_syntax(NULL, LOG_WARNING, filename, line_number, EINVAL,
+                                log_syntax(NULL, LOG_WARNING, s->filename, line_number, EINVAL,
                                            "Property expected, ignoring record with no properties");
                                 r = -EINVAL;
                                 state = HW_NONE;
-                                strv_clear(match_list);
                                 break;
                         }
 
                         if (line[0] != ' ') {
                                 /* another match */
-                                match = strdup(line);
-                                if (!match)
-                                        return -ENOMEM;
-
-                                err = strv_consume(&match_list, match);
+                                err = hwdb_source_add_match(s, &line);
                                 if (err < 0)
                                         return err;
 
@@ -562,7 +658,7 @@ static int import_file(struct trie *trie, const char *filename, uint16_t file_pr
 
                         /* first data */
                         state = HW_DATA;
-                        err = insert_data(trie, match_list, line, filename, file_priority, line_number, compat);
+                        err = hwdb_source_add_property(s, matches_first, &line, line_number);
                         if (err < 0)
                                 r = err;
                         break;
@@ -571,20 +667,18 @@ static int import_file(struct trie *trie, const char *filename, uint16_t file_pr
                         if (len == 0) {
                                 /* end of record */
                                 state = HW_NONE;
-                                strv_clear(match_list);
                                 break;
                         }
 
                         if (line[0] != ' ') {
-                                log_syntax(NULL, LOG_WARNING, filename, line_number, EINVAL,
+                                log_syntax(NULL, LOG_WARNING, s->filename, line_number, EINVAL,
                                            "Property or empty line expected, got \"%s\", ignoring record", line);
                                 r = -EINVAL;
                                 state = HW_NONE;
-                                strv_clear(match_list);
                                 break;
                         }
 
-                        err = insert_data(trie, match_list, line, filename, file_priority, line_number, compat);
+                        err = hwdb_source_add_property(s, matches_first, &line, line_number);
                         if (err < 0)
                                 r = err;
                         break;
@@ -592,50 +686,255 @@ static int import_file(struct trie *trie, const char *filename, uint16_t file_pr
         }
 
         if (state == HW_MATCH)
-                log_syntax(NULL, LOG_WARNING, filename, line_number, EINVAL,
+                log_syntax(NULL, LOG_WARNING, s->filename, line_number, EINVAL,
                            "Property expected, ignoring record with no properties");
 
         return r;
 }
 
-int hwdb_update(const char *root, const char *hwdb_bin_dir, bool strict, bool compat) {
+static int hwdb_source_load(struct hwdb_source *s) {
+        /* The hash is stored in hwdb.bin, hence use a fixed key */
+        static const uint8_t key[16] = {
+                0x2b, 0x8e, 0x71, 0x04, 0xc6, 0x5f, 0x3a, 0xd9,
+                0x17, 0xe0, 0x9c, 0x42, 0x6d, 0xb3, 0x58, 0xf1,
+        };
+        int r;
+
+        assert(s);
+
+        log_debug("Reading file \"%s\"", s->filename);
+
+        r = read_full_file(s->filename, &s->contents, &s->size);
+        if (r < 0)
+                return r;
+
+        s->hash = siphash24(s->contents, s->size, key);
+        return 0;
+}
+
+static int hwdb_source_import(struct trie *trie, struct hwdb_source *s, bool compat) {
+        size_t i, j;
+
+        assert(trie);
+        assert(s);
+
+        for (i = 0; i < s->n_properties; i++) {
+                struct hwdb_property *p = s->properties + i;
+
+                for (j = 0; j < p->matches_count; j++)
+                        trie_insert(trie, trie->root, s->matches[p->matches_first + j], p->key, p->value,
+                                    s->filename, s->file_priority, p->line_number, compat);
+        }
+
+        return s->r;
+}
+
+struct hwdb_sources_job {
+        struct hwdb_source *sources;
+        size_t n_sources;
+        size_t next;
+        bool parse;
+};
+
+static void *hwdb_sources_thread(void *userdata) {
+        struct hwdb_sources_job *job = userdata;
+
+        for (;;) {
+                struct hwdb_source *s;
+                size_t i;
+
+                i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+                if (i >= job->n_sources)
+                        break;
+
+                s = job->sources + i;
+                if (job->parse) {
+                        if (s->r >= 0)
+                                s->r = hwdb_source_parse(s);
+
+                        /* Everything we need has been copied out now */
+                        s->contents = mfree(s->contents);
+                } else
+                        s->r = hwdb_source_load(s);
+        }
+
+        return NULL;
+}
+
+static void hwdb_sources_run(struct hwdb_source *sources, size_t n_sources, bool parse) {
+        struct hwdb_sources_job job = {
+                .sources = sources,
+                .n_sources = n_sources,
+                .parse = parse,
+        };
+        pthread_t threads[HWDB_JOBS_MAX];
+        unsigned n_jobs = 1, n_threads = 0, i;
+        cpu_set_t cpu_set;
+
+        /* The files are independent of each other, so read or parse them in parallel. The calling thread
+         * does its share of the work, too, and everything is done if thread creation fails. */
+
+        if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0)
+                n_jobs = MIN((unsigned) CPU_COUNT(&cpu_set), HWDB_JOBS_MAX);
+        n_jobs = MAX(1U, (unsigned) MIN((size_t) n_jobs, n_sources));
+
+        for (i = 1; i < n_jobs; i++) {
+                if (pthread_create(threads + n_threads, NULL, hwdb_sources_thread, &job) != 0)
+                        break;
+                n_threads++;
+        }
+
+        (void) hwdb_sources_thread(&job);
+
+        for (i = 0; i < n_threads; i++)
+                (void) pthread_join(threads[i], NULL);
+}
+
+static bool hwdb_bin_is_up_to_date(const char *hwdb_bin, const struct hwdb_source *sources, size_t n_sources, bool compat) {
+        const struct trie_header_f *h;
+        const char sig[] = HWDB_SIG;
+        _cleanup_close_ int fd = -1;
+        bool up_to_date = false;
+        uint64_t off, n, size;
+        struct stat st;
+        const char *map;
+        size_t i;
+
+        fd = open(hwdb_bin, O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
+                return false;
+
+        if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(struct trie_header_f))
+                return false;
+
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+                return false;
+
+        h = (const struct trie_header_f *) map;
+        size = st.st_size;
+        off = le64toh(h->sources_off);
+        n = le64toh(h->sources_count);
+
+        /* Only trust the source table if it was written by the same version in the same format */
+        if (memcmp(h->signature, sig, sizeof(h->signature)) != 0 ||
+            le64toh(h->file_size) != size ||
+            le64toh(h->tool_version) != PROJECT_VERSION ||
+            le64toh(h->header_size) < sizeof(struct trie_header_f) ||
+            le64toh(h->value_entry_size) != (compat ? sizeof(struct trie_value_entry_f) : sizeof(struct trie_value_entry2_f)) ||
+            le64toh(h->source_entry_size) != sizeof(struct trie_source_entry_f) ||
+            n != n_sources ||
+            off > size || n > (size - off) / sizeof(struct trie_source_entry_f))
+                goto finish;
+
+        for (i = 0; i < n_sources; i++) {
+                const struct trie_source_entry_f *e;
+                uint64_t filename_off;
+
+                /* If a file could not be read, we cannot tell */
+                if (sources[i].r < 0)
+                        goto finish;
+
+                e = (const struct trie_source_entry_f *) (map + off + i * sizeof(struct trie_source_entry_f));
+                filename_off = le64toh(e->filename_off);
+
+                if (le64toh(e->size) != sources[i].size ||
+                    le64toh(e->hash) != sources[i].hash ||
+                    filename_off >= size ||
+                    strnlen(map + filename_off, size - filename_off) >= size - filename_off ||
+                    !streq(map + filename_off, sources[i].filename))
+                        goto finish;
+        }
+
+        up_to_date = true;
+
+finish:
+        (void) munmap((void *) map, st.st_size);
+        return up_to_date;
+}
+
+int hwdb_update(const char *root, const char *hwdb_bin_dir, bool strict, bool compat, bool incremental) {
         _cleanup_free_ char *hwdb_bin = NULL;
         _cleanup_(trie_freep) struct trie *trie = NULL;
         _cleanup_strv_free_ char **files = NULL;
-        char **f;
-        uint16_t file_priority = 1;
+        struct hwdb_source *sources = NULL;
+        size_t n_sources, i;
         int r = 0, err;
 
         /* The argument 'compat' controls the format version of database. If false, then hwdb.bin will be created with
          * additional information such that priority, line number, and filename of database source. If true, then hwdb.bin
          * will be created without the information. systemd-hwdb command should set the argument false, and 'udevadm hwdb'
-         * command should set it true. */
+         * command should set it true.
+         *
+         * hwdb.bin records size and hash of each source file. If 'incremental' is true and none of them changed, the
+         * existing database is left alone. */
 
-        trie = new0(struct trie, 1);
-        if (!trie)
+        hwdb_bin = path_join(root, hwdb_bin_dir ?: default_hwdb_bin_dir, "hwdb.bin");
+        if (!hwdb_bin)
                 return -ENOMEM;
 
+        err = conf_files_list_strv(&files, ".hwdb", root, 0, conf_file_dirs);
+        if (err < 0)
+                return log_error_errno(err, "Failed to enumerate hwdb files: %m");
+
+        n_sources = strv_length(files);
+        if (n_sources > 0) {
+                sources = new0(struct hwdb_source, n_sources);
+                if (!sources)
+                        return -ENOMEM;
+        }
+
+        for (i = 0; i < n_sources; i++)
+                sources[i] = (struct hwdb_source) {
+                        .filename = files[i],
+                        .file_priority = i + 1,
+                };
+
+        hwdb_sources_run(sources, n_sources, false);
+
+        if (incremental && hwdb_bin_is_up_to_date(hwdb_bin, sources, n_sources, compat)) {
+                log_debug("%s is up to date, not rebuilding it.", hwdb_bin);
+                goto finish;
+        }
+
+        hwdb_sources_run(sources, n_sources, true);
+
+        trie = new0(struct trie, 1);
+        if (!trie) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
         /* string store */
         trie->strings = strbuf_new();
-        if (!trie->strings)
-                return -ENOMEM;
+        if (!trie->strings) {
+                r = -ENOMEM;
+                goto finish;
+        }
 
         /* index */
         trie->root = new0(struct trie_node, 1);
-        if (!trie->root)
-                return -ENOMEM;
+        if (!trie->root) {
+                r = -ENOMEM;
+                goto finish;
+        }
 
         trie->nodes_count++;
 
-        err = conf_files_list_strv(&files, ".hwdb", root, 0, conf_file_dirs);
-        if (err < 0)
-                return log_error_errno(err, "Failed to enumerate hwdb files: %m");
+        /* Files are inserted in order of their priority, and later properties replace earlier ones */
+        for (i = 0; i < n_sources; i++) {
+                ssize_t off;
 
-        STRV_FOREACH(f, files) {
-                log_debug("Reading file \"%s\"", *f);
-                err = import_file(trie, *f, file_priority++, compat);
+                err = hwdb_source_import(trie, sources + i, compat);
                 if (err < 0 && strict)
                         r = err;
+
+                off = strbuf_add_string(trie->strings, sources[i].filename, strlen(sources[i].filename));
+                if (off < 0) {
+                        r = off;
+                        goto finish;
+                }
+                sources[i].filename_off = off;
         }
 
         strbuf_complete(trie->strings);
@@ -654,19 +953,19 @@ int hwdb_update(const char *root, const char *hwdb_bin_dir, bool strict, bool co
         log_debug("strings dedup'ed: %8zu bytes (%8zu)",
                   trie->strings->dedup_len, trie->strings->dedup_count);
 
-        hwdb_bin = path_join(root, hwdb_bin_dir ?: default_hwdb_bin_dir, "hwdb.bin");
-        if (!hwdb_bin)
-                return -ENOMEM;
-
         mkdir_parents_label(hwdb_bin, 0755);
-        err = trie_store(trie, hwdb_bin, compat);
-        if (err < 0)
-                return log_error_errno(err, "Failed to write database %s: %m", hwdb_bin);
+        err = trie_store(trie, hwdb_bin, compat, sources, n_sources);
+        if (err < 0) {
+                r = log_error_errno(err, "Failed to write database %s: %m", hwdb_bin);
+                goto finish;
+        }
 
         err = label_fix(hwdb_bin, 0);
         if (err < 0)
-                return err;
+                r = err;
 
+finish:
+        hwdb_sources_free(sources, n_sources);
         return r;
 }
 
@@ -2,9 +2,12 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "sd-hwdb.h"
 
+int hwdb_new_from_path(const char *path, sd_hwdb **ret);
 bool hwdb_validate(sd_hwdb *hwdb);
-int hwdb_update(const char *root, const char *hwdb_bin_dir, bool strict, bool compat);
+int hwdb_seek_first(sd_hwdb *hwdb, char * const *modaliases, const char *key_filter, size_t *ret_index);
+int hwdb_update(const char *root, const char *hwdb_bin_dir, bool strict, bool compat, bool incremental);
 int hwdb_query(const char *modalias);
@@ -20,6 +20,7 @@
 #include "hwdb-util.h"
 #include "nulstr-util.h"
 #include "string-util.h"
+#include "strv.h"
 #include "time-util.h"
 
 struct sd_hwdb {
@@ -194,6 +195,51 @@ static int hwdb_add_property(sd_hwdb *hwdb, const struct trie_value_entry_f *ent
         return 0;
 }
 
+static bool linebuf_glob_prefix_may_match(struct linebuf *buf, const char *search) {
+        const char *pattern;
+        bool in_bracket = false;
+        size_t i;
+        int r;
+
+        /* All patterns below a trie node start with the glob in buf. If "buf*" does not match the search
+         * string, none of them can, and the whole subtree may be skipped. This only holds if buf ends at a
+         * token boundary, i.e. not inside a bracket expression or right after an escaping backslash. If
+         * that is not the case, we cannot tell, and claim that there may be a match. */
+
+        for (i = 0; i < buf->len; i++) {
+                char c = buf->bytes[i];
+
+                if (c == '\\') {
+                        if (++i >= buf->len)
+                                return true;
+                } else if (in_bracket) {
+                        if (c == '[')
+                                return true; /* character classes and friends, don't bother */
+                        if (c == ']')
+                                in_bracket = false;
+                } else if (c == '[') {
+                        in_bracket = true;
+
+                        /* A closing bracket right at the beginning (after an optional negation) is literal */
+                        if (i + 1 < buf->len && IN_SET(buf->bytes[i + 1], '!', '^'))
+                                i++;
+                        if (i + 1 < buf->len && buf->bytes[i + 1] == ']')
+                                i++;
+                }
+        }
+        if (in_bracket)
+                return true;
+
+        if (!linebuf_add_char(buf, '*'))
+                return true;
+
+        pattern = linebuf_get(buf);
+        r = pattern ? fnmatch(pattern, search, 0) : 0;
+
+        linebuf_rem_char(buf);
+        return r == 0;
+}
+
 static int trie_fnmatch_f(sd_hwdb *hwdb, const struct trie_node_f *node, size_t p,
                           struct linebuf *buf, const char *search) {
         size_t len;
@@ -205,6 +251,14 @@ static int trie_fnmatch_f(sd_hwdb *hwdb, const struct trie_node_f *node, size_t
         len = strlen(prefix + p);
         linebuf_add(buf, prefix + p, len);
 
+        /* Prune subtrees that cannot match anyway, which avoids calling fnmatch() for each of their values.
+         * Most globs in the hwdb are of the form "…:svn*:pnFoo*", where everything after the first '*'
+         * ends up in a single subtree. */
+        if (node->children_count > 0 && !linebuf_glob_prefix_may_match(buf, search)) {
+                linebuf_rem(buf, len);
+                return 0;
+        }
+
         for (i = 0; i < node->children_count; i++) {
                 const struct trie_child_entry_f *child = trie_node_child(hwdb, node, i);
 
@@ -305,12 +359,12 @@ static const char hwdb_bin_paths[] =
 #endif
         UDEVLIBEXECDIR "/hwdb.bin\0";
 
-_public_ int sd_hwdb_new(sd_hwdb **ret) {
+static int hwdb_new(const char *path, sd_hwdb **ret) {
         _cleanup_(sd_hwdb_unrefp) sd_hwdb *hwdb = NULL;
         const char *hwdb_bin_path;
         const char sig[] = HWDB_SIG;
 
-        assert_return(ret, -EINVAL);
+        assert(ret);
 
         hwdb = new0(sd_hwdb, 1);
         if (!hwdb)
@@ -318,19 +372,26 @@ _public_ int sd_hwdb_new(sd_hwdb **ret) {
 
         hwdb->n_ref = 1;
 
-        /* find hwdb.bin in hwdb_bin_paths */
-        NULSTR_FOREACH(hwdb_bin_path, hwdb_bin_paths) {
-                log_debug("Trying to open \"%s\"...", hwdb_bin_path);
+        if (path) {
+                hwdb_bin_path = path;
                 hwdb->f = fopen(hwdb_bin_path, "re");
-                if (hwdb->f)
-                        break;
-                if (errno != ENOENT)
+                if (!hwdb->f)
                         return log_debug_errno(errno, "Failed to open %s: %m", hwdb_bin_path);
-        }
+        } else {
+                /* find hwdb.bin in hwdb_bin_paths */
+                NULSTR_FOREACH(hwdb_bin_path, hwdb_bin_paths) {
+                        log_debug("Trying to open \"%s\"...", hwdb_bin_path);
+                        hwdb->f = fopen(hwdb_bin_path, "re");
+                        if (hwdb->f)
+                                break;
+                        if (errno != ENOENT)
+                                return log_debug_errno(errno, "Failed to open %s: %m", hwdb_bin_path);
+                }
 
-        if (!hwdb->f)
-                return log_debug_errno(SYNTHETIC_ERRNO(ENOENT),
-                                       "hwdb.bin does not exist, please run 'systemd-hwdb update'");
+                if (!hwdb->f)
+                        return log_debug_errno(SYNTHETIC_ERRNO(ENOENT),
+                                               "hwdb.bin does not exist, please run 'systemd-hwdb update'");
+        }
 
         if (fstat(fileno(hwdb->f), &hwdb->st) < 0)
                 return log_debug_errno(errno, "Failed to stat %s: %m", hwdb_bin_path);
@@ -360,6 +421,19 @@ _public_ int sd_hwdb_new(sd_hwdb **ret) {
         return 0;
 }
 
+_public_ int sd_hwdb_new(sd_hwdb **ret) {
+        assert_return(ret, -EINVAL);
+
+        return hwdb_new(NULL, ret);
+}
+
+int hwdb_new_from_path(const char *path, sd_hwdb **ret) {
+        assert(path);
+        assert(ret);
+
+        return hwdb_new(path, ret);
+}
+
 static sd_hwdb *hwdb_free(sd_hwdb *hwdb) {
         assert(hwdb);
 
@@ -445,6 +519,47 @@ _public_ int sd_hwdb_seek(sd_hwdb *hwdb, const char *modalias) {
         return 0;
 }
 
+int hwdb_seek_first(sd_hwdb *hwdb, char * const *modaliases, const char *key_filter, size_t *ret_index) {
+        char * const *m;
+        int r;
+
+        assert(hwdb);
+        assert(hwdb->f);
+
+        /* Looks up the modaliases one after the other, and stops at the first one that yields any properties,
+         * or any properties whose keys match the key_filter glob, if specified. The properties of that
+         * modalias can then be read with sd_hwdb_enumerate(). If none matches, there is nothing to enumerate. */
+
+        STRV_FOREACH(m, modaliases) {
+                const struct trie_value_entry_f *entry;
+                Iterator i;
+                const void *k;
+
+                r = properties_prepare(hwdb, *m);
+                if (r < 0)
+                        return r;
+
+                ORDERED_HASHMAP_FOREACH_KEY(entry, k, hwdb->properties, i)
+                        if (!key_filter || fnmatch(key_filter, k, FNM_NOESCAPE) == 0)
+                                break;
+                if (!entry)
+                        continue;
+
+                hwdb->properties_modified = false;
+                hwdb->properties_iterator = ITERATOR_FIRST;
+
+                if (ret_index)
+                        *ret_index = m - modaliases;
+                return 1;
+        }
+
+        ordered_hashmap_clear(hwdb->properties);
+        hwdb->properties_modified = false;
+        hwdb->properties_iterator = ITERATOR_FIRST;
+
+        return 0;
+}
+
 _public_ int sd_hwdb_enumerate(sd_hwdb *hwdb, const char **key, const char **value) {
         const struct trie_value_entry_f *entry;
         const void *k;
@@ -8,6 +8,7 @@
 #include "escape.h"
 #include "hexdecoct.h"
 #include "memory-util.h"
+#include "mempool.h"
 #include "resolved-dns-dnssec.h"
 #include "resolved-dns-packet.h"
 #include "resolved-dns-rr.h"
@@ -369,14 +370,21 @@ bool dns_resource_key_reduce(DnsResourceKey **a, DnsResourceKey **b) {
         return true;
 }
 
+DEFINE_MEMPOOL(resource_record_pool, DnsResourceRecord, 64);
+
 DnsResourceRecord* dns_resource_record_new(DnsResourceKey *key) {
         DnsResourceRecord *rr;
+        bool up;
+
+        /* Every packet parsed or cached creates a bunch of these */
+        up = mempool_enabled();
 
-        rr = new0(DnsResourceRecord, 1);
+        rr = up ? mempool_alloc0_tile(&resource_record_pool) : new0(DnsResourceRecord, 1);
         if (!rr)
                 return NULL;
 
         rr->n_ref = 1;
+        rr->from_pool = up;
         rr->key = dns_resource_key_ref(key);
         rr->expiry = USEC_INFINITY;
         rr->n_skip_labels_signer = rr->n_skip_labels_source = (unsigned) -1;
@@ -486,7 +494,13 @@ static DnsResourceRecord* dns_resource_record_free(DnsResourceRecord *rr) {
         }
 
         free(rr->to_string);
-        return mfree(rr);
+
+        if (rr->from_pool)
+                mempool_free_tile(&resource_record_pool, rr);
+        else
+                free(rr);
+
+        return NULL;
 }
 
 DEFINE_TRIVIAL_REF_UNREF_FUNC(DnsResourceRecord, dns_resource_record, dns_resource_record_free);
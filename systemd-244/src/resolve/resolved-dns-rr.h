@@ -103,6 +103,7 @@ struct DnsResourceRecord {
         unsigned n_skip_labels_source;
 
         bool unparseable:1;
+        bool from_pool:1;
 
         bool wire_format_canonical:1;
         void *wire_format;
@@ -1847,8 +1847,21 @@ static int json_parse_string(const char **p, char **ret) {
         c++;
 
         for (;;) {
+                size_t k;
                 int len;
 
+                /* Copy runs of plain ASCII characters in one go */
+                for (k = 0; c[k] >= ' ' && c[k] < 0x7f && !IN_SET(c[k], '"', '\\'); k++)
+                        ;
+                if (k > 0) {
+                        if (!GREEDY_REALLOC(s, allocated, n + k + 1))
+                                return -ENOMEM;
+
+                        memcpy(s + n, c, k);
+                        n += k;
+                        c += k;
+                }
+
                 /* Check for EOF */
                 if (*c == 0)
                         return -EINVAL;
@@ -2059,6 +2072,12 @@ static int json_parse_number(const char **p, JsonValue *ret) {
         }
 }
 
+enum { /* Tokenizer states */
+        STATE_NULL,
+        STATE_VALUE,
+        STATE_VALUE_POST,
+};
+
 int json_tokenize(
                 const char **p,
                 char **ret_string,
@@ -2074,12 +2093,6 @@ int json_tokenize(
         size_t n;
         int t, r;
 
-        enum {
-                STATE_NULL,
-                STATE_VALUE,
-                STATE_VALUE_POST,
-        };
-
         assert(p);
         assert(*p);
         assert(ret_string);
@@ -2271,18 +2284,120 @@ static void json_stack_release(JsonStack *s) {
         s->elements = mfree(s->elements);
 }
 
+typedef struct JsonParseStack {
+        JsonExpect expect;
+
+        /* The values parsed so far, already in the shape they take once embedded into the surrounding array or
+         * object: simple values and short strings are stored inline, everything else as reference. This way
+         * parsing needs no allocation per value, only one per array, object and long string. */
+        JsonVariant *elements;
+        size_t n_elements, n_elements_allocated;
+
+        unsigned line_before;
+        unsigned column_before;
+} JsonParseStack;
+
+static void json_parse_stack_clear(JsonParseStack *s) {
+        size_t i;
+
+        assert(s);
+
+        /* Keeps the element buffer around, so that it may be reused for the next array or object on this level */
+
+        for (i = 0; i < s->n_elements; i++)
+                json_variant_free_inner(s->elements + i);
+
+        s->n_elements = 0;
+}
+
+static JsonVariant *json_parse_stack_push(JsonParseStack *s, JsonSource *source, unsigned line, unsigned column) {
+        JsonVariant *w;
+
+        assert(s);
+
+        if (!GREEDY_REALLOC(s->elements, s->n_elements_allocated, s->n_elements + 1))
+                return NULL;
+
+        if (source && line > source->max_line)
+                source->max_line = line;
+        if (source && column > source->max_column)
+                source->max_column = column;
+
+        w = s->elements + s->n_elements++;
+        *w = (JsonVariant) {
+                .source = json_source_ref(source),
+                .line = line,
+                .column = column,
+                .type = JSON_VARIANT_NULL,
+        };
+
+        return w;
+}
+
+static int json_parse_stack_close(JsonParseStack *s, JsonVariantType type, JsonVariant **ret) {
+        _cleanup_free_ JsonVariant *v = NULL;
+        uint16_t depth = 0;
+        size_t i;
+
+        assert(s);
+        assert(IN_SET(type, JSON_VARIANT_ARRAY, JSON_VARIANT_OBJECT));
+        assert(ret);
+
+        /* Turns the collected elements into an array or object, moving them over as they are */
+
+        if (s->n_elements == 0) {
+                *ret = type == JSON_VARIANT_ARRAY ? JSON_VARIANT_MAGIC_EMPTY_ARRAY : JSON_VARIANT_MAGIC_EMPTY_OBJECT;
+                return 0;
+        }
+
+        for (i = 0; i < s->n_elements; i++) {
+                uint16_t d;
+
+                d = json_variant_depth(s->elements + i);
+                if (d >= DEPTH_MAX) /* Refuse too deep nesting */
+                        return -ELNRNG;
+                if (d >= depth)
+                        depth = d + 1;
+        }
+
+        v = new(JsonVariant, s->n_elements + 1);
+        if (!v)
+                return -ENOMEM;
+
+        *v = (JsonVariant) {
+                .n_ref = 1,
+                .type = type,
+                .depth = depth,
+                .n_elements = s->n_elements,
+        };
+
+        memcpy(v + 1, s->elements, s->n_elements * sizeof(JsonVariant));
+        for (i = 0; i < s->n_elements; i++) {
+                v[1 + i].is_embedded = true;
+                v[1 + i].parent = v;
+        }
+
+        s->n_elements = 0;
+
+        *ret = TAKE_PTR(v);
+        return 0;
+}
+
 static int json_parse_internal(
                 const char **input,
                 JsonSource *source,
                 JsonVariant **ret,
                 unsigned *line,
                 unsigned *column,
+                void **state,
                 bool continue_end) {
 
         size_t n_stack = 1, n_stack_allocated = 0, i;
         unsigned line_buffer = 0, column_buffer = 0;
         void *tokenizer_state = NULL;
-        JsonStack *stack = NULL;
+        _cleanup_(json_variant_unrefp) JsonVariant *v = NULL;
+        JsonParseStack *stack = NULL;
+        JsonVariant *top;
         const char *p;
         int r;
 
@@ -2291,23 +2406,24 @@ static int json_parse_internal(
 
         p = *input;
 
-        if (!GREEDY_REALLOC(stack, n_stack_allocated, n_stack))
+        if (!GREEDY_REALLOC0(stack, n_stack_allocated, n_stack))
                 return -ENOMEM;
 
-        stack[0] = (JsonStack) {
-                .expect = EXPECT_TOPLEVEL,
-        };
+        stack[0].expect = EXPECT_TOPLEVEL;
 
         if (!line)
                 line = &line_buffer;
         if (!column)
                 column = &column_buffer;
+        if (!state)
+                state = &tokenizer_state;
 
         for (;;) {
                 _cleanup_(json_variant_unrefp) JsonVariant *add = NULL;
                 _cleanup_free_ char *string = NULL;
                 unsigned line_token, column_token;
-                JsonStack *current;
+                JsonParseStack *current;
+                JsonVariant *w;
                 JsonValue value;
                 int token;
 
@@ -2317,7 +2433,7 @@ static int json_parse_internal(
                 if (continue_end && current->expect == EXPECT_END)
                         goto done;
 
-                token = json_tokenize(&p, &string, &value, &line_token, &column_token, &tokenizer_state, line, column);
+                token = json_tokenize(&p, &string, &value, &line_token, &column_token, state, line, column);
                 if (token < 0) {
                         r = token;
                         goto finish;
@@ -2343,7 +2459,7 @@ static int json_parse_internal(
                         }
 
                         current->expect = EXPECT_OBJECT_VALUE;
-                        break;
+                        continue;
 
                 case JSON_TOKEN_COMMA:
 
@@ -2356,107 +2472,58 @@ static int json_parse_internal(
                                 goto finish;
                         }
 
-                        break;
+                        continue;
 
                 case JSON_TOKEN_OBJECT_OPEN:
+                case JSON_TOKEN_ARRAY_OPEN:
 
                         if (!IN_SET(current->expect, EXPECT_TOPLEVEL, EXPECT_OBJECT_VALUE, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT)) {
                                 r = -EINVAL;
                                 goto finish;
                         }
 
-                        if (!GREEDY_REALLOC(stack, n_stack_allocated, n_stack+1)) {
+                        if (!GREEDY_REALLOC0(stack, n_stack_allocated, n_stack+1)) {
                                 r = -ENOMEM;
                                 goto finish;
                         }
-                        current = stack + n_stack - 1;
 
-                        /* Prepare the expect for when we return from the child */
-                        if (current->expect == EXPECT_TOPLEVEL)
-                                current->expect = EXPECT_END;
-                        else if (current->expect == EXPECT_OBJECT_VALUE)
-                                current->expect = EXPECT_OBJECT_COMMA;
-                        else {
-                                assert(IN_SET(current->expect, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT));
-                                current->expect = EXPECT_ARRAY_COMMA;
-                        }
+                        current = stack + n_stack++;
+                        assert(current->n_elements == 0);
 
-                        stack[n_stack++] = (JsonStack) {
-                                .expect = EXPECT_OBJECT_FIRST_KEY,
-                                .line_before = line_token,
-                                .column_before = column_token,
-                        };
+                        current->expect = token == JSON_TOKEN_OBJECT_OPEN ? EXPECT_OBJECT_FIRST_KEY : EXPECT_ARRAY_FIRST_ELEMENT;
+                        current->line_before = line_token;
+                        current->column_before = column_token;
 
-                        current = stack + n_stack - 1;
-                        break;
+                        /* The parent's expect is updated once we return from the child */
+                        continue;
 
                 case JSON_TOKEN_OBJECT_CLOSE:
-                        if (!IN_SET(current->expect, EXPECT_OBJECT_FIRST_KEY, EXPECT_OBJECT_COMMA)) {
+                case JSON_TOKEN_ARRAY_CLOSE:
+
+                        if (token == JSON_TOKEN_OBJECT_CLOSE ?
+                            !IN_SET(current->expect, EXPECT_OBJECT_FIRST_KEY, EXPECT_OBJECT_COMMA) :
+                            !IN_SET(current->expect, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_COMMA)) {
                                 r = -EINVAL;
                                 goto finish;
                         }
 
                         assert(n_stack > 1);
 
-                        r = json_variant_new_object(&add, current->elements, current->n_elements);
+                        r = json_parse_stack_close(current,
+                                                   token == JSON_TOKEN_OBJECT_CLOSE ? JSON_VARIANT_OBJECT : JSON_VARIANT_ARRAY,
+                                                   &add);
                         if (r < 0)
                                 goto finish;
 
                         line_token = current->line_before;
                         column_token = current->column_before;
 
-                        json_stack_release(current);
+                        json_parse_stack_clear(current);
                         n_stack--, current--;
 
-                        break;
-
-                case JSON_TOKEN_ARRAY_OPEN:
-                        if (!IN_SET(current->expect, EXPECT_TOPLEVEL, EXPECT_OBJECT_VALUE, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT)) {
-                                r = -EINVAL;
-                                goto finish;
-                        }
-
-                        if (!GREEDY_REALLOC(stack, n_stack_allocated, n_stack+1)) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
-                        current = stack + n_stack - 1;
-
-                        /* Prepare the expect for when we return from the child */
-                        if (current->expect == EXPECT_TOPLEVEL)
-                                current->expect = EXPECT_END;
-                        else if (current->expect == EXPECT_OBJECT_VALUE)
-                                current->expect = EXPECT_OBJECT_COMMA;
-                        else {
-                                assert(IN_SET(current->expect, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT));
-                                current->expect = EXPECT_ARRAY_COMMA;
-                        }
-
-                        stack[n_stack++] = (JsonStack) {
-                                .expect = EXPECT_ARRAY_FIRST_ELEMENT,
-                                .line_before = line_token,
-                                .column_before = column_token,
-                        };
-
-                        break;
-
-                case JSON_TOKEN_ARRAY_CLOSE:
-                        if (!IN_SET(current->expect, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_COMMA)) {
-                                r = -EINVAL;
-                                goto finish;
-                        }
-
-                        assert(n_stack > 1);
-
-                        r = json_variant_new_array(&add, current->elements, current->n_elements);
-                        if (r < 0)
-                                goto finish;
-
-                        line_token = current->line_before;
-                        column_token = current->column_before;
+                        if (json_variant_is_regular(add))
+                                (void) json_variant_set_source(&add, source, line_token, column_token);
 
-                        json_stack_release(current);
-                        n_stack--, current--;
                         break;
 
                 case JSON_TOKEN_STRING:
@@ -2465,141 +2532,99 @@ static int json_parse_internal(
                                 goto finish;
                         }
 
-                        r = json_variant_new_string(&add, string);
-                        if (r < 0)
-                                goto finish;
-
-                        if (current->expect == EXPECT_TOPLEVEL)
-                                current->expect = EXPECT_END;
-                        else if (IN_SET(current->expect, EXPECT_OBJECT_FIRST_KEY, EXPECT_OBJECT_NEXT_KEY))
-                                current->expect = EXPECT_OBJECT_COLON;
-                        else if (current->expect == EXPECT_OBJECT_VALUE)
-                                current->expect = EXPECT_OBJECT_COMMA;
-                        else {
-                                assert(IN_SET(current->expect, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT));
-                                current->expect = EXPECT_ARRAY_COMMA;
+                        /* Strings that don't fit into the element are allocated separately */
+                        if (strlen(string) > INLINE_STRING_MAX) {
+                                r = json_variant_new_string(&add, string);
+                                if (r < 0)
+                                        goto finish;
                         }
 
                         break;
 
                 case JSON_TOKEN_REAL:
+                case JSON_TOKEN_INTEGER:
+                case JSON_TOKEN_UNSIGNED:
+                case JSON_TOKEN_BOOLEAN:
+                case JSON_TOKEN_NULL:
                         if (!IN_SET(current->expect, EXPECT_TOPLEVEL, EXPECT_OBJECT_VALUE, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT)) {
                                 r = -EINVAL;
                                 goto finish;
                         }
 
-                        r = json_variant_new_real(&add, value.real);
-                        if (r < 0)
-                                goto finish;
+                        break;
 
-                        if (current->expect == EXPECT_TOPLEVEL)
-                                current->expect = EXPECT_END;
-                        else if (current->expect == EXPECT_OBJECT_VALUE)
-                                current->expect = EXPECT_OBJECT_COMMA;
-                        else {
-                                assert(IN_SET(current->expect, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT));
-                                current->expect = EXPECT_ARRAY_COMMA;
-                        }
+                default:
+                        assert_not_reached("Unexpected token");
+                }
 
-                        break;
+                /* We got a value (or a key), add it to the current array or object */
 
-                case JSON_TOKEN_INTEGER:
-                        if (!IN_SET(current->expect, EXPECT_TOPLEVEL, EXPECT_OBJECT_VALUE, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT)) {
-                                r = -EINVAL;
-                                goto finish;
-                        }
+                w = json_parse_stack_push(current, source, line_token, column_token);
+                if (!w) {
+                        r = -ENOMEM;
+                        goto finish;
+                }
 
-                        r = json_variant_new_integer(&add, value.integer);
-                        if (r < 0)
-                                goto finish;
+                switch (token) {
 
-                        if (current->expect == EXPECT_TOPLEVEL)
-                                current->expect = EXPECT_END;
-                        else if (current->expect == EXPECT_OBJECT_VALUE)
-                                current->expect = EXPECT_OBJECT_COMMA;
-                        else {
-                                assert(IN_SET(current->expect, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT));
-                                current->expect = EXPECT_ARRAY_COMMA;
-                        }
+                case JSON_TOKEN_OBJECT_CLOSE:
+                        w->type = JSON_VARIANT_OBJECT;
+                        w->is_reference = true;
+                        w->reference = TAKE_PTR(add);
+                        break;
 
+                case JSON_TOKEN_ARRAY_CLOSE:
+                        w->type = JSON_VARIANT_ARRAY;
+                        w->is_reference = true;
+                        w->reference = TAKE_PTR(add);
                         break;
 
-                case JSON_TOKEN_UNSIGNED:
-                        if (!IN_SET(current->expect, EXPECT_TOPLEVEL, EXPECT_OBJECT_VALUE, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT)) {
-                                r = -EINVAL;
-                                goto finish;
-                        }
+                case JSON_TOKEN_STRING:
+                        w->type = JSON_VARIANT_STRING;
+                        if (add) {
+                                w->is_reference = true;
+                                w->reference = TAKE_PTR(add);
+                        } else
+                                strcpy(w->string, string);
+                        break;
 
-                        r = json_variant_new_unsigned(&add, value.unsig);
-                        if (r < 0)
-                                goto finish;
+                case JSON_TOKEN_REAL:
+                        w->type = JSON_VARIANT_REAL;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wfloat-equal"
+                        /* Like json_variant_new_real(), don't retain negative zero */
+                        w->value.real = value.real == 0.0 ? 0.0 : value.real;
+#pragma GCC diagnostic pop
+                        break;
 
-                        if (current->expect == EXPECT_TOPLEVEL)
-                                current->expect = EXPECT_END;
-                        else if (current->expect == EXPECT_OBJECT_VALUE)
-                                current->expect = EXPECT_OBJECT_COMMA;
-                        else {
-                                assert(IN_SET(current->expect, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT));
-                                current->expect = EXPECT_ARRAY_COMMA;
-                        }
+                case JSON_TOKEN_INTEGER:
+                        w->type = JSON_VARIANT_INTEGER;
+                        w->value.integer = value.integer;
+                        break;
 
+                case JSON_TOKEN_UNSIGNED:
+                        w->type = JSON_VARIANT_UNSIGNED;
+                        w->value.unsig = value.unsig;
                         break;
 
                 case JSON_TOKEN_BOOLEAN:
-                        if (!IN_SET(current->expect, EXPECT_TOPLEVEL, EXPECT_OBJECT_VALUE, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT)) {
-                                r = -EINVAL;
-                                goto finish;
-                        }
-
-                        r = json_variant_new_boolean(&add, value.boolean);
-                        if (r < 0)
-                                goto finish;
-
-                        if (current->expect == EXPECT_TOPLEVEL)
-                                current->expect = EXPECT_END;
-                        else if (current->expect == EXPECT_OBJECT_VALUE)
-                                current->expect = EXPECT_OBJECT_COMMA;
-                        else {
-                                assert(IN_SET(current->expect, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT));
-                                current->expect = EXPECT_ARRAY_COMMA;
-                        }
-
+                        w->type = JSON_VARIANT_BOOLEAN;
+                        w->value.boolean = value.boolean;
                         break;
 
                 case JSON_TOKEN_NULL:
-                        if (!IN_SET(current->expect, EXPECT_TOPLEVEL, EXPECT_OBJECT_VALUE, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT)) {
-                                r = -EINVAL;
-                                goto finish;
-                        }
-
-                        r = json_variant_new_null(&add);
-                        if (r < 0)
-                                goto finish;
-
-                        if (current->expect == EXPECT_TOPLEVEL)
-                                current->expect = EXPECT_END;
-                        else if (current->expect == EXPECT_OBJECT_VALUE)
-                                current->expect = EXPECT_OBJECT_COMMA;
-                        else {
-                                assert(IN_SET(current->expect, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT));
-                                current->expect = EXPECT_ARRAY_COMMA;
-                        }
-
                         break;
-
-                default:
-                        assert_not_reached("Unexpected token");
                 }
 
-                if (add) {
-                        (void) json_variant_set_source(&add, source, line_token, column_token);
-
-                        if (!GREEDY_REALLOC(current->elements, current->n_elements_allocated, current->n_elements + 1)) {
-                                r = -ENOMEM;
-                                goto finish;
-                        }
-
-                        current->elements[current->n_elements++] = TAKE_PTR(add);
+                if (current->expect == EXPECT_TOPLEVEL)
+                        current->expect = EXPECT_END;
+                else if (IN_SET(current->expect, EXPECT_OBJECT_FIRST_KEY, EXPECT_OBJECT_NEXT_KEY))
+                        current->expect = EXPECT_OBJECT_COLON;
+                else if (current->expect == EXPECT_OBJECT_VALUE)
+                        current->expect = EXPECT_OBJECT_COMMA;
+                else {
+                        assert(IN_SET(current->expect, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_NEXT_ELEMENT));
+                        current->expect = EXPECT_ARRAY_COMMA;
                 }
         }
 
@@ -2607,13 +2632,36 @@ done:
         assert(n_stack == 1);
         assert(stack[0].n_elements == 1);
 
-        *ret = json_variant_ref(stack[0].elements[0]);
+        /* The top-level value is returned stand-alone rather than embedded, move it out of its element */
+        top = stack[0].elements;
+        if (top->is_reference) {
+                v = TAKE_PTR(top->reference);
+                top->is_reference = false;
+                top->type = JSON_VARIANT_NULL;
+
+                r = json_variant_set_source(&v, top->source, top->line, top->column);
+                if (r < 0)
+                        goto finish;
+        } else {
+                v = newdup(JsonVariant, top, 1);
+                if (!v) {
+                        r = -ENOMEM;
+                        goto finish;
+                }
+
+                v->n_ref = 1;
+                stack[0].n_elements = 0; /* The source reference moved over too */
+        }
+
+        *ret = TAKE_PTR(v);
         *input = p;
         r = 0;
 
 finish:
-        for (i = 0; i < n_stack; i++)
-                json_stack_release(stack + i);
+        for (i = 0; i < n_stack_allocated; i++) {
+                json_parse_stack_clear(stack + i);
+                free(stack[i].elements);
+        }
 
         free(stack);
 
@@ -2621,11 +2669,11 @@ finish:
 }
 
 int json_parse(const char *input, JsonVariant **ret, unsigned *ret_line, unsigned *ret_column) {
-        return json_parse_internal(&input, NULL, ret, ret_line, ret_column, false);
+        return json_parse_internal(&input, NULL, ret, ret_line, ret_column, NULL, false);
 }
 
 int json_parse_continue(const char **p, JsonVariant **ret, unsigned *ret_line, unsigned *ret_column) {
-        return json_parse_internal(p, NULL, ret, ret_line, ret_column, true);
+        return json_parse_internal(p, NULL, ret, ret_line, ret_column, NULL, true);
 }
 
 int json_parse_file(FILE *f, const char *path, JsonVariant **ret, unsigned *ret_line, unsigned *ret_column) {
@@ -2650,7 +2698,522 @@ int json_parse_file(FILE *f, const char *path, JsonVariant **ret, unsigned *ret_
         }
 
         p = text;
-        return json_parse_internal(&p, source, ret, ret_line, ret_column, false);
+        return json_parse_internal(&p, source, ret, ret_line, ret_column, NULL, false);
+}
+
+struct JsonReader {
+        const char *p;
+        void *tokenizer_state;
+        unsigned line, column;
+
+        /* For each array and object we are in, innermost last, what comes next in it */
+        JsonExpect *stack;
+        size_t n_stack, n_stack_allocated;
+
+        /* Whether a value is to be read next, rather than a key, a comma, or the end of an array, an object or
+         * the input */
+        bool at_value;
+
+        /* The key last returned by json_reader_next_key() */
+        char *key;
+};
+
+int json_reader_new(JsonReader **ret, const char *input) {
+        JsonReader *r;
+
+        assert_return(ret, -EINVAL);
+        assert_return(input, -EINVAL);
+
+        r = new(JsonReader, 1);
+        if (!r)
+                return -ENOMEM;
+
+        *r = (JsonReader) {
+                .p = input,
+                .tokenizer_state = INT_TO_PTR(STATE_VALUE),
+                .line = 1,
+                .column = 1,
+                .at_value = true,
+        };
+
+        *ret = r;
+        return 0;
+}
+
+JsonReader *json_reader_free(JsonReader *r) {
+        if (!r)
+                return NULL;
+
+        free(r->stack);
+        free(r->key);
+
+        return mfree(r);
+}
+
+void json_reader_get_position(JsonReader *r, unsigned *ret_line, unsigned *ret_column) {
+        assert(r);
+
+        if (ret_line)
+                *ret_line = r->line;
+        if (ret_column)
+                *ret_column = r->column;
+}
+
+static int json_reader_tokenize(JsonReader *r, char **ret_string, unsigned *ret_line, unsigned *ret_column, JsonValue *ret_value) {
+        unsigned line_token, column_token;
+        JsonValue value;
+
+        assert(r);
+        assert(ret_string);
+
+        return json_tokenize(&r->p, ret_string, ret_value ?: &value,
+                             ret_line ?: &line_token, ret_column ?: &column_token,
+                             &r->tokenizer_state, &r->line, &r->column);
+}
+
+static char json_reader_peek(JsonReader *r) {
+        size_t n;
+
+        assert(r);
+
+        /* Returns the first character of the next token, without consuming the token */
+
+        n = strspn(r->p, WHITESPACE);
+        inc_lines_columns(&r->line, &r->column, r->p, n);
+        r->p += n;
+
+        return *r->p;
+}
+
+static void json_reader_value_done(JsonReader *r) {
+        JsonExpect *e;
+
+        assert(r);
+
+        r->at_value = false;
+
+        if (r->n_stack == 0)
+                return;
+
+        e = r->stack + r->n_stack - 1;
+        if (*e == EXPECT_OBJECT_VALUE)
+                *e = EXPECT_OBJECT_COMMA;
+        else {
+                assert(*e == EXPECT_ARRAY_NEXT_ELEMENT);
+                *e = EXPECT_ARRAY_COMMA;
+        }
+}
+
+JsonVariantType json_reader_peek_type(JsonReader *r) {
+        char c;
+
+        assert_return(r, _JSON_VARIANT_TYPE_INVALID);
+
+        if (!r->at_value)
+                return _JSON_VARIANT_TYPE_INVALID;
+
+        c = json_reader_peek(r);
+        switch (c) {
+
+        case '{':
+                return JSON_VARIANT_OBJECT;
+
+        case '[':
+                return JSON_VARIANT_ARRAY;
+
+        case '"':
+                return JSON_VARIANT_STRING;
+
+        case 't':
+        case 'f':
+                return JSON_VARIANT_BOOLEAN;
+
+        case 'n':
+                return JSON_VARIANT_NULL;
+
+        default:
+                /* We can't tell integers from reals without parsing them, hence use the pseudo-type */
+                if (c != 0 && strchr("-0123456789", c))
+                        return JSON_VARIANT_NUMBER;
+
+                return _JSON_VARIANT_TYPE_INVALID;
+        }
+}
+
+static int json_reader_enter(JsonReader *r, int token_open, JsonExpect expect) {
+        _cleanup_free_ char *string = NULL;
+        int token;
+
+        assert_return(r, -EINVAL);
+        assert_return(r->at_value, -EINVAL);
+
+        if (r->n_stack >= DEPTH_MAX) /* Refuse too deep nesting, like the parser does */
+                return -ELNRNG;
+
+        if (!GREEDY_REALLOC(r->stack, r->n_stack_allocated, r->n_stack + 1))
+                return -ENOMEM;
+
+        token = json_reader_tokenize(r, &string, NULL, NULL, NULL);
+        if (token < 0)
+                return token;
+        if (token != token_open)
+                return -EINVAL;
+
+        r->stack[r->n_stack++] = expect;
+        r->at_value = false;
+
+        return 0;
+}
+
+int json_reader_enter_object(JsonReader *r) {
+        return json_reader_enter(r, JSON_TOKEN_OBJECT_OPEN, EXPECT_OBJECT_FIRST_KEY);
+}
+
+int json_reader_enter_array(JsonReader *r) {
+        return json_reader_enter(r, JSON_TOKEN_ARRAY_OPEN, EXPECT_ARRAY_FIRST_ELEMENT);
+}
+
+int json_reader_next_key(JsonReader *r, const char **ret_key) {
+        _cleanup_free_ char *string = NULL, *colon = NULL;
+        JsonExpect *e;
+        int token;
+
+        assert_return(r, -EINVAL);
+        assert_return(!r->at_value, -EINVAL);
+        assert_return(r->n_stack > 0, -EINVAL);
+
+        e = r->stack + r->n_stack - 1;
+        assert_return(IN_SET(*e, EXPECT_OBJECT_FIRST_KEY, EXPECT_OBJECT_COMMA), -EINVAL);
+
+        token = json_reader_tokenize(r, &string, NULL, NULL, NULL);
+        if (token < 0)
+                return token;
+
+        if (token == JSON_TOKEN_OBJECT_CLOSE) {
+                r->n_stack--;
+                json_reader_value_done(r);
+
+                if (ret_key)
+                        *ret_key = NULL;
+                return 0;
+        }
+
+        if (*e == EXPECT_OBJECT_COMMA) {
+                if (token != JSON_TOKEN_COMMA)
+                        return -EINVAL;
+
+                token = json_reader_tokenize(r, &string, NULL, NULL, NULL);
+                if (token < 0)
+                        return token;
+        }
+
+        if (token != JSON_TOKEN_STRING)
+                return -EINVAL;
+
+        token = json_reader_tokenize(r, &colon, NULL, NULL, NULL);
+        if (token < 0)
+                return token;
+        if (token != JSON_TOKEN_COLON)
+                return -EINVAL;
+
+        free_and_replace(r->key, string);
+        *e = EXPECT_OBJECT_VALUE;
+        r->at_value = true;
+
+        if (ret_key)
+                *ret_key = r->key;
+        return 1;
+}
+
+int json_reader_next_element(JsonReader *r) {
+        _cleanup_free_ char *string = NULL;
+        JsonExpect *e;
+        int token;
+
+        assert_return(r, -EINVAL);
+        assert_return(!r->at_value, -EINVAL);
+        assert_return(r->n_stack > 0, -EINVAL);
+
+        e = r->stack + r->n_stack - 1;
+        assert_return(IN_SET(*e, EXPECT_ARRAY_FIRST_ELEMENT, EXPECT_ARRAY_COMMA), -EINVAL);
+
+        if (json_reader_peek(r) == ']') {
+                token = json_reader_tokenize(r, &string, NULL, NULL, NULL);
+                if (token < 0)
+                        return token;
+                assert(token == JSON_TOKEN_ARRAY_CLOSE);
+
+                r->n_stack--;
+                json_reader_value_done(r);
+                return 0;
+        }
+
+        if (*e == EXPECT_ARRAY_COMMA) {
+                token = json_reader_tokenize(r, &string, NULL, NULL, NULL);
+                if (token < 0)
+                        return token;
+                if (token != JSON_TOKEN_COMMA)
+                        return -EINVAL;
+        }
+
+        *e = EXPECT_ARRAY_NEXT_ELEMENT;
+        r->at_value = true;
+
+        return 1;
+}
+
+int json_reader_read_variant(JsonReader *r, JsonVariant **ret) {
+        _cleanup_(json_variant_unrefp) JsonVariant *v = NULL;
+        int k;
+
+        assert_return(r, -EINVAL);
+        assert_return(r->at_value, -EINVAL);
+        assert_return(ret, -EINVAL);
+
+        if (IN_SET(json_reader_peek_type(r), JSON_VARIANT_OBJECT, JSON_VARIANT_ARRAY)) {
+                k = json_parse_internal(&r->p, NULL, &v, &r->line, &r->column, &r->tokenizer_state, true);
+                if (k < 0)
+                        return k;
+        } else {
+                /* Simple values we can convert right-away, without setting up the parser */
+                _cleanup_free_ char *string = NULL;
+                unsigned line_token, column_token;
+                JsonValue value;
+                int token;
+
+                token = json_reader_tokenize(r, &string, &line_token, &column_token, &value);
+                if (token < 0)
+                        return token;
+
+                switch (token) {
+
+                case JSON_TOKEN_STRING:
+                        k = json_variant_new_string(&v, string);
+                        break;
+
+                case JSON_TOKEN_REAL:
+                        k = json_variant_new_real(&v, value.real);
+                        break;
+
+                case JSON_TOKEN_INTEGER:
+                        k = json_variant_new_integer(&v, value.integer);
+                        break;
+
+                case JSON_TOKEN_UNSIGNED:
+                        k = json_variant_new_unsigned(&v, value.unsig);
+                        break;
+
+                case JSON_TOKEN_BOOLEAN:
+                        k = json_variant_new_boolean(&v, value.boolean);
+                        break;
+
+                case JSON_TOKEN_NULL:
+                        k = json_variant_new_null(&v);
+                        break;
+
+                default:
+                        return -EINVAL;
+                }
+                if (k < 0)
+                        return k;
+
+                k = json_variant_set_source(&v, NULL, line_token, column_token);
+                if (k < 0)
+                        return k;
+        }
+
+        json_reader_value_done(r);
+
+        *ret = TAKE_PTR(v);
+        return 0;
+}
+
+int json_reader_skip(JsonReader *r) {
+        _cleanup_free_ char *string = NULL;
+        int k, token;
+
+        assert_return(r, -EINVAL);
+        assert_return(r->at_value, -EINVAL);
+
+        /* Consumes the next value without turning it into a JsonVariant. Only the syntax is validated. */
+
+        switch (json_reader_peek_type(r)) {
+
+        case JSON_VARIANT_OBJECT:
+                k = json_reader_enter_object(r);
+                if (k < 0)
+                        return k;
+
+                while ((k = json_reader_next_key(r, NULL)) > 0) {
+                        k = json_reader_skip(r);
+                        if (k < 0)
+                                return k;
+                }
+
+                return k;
+
+        case JSON_VARIANT_ARRAY:
+                k = json_reader_enter_array(r);
+                if (k < 0)
+                        return k;
+
+                while ((k = json_reader_next_element(r)) > 0) {
+                        k = json_reader_skip(r);
+                        if (k < 0)
+                                return k;
+                }
+
+                return k;
+
+        default:
+                token = json_reader_tokenize(r, &string, NULL, NULL, NULL);
+                if (token < 0)
+                        return token;
+                if (!IN_SET(token, JSON_TOKEN_STRING, JSON_TOKEN_REAL, JSON_TOKEN_INTEGER, JSON_TOKEN_UNSIGNED, JSON_TOKEN_BOOLEAN, JSON_TOKEN_NULL))
+                        return -EINVAL;
+
+                json_reader_value_done(r);
+                return 0;
+        }
+}
+
+int json_reader_end(JsonReader *r) {
+        assert_return(r, -EINVAL);
+        assert_return(!r->at_value && r->n_stack == 0, -EINVAL);
+
+        /* Verifies that nothing but whitespace follows the top-level value */
+
+        return json_reader_peek(r) == 0 ? 0 : -EINVAL;
+}
+
+int json_reader_dispatch(JsonReader *r, const JsonDispatch table[], JsonDispatchCallback bad, JsonDispatchFlags flags, void *userdata) {
+        const JsonDispatch *p;
+        const char *key;
+        int k, done = 0;
+        bool *found;
+        size_t m;
+
+        assert_return(r, -EINVAL);
+        assert_return(r->at_value, -EINVAL);
+
+        /* Like json_dispatch(), but reads the object right from the input: only the field values are turned into
+         * JsonVariant objects, one at a time, the object as a whole is never put together. Values of fields that
+         * neither the table nor 'bad' are interested in are skipped without allocating anything for them. Note
+         * that on failure the reader is left in the middle of the object. */
+
+        if (json_reader_peek_type(r) != JSON_VARIANT_OBJECT) {
+                json_log(NULL, flags, 0, "JSON variant is not an object.");
+
+                if (flags & JSON_PERMISSIVE)
+                        return json_reader_skip(r);
+
+                return -EINVAL;
+        }
+
+        for (p = table, m = 0; p->name; p++)
+                m++;
+
+        found = newa0(bool, m);
+
+        k = json_reader_enter_object(r);
+        if (k < 0)
+                return k;
+
+        while ((k = json_reader_next_key(r, &key)) > 0) {
+                _cleanup_(json_variant_unrefp) JsonVariant *value = NULL;
+
+                for (p = table; p->name; p++)
+                        if (p->name == (const char*) -1 ||
+                            streq(key, p->name))
+                                break;
+
+                if (!p->name && !bad) {
+                        json_log(NULL, flags, 0, "Unexpected object field '%s'.", key);
+
+                        if (!(flags & JSON_PERMISSIVE))
+                                return -EADDRNOTAVAIL;
+
+                        k = json_reader_skip(r);
+                        if (k < 0)
+                                return k;
+
+                        continue;
+                }
+
+                k = json_reader_read_variant(r, &value);
+                if (k < 0)
+                        return k;
+
+                if (p->name) { /* Found a matching entry! :-) */
+                        JsonDispatchFlags merged_flags;
+
+                        merged_flags = flags | p->flags;
+
+                        if (p->type != _JSON_VARIANT_TYPE_INVALID &&
+                            !json_variant_has_type(value, p->type)) {
+
+                                json_log(value, merged_flags, 0,
+                                         "Object field '%s' has wrong type %s, expected %s.", key,
+                                         json_variant_type_to_string(json_variant_type(value)), json_variant_type_to_string(p->type));
+
+                                if (merged_flags & JSON_PERMISSIVE)
+                                        continue;
+
+                                return -EINVAL;
+                        }
+
+                        if (found[p-table]) {
+                                json_log(value, merged_flags, 0, "Duplicate object field '%s'.", key);
+
+                                if (merged_flags & JSON_PERMISSIVE)
+                                        continue;
+
+                                return -ENOTUNIQ;
+                        }
+
+                        found[p-table] = true;
+
+                        if (p->callback) {
+                                k = p->callback(key, value, merged_flags, (uint8_t*) userdata + p->offset);
+                                if (k < 0) {
+                                        if (merged_flags & JSON_PERMISSIVE)
+                                                continue;
+
+                                        return k;
+                                }
+                        }
+
+                        done ++;
+
+                } else { /* Didn't find a matching entry! :-( */
+
+                        k = bad(key, value, flags, userdata);
+                        if (k < 0) {
+                                if (flags & JSON_PERMISSIVE)
+                                        continue;
+
+                                return k;
+                        } else
+                                done ++;
+                }
+        }
+        if (k < 0)
+                return k;
+
+        for (p = table; p->name; p++) {
+                JsonDispatchFlags merged_flags = p->flags | flags;
+
+                if ((merged_flags & JSON_MANDATORY) && !found[p-table]) {
+                        json_log(NULL, merged_flags, 0, "Missing object field '%s'.", p->name);
+
+                        if ((merged_flags & JSON_PERMISSIVE))
+                                continue;
+
+                        return -ENXIO;
+                }
+        }
+
+        return done;
 }
 
 int json_buildv(JsonVariant **ret, va_list ap) {
@@ -247,6 +247,26 @@ assert_cc(sizeof(uintmax_t) == sizeof(uint64_t));
 assert_cc(sizeof(intmax_t) == sizeof(int64_t));
 #define json_dispatch_int64 json_dispatch_integer
 
+/* A pull parser, for processing large documents piece by piece, without building a JsonVariant tree for all of
+ * it. Objects and arrays are entered and iterated through, while the values inside them are read as JsonVariant,
+ * dispatched into C structures, or skipped. */
+typedef struct JsonReader JsonReader;
+
+int json_reader_new(JsonReader **ret, const char *input);
+JsonReader *json_reader_free(JsonReader *r);
+DEFINE_TRIVIAL_CLEANUP_FUNC(JsonReader *, json_reader_free);
+
+JsonVariantType json_reader_peek_type(JsonReader *r);
+int json_reader_enter_object(JsonReader *r);
+int json_reader_enter_array(JsonReader *r);
+int json_reader_next_key(JsonReader *r, const char **ret_key);
+int json_reader_next_element(JsonReader *r);
+int json_reader_read_variant(JsonReader *r, JsonVariant **ret);
+int json_reader_skip(JsonReader *r);
+int json_reader_dispatch(JsonReader *r, const JsonDispatch table[], JsonDispatchCallback bad, JsonDispatchFlags flags, void *userdata);
+int json_reader_end(JsonReader *r);
+void json_reader_get_position(JsonReader *r, unsigned *ret_line, unsigned *ret_column);
+
 static inline int json_dispatch_level(JsonDispatchFlags flags) {
 
         /* Did the user request no logging? If so, then never log higher than LOG_DEBUG. Also, if this is marked as
@@ -108,6 +108,12 @@ struct Varlink {
                           * at most. */
         unsigned n_pending;
 
+        /* The flags of the method calls we still expect replies for, oldest first. Replies arrive in the
+         * order the calls were made, hence the head tells us whether the next reply may say "continues". */
+        VarlinkMethodFlags *pending;
+        size_t pending_allocated;
+        size_t pending_index;
+
         int fd;
 
         char *input_buffer; /* valid data starts at input_buffer_index, ends at input_buffer_index+input_buffer_size */
@@ -357,6 +363,9 @@ static void varlink_clear(Varlink *v) {
 
         v->input_buffer = mfree(v->input_buffer);
         v->output_buffer = mfree(v->output_buffer);
+        v->pending = mfree(v->pending);
+        v->pending_allocated = v->pending_index = 0;
+        v->n_pending = 0;
 
         v->current = json_variant_unref(v->current);
         v->reply = json_variant_unref(v->reply);
@@ -662,6 +671,48 @@ static int varlink_sanitize_parameters(JsonVariant **v) {
         return 0;
 }
 
+static int varlink_push_pending(Varlink *v, VarlinkMethodFlags flags) {
+        assert(v);
+
+        /* Move the queue back to the start of the array before growing it */
+        if (v->pending_index > 0 && v->pending_index + v->n_pending >= v->pending_allocated) {
+                memmove(v->pending, v->pending + v->pending_index, v->n_pending * sizeof(VarlinkMethodFlags));
+                v->pending_index = 0;
+        }
+
+        if (!GREEDY_REALLOC(v->pending, v->pending_allocated, v->pending_index + v->n_pending + 1))
+                return -ENOMEM;
+
+        v->pending[v->pending_index + v->n_pending++] = flags;
+        return 0;
+}
+
+static VarlinkMethodFlags varlink_pending_head(Varlink *v) {
+        assert(v);
+        assert(v->n_pending > 0);
+
+        return v->pending[v->pending_index];
+}
+
+static void varlink_pop_pending(Varlink *v) {
+        assert(v);
+        assert(v->n_pending > 0);
+
+        v->n_pending--;
+        v->pending_index = v->n_pending == 0 ? 0 : v->pending_index + 1;
+}
+
+static VarlinkState varlink_awaiting_state(Varlink *v) {
+        assert(v);
+
+        /* The state a client with asynchronous method calls in flight is in, depending on the oldest one */
+
+        if (v->n_pending == 0)
+                return VARLINK_IDLE_CLIENT;
+
+        return FLAGS_SET(varlink_pending_head(v), VARLINK_METHOD_MORE) ? VARLINK_AWAITING_REPLY_MORE : VARLINK_AWAITING_REPLY;
+}
+
 static int varlink_dispatch_reply(Varlink *v) {
         _cleanup_(json_variant_unrefp) JsonVariant *parameters = NULL;
         VarlinkReplyFlags flags = 0;
@@ -715,7 +766,7 @@ static int varlink_dispatch_reply(Varlink *v) {
         }
 
         /* Replies with 'continue' set are only OK if we set 'more' when the method call was initiated */
-        if (v->state != VARLINK_AWAITING_REPLY_MORE && FLAGS_SET(flags, VARLINK_REPLY_CONTINUES))
+        if (FLAGS_SET(flags, VARLINK_REPLY_CONTINUES) && !FLAGS_SET(varlink_pending_head(v), VARLINK_METHOD_MORE))
                 goto invalid;
 
         /* An error is final */
@@ -726,6 +777,10 @@ static int varlink_dispatch_reply(Varlink *v) {
         if (r < 0)
                 goto invalid;
 
+        /* With many calls in flight the last one might be answered long after it was sent, hence only time
+         * out if the server stays silent for too long */
+        v->timestamp = now(CLOCK_MONOTONIC);
+
         if (IN_SET(v->state, VARLINK_AWAITING_REPLY, VARLINK_AWAITING_REPLY_MORE)) {
                 varlink_set_state(v, VARLINK_PROCESSING_REPLY);
 
@@ -739,16 +794,13 @@ static int varlink_dispatch_reply(Varlink *v) {
 
                 if (v->state == VARLINK_PROCESSING_REPLY) {
 
-                        assert(v->n_pending > 0);
-
                         if (!FLAGS_SET(flags, VARLINK_REPLY_CONTINUES))
-                                v->n_pending--;
+                                varlink_pop_pending(v);
 
-                        varlink_set_state(v,
-                                          FLAGS_SET(flags, VARLINK_REPLY_CONTINUES) ? VARLINK_AWAITING_REPLY_MORE :
-                                          v->n_pending == 0 ? VARLINK_IDLE_CLIENT : VARLINK_AWAITING_REPLY);
+                        varlink_set_state(v, varlink_awaiting_state(v));
                 }
         } else {
+                /* The reply is picked up by varlink_collect(), which also dequeues the call */
                 assert(v->state == VARLINK_CALLING);
                 varlink_set_state(v, VARLINK_CALLED);
         }
@@ -905,7 +957,21 @@ fail:
         return r;
 }
 
+static bool varlink_write_deferrable(Varlink *v) {
+        assert(v);
+
+        /* Method calls a client pipelined usually arrive with the same read, and as long as they are
+         * answered right away we can dispatch them one after the other. Hold the replies back until the
+         * input is drained then, so that they go out with a single write rather than one per call. Don't let
+         * the output buffer grow too much while doing so. */
+
+        return v->state == VARLINK_IDLE_SERVER &&
+                (v->current || v->input_buffer_unscanned > 0) &&
+                v->output_buffer_size < VARLINK_READ_SIZE;
+}
+
 int varlink_process(Varlink *v) {
+        bool write_deferred;
         int r;
 
         assert_return(v, -EINVAL);
@@ -915,9 +981,12 @@ int varlink_process(Varlink *v) {
 
         varlink_ref(v);
 
-        r = varlink_write(v);
-        if (r != 0)
-                goto finish;
+        write_deferred = varlink_write_deferrable(v);
+        if (!write_deferred) {
+                r = varlink_write(v);
+                if (r != 0)
+                        goto finish;
+        }
 
         r = varlink_dispatch_reply(v);
         if (r != 0)
@@ -935,6 +1004,13 @@ int varlink_process(Varlink *v) {
         if (r != 0)
                 goto finish;
 
+        if (write_deferred) {
+                /* Nothing left to dispatch, send out what we held back above */
+                r = varlink_write(v);
+                if (r != 0)
+                        goto finish;
+        }
+
         r = varlink_test_disconnect(v);
         if (r != 0)
                 goto finish;
@@ -1265,7 +1341,7 @@ int varlink_send(Varlink *v, const char *method, JsonVariant *parameters) {
                 return -ENOTCONN;
 
         /* We allow enqueuing multiple method calls at once! */
-        if (!IN_SET(v->state, VARLINK_IDLE_CLIENT, VARLINK_AWAITING_REPLY))
+        if (!IN_SET(v->state, VARLINK_IDLE_CLIENT, VARLINK_AWAITING_REPLY, VARLINK_AWAITING_REPLY_MORE, VARLINK_CALLING))
                 return -EBUSY;
 
         r = varlink_sanitize_parameters(&parameters);
@@ -1316,7 +1392,7 @@ int varlink_invoke(Varlink *v, const char *method, JsonVariant *parameters) {
                 return -ENOTCONN;
 
         /* We allow enqueing multiple method calls at once! */
-        if (!IN_SET(v->state, VARLINK_IDLE_CLIENT, VARLINK_AWAITING_REPLY))
+        if (!IN_SET(v->state, VARLINK_IDLE_CLIENT, VARLINK_AWAITING_REPLY, VARLINK_AWAITING_REPLY_MORE))
                 return -EBUSY;
 
         r = varlink_sanitize_parameters(&parameters);
@@ -1329,12 +1405,17 @@ int varlink_invoke(Varlink *v, const char *method, JsonVariant *parameters) {
         if (r < 0)
                 return r;
 
-        r = varlink_enqueue_json(v, m);
+        r = varlink_push_pending(v, 0);
         if (r < 0)
                 return r;
 
-        varlink_set_state(v, VARLINK_AWAITING_REPLY);
-        v->n_pending++;
+        r = varlink_enqueue_json(v, m);
+        if (r < 0) {
+                v->n_pending--;
+                return r;
+        }
+
+        varlink_set_state(v, varlink_awaiting_state(v));
         v->timestamp = now(CLOCK_MONOTONIC);
 
         return 0;
@@ -1366,9 +1447,9 @@ int varlink_observe(Varlink *v, const char *method, JsonVariant *parameters) {
 
         if (v->state == VARLINK_DISCONNECTED)
                 return -ENOTCONN;
-        /* Note that we don't allow enqueuing multiple method calls when we are in more/continues mode! We
-         * thus insist on an idle client here. */
-        if (v->state != VARLINK_IDLE_CLIENT)
+        /* The server answers calls in order, hence this may be enqueued behind other calls, and calls
+         * enqueued after this one are answered once the last reply to this one has been received. */
+        if (!IN_SET(v->state, VARLINK_IDLE_CLIENT, VARLINK_AWAITING_REPLY, VARLINK_AWAITING_REPLY_MORE))
                 return -EBUSY;
 
         r = varlink_sanitize_parameters(&parameters);
@@ -1382,13 +1463,17 @@ int varlink_observe(Varlink *v, const char *method, JsonVariant *parameters) {
         if (r < 0)
                 return r;
 
-        r = varlink_enqueue_json(v, m);
+        r = varlink_push_pending(v, VARLINK_METHOD_MORE);
         if (r < 0)
                 return r;
 
+        r = varlink_enqueue_json(v, m);
+        if (r < 0) {
+                v->n_pending--;
+                return r;
+        }
 
-        varlink_set_state(v, VARLINK_AWAITING_REPLY_MORE);
-        v->n_pending++;
+        varlink_set_state(v, varlink_awaiting_state(v));
         v->timestamp = now(CLOCK_MONOTONIC);
 
         return 0;
@@ -1411,26 +1496,21 @@ int varlink_observeb(Varlink *v, const char *method, ...) {
         return varlink_observe(v, method, parameters);
 }
 
-int varlink_call(
-                Varlink *v,
-                const char *method,
-                JsonVariant *parameters,
-                JsonVariant **ret_parameters,
-                const char **ret_error_id,
-                VarlinkReplyFlags *ret_flags) {
-
+int varlink_call_enqueue(Varlink *v, const char *method, JsonVariant *parameters, VarlinkMethodFlags flags) {
         _cleanup_(json_variant_unrefp) JsonVariant *m = NULL;
         int r;
 
         assert_return(v, -EINVAL);
         assert_return(method, -EINVAL);
+        assert_return((flags & ~VARLINK_METHOD_MORE) == 0, -EINVAL);
 
         if (v->state == VARLINK_DISCONNECTED)
                 return -ENOTCONN;
-        if (!IN_SET(v->state, VARLINK_IDLE_CLIENT))
-                return -EBUSY;
 
-        assert(v->n_pending == 0); /* n_pending can't be > 0 if we are in VARLINK_IDLE_CLIENT state */
+        /* Replies to these calls are collected synchronously, hence don't mix them with calls whose replies
+         * go to the reply callback */
+        if (!IN_SET(v->state, VARLINK_IDLE_CLIENT, VARLINK_CALLING))
+                return -EBUSY;
 
         r = varlink_sanitize_parameters(&parameters);
         if (r < 0)
@@ -1438,18 +1518,62 @@ int varlink_call(
 
         r = json_build(&m, JSON_BUILD_OBJECT(
                                        JSON_BUILD_PAIR("method", JSON_BUILD_STRING(method)),
-                                       JSON_BUILD_PAIR("parameters", JSON_BUILD_VARIANT(parameters))));
+                                       JSON_BUILD_PAIR("parameters", JSON_BUILD_VARIANT(parameters)),
+                                       JSON_BUILD_PAIR_CONDITION(FLAGS_SET(flags, VARLINK_METHOD_MORE), "more", JSON_BUILD_BOOLEAN(true))));
         if (r < 0)
                 return r;
 
-        r = varlink_enqueue_json(v, m);
+        r = varlink_push_pending(v, flags);
         if (r < 0)
                 return r;
 
+        r = varlink_enqueue_json(v, m);
+        if (r < 0) {
+                v->n_pending--;
+                return r;
+        }
+
         varlink_set_state(v, VARLINK_CALLING);
-        v->n_pending++;
         v->timestamp = now(CLOCK_MONOTONIC);
 
+        return 0;
+}
+
+int varlink_call_enqueueb(Varlink *v, const char *method, VarlinkMethodFlags flags, ...) {
+        _cleanup_(json_variant_unrefp) JsonVariant *parameters = NULL;
+        va_list ap;
+        int r;
+
+        assert_return(v, -EINVAL);
+
+        va_start(ap, flags);
+        r = json_buildv(&parameters, ap);
+        va_end(ap);
+
+        if (r < 0)
+                return r;
+
+        return varlink_call_enqueue(v, method, parameters, flags);
+}
+
+int varlink_collect(
+                Varlink *v,
+                JsonVariant **ret_parameters,
+                const char **ret_error_id,
+                VarlinkReplyFlags *ret_flags) {
+
+        VarlinkReplyFlags flags = 0;
+        int r;
+
+        assert_return(v, -EINVAL);
+
+        if (v->state == VARLINK_DISCONNECTED)
+                return -ENOTCONN;
+        if (v->state == VARLINK_IDLE_CLIENT) /* All replies collected already */
+                return 0;
+        if (v->state != VARLINK_CALLING)
+                return -EBUSY;
+
         while (v->state == VARLINK_CALLING) {
 
                 r = varlink_process(v);
@@ -1471,16 +1595,22 @@ int varlink_call(
                 json_variant_unref(v->reply);
                 v->reply = TAKE_PTR(v->current);
 
-                varlink_set_state(v, VARLINK_IDLE_CLIENT);
-                assert(v->n_pending == 1);
-                v->n_pending--;
+                /* varlink_dispatch_reply() validated the reply already */
+                if (json_variant_by_key(v->reply, "error"))
+                        flags |= VARLINK_REPLY_ERROR;
+                if (json_variant_boolean(json_variant_by_key(v->reply, "continues")))
+                        flags |= VARLINK_REPLY_CONTINUES;
+                else
+                        varlink_pop_pending(v);
+
+                varlink_set_state(v, v->n_pending > 0 ? VARLINK_CALLING : VARLINK_IDLE_CLIENT);
 
                 if (ret_parameters)
                         *ret_parameters = json_variant_by_key(v->reply, "parameters");
                 if (ret_error_id)
                         *ret_error_id = json_variant_string(json_variant_by_key(v->reply, "error"));
                 if (ret_flags)
-                        *ret_flags = 0;
+                        *ret_flags = flags;
 
                 return 1;
 
@@ -1496,6 +1626,33 @@ int varlink_call(
         }
 }
 
+int varlink_call(
+                Varlink *v,
+                const char *method,
+                JsonVariant *parameters,
+                JsonVariant **ret_parameters,
+                const char **ret_error_id,
+                VarlinkReplyFlags *ret_flags) {
+
+        int r;
+
+        assert_return(v, -EINVAL);
+        assert_return(method, -EINVAL);
+
+        if (v->state == VARLINK_DISCONNECTED)
+                return -ENOTCONN;
+        if (!IN_SET(v->state, VARLINK_IDLE_CLIENT))
+                return -EBUSY;
+
+        assert(v->n_pending == 0); /* n_pending can't be > 0 if we are in VARLINK_IDLE_CLIENT state */
+
+        r = varlink_call_enqueue(v, method, parameters, 0);
+        if (r < 0)
+                return r;
+
+        return varlink_collect(v, ret_parameters, ret_error_id, ret_flags);
+}
+
 int varlink_callb(
                 Varlink *v,
                 const char *method,
@@ -82,6 +82,17 @@ int varlink_sendb(Varlink *v, const char *method, ...);
 int varlink_call(Varlink *v, const char *method, JsonVariant *parameters, JsonVariant **ret_parameters, const char **ret_error_id, VarlinkReplyFlags *ret_flags);
 int varlink_callb(Varlink *v, const char *method, JsonVariant **ret_parameters, const char **ret_error_id, VarlinkReplyFlags *ret_flags, ...);
 
+/* Enqueue method call, and collect the reply later with varlink_collect(). Any number of calls may be enqueued
+ * before collecting the replies, which saves a round-trip per call. Pass VARLINK_METHOD_MORE to ask for more
+ * than one reply. */
+int varlink_call_enqueue(Varlink *v, const char *method, JsonVariant *parameters, VarlinkMethodFlags flags);
+int varlink_call_enqueueb(Varlink *v, const char *method, VarlinkMethodFlags flags, ...);
+
+/* Wait for the next reply to calls enqueued with varlink_call_enqueue(), in the order the calls were enqueued.
+ * VARLINK_REPLY_CONTINUES is set if more replies to the same call follow. Returns 0 if no call is pending
+ * anymore. The returned parameters and error id remain valid until the next call. */
+int varlink_collect(Varlink *v, JsonVariant **ret_parameters, const char **ret_error_id, VarlinkReplyFlags *ret_flags);
+
 /* Enqueue method call, expect a reply, which is eventually delivered to the reply callback */
 int varlink_invoke(Varlink *v, const char *method, JsonVariant *parameters);
 int varlink_invokeb(Varlink *v, const char *method, ...);
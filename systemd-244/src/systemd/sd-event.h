@@ -110,6 +110,8 @@ int sd_event_get_exit_code(sd_event *e, int *code);
 int sd_event_set_watchdog(sd_event *e, int b);
 int sd_event_get_watchdog(sd_event *e);
 int sd_event_get_iteration(sd_event *e, uint64_t *ret);
+int sd_event_get_wakeups(sd_event *e, uint64_t *ret_wakeups, uint64_t *ret_events, uint64_t *ret_full);
+int sd_event_get_dispatch_time(sd_event *e, uint64_t *ret);
 
 sd_event_source* sd_event_source_ref(sd_event_source *s);
 sd_event_source* sd_event_source_unref(sd_event_source *s);
@@ -134,6 +136,9 @@ int sd_event_source_set_io_fd_own(sd_event_source *s, int own);
 int sd_event_source_get_io_events(sd_event_source *s, uint32_t* events);
 int sd_event_source_set_io_events(sd_event_source *s, uint32_t events);
 int sd_event_source_get_io_revents(sd_event_source *s, uint32_t* revents);
+int sd_event_source_get_io_read_size(sd_event_source *s, size_t *ret);
+int sd_event_source_set_io_read_size(sd_event_source *s, size_t size);
+int sd_event_source_get_io_read_data(sd_event_source *s, const void **ret_data, size_t *ret_size);
 int sd_event_source_get_time(sd_event_source *s, uint64_t *usec);
 int sd_event_source_set_time(sd_event_source *s, uint64_t usec);
 int sd_event_source_get_time_accuracy(sd_event_source *s, uint64_t *usec);
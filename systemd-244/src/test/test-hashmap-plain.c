@@ -746,6 +746,7 @@ static void test_hashmap_many(void) {
                 unsigned n_entries;
         } tests[] = {
                 { "trivial_hashmap_ops",  NULL,                  slow ? 1 << 20 : 240 },
+                { "trivial_fast_hash_ops", &trivial_fast_hash_ops, slow ? 1 << 20 : 240 },
                 { "crippled_hashmap_ops", &crippled_hashmap_ops, slow ? 1 << 14 : 140 },
         };
 
@@ -784,6 +785,71 @@ static void test_hashmap_many(void) {
         }
 }
 
+static void test_hashmap_benchmark_one(const char *title, const struct hash_ops *ops, char **keys, unsigned n_entries) {
+        char b[FORMAT_TIMESPAN_MAX];
+        Hashmap *h;
+        usec_t ts;
+        unsigned i;
+
+        assert_se(h = hashmap_new(ops));
+
+        ts = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n_entries; i++)
+                assert_se(hashmap_put(h, keys[i], keys[i]) == 1);
+        log_info("%s: %u inserts took %s", title, n_entries,
+                 format_timespan(b, sizeof b, now(CLOCK_MONOTONIC) - ts, 1));
+
+        ts = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n_entries; i++)
+                assert_se(hashmap_get(h, keys[i]) == keys[i]);
+        log_info("%s: %u successful lookups took %s", title, n_entries,
+                 format_timespan(b, sizeof b, now(CLOCK_MONOTONIC) - ts, 1));
+
+        /* The second half of the keys is not in the hashmap */
+        ts = now(CLOCK_MONOTONIC);
+        for (i = n_entries; i < 2 * n_entries; i++)
+                assert_se(!hashmap_get(h, keys[i]));
+        log_info("%s: %u failing lookups took %s", title, n_entries,
+                 format_timespan(b, sizeof b, now(CLOCK_MONOTONIC) - ts, 1));
+
+        ts = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n_entries; i++)
+                assert_se(hashmap_remove(h, keys[i]) == keys[i]);
+        log_info("%s: %u removals took %s", title, n_entries,
+                 format_timespan(b, sizeof b, now(CLOCK_MONOTONIC) - ts, 1));
+
+        assert_se(hashmap_isempty(h));
+        hashmap_free(h);
+}
+
+static void test_hashmap_benchmark(void) {
+        bool slow = slow_tests_enabled();
+        unsigned n_entries, i;
+
+        /* Compares SipHash with the fast hash functions for trusted keys, for pointer and string keys. Run with
+         * a tree before the change to compare with that. */
+
+        log_info("/* %s (%s) */", __func__, slow ? "slow" : "fast");
+
+        for (n_entries = 1000; n_entries <= (slow ? 10000000U : 100000U); n_entries *= 10) {
+                _cleanup_free_ char **keys = NULL;
+                _cleanup_free_ char *strings = NULL;
+
+                assert_se(keys = new(char*, 2 * n_entries));
+                assert_se(strings = new(char, 2 * n_entries * DECIMAL_STR_MAX(unsigned)));
+
+                for (i = 0; i < 2 * n_entries; i++) {
+                        keys[i] = strings + i * DECIMAL_STR_MAX(unsigned);
+                        sprintf(keys[i], "%u", i);
+                }
+
+                test_hashmap_benchmark_one("trivial_hash_ops", &trivial_hash_ops, keys, n_entries);
+                test_hashmap_benchmark_one("trivial_fast_hash_ops", &trivial_fast_hash_ops, keys, n_entries);
+                test_hashmap_benchmark_one("string_hash_ops", &string_hash_ops, keys, n_entries);
+                test_hashmap_benchmark_one("string_fast_hash_ops", &string_fast_hash_ops, keys, n_entries);
+        }
+}
+
 extern unsigned custom_counter;
 extern const struct hash_ops boring_hash_ops, custom_hash_ops;
 
@@ -1085,6 +1151,7 @@ void test_hashmap_funcs(void) {
         test_hashmap_get2();
         test_hashmap_size();
         test_hashmap_many();
+        test_hashmap_benchmark();
         test_hashmap_free();
         test_hashmap_free_with_destructor();
         test_hashmap_first();
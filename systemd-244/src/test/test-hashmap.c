@@ -1,6 +1,11 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
+#include <pthread.h>
+#include <unistd.h>
+
 #include "hashmap.h"
+#include "process-util.h"
+#include "string-util.h"
 #include "util.h"
 
 unsigned custom_counter = 0;
@@ -109,11 +114,71 @@ static void test_iterated_cache(void) {
         assert_se(iterated_cache_free(c) == NULL);
 }
 
+#define N_THREADS 8
+#define N_ENTRIES 3 /* few enough to stay in direct storage, which uses the shared hash key */
+
+static pthread_barrier_t concurrent_barrier;
+
+static void *concurrent_thread(void *userdata) {
+        Hashmap *m;
+        unsigned i;
+
+        /* All threads allocate their first hash table at the same time, then look up what they put in after
+         * all others did the same */
+        (void) pthread_barrier_wait(&concurrent_barrier);
+
+        assert_se(m = hashmap_new(NULL));
+        for (i = 0; i < N_ENTRIES; i++)
+                assert_se(hashmap_put(m, UINT_TO_PTR(i + 1), UINT_TO_PTR(i + 1)) == 1);
+
+        (void) pthread_barrier_wait(&concurrent_barrier);
+
+        for (i = 0; i < N_ENTRIES; i++)
+                assert_se(hashmap_get(m, UINT_TO_PTR(i + 1)) == UINT_TO_PTR(i + 1));
+
+        hashmap_free(m);
+        return NULL;
+}
+
+static void test_concurrent_first_use_child(void) {
+        pthread_t threads[N_THREADS];
+        unsigned i;
+
+        assert_se(pthread_barrier_init(&concurrent_barrier, NULL, N_THREADS) == 0);
+
+        for (i = 0; i < N_THREADS; i++)
+                assert_se(pthread_create(threads + i, NULL, concurrent_thread, NULL) == 0);
+        for (i = 0; i < N_THREADS; i++)
+                assert_se(pthread_join(threads[i], NULL) == 0);
+
+        assert_se(pthread_barrier_destroy(&concurrent_barrier) == 0);
+}
+
+static void test_concurrent_first_use(void) {
+        int r;
+
+        log_info("/* %s */", __func__);
+
+        /* Run in a new process image, in which no hash table was allocated yet */
+        r = safe_fork("(concurrent)", FORK_DEATHSIG|FORK_LOG|FORK_WAIT, NULL);
+        assert_se(r >= 0);
+        if (r == 0) {
+                (void) execl("/proc/self/exe", program_invocation_short_name, "--concurrent-first-use", NULL);
+                log_error_errno(errno, "Failed to execute test: %m");
+                _exit(EXIT_FAILURE);
+        }
+}
+
 int main(int argc, const char *argv[]) {
         /* This file tests in test-hashmap-plain.c, and tests in test-hashmap-ordered.c, which is generated
          * from test-hashmap-plain.c. Hashmap tests should be added to test-hashmap-plain.c, and here only if
          * they don't apply to ordered hashmaps. */
 
+        if (argc > 1 && streq(argv[1], "--concurrent-first-use")) {
+                test_concurrent_first_use_child();
+                return 0;
+        }
+
         log_parse_environment();
         log_open();
 
@@ -127,6 +192,7 @@ int main(int argc, const char *argv[]) {
         test_trivial_compare_func();
         test_string_compare_func();
         test_iterated_cache();
+        test_concurrent_first_use();
 
         return 0;
 }
@@ -10,6 +10,7 @@
 #include "string-util.h"
 #include "strv.h"
 #include "tests.h"
+#include "time-util.h"
 #include "util.h"
 
 static void test_tokenizer(const char *data, ...) {
@@ -415,6 +416,199 @@ static void test_depth(void) {
         fputs("\n", stdout);
 }
 
+typedef struct Record {
+        char *name;
+        uint32_t uid;
+        int disabled;
+        char **groups;
+        JsonVariant *extra;
+} Record;
+
+static void record_done(Record *r) {
+        free(r->name);
+        strv_free(r->groups);
+        json_variant_unref(r->extra);
+        *r = (Record) {};
+}
+
+static const JsonDispatch record_table[] = {
+        { "name",     JSON_VARIANT_STRING,   json_dispatch_string,   offsetof(Record, name),     JSON_MANDATORY },
+        { "uid",      JSON_VARIANT_UNSIGNED, json_dispatch_uint32,   offsetof(Record, uid),      JSON_MANDATORY },
+        { "disabled", JSON_VARIANT_BOOLEAN,  json_dispatch_tristate, offsetof(Record, disabled), 0              },
+        { "groups",   JSON_VARIANT_ARRAY,    json_dispatch_strv,     offsetof(Record, groups),   0              },
+        { "extra",    _JSON_VARIANT_TYPE_INVALID, json_dispatch_variant, offsetof(Record, extra), 0            },
+        {}
+};
+
+static void test_reader(void) {
+        static const char data[] =
+                "{ \"records\" : [\n"
+                "  { \"name\" : \"root\", \"uid\" : 0, \"groups\" : [ \"wheel\" ], \"extra\" : { \"a\" : [ 1, 2 ] } },\n"
+                "  { \"ignored\" : { \"x\" : [ {}, [], \"y\" ] }, \"uid\" : 4711, \"name\" : \"a-rather-long-user-name\", \"disabled\" : true }\n"
+                "], \"count\" : 2 }\n";
+
+        _cleanup_(json_reader_freep) JsonReader *r = NULL;
+        _cleanup_(json_variant_unrefp) JsonVariant *v = NULL;
+        Record record = {};
+        unsigned line, column, n = 0;
+        const char *key;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(json_reader_new(&r, data) >= 0);
+        assert_se(json_reader_peek_type(r) == JSON_VARIANT_OBJECT);
+        assert_se(json_reader_enter_object(r) >= 0);
+
+        assert_se(json_reader_next_key(r, &key) > 0);
+        assert_se(streq(key, "records"));
+        assert_se(json_reader_peek_type(r) == JSON_VARIANT_ARRAY);
+        assert_se(json_reader_enter_array(r) >= 0);
+
+        /* The second record has a field the table doesn't know */
+        assert_se(json_reader_next_element(r) > 0);
+        assert_se(json_reader_dispatch(r, record_table, NULL, 0, &record) == 4);
+        assert_se(streq(record.name, "root"));
+        assert_se(record.uid == 0);
+        assert_se(strv_equal(record.groups, STRV_MAKE("wheel")));
+        assert_se(json_variant_elements(json_variant_by_key(record.extra, "a")) == 2);
+        assert_se(json_variant_get_source(record.extra, NULL, &line, &column) >= 0);
+        assert_se(line == 2 && column == 67);
+        record_done(&record);
+
+        assert_se(json_reader_next_element(r) > 0);
+        assert_se(json_reader_dispatch(r, record_table, NULL, JSON_PERMISSIVE, &record) == 3);
+        assert_se(streq(record.name, "a-rather-long-user-name"));
+        assert_se(record.uid == 4711);
+        assert_se(record.disabled > 0);
+        assert_se(!record.groups && !record.extra);
+        record_done(&record);
+
+        assert_se(json_reader_next_element(r) == 0);
+
+        assert_se(json_reader_next_key(r, &key) > 0);
+        assert_se(streq(key, "count"));
+        assert_se(json_reader_peek_type(r) == JSON_VARIANT_NUMBER);
+        assert_se(json_reader_read_variant(r, &v) >= 0);
+        assert_se(json_variant_unsigned(v) == 2);
+
+        assert_se(json_reader_next_key(r, &key) == 0);
+        assert_se(json_reader_end(r) >= 0);
+        json_reader_get_position(r, &line, &column);
+        assert_se(line == 5 && column == 1);
+
+        /* Unknown fields are refused unless we are permissive, as are missing mandatory ones */
+        r = json_reader_free(r);
+        assert_se(json_reader_new(&r, "{ \"name\" : \"foo\", \"uid\" : 1, \"bogus\" : 7 }") >= 0);
+        assert_se(json_reader_dispatch(r, record_table, NULL, 0, &record) == -EADDRNOTAVAIL);
+        record_done(&record);
+
+        r = json_reader_free(r);
+        assert_se(json_reader_new(&r, "{ \"name\" : \"foo\" }") >= 0);
+        assert_se(json_reader_dispatch(r, record_table, NULL, 0, &record) == -ENXIO);
+        record_done(&record);
+
+        r = json_reader_free(r);
+        assert_se(json_reader_new(&r, "[ \"foo\", 7 ]") >= 0);
+        assert_se(json_reader_dispatch(r, record_table, NULL, 0, &record) == -EINVAL);
+
+        /* Skipping validates the syntax all the same */
+        r = json_reader_free(r);
+        assert_se(json_reader_new(&r, "[ { \"a\" : [ 1, 2, ] } ]") >= 0);
+        assert_se(json_reader_skip(r) == -EINVAL);
+
+        r = json_reader_free(r);
+        assert_se(json_reader_new(&r, "[ 1, 2 ] 3") >= 0);
+        assert_se(json_reader_enter_array(r) >= 0);
+        while ((n = json_reader_next_element(r)) > 0)
+                assert_se(json_reader_skip(r) >= 0);
+        assert_se(json_reader_end(r) == -EINVAL);
+}
+
+static char *benchmark_document(unsigned n_records) {
+        _cleanup_fclose_ FILE *f = NULL;
+        char *text = NULL;
+        size_t size;
+        unsigned i;
+
+        assert_se(f = open_memstream_unlocked(&text, &size));
+
+        /* Something that looks like a user database listing */
+        fputs("[", f);
+        for (i = 0; i < n_records; i++)
+                fprintf(f, "%s{\"userName\":\"user%u\",\"uid\":%u,\"gid\":%u,\"realName\":\"User Number %u\","
+                        "\"homeDirectory\":\"/home/user%u\",\"shell\":\"/bin/bash\",\"disabled\":%s,"
+                        "\"memberOf\":[\"users\",\"wheel\"],\"lastChangeUSec\":%u000000}",
+                        i > 0 ? ",\n" : "", i, 1000 + i, 1000 + i, i, i, i % 7 == 0 ? "true" : "false", 1500000000 + i);
+        fputs("]\n", f);
+
+        assert_se(fflush_and_check(f) >= 0);
+        f = safe_fclose(f);
+
+        return text;
+}
+
+static const JsonDispatch benchmark_table[] = {
+        { "userName",      JSON_VARIANT_STRING,   json_dispatch_string,   offsetof(Record, name),     JSON_MANDATORY },
+        { "uid",           JSON_VARIANT_UNSIGNED, json_dispatch_uint32,   offsetof(Record, uid),      JSON_MANDATORY },
+        { "disabled",      JSON_VARIANT_BOOLEAN,  json_dispatch_tristate, offsetof(Record, disabled), 0              },
+        { "memberOf",      JSON_VARIANT_ARRAY,    json_dispatch_strv,     offsetof(Record, groups),   0              },
+        {}
+};
+
+static void test_benchmark(unsigned n_records) {
+        _cleanup_(json_reader_freep) JsonReader *r = NULL;
+        _cleanup_(json_variant_unrefp) JsonVariant *v = NULL;
+        _cleanup_free_ char *text = NULL, *formatted = NULL;
+        char b[FORMAT_TIMESPAN_MAX];
+        Record record = {};
+        JsonVariant *e;
+        usec_t ts;
+        unsigned n;
+
+        log_info("/* %s(%u) */", __func__, n_records);
+
+        /* Don't measure the debug logging about the fields we ignore */
+        log_set_max_level(LOG_INFO);
+
+        text = benchmark_document(n_records);
+
+        ts = now(CLOCK_MONOTONIC);
+        assert_se(json_parse(text, &v, NULL, NULL) >= 0);
+        log_info("json_parse() of %zu bytes: %s", strlen(text), format_timespan(b, sizeof b, now(CLOCK_MONOTONIC) - ts, 1));
+        assert_se(json_variant_elements(v) == n_records);
+
+        ts = now(CLOCK_MONOTONIC);
+        assert_se(json_variant_format(v, 0, &formatted) >= 0);
+        log_info("json_variant_format(): %s", format_timespan(b, sizeof b, now(CLOCK_MONOTONIC) - ts, 1));
+
+        ts = now(CLOCK_MONOTONIC);
+        n = 0;
+        JSON_VARIANT_ARRAY_FOREACH(e, v) {
+                assert_se(json_dispatch(e, benchmark_table, NULL, JSON_PERMISSIVE, &record) >= 0);
+                n += record.uid == 1000 + n;
+        }
+        log_info("json_dispatch() of all records: %s", format_timespan(b, sizeof b, now(CLOCK_MONOTONIC) - ts, 1));
+        assert_se(n == n_records);
+        record_done(&record);
+
+        v = json_variant_unref(v);
+
+        ts = now(CLOCK_MONOTONIC);
+        n = 0;
+        assert_se(json_reader_new(&r, text) >= 0);
+        assert_se(json_reader_enter_array(r) >= 0);
+        while (json_reader_next_element(r) > 0) {
+                assert_se(json_reader_dispatch(r, benchmark_table, NULL, JSON_PERMISSIVE, &record) >= 0);
+                n += record.uid == 1000 + n;
+        }
+        assert_se(json_reader_end(r) >= 0);
+        log_info("json_reader_dispatch() of all records: %s", format_timespan(b, sizeof b, now(CLOCK_MONOTONIC) - ts, 1));
+        assert_se(n == n_records);
+        record_done(&record);
+
+        log_set_max_level(LOG_DEBUG);
+}
+
 int main(int argc, char *argv[]) {
         test_setup_logging(LOG_DEBUG);
 
@@ -467,5 +661,10 @@ int main(int argc, char *argv[]) {
 
         test_depth();
 
+        test_reader();
+
+        test_benchmark(1000);
+        test_benchmark(slow_tests_enabled() ? 1000000 : 10000);
+
         return 0;
 }
@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <sys/socket.h>
+
+#include "fd-util.h"
+#include "log.h"
+#include "manager.h"
+#include "process-util.h"
+#include "rm-rf.h"
+#include "service.h"
+#include "socket-util.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "tests.h"
+
+#define BUDGET 2U
+#define N_MESSAGES (3 * BUDGET + 1)
+
+static void send_notify(int fd, const char *message) {
+        assert_se(send(fd, message, strlen(message), MSG_DONTWAIT) == (ssize_t) strlen(message));
+}
+
+static void run_once(Manager *m, unsigned *iterations) {
+        assert_se(++*iterations < 1000);
+        assert_se(sd_event_run(m->event, 5 * USEC_PER_SEC) > 0);
+}
+
+int main(int argc, char *argv[]) {
+        _cleanup_(rm_rf_physical_and_freep) char *runtime_dir = NULL;
+        _cleanup_(manager_freep) Manager *m = NULL;
+        _cleanup_close_ int fd = -1;
+        union sockaddr_union sa = {};
+        unsigned i, iterations = 0;
+        char buf[STRLEN("STATUS=message ") + DECIMAL_STR_MAX(unsigned)], last[sizeof(buf)];
+        const char *status;
+        Service *s;
+        Unit *u;
+        int r, salen;
+
+        test_setup_logging(LOG_DEBUG);
+
+        r = enter_cgroup_subroot(NULL);
+        if (r == -ENOMEDIUM)
+                return log_tests_skipped("cgroupfs not available");
+
+        assert_se(set_unit_path(get_testdata_dir()) >= 0);
+        assert_se(runtime_dir = setup_fake_runtime_dir());
+
+        r = manager_new(UNIT_FILE_USER, MANAGER_TEST_RUN_BASIC | MANAGER_TEST_RUN_NOTIFY, &m);
+        if (manager_errno_skip_test(r))
+                return log_tests_skipped_errno(r, "manager_new");
+        assert_se(r >= 0);
+        assert_se(manager_startup(m, NULL, NULL) >= 0);
+        assert_se(m->notify_fd >= 0);
+        assert_se(!m->notify_throttled);
+
+        m->notify_budget = BUDGET;
+
+        assert_se(u = unit_new(m, sizeof(Service)));
+        assert_se(unit_add_name(u, "notify.service") >= 0);
+        s = SERVICE(u);
+        s->notify_access = NOTIFY_ALL;
+        assert_se(unit_watch_pid(u, getpid_cached(), false) >= 0);
+
+        assert_se((fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0)) >= 0);
+        assert_se((salen = sockaddr_un_set_path(&sa.un, m->notify_socket)) >= 0);
+        assert_se(connect(fd, &sa.sa, salen) >= 0);
+
+        /* Queue more messages than the budget allows to process in one iteration */
+        for (i = 0; i < N_MESSAGES; i++) {
+                xsprintf(buf, "STATUS=message %u", i);
+                send_notify(fd, buf);
+        }
+        xsprintf(last, "message %u", N_MESSAGES - 1);
+
+        /* Once the budget is used up, the notify event source is throttled, with the rest still queued */
+        while (!m->notify_throttled)
+                run_once(m, &iterations);
+        xsprintf(buf, "message %u", BUDGET - 1);
+        assert_se(streq_ptr(s->status_text, buf));
+
+        /* The remaining ones are processed in later iterations, and nothing is left behind */
+        while (!streq_ptr(s->status_text, last))
+                run_once(m, &iterations);
+        assert_se(!m->notify_throttled);
+        assert_se(recv(m->notify_fd, buf, sizeof(buf), MSG_DONTWAIT|MSG_PEEK) < 0 && errno == EAGAIN);
+
+        /* A repeated status text is dropped early: the one we already have is kept and not replaced by a copy */
+        send_notify(fd, "STATUS=same");
+        while (!streq_ptr(s->status_text, "same"))
+                run_once(m, &iterations);
+        status = s->status_text;
+
+        send_notify(fd, "STATUS=same\nERRNO=5");
+        while (s->status_errno != 5)
+                run_once(m, &iterations);
+        assert_se(s->status_text == status);
+
+        /* An empty one still clears it */
+        send_notify(fd, "STATUS=");
+        while (s->status_text)
+                run_once(m, &iterations);
+
+        return 0;
+}
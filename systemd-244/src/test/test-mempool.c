@@ -0,0 +1,205 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "mempool.h"
+#include "process-util.h"
+#include "tests.h"
+#include "time-util.h"
+
+typedef struct Tile {
+        uint64_t data[12];
+} Tile;
+
+DEFINE_MEMPOOL(tile_pool, Tile, 16);
+
+#define N_THREADS 8U
+#define N_LIVE 256U
+
+static unsigned n_iterations;
+
+static void test_basic(void) {
+        MempoolStats stats;
+        Tile *a, *b;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(a = mempool_alloc0_tile(&tile_pool));
+        assert_se(a->data[0] == 0 && a->data[11] == 0);
+        assert_se(b = mempool_alloc_tile(&tile_pool));
+        assert_se(a != b);
+
+        /* A freed tile is handed out again first */
+        mempool_free_tile(&tile_pool, b);
+        assert_se(mempool_alloc_tile(&tile_pool) == b);
+
+        mempool_free_tile(&tile_pool, a);
+        mempool_free_tile(&tile_pool, b);
+
+        mempool_get_stats(&tile_pool, &stats);
+        assert_se(stats.n_pools == 1);
+        assert_se(stats.n_allocs == 3);
+        assert_se(stats.n_cache_hits == 2);
+}
+
+static void* thread_free(void *p) {
+        Tile **tiles = p;
+        unsigned i;
+
+        for (i = 0; i < N_LIVE; i++)
+                mempool_free_tile(&tile_pool, tiles[i]);
+
+        return NULL;
+}
+
+static void test_free_in_other_thread(void) {
+        _cleanup_free_ Tile **tiles = NULL;
+        MempoolStats stats;
+        pthread_t t;
+        unsigned i;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(tiles = new(Tile*, N_LIVE));
+        for (i = 0; i < N_LIVE; i++)
+                assert_se(tiles[i] = mempool_alloc_tile(&tile_pool));
+
+        assert_se(pthread_create(&t, NULL, thread_free, tiles) == 0);
+        assert_se(pthread_join(t, NULL) == 0);
+
+        /* Everything the thread freed went to the shared free list, at the latest when it exited */
+        mempool_get_stats(&tile_pool, &stats);
+        assert_se(stats.n_free >= N_LIVE);
+
+        /* Hence allocating again does not need new tiles */
+        for (i = 0; i < N_LIVE; i++)
+                assert_se(tiles[i] = mempool_alloc_tile(&tile_pool));
+        assert_se(tile_pool.stats.n_tiles == stats.n_tiles);
+
+        for (i = 0; i < N_LIVE; i++)
+                mempool_free_tile(&tile_pool, tiles[i]);
+}
+
+static void* thread_hold_lock(void *p) {
+        int *fd = p;
+
+        /* Pretend to be in the middle of a refill while the main thread forks */
+        assert_se(pthread_mutex_lock(&tile_pool.lock) == 0);
+        assert_se(write(*fd, "x", 1) == 1);
+        (void) usleep(100 * USEC_PER_MSEC);
+        assert_se(pthread_mutex_unlock(&tile_pool.lock) == 0);
+
+        return NULL;
+}
+
+static void test_fork_while_locked(void) {
+        _cleanup_close_pair_ int fds[2] = { -1, -1 };
+        MempoolStats stats;
+        pthread_t t;
+        pid_t pid;
+        char x;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(pipe2(fds, O_CLOEXEC) >= 0);
+        assert_se(pthread_create(&t, NULL, thread_hold_lock, fds + 1) == 0);
+        assert_se(read(fds[0], &x, 1) == 1);
+
+        pid = fork();
+        assert_se(pid >= 0);
+        if (pid == 0) {
+                /* The lock must not be inherited in the locked state */
+                (void) alarm(10);
+                mempool_get_stats(&tile_pool, &stats);
+                _exit(EXIT_SUCCESS);
+        }
+
+        assert_se(pthread_join(t, NULL) == 0);
+        assert_se(wait_for_terminate_and_check("(mempool-child)", pid, WAIT_LOG) == EXIT_SUCCESS);
+}
+
+static void* thread_benchmark(void *p) {
+        bool use_pool = PTR_TO_INT(p);
+        Tile *live[N_LIVE] = {};
+        uint64_t x = UINT64_C(0x9e3779b97f4a7c15);
+        unsigned i, j;
+
+        /* Keep a number of objects alive, and replace a random one of them in each iteration, which is roughly
+         * what happens with event sources or messages. Use a trivial PRNG, so that it doesn't dominate. */
+
+        for (i = 0; i < n_iterations; i++) {
+                x = x * UINT64_C(6364136223846793005) + UINT64_C(1442695040888963407);
+                j = (x >> 33) % N_LIVE;
+
+                if (live[j]) {
+                        if (use_pool)
+                                mempool_free_tile(&tile_pool, live[j]);
+                        else
+                                free(live[j]);
+                }
+
+                assert_se(live[j] = use_pool ? mempool_alloc_tile(&tile_pool) : new(Tile, 1));
+                live[j]->data[0] = i;
+        }
+
+        for (j = 0; j < N_LIVE; j++) {
+                if (!live[j])
+                        continue;
+
+                if (use_pool)
+                        mempool_free_tile(&tile_pool, live[j]);
+                else
+                        free(live[j]);
+        }
+
+        return NULL;
+}
+
+static void test_benchmark(unsigned n_threads, bool use_pool) {
+        char b[FORMAT_TIMESPAN_MAX];
+        pthread_t t[N_THREADS];
+        usec_t ts;
+        unsigned i;
+
+        assert(n_threads <= N_THREADS);
+
+        ts = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < n_threads; i++)
+                assert_se(pthread_create(t + i, NULL, thread_benchmark, INT_TO_PTR(use_pool)) == 0);
+        for (i = 0; i < n_threads; i++)
+                assert_se(pthread_join(t[i], NULL) == 0);
+
+        log_info("%s, %u threads: %u allocations took %s", use_pool ? "mempool" : "malloc",
+                 n_threads, n_threads * n_iterations,
+                 format_timespan(b, sizeof b, now(CLOCK_MONOTONIC) - ts, 1));
+}
+
+int main(int argc, char *argv[]) {
+        MempoolStats stats;
+        unsigned n;
+
+        test_setup_logging(LOG_INFO);
+
+        test_basic();
+        test_free_in_other_thread();
+        test_fork_while_locked();
+
+        n_iterations = slow_tests_enabled() ? 10000000U : 100000U;
+
+        log_info("/* benchmark */");
+        for (n = 1; n <= N_THREADS; n *= 2) {
+                test_benchmark(n, false);
+                test_benchmark(n, true);
+        }
+
+        mempool_get_stats(&tile_pool, &stats);
+        log_info("%zu pools, %zu tiles, %zu free, %" PRIu64 " allocations, %" PRIu64 " cache hits",
+                 stats.n_pools, stats.n_tiles, stats.n_free, stats.n_allocs, stats.n_cache_hits);
+
+        return 0;
+}
@@ -1,8 +1,21 @@
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "sd-hwdb.h"
 
 #include "alloc-util.h"
+#include "conf-files.h"
 #include "errno.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "hwdb-util.h"
+#include "mkdir.h"
+#include "path-util.h"
+#include "rm-rf.h"
+#include "strv.h"
 #include "tests.h"
+#include "time-util.h"
+#include "tmpfile-util.h"
 
 static int test_failed_enumerate(void) {
         _cleanup_(sd_hwdb_unrefp) sd_hwdb *hwdb = NULL;
@@ -59,11 +72,177 @@ static void test_basic_enumerate(void) {
         assert_se(len1 == len2);
 }
 
+static char *glob_to_modalias(const char *glob) {
+        char *s, *q;
+        const char *p;
+
+        /* Turns a match of the hwdb into a string that it matches, by filling in the wildcards. Returns NULL
+         * for the few matches with negated character sets, let's not bother with those. */
+
+        s = q = strdup(glob);
+        assert_se(s);
+
+        for (p = glob; *p; p++)
+                switch (*p) {
+
+                case '*':
+                        *(q++) = 'X';
+                        break;
+
+                case '?':
+                        *(q++) = '0';
+                        break;
+
+                case '[':
+                        if (IN_SET(p[1], '!', '^'))
+                                return mfree(s);
+                        *(q++) = p[1];
+                        p = strchr(p + 2, ']');
+                        assert_se(p);
+                        break;
+
+                default:
+                        *(q++) = *p;
+                }
+
+        *q = 0;
+        return s;
+}
+
+static void test_corpus(void) {
+        _cleanup_(rm_rf_physical_and_freep) char *root = NULL;
+        _cleanup_(sd_hwdb_unrefp) sd_hwdb *hwdb = NULL;
+        _cleanup_strv_free_ char **files = NULL, **modaliases = NULL;
+        _cleanup_free_ char *source = NULL, *bin = NULL;
+        char b[FORMAT_TIMESPAN_MAX], **f, **m;
+        const char *key, *value, *t;
+        unsigned i, n_iterations;
+        size_t n = 0, allocated = 0, index;
+        struct stat st, st2;
+        usec_t ts;
+
+        log_info("/* %s */", __func__);
+
+        /* Build a database from the hwdb.d/ directory in the source tree, and look up a modalias derived from
+         * each of its matches. This covers the whole matching logic, and serves as a benchmark for building
+         * the database, for incremental updates, and for lookups. */
+
+        source = path_join(get_testdata_dir(), "../hwdb.d");
+        assert_se(source);
+        if (access(source, F_OK) < 0) {
+                log_info("%s not found, skipping.", source);
+                return;
+        }
+
+        assert_se(mkdtemp_malloc("/tmp/test-sd-hwdb-XXXXXX", &root) >= 0);
+        t = strjoina(root, UDEVLIBEXECDIR "/hwdb.d");
+        assert_se(mkdir_parents(t, 0755) >= 0);
+        assert_se(symlink(source, t) >= 0);
+
+        ts = now(CLOCK_MONOTONIC);
+        assert_se(hwdb_update(root, "/", true, false, false) >= 0);
+        log_info("Compiling %s took %s", source, format_timespan(b, sizeof b, now(CLOCK_MONOTONIC) - ts, USEC_PER_MSEC));
+
+        bin = path_join(root, "hwdb.bin");
+        assert_se(bin);
+        assert_se(stat(bin, &st) >= 0);
+
+        /* Nothing changed, hence an incremental update leaves the database alone */
+        ts = now(CLOCK_MONOTONIC);
+        assert_se(hwdb_update(root, "/", true, false, true) >= 0);
+        log_info("Incremental update without changes took %s", format_timespan(b, sizeof b, now(CLOCK_MONOTONIC) - ts, USEC_PER_MSEC));
+
+        assert_se(stat(bin, &st2) >= 0);
+        assert_se(st.st_ino == st2.st_ino);
+
+        /* A new file is picked up */
+        t = strjoina(root, "/etc/udev/hwdb.d/99-test.hwdb");
+        assert_se(write_string_file(t, "test-sd-hwdb:incremental\n TEST_SD_HWDB=1",
+                                    WRITE_STRING_FILE_CREATE|WRITE_STRING_FILE_MKDIR_0755) >= 0);
+
+        ts = now(CLOCK_MONOTONIC);
+        assert_se(hwdb_update(root, "/", true, false, true) >= 0);
+        log_info("Incremental update with a new file took %s", format_timespan(b, sizeof b, now(CLOCK_MONOTONIC) - ts, USEC_PER_MSEC));
+
+        assert_se(stat(bin, &st2) >= 0);
+        assert_se(st.st_ino != st2.st_ino);
+
+        assert_se(hwdb_new_from_path(bin, &hwdb) >= 0);
+        assert_se(sd_hwdb_get(hwdb, "test-sd-hwdb:incremental", "TEST_SD_HWDB", &value) >= 0);
+        assert_se(streq(value, "1"));
+
+        assert_se(conf_files_list(&files, ".hwdb", NULL, 0, source) >= 0);
+        STRV_FOREACH(f, files) {
+                _cleanup_fclose_ FILE *file = NULL;
+
+                assert_se(file = fopen(*f, "re"));
+
+                for (;;) {
+                        _cleanup_free_ char *line = NULL;
+                        char *modalias;
+                        int r;
+
+                        r = read_line(file, LONG_LINE_MAX, &line);
+                        assert_se(r >= 0);
+                        if (r == 0)
+                                break;
+                        if (IN_SET(line[0], 0, ' ', '#'))
+                                continue;
+
+                        modalias = glob_to_modalias(line);
+                        if (!modalias)
+                                continue;
+
+                        assert_se(GREEDY_REALLOC(modaliases, allocated, n + 2));
+                        modaliases[n++] = modalias;
+                        modaliases[n] = NULL;
+                }
+        }
+
+        assert_se(n > 0);
+
+        /* Every modalias matches at least the match it was derived from */
+        STRV_FOREACH(m, modaliases) {
+                size_t n_properties = 0;
+
+                SD_HWDB_FOREACH_PROPERTY(hwdb, *m, key, value)
+                        n_properties++;
+
+                if (n_properties == 0)
+                        log_error("No properties for %s", *m);
+                assert_se(n_properties > 0);
+        }
+
+        n_iterations = slow_tests_enabled() ? 10 : 1;
+
+        ts = now(CLOCK_MONOTONIC);
+        for (i = 0; i < n_iterations; i++)
+                STRV_FOREACH(m, modaliases)
+                        assert_se(sd_hwdb_seek(hwdb, *m) >= 0);
+        ts = now(CLOCK_MONOTONIC) - ts;
+
+        log_info("%zu lookups took %s, %.2fµs per lookup", n * n_iterations,
+                 format_timespan(b, sizeof b, ts, 1), (double) ts / (n * n_iterations));
+
+        /* Looking up several at once stops at the first that matches */
+        index = SIZE_MAX;
+        assert_se(hwdb_seek_first(hwdb, STRV_MAKE("no-such-modalias-should-exist", modaliases[n / 2], modaliases[0]),
+                                  NULL, &index) == 1);
+        assert_se(index == 1);
+        assert_se(sd_hwdb_enumerate(hwdb, &key, &value) == 1);
+
+        assert_se(hwdb_seek_first(hwdb, STRV_MAKE("no-such-modalias-should-exist", modaliases[0]),
+                                  "NO_SUCH_PROPERTY_SHOULD_EXIST*", &index) == 0);
+        assert_se(sd_hwdb_enumerate(hwdb, &key, &value) == 0);
+}
+
 int main(int argc, char *argv[]) {
         int r;
 
         test_setup_logging(LOG_DEBUG);
 
+        test_corpus();
+
         r = test_failed_enumerate();
         if (r < 0)
                 return log_tests_skipped_errno(r, "cannot open hwdb");
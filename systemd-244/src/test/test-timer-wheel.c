@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <stdlib.h>
+
+#include "alloc-util.h"
+#include "random-util.h"
+#include "tests.h"
+#include "timer-wheel.h"
+
+#define N_ENTRIES 1024U
+
+static TimerWheelEntry *find_min(TimerWheelEntry *entries, size_t n) {
+        TimerWheelEntry *min = NULL;
+        size_t i;
+
+        for (i = 0; i < n; i++)
+                if (timer_wheel_entry_linked(entries + i) && (!min || entries[i].key < min->key))
+                        min = entries + i;
+
+        return min;
+}
+
+static void check_min(TimerWheel *w, TimerWheelEntry *entries, size_t n) {
+        TimerWheelEntry *min;
+
+        /* Several entries might have the same key, hence compare that */
+        min = find_min(entries, n);
+        if (min)
+                assert_se(timer_wheel_peek(w)->key == min->key);
+        else
+                assert_se(!timer_wheel_peek(w));
+}
+
+static usec_t random_key(usec_t base) {
+        /* Mix up near and far entries, to exercise all levels */
+        switch (random_u64() % 4) {
+        case 0:
+                return base + random_u64() % (10 * USEC_PER_MSEC);
+        case 1:
+                return base + random_u64() % (10 * USEC_PER_SEC);
+        case 2:
+                return base + random_u64() % USEC_PER_DAY;
+        default:
+                return random_u64() % (base + USEC_PER_WEEK);
+        }
+}
+
+static void test_basic(void) {
+        _cleanup_(timer_wheel_freep) TimerWheel *w = NULL;
+        TimerWheelEntry a = {}, b = {}, c = {};
+
+        assert_se(timer_wheel_ensure_allocated(&w) >= 0);
+        assert_se(timer_wheel_isempty(w));
+        assert_se(!timer_wheel_peek(w));
+
+        timer_wheel_put(w, &a, 5 * USEC_PER_SEC);
+        timer_wheel_put(w, &b, 3 * USEC_PER_SEC);
+        timer_wheel_put(w, &c, USEC_INFINITY);
+        assert_se(timer_wheel_size(w) == 3);
+        assert_se(timer_wheel_peek(w) == &b);
+
+        /* Moving an entry keeps the size */
+        timer_wheel_put(w, &b, 7 * USEC_PER_SEC);
+        assert_se(timer_wheel_size(w) == 3);
+        assert_se(timer_wheel_peek(w) == &a);
+
+        timer_wheel_remove(w, &a);
+        assert_se(!timer_wheel_entry_linked(&a));
+        assert_se(timer_wheel_peek(w) == &b);
+
+        timer_wheel_advance(w, 6 * USEC_PER_SEC);
+        assert_se(timer_wheel_peek(w) == &b);
+
+        /* Entries before the base are fine too */
+        timer_wheel_put(w, &a, USEC_PER_SEC);
+        assert_se(timer_wheel_peek(w) == &a);
+
+        timer_wheel_remove(w, &a);
+        timer_wheel_remove(w, &a);
+        timer_wheel_remove(w, &b);
+        assert_se(timer_wheel_peek(w) == &c);
+
+        timer_wheel_remove(w, &c);
+        assert_se(timer_wheel_isempty(w));
+        assert_se(!timer_wheel_peek(w));
+}
+
+static void test_random(void) {
+        /* The wheel has to go first, hence declare it last */
+        _cleanup_free_ TimerWheelEntry *entries = NULL;
+        _cleanup_(timer_wheel_freep) TimerWheel *w = NULL;
+        usec_t now = USEC_PER_DAY;
+        unsigned i, n_fired = 0;
+
+        assert_se(w = timer_wheel_new());
+        assert_se(entries = new0(TimerWheelEntry, N_ENTRIES));
+
+        for (i = 0; i < N_ENTRIES; i++)
+                timer_wheel_put(w, entries + i, random_key(now));
+
+        for (i = 0; i < 100 * N_ENTRIES; i++) {
+                TimerWheelEntry *e = entries + random_u64() % N_ENTRIES;
+
+                switch (random_u64() % 8) {
+
+                case 0:
+                        timer_wheel_remove(w, e);
+                        break;
+
+                case 1:
+                        /* Let time pass, and take out everything that is due, like sd-event does */
+                        now += random_u64() % (random_u64() % 2 ? USEC_PER_SEC : USEC_PER_HOUR);
+
+                        for (;;) {
+                                TimerWheelEntry *min;
+
+                                check_min(w, entries, N_ENTRIES);
+
+                                min = timer_wheel_peek(w);
+                                if (!min || min->key > now)
+                                        break;
+
+                                timer_wheel_remove(w, min);
+                                n_fired++;
+                        }
+
+                        timer_wheel_advance(w, now);
+                        break;
+
+                case 2:
+                        /* Occasionally the clock jumps backwards */
+                        if (random_u64() % 64 == 0) {
+                                now -= MIN(now, random_u64() % USEC_PER_HOUR);
+                                timer_wheel_advance(w, now);
+                        }
+                        break;
+
+                default:
+                        timer_wheel_put(w, e, random_key(now));
+                }
+
+                check_min(w, entries, N_ENTRIES);
+        }
+
+        log_info("%u entries fired.", n_fired);
+}
+
+int main(int argc, char **argv) {
+        test_setup_logging(LOG_INFO);
+
+        test_basic();
+        test_random();
+
+        return 0;
+}
@@ -0,0 +1,144 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#include <stdio.h>
+
+#include "bus-error.h"
+#include "manager.h"
+#include "parse-util.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "target.h"
+#include "tests.h"
+#include "time-util.h"
+#include "unit.h"
+
+/* Builds a synthetic graph of target units with a dense web of Wants= and After= dependencies, and times how
+ * long it takes to build and activate start and isolate transactions on it. */
+
+#define N_DEPS_PER_UNIT 8
+#define N_ITERATIONS 5
+
+static unsigned arg_n_units = 1000;
+
+static Unit *add_target(Manager *m, const char *name) {
+        Unit *u;
+
+        assert_se(u = unit_new(m, sizeof(Target)));
+        assert_se(unit_add_name(u, name) >= 0);
+        u->load_state = UNIT_LOADED;
+        u->default_dependencies = false;
+
+        return u;
+}
+
+static void build_graph(Manager *m, Unit **units, Unit **ret_all, Unit **ret_half) {
+        Unit *all, *half;
+        uint64_t seed = 0x9e3779b97f4a7c15ULL;
+        unsigned i, k;
+
+        all = add_target(m, "bench-all.target");
+        half = add_target(m, "bench-half.target");
+        all->allow_isolate = half->allow_isolate = true;
+
+        for (i = 0; i < arg_n_units; i++) {
+                char name[STRLEN("bench-.target") + DECIMAL_STR_MAX(unsigned)];
+
+                xsprintf(name, "bench-%u.target", i);
+                units[i] = add_target(m, name);
+
+                /* Every unit pulls in and is ordered after a handful of "random" units with a lower index, so
+                 * that the resulting graph is dense, but acyclic. */
+                for (k = 0; i > 0 && k < N_DEPS_PER_UNIT; k++) {
+                        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+
+                        assert_se(unit_add_two_dependencies(units[i], UNIT_AFTER, UNIT_WANTS,
+                                                            units[(seed >> 33) % i], true, UNIT_DEPENDENCY_FILE) >= 0);
+                }
+
+                assert_se(unit_add_two_dependencies(all, UNIT_AFTER, UNIT_WANTS, units[i], true, UNIT_DEPENDENCY_FILE) >= 0);
+                if (i % 2 == 0)
+                        assert_se(unit_add_two_dependencies(half, UNIT_AFTER, UNIT_WANTS, units[i], true, UNIT_DEPENDENCY_FILE) >= 0);
+        }
+
+        *ret_all = all;
+        *ret_half = half;
+}
+
+static void set_all_active(Unit **units, TargetState state) {
+        unsigned i;
+
+        for (i = 0; i < arg_n_units; i++)
+                TARGET(units[i])->state = state;
+}
+
+static void bench_transaction(Manager *m, const char *label, Unit *u, JobMode mode) {
+        char best_buf[FORMAT_TIMESPAN_MAX], avg_buf[FORMAT_TIMESPAN_MAX];
+        usec_t total = 0, best = USEC_INFINITY;
+        unsigned i;
+
+        for (i = 0; i < N_ITERATIONS; i++) {
+                _cleanup_(sd_bus_error_free) sd_bus_error err = SD_BUS_ERROR_NULL;
+                usec_t t;
+                int r;
+
+                manager_clear_jobs(m);
+
+                t = now(CLOCK_MONOTONIC);
+                r = manager_add_job(m, JOB_START, u, mode, NULL, &err, NULL);
+                t = now(CLOCK_MONOTONIC) - t;
+
+                if (r < 0)
+                        log_error_errno(r, "Failed to enqueue %s job: %s", label, bus_error_message(&err, r));
+                assert_se(r >= 0);
+
+                total += t;
+                best = MIN(best, t);
+        }
+
+        log_info("%s: %u units, %u jobs, best %s, average %s", label, arg_n_units, hashmap_size(m->jobs),
+                 format_timespan(best_buf, sizeof(best_buf), best, 1),
+                 format_timespan(avg_buf, sizeof(avg_buf), total / N_ITERATIONS, 1));
+
+        manager_clear_jobs(m);
+}
+
+int main(int argc, char *argv[]) {
+        _cleanup_(rm_rf_physical_and_freep) char *runtime_dir = NULL;
+        _cleanup_(manager_freep) Manager *m = NULL;
+        _cleanup_free_ Unit **units = NULL;
+        Unit *all, *half;
+        int r;
+
+        test_setup_logging(LOG_INFO);
+
+        if (argc >= 2)
+                assert_se(safe_atou(argv[1], &arg_n_units) >= 0 && arg_n_units > 0);
+        else if (slow_tests_enabled())
+                arg_n_units = 10000;
+
+        r = enter_cgroup_subroot(NULL);
+        if (r == -ENOMEDIUM)
+                return log_tests_skipped("cgroupfs not available");
+
+        assert_se(runtime_dir = setup_fake_runtime_dir());
+        r = manager_new(UNIT_FILE_USER, MANAGER_TEST_RUN_BASIC, &m);
+        if (manager_errno_skip_test(r))
+                return log_tests_skipped_errno(r, "manager_new");
+        assert_se(r >= 0);
+        assert_se(manager_startup(m, NULL, NULL) >= 0);
+
+        assert_se(units = new(Unit*, arg_n_units));
+        build_graph(m, units, &all, &half);
+
+        /* Nothing is running: every unit gets a start job */
+        set_all_active(units, TARGET_DEAD);
+        bench_transaction(m, "start", all, JOB_REPLACE);
+        bench_transaction(m, "isolate", all, JOB_ISOLATE);
+
+        /* Everything is running: isolating to half of the units stops the other half */
+        set_all_active(units, TARGET_ACTIVE);
+        bench_transaction(m, "start (active)", all, JOB_REPLACE);
+        bench_transaction(m, "isolate (active)", half, JOB_ISOLATE);
+
+        return 0;
+}
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "device-private.h"
+#include "fs-util.h"
+#include "parse-util.h"
+#include "path-util.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "strv.h"
+#include "tests.h"
+#include "time-util.h"
+#include "udev-node.h"
+#include "user-util.h"
+
+#define SHARED_LINK "/dev/disk/by-test/shared"
+
+/* Use the device numbers of loop devices, so that the entries of older versions, which need to look into
+ * sysfs, can be compared, if the loop devices exist. */
+#define TEST_MAJOR 7U
+
+static int test_priority(unsigned i) {
+        /* Spread the priorities, and have plenty of ties */
+        return (int) ((i * 7919U) % 13U) - 6;
+}
+
+static int shared_link_priority(void) {
+        _cleanup_free_ char *target = NULL;
+        const char *e;
+        unsigned i;
+
+        if (readlink_malloc(SHARED_LINK, &target) < 0)
+                return INT_MIN;
+
+        e = startswith(target, "../../loop");
+        assert_se(e);
+        assert_se(safe_atou(e, &i) >= 0);
+
+        return test_priority(i);
+}
+
+static sd_device *test_device_new(unsigned i) {
+        _cleanup_strv_free_ char **properties = NULL;
+        const char *devnode;
+        sd_device *dev;
+
+        /* device_new_from_strv() modifies the strings, hence they must not be literals */
+        assert_se(properties = strv_new("ACTION=add", "SUBSYSTEM=block", "SEQNUM=1"));
+        assert_se(strv_extendf(&properties, "DEVPATH=/devices/virtual/block/loop%u", i) >= 0);
+        assert_se(strv_extendf(&properties, "DEVNAME=/dev/loop%u", i) >= 0);
+        assert_se(strv_extendf(&properties, "MAJOR=%u", TEST_MAJOR) >= 0);
+        assert_se(strv_extendf(&properties, "MINOR=%u", i) >= 0);
+        assert_se(strv_extendf(&properties, "DEVLINKS=" SHARED_LINK " /dev/disk/by-test/loop%u", i) >= 0);
+
+        assert_se(device_new_from_strv(&dev, properties) >= 0);
+        device_set_devlink_priority(dev, test_priority(i));
+
+        /* The device node is needed to find out who owns a link */
+        assert_se(sd_device_get_devname(dev, &devnode) >= 0);
+        assert_se(mknod(devnode, S_IFBLK|0600, makedev(TEST_MAJOR, i)) >= 0);
+        assert_se(device_update_db(dev) >= 0);
+
+        return dev;
+}
+
+static void test_links(unsigned n) {
+        char b[FORMAT_TIMESPAN_MAX];
+        sd_device **devs;
+        unsigned i, j, step;
+        int max;
+        usec_t ts;
+
+        log_info("/* %s(%u) */", __func__, n);
+
+        assert_se(devs = new(sd_device*, n));
+        for (i = 0; i < n; i++)
+                devs[i] = test_device_new(i);
+
+        ts = now(CLOCK_MONOTONIC);
+
+        max = INT_MIN;
+        for (i = 0; i < n; i++) {
+                char unique[STRLEN("/dev/disk/by-test/loop") + DECIMAL_STR_MAX(unsigned)];
+
+                assert_se(udev_node_add(devs[i], false, MODE_INVALID, UID_INVALID, GID_INVALID, NULL) >= 0);
+
+                max = MAX(max, test_priority(i));
+                assert_se(shared_link_priority() == max);
+
+                xsprintf(unique, "/dev/disk/by-test/loop%u", i);
+                assert_se(access(unique, F_OK) >= 0);
+        }
+
+        log_info("Adding %u devices sharing a link took %s", n,
+                 format_timespan(b, sizeof b, now(CLOCK_MONOTONIC) - ts, USEC_PER_MSEC));
+
+        /* Remove them in a different order, every step must select the highest remaining priority */
+        step = 7;
+        assert_se(n % step != 0);
+
+        ts = now(CLOCK_MONOTONIC);
+
+        for (i = 0, j = 0; i < n; i++, j = (j + step) % n) {
+                const char *devnode;
+                unsigned k;
+
+                assert_se(udev_node_remove(devs[j]) >= 0);
+                assert_se(sd_device_get_devname(devs[j], &devnode) >= 0);
+                assert_se(unlink(devnode) >= 0);
+                devs[j] = sd_device_unref(devs[j]);
+
+                max = INT_MIN;
+                for (k = 0; k < n; k++)
+                        if (devs[k])
+                                max = MAX(max, test_priority(k));
+                assert_se(shared_link_priority() == max);
+        }
+
+        log_info("Removing %u devices sharing a link took %s", n,
+                 format_timespan(b, sizeof b, now(CLOCK_MONOTONIC) - ts, USEC_PER_MSEC));
+
+        assert_se(access(SHARED_LINK, F_OK) < 0 && errno == ENOENT);
+        assert_se(access("/run/udev/links/\\x2fdisk\\x2fby-test\\x2fshared", F_OK) < 0 && errno == ENOENT);
+
+        free(devs);
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        if (getuid() != 0)
+                return log_tests_skipped("not root");
+
+        /* Work on empty /dev and /run in our own mount namespace */
+        if (unshare(CLONE_NEWNS) < 0)
+                return log_tests_skipped_errno(errno, "Failed to create mount namespace");
+        assert_se(mount(NULL, "/", NULL, MS_SLAVE|MS_REC, NULL) >= 0);
+        assert_se(mount("tmpfs", "/dev", "tmpfs", MS_NOSUID, "mode=755") >= 0);
+        assert_se(mount("tmpfs", "/run", "tmpfs", MS_NOSUID|MS_NODEV, "mode=755") >= 0);
+
+        test_links(16);
+        test_links(slow_tests_enabled() ? 4096 : 512);
+
+        return 0;
+}
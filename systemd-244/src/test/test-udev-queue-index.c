@@ -0,0 +1,403 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+#include <stdio.h>
+#include <sys/sysmacros.h>
+
+#include "alloc-util.h"
+#include "device-private.h"
+#include "list.h"
+#include "random-util.h"
+#include "string-util.h"
+#include "stdio-util.h"
+#include "strv.h"
+#include "tests.h"
+#include "time-util.h"
+#include "udev-queue-index.h"
+
+typedef struct Event Event;
+
+struct Event {
+        sd_device *dev;
+        uint64_t seqnum;
+        uint64_t delaying_seqnum;
+        UdevQueueEntry *entry;
+        bool running;
+        LIST_FIELDS(Event, event);
+};
+
+typedef struct Queue {
+        UdevQueueIndex *index;
+        LIST_HEAD(Event, events);
+        Event *tail;
+        unsigned n_events;
+        uint64_t seqnum;
+} Queue;
+
+static sd_device *make_device(const char *devpath, const char *subsystem, dev_t devnum, int ifindex, const char *devpath_old, uint64_t seqnum) {
+        _cleanup_strv_free_ char **l = NULL;
+        sd_device *dev;
+
+        assert_se(l = strv_new("ACTION=add"));
+        assert_se(strv_extendf(&l, "DEVPATH=%s", devpath) >= 0);
+        assert_se(strv_extendf(&l, "SUBSYSTEM=%s", subsystem) >= 0);
+        assert_se(strv_extendf(&l, "SEQNUM=%" PRIu64, seqnum) >= 0);
+        if (major(devnum) != 0) {
+                assert_se(strv_extendf(&l, "MAJOR=%u", major(devnum)) >= 0);
+                assert_se(strv_extendf(&l, "MINOR=%u", minor(devnum)) >= 0);
+        }
+        if (ifindex > 0)
+                assert_se(strv_extendf(&l, "IFINDEX=%i", ifindex) >= 0);
+        if (devpath_old)
+                assert_se(strv_extendf(&l, "DEVPATH_OLD=%s", devpath_old) >= 0);
+
+        assert_se(device_new_from_strv(&dev, l) >= 0);
+        return dev;
+}
+
+static Event *queue_add(Queue *q, const char *devpath, const char *subsystem, dev_t devnum, int ifindex, const char *devpath_old) {
+        Event *e;
+
+        assert_se(e = new0(Event, 1));
+        e->seqnum = ++q->seqnum;
+        e->dev = make_device(devpath, subsystem, devnum, ifindex, devpath_old, e->seqnum);
+        assert_se(udev_queue_index_add(q->index, e->dev, e->seqnum, &e->entry) >= 0);
+
+        LIST_INSERT_AFTER(event, q->events, q->tail, e);
+        q->tail = e;
+        q->n_events++;
+
+        return e;
+}
+
+static void queue_remove(Queue *q, Event *e) {
+        if (q->tail == e)
+                q->tail = e->event_prev;
+        LIST_REMOVE(event, q->events, e);
+        q->n_events--;
+
+        udev_queue_entry_free(e->entry);
+        sd_device_unref(e->dev);
+        free(e);
+}
+
+static void queue_init(Queue *q) {
+        *q = (Queue) {};
+        assert_se(udev_queue_index_new(&q->index) >= 0);
+}
+
+static void queue_done(Queue *q) {
+        while (q->events)
+                queue_remove(q, q->events);
+
+        assert_se(udev_queue_index_size(q->index) == 0);
+        q->index = udev_queue_index_free(q->index);
+}
+
+/* How udevd used to find out whether an event has to wait, by comparing it with all earlier events */
+static bool reference_is_blocked(Queue *q, Event *event) {
+        const char *subsystem, *devpath, *devpath_old = NULL;
+        dev_t devnum = makedev(0, 0);
+        Event *loop_event;
+        size_t devpath_len;
+        int ifindex = 0;
+        bool is_block;
+
+        assert_se(sd_device_get_subsystem(event->dev, &subsystem) >= 0);
+        is_block = streq(subsystem, "block");
+        assert_se(sd_device_get_devpath(event->dev, &devpath) >= 0);
+        devpath_len = strlen(devpath);
+        (void) sd_device_get_property_value(event->dev, "DEVPATH_OLD", &devpath_old);
+        (void) sd_device_get_devnum(event->dev, &devnum);
+        (void) sd_device_get_ifindex(event->dev, &ifindex);
+
+        LIST_FOREACH(event, loop_event, q->events) {
+                size_t loop_devpath_len, common;
+                const char *loop_devpath;
+
+                if (loop_event->seqnum < event->delaying_seqnum)
+                        continue;
+                if (loop_event->seqnum == event->delaying_seqnum)
+                        return true;
+                if (loop_event->seqnum >= event->seqnum)
+                        break;
+
+                if (major(devnum) != 0) {
+                        const char *s;
+                        dev_t d;
+
+                        if (sd_device_get_subsystem(loop_event->dev, &s) < 0)
+                                continue;
+
+                        if (sd_device_get_devnum(loop_event->dev, &d) >= 0 &&
+                            devnum == d && is_block == streq(s, "block"))
+                                goto set_delaying_seqnum;
+                }
+
+                if (ifindex > 0) {
+                        int i;
+
+                        if (sd_device_get_ifindex(loop_event->dev, &i) >= 0 &&
+                            ifindex == i)
+                                goto set_delaying_seqnum;
+                }
+
+                if (sd_device_get_devpath(loop_event->dev, &loop_devpath) < 0)
+                        continue;
+
+                if (devpath_old && streq(devpath_old, loop_devpath))
+                        goto set_delaying_seqnum;
+
+                loop_devpath_len = strlen(loop_devpath);
+                common = MIN(devpath_len, loop_devpath_len);
+                if (!strneq(devpath, loop_devpath, common))
+                        continue;
+                if (devpath_len == loop_devpath_len)
+                        goto set_delaying_seqnum;
+                if (devpath[common] == '/')
+                        goto set_delaying_seqnum;
+                if (loop_devpath[common] == '/')
+                        goto set_delaying_seqnum;
+        }
+
+        return false;
+
+set_delaying_seqnum:
+        event->delaying_seqnum = loop_event->seqnum;
+        return true;
+}
+
+static void test_basic(void) {
+        Event *disk, *part, *part2, *sibling, *other, *renamed, *net, *net2, *chr;
+        uint64_t blocker;
+        Queue q;
+
+        log_info("/* %s */", __func__);
+
+        queue_init(&q);
+
+        disk = queue_add(&q, "/devices/pci0000:00/0000:00:1f.2/ata1/host0/block/sda", "block", makedev(8, 0), 0, NULL);
+        part = queue_add(&q, "/devices/pci0000:00/0000:00:1f.2/ata1/host0/block/sda/sda1", "block", makedev(8, 1), 0, NULL);
+        part2 = queue_add(&q, "/devices/pci0000:00/0000:00:1f.2/ata1/host0/block/sda/sda1", "block", makedev(8, 1), 0, NULL);
+        sibling = queue_add(&q, "/devices/pci0000:00/0000:00:1f.2/ata1/host0/block/sdab", "block", makedev(65, 160), 0, NULL);
+        other = queue_add(&q, "/devices/virtual/block/loop0", "block", makedev(8, 0), 0, NULL);
+        chr = queue_add(&q, "/devices/virtual/misc/foo", "misc", makedev(8, 0), 0, NULL);
+        net = queue_add(&q, "/devices/virtual/net/eth0", "net", 0, 2, NULL);
+        renamed = queue_add(&q, "/devices/virtual/net/lan0", "net", 0, 3, "/devices/virtual/net/eth0");
+        net2 = queue_add(&q, "/devices/virtual/net/wan0", "net", 0, 2, NULL);
+
+        assert_se(udev_queue_index_size(q.index) == 9);
+
+        assert_se(!udev_queue_entry_is_blocked(disk->entry, NULL));
+        assert_se(udev_queue_entry_is_blocked(part->entry, &blocker) && blocker == disk->seqnum);
+        assert_se(udev_queue_entry_is_blocked(part2->entry, &blocker) && blocker == part->seqnum);
+        assert_se(!udev_queue_entry_is_blocked(sibling->entry, NULL));
+        assert_se(udev_queue_entry_is_blocked(other->entry, &blocker) && blocker == disk->seqnum);
+        assert_se(!udev_queue_entry_is_blocked(chr->entry, NULL));
+        assert_se(!udev_queue_entry_is_blocked(net->entry, NULL));
+        assert_se(udev_queue_entry_is_blocked(renamed->entry, &blocker) && blocker == net->seqnum);
+        assert_se(udev_queue_entry_is_blocked(net2->entry, &blocker) && blocker == net->seqnum);
+
+        /* A parent waits for its children queued earlier, too */
+        queue_remove(&q, other);
+        queue_remove(&q, disk);
+        disk = queue_add(&q, "/devices/pci0000:00/0000:00:1f.2/ata1/host0/block/sda", "block", makedev(8, 0), 0, NULL);
+        assert_se(udev_queue_entry_is_blocked(disk->entry, &blocker) && blocker == part->seqnum);
+        assert_se(!udev_queue_entry_is_blocked(part->entry, NULL));
+        assert_se(udev_queue_entry_is_blocked(part2->entry, &blocker) && blocker == part->seqnum);
+        assert_se(!udev_queue_entry_is_blocked(chr->entry, NULL));
+
+        queue_remove(&q, part);
+        assert_se(!udev_queue_entry_is_blocked(part2->entry, NULL));
+        queue_remove(&q, part2);
+        assert_se(!udev_queue_entry_is_blocked(disk->entry, NULL));
+
+        queue_remove(&q, net);
+        assert_se(!udev_queue_entry_is_blocked(renamed->entry, NULL));
+        assert_se(!udev_queue_entry_is_blocked(net2->entry, NULL));
+
+        queue_done(&q);
+}
+
+static const char *const paths[] = {
+        "/devices/a",
+        "/devices/a/b",
+        "/devices/a/b/c",
+        "/devices/a/b/cd",
+        "/devices/a/bc",
+        "/devices/a/bc/d",
+        "/devices/ab",
+        "/devices/x",
+        "/devices/x/y",
+        "/devices/x/y/z",
+};
+
+static void test_random(unsigned n_ops) {
+        unsigned k;
+        Queue q;
+
+        log_info("/* %s */", __func__);
+
+        /* Random sequences of queued and finished events on a handful of related devices, compared with the
+         * linear search */
+
+        queue_init(&q);
+
+        for (k = 0; k < n_ops; k++) {
+                Event *e;
+
+                if (q.n_events > 0 && random_u64() % 5 < 2) {
+                        unsigned i = random_u64() % q.n_events;
+
+                        for (e = q.events; i > 0; i--)
+                                e = e->event_next;
+
+                        queue_remove(&q, e);
+                } else
+                        (void) queue_add(&q,
+                                         paths[random_u64() % ELEMENTSOF(paths)],
+                                         random_u64() % 2 ? "block" : "tty",
+                                         random_u64() % 2 ? makedev(8, random_u64() % 3) : 0,
+                                         random_u64() % 3,
+                                         random_u64() % 4 == 0 ? paths[random_u64() % ELEMENTSOF(paths)] : NULL);
+
+                LIST_FOREACH(event, e, q.events)
+                        assert_se(udev_queue_entry_is_blocked(e->entry, NULL) == reference_is_blocked(&q, e));
+        }
+
+        queue_done(&q);
+}
+
+static void coldplug_queue(Queue *q, unsigned n) {
+        unsigned c, ns, p, vf, n_controllers;
+
+        /* Roughly what "udevadm trigger" generates on a machine with plenty of NVMe namespaces and SR-IOV
+         * network functions: a parent comes before its children */
+
+        n_controllers = MAX(n / 122, 1U);
+
+        for (c = 0; c < n_controllers; c++) {
+                char ctrl[128], nvme[192];
+
+                xsprintf(ctrl, "/devices/pci0000:%02x/0000:%02x:%02x.0", c / 256, c / 256, c % 256);
+                xsprintf(nvme, "%s/nvme/nvme%u", ctrl, c);
+                (void) queue_add(q, ctrl, "pci", 0, 0, NULL);
+                (void) queue_add(q, nvme, "nvme", makedev(240, c), 0, NULL);
+
+                for (ns = 0; ns < 16; ns++) {
+                        char disk[256];
+
+                        xsprintf(disk, "%s/nvme%un%u", nvme, c, ns + 1);
+                        (void) queue_add(q, disk, "block", makedev(259, (c * 16 + ns) * 8), 0, NULL);
+
+                        for (p = 1; p <= 4; p++) {
+                                char part[320];
+
+                                xsprintf(part, "%s/nvme%un%up%u", disk, c, ns + 1, p);
+                                (void) queue_add(q, part, "block", makedev(259, (c * 16 + ns) * 8 + p), 0, NULL);
+                        }
+                }
+
+                for (vf = 0; vf < 20; vf++) {
+                        char func[192], net[256];
+
+                        xsprintf(func, "%s/virtfn%u", ctrl, vf);
+                        xsprintf(net, "%s/net/ens%uf%uv%u", func, c, 0, vf);
+                        (void) queue_add(q, func, "pci", 0, 0, NULL);
+                        (void) queue_add(q, net, "net", 0, 2 + c * 20 + vf, NULL);
+                }
+        }
+}
+
+#define CHILDREN_MAX 16U
+
+static uint64_t *replay(unsigned n, bool reference) {
+        _cleanup_free_ uint64_t *started = NULL;
+        Event *running[CHILDREN_MAX];
+        unsigned n_running = 0, n_started = 0, n_total;
+        char buf[FORMAT_TIMESPAN_MAX];
+        usec_t ts;
+        Queue q;
+
+        queue_init(&q);
+
+        coldplug_queue(&q, n);
+        n_total = q.n_events;
+
+        assert_se(started = new(uint64_t, n_total));
+
+        ts = now(CLOCK_MONOTONIC);
+
+        /* Like udevd: every time a worker finishes, look for events that can run now. The old logic went
+         * through the whole queue each time, the new one stops once all workers are busy. */
+        for (;;) {
+                Event *e;
+
+                LIST_FOREACH(event, e, q.events) {
+                        if (e->running)
+                                continue;
+
+                        if (reference ? reference_is_blocked(&q, e) : udev_queue_entry_is_blocked(e->entry, NULL))
+                                continue;
+
+                        if (n_running >= CHILDREN_MAX) {
+                                if (reference)
+                                        continue;
+                                break;
+                        }
+
+                        e->running = true;
+                        running[n_running++] = e;
+                        started[n_started++] = e->seqnum;
+                }
+
+                if (n_running == 0)
+                        break;
+
+                /* The oldest event finishes */
+                queue_remove(&q, running[0]);
+                memmove(running, running + 1, --n_running * sizeof(Event*));
+        }
+
+        assert_se(n_started == n_total);
+        assert_se(q.n_events == 0);
+
+        log_info("%s: %u events replayed in %s", reference ? "linear search" : "index",
+                 n_total, format_timespan(buf, sizeof buf, now(CLOCK_MONOTONIC) - ts, 1));
+
+        queue_done(&q);
+        return TAKE_PTR(started);
+}
+
+static void test_replay(unsigned n, bool compare) {
+        _cleanup_free_ uint64_t *a = NULL, *b = NULL;
+        Queue q;
+
+        log_info("/* %s(%u) */", __func__, n);
+
+        a = replay(n, false);
+        if (!compare)
+                return;
+
+        /* Both need to start the events in the very same order */
+        b = replay(n, true);
+
+        queue_init(&q);
+        coldplug_queue(&q, n);
+        assert_se(memcmp(a, b, q.n_events * sizeof(uint64_t)) == 0);
+        queue_done(&q);
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        test_basic();
+        test_random(slow_tests_enabled() ? 20000 : 2000);
+
+        /* The linear search is quadratic per pass over the queue, only compare with it on small queues */
+        test_replay(300, true);
+        if (slow_tests_enabled())
+                test_replay(1000, true);
+        test_replay(50000, false);
+
+        return 0;
+}
@@ -0,0 +1,234 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "sd-device.h"
+
+#include "alloc-util.h"
+#include "device-private.h"
+#include "device-util.h"
+#include "fileio.h"
+#include "format-util.h"
+#include "fs-util.h"
+#include "hashmap.h"
+#include "path-util.h"
+#include "rm-rf.h"
+#include "string-util.h"
+#include "strv.h"
+#include "tests.h"
+#include "tmpfile-util.h"
+#include "udev-event.h"
+#include "udev-rules.h"
+
+static const char rules_early[] =
+        "SUBSYSTEM==\"block\", KERNEL==\"sd*\", ENV{TEST_DISK}=\"1\"\n"
+        "SUBSYSTEM==\"block\", KERNEL==\"sd*[0-9]\", ENV{TEST_PART}=\"$kernel\", TAG+=\"part\"\n"
+        "SUBSYSTEM==\"block\", ACTION==\"remove\", GOTO=\"test_end\"\n"
+        "SUBSYSTEM==\"block\", KERNEL!=\"loop*\", ENV{TEST_NOT_LOOP}=\"1\"\n"
+        "KERNEL==\"loop[0-9]*\", ENV{TEST_LOOP}=\"1\", MODE=\"0600\"\n"
+        "LABEL=\"test_end\"\n"
+        "SUBSYSTEM==\"net\", KERNEL==\"eth*|en*\", ENV{TEST_NET}=\"$env{INTERFACE}\", RUN+=\"/bin/true $kernel\"\n"
+        "SUBSYSTEM==\"tty\", KERNEL==\"tty[0-9]*\", GROUP=\"test-udev-rules-no-such-group\", MODE=\"0620\"\n"
+        "SUBSYSTEM==\"mem\", KERNEL==\"null\", OWNER=\"root\", MODE=\"0666\", TAG+=\"mem\"\n"
+        "KERNEL==\"*0\", ENV{TEST_ZERO}=\"1\"\n"
+        "SUBSYSTEM==\"input\", ACTION==\"add|change\", ENV{TEST_INPUT}=\"$env{ACTION}\"\n"
+        "ENV{TEST_DISK}==\"1\", ENV{TEST_DISK_SEEN}=\"1\"\n";
+
+static const char rules_late[] =
+        "ACTION==\"remove\", ENV{TEST_REMOVE}=\"1\"\n"
+        "SUBSYSTEM!=\"block\", ENV{TEST_NOT_BLOCK}=\"1\"\n"
+        "SUBSYSTEM==\"net\", KERNEL==\"eth0\", ENV{TEST_NET}=\"$env{TEST_NET}-late\", RUN+=\"/bin/true late\"\n";
+
+static const char * const devices[] = {
+        "add",    "/devices/virtual/block/sda",          "block",
+        "change", "/devices/virtual/block/sda/sdb1",     "block",
+        "remove", "/devices/virtual/block/loop0",        "block",
+        "add",    "/devices/virtual/block/loop1",        "block",
+        "add",    "/devices/virtual/net/eth0",           "net",
+        "add",    "/devices/virtual/net/wlan0",          "net",
+        "add",    "/devices/virtual/tty/tty0",           "tty",
+        "add",    "/devices/virtual/tty/ttyS1",          "tty",
+        "add",    "/devices/virtual/mem/null",           "mem",
+        "add",    "/devices/virtual/input/input3",       "input",
+        "change", "/devices/virtual/input/input3",       "input",
+        "bind",   "/devices/virtual/input/input3",       "input",
+};
+
+/* Applies the rules to a fresh device, and returns everything the rules may have changed */
+static char **apply_rules(UdevRules *rules, const char *action, const char *devpath, const char *subsystem) {
+        _cleanup_(udev_event_freep) UdevEvent *event = NULL;
+        _cleanup_strv_free_ char **env = NULL;
+        _cleanup_(sd_device_unrefp) sd_device *dev = NULL;
+        const char *key, *value;
+        char **l = NULL;
+        void *val;
+        Iterator i;
+
+        assert_se(env = strv_new("SEQNUM=1"));
+        assert_se(strv_extendf(&env, "ACTION=%s", action) >= 0);
+        assert_se(strv_extendf(&env, "DEVPATH=%s", devpath) >= 0);
+        assert_se(strv_extendf(&env, "SUBSYSTEM=%s", subsystem) >= 0);
+        if (streq(subsystem, "net"))
+                assert_se(strv_extendf(&env, "INTERFACE=%s", basename(devpath)) >= 0);
+
+        assert_se(device_new_from_strv(&dev, env) >= 0);
+        assert_se(event = udev_event_new(dev, 0, NULL));
+
+        assert_se(udev_rules_apply_to_event(rules, event, USEC_INFINITY, NULL) >= 0);
+
+        FOREACH_DEVICE_PROPERTY(dev, key, value)
+                assert_se(strv_extendf(&l, "%s=%s", key, value) >= 0);
+        FOREACH_DEVICE_TAG(dev, key)
+                assert_se(strv_extendf(&l, "tag:%s", key) >= 0);
+        ORDERED_HASHMAP_FOREACH_KEY(val, key, event->run_list, i)
+                assert_se(strv_extendf(&l, "run:%s", key) >= 0);
+        assert_se(strv_extendf(&l, "mode:%04o uid:"UID_FMT" gid:"GID_FMT, event->mode, event->uid, event->gid) >= 0);
+
+        return l;
+}
+
+static char ***apply_all(UdevRules *rules) {
+        char ***results;
+        size_t k;
+
+        assert_se(results = new0(char**, ELEMENTSOF(devices) / 3 + 1));
+        for (k = 0; k < ELEMENTSOF(devices) / 3; k++)
+                results[k] = apply_rules(rules, devices[3*k], devices[3*k+1], devices[3*k+2]);
+
+        return results;
+}
+
+static void results_free(char ***results) {
+        char ***r;
+
+        for (r = results; *r; r++)
+                strv_free(*r);
+        free(results);
+}
+
+static void assert_results_equal(char ***a, char ***b) {
+        size_t k;
+
+        for (k = 0; k < ELEMENTSOF(devices) / 3; k++) {
+                if (!strv_equal(a[k], b[k])) {
+                        log_error("Results for %s %s differ:", devices[3*k], devices[3*k+1]);
+                        strv_print(a[k]);
+                        log_error("vs.");
+                        strv_print(b[k]);
+                }
+
+                assert_se(strv_equal(a[k], b[k]));
+        }
+}
+
+static void test_index(const char *dir, char ****ret_results) {
+        _cleanup_(udev_rules_freep) UdevRules *rules = NULL;
+        char ***indexed, ***linear;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(udev_rules_new_from_dirs(&rules, RESOLVE_NAME_EARLY, STRV_MAKE(dir)) >= 0);
+
+        /* Looking up the candidate lines in the index must give the same result as walking all of them */
+        indexed = apply_all(rules);
+        udev_rules_set_index(rules, false);
+        linear = apply_all(rules);
+
+        assert_results_equal(indexed, linear);
+        results_free(linear);
+
+        /* Make sure the rules did match at all */
+        assert_se(strv_contains(indexed[0], "TEST_DISK_SEEN=1"));
+        assert_se(strv_contains(indexed[1], "TEST_PART=sdb1"));
+        assert_se(strv_contains(indexed[1], "tag:part"));
+        assert_se(!strv_contains(indexed[2], "TEST_NOT_LOOP=1"));
+        assert_se(strv_contains(indexed[2], "TEST_REMOVE=1"));
+        assert_se(strv_contains(indexed[3], "TEST_LOOP=1"));
+        assert_se(strv_contains(indexed[4], "TEST_NET=eth0-late"));
+        assert_se(strv_contains(indexed[4], "run:/bin/true eth0"));
+        assert_se(!strv_contains(indexed[5], "TEST_NET=wlan0"));
+        assert_se(strv_contains(indexed[5], "TEST_ZERO=1"));
+        assert_se(strv_contains(indexed[8], "tag:mem"));
+        assert_se(strv_contains(indexed[10], "TEST_INPUT=change"));
+        assert_se(!strv_contains(indexed[11], "TEST_INPUT=bind"));
+
+        *ret_results = indexed;
+}
+
+static void test_cache(const char *dir, char ***expected) {
+        _cleanup_(udev_rules_freep) UdevRules *rules = NULL;
+        _cleanup_free_ char *cache = NULL, *early = NULL, *other = NULL, *buf = NULL;
+        char ***results;
+        size_t size;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(cache = path_join(dir, "rules.cache"));
+        assert_se(early = path_join(dir, "50-test.rules"));
+        assert_se(other = path_join(dir, "70-other.rules"));
+
+        assert_se(udev_rules_new_from_dirs(&rules, RESOLVE_NAME_EARLY, STRV_MAKE(dir)) >= 0);
+        assert_se(udev_rules_save_cache(rules, cache) >= 0);
+        rules = udev_rules_free(rules);
+
+        /* The rules read back from the cache behave like the ones they were written from */
+        assert_se(udev_rules_load_cache_from_dirs(&rules, RESOLVE_NAME_EARLY, STRV_MAKE(dir), cache) >= 0);
+        results = apply_all(rules);
+        assert_results_equal(expected, results);
+        results_free(results);
+        rules = udev_rules_free(rules);
+
+        /* Names are resolved differently */
+        assert_se(udev_rules_load_cache_from_dirs(&rules, RESOLVE_NAME_LATE, STRV_MAKE(dir), cache) == -ESTALE);
+
+        /* A file was added */
+        assert_se(write_string_file(other, "ENV{TEST_OTHER}=\"1\"", WRITE_STRING_FILE_CREATE) >= 0);
+        assert_se(udev_rules_load_cache_from_dirs(&rules, RESOLVE_NAME_EARLY, STRV_MAKE(dir), cache) == -ESTALE);
+        assert_se(udev_rules_new_from_dirs(&rules, RESOLVE_NAME_EARLY, STRV_MAKE(dir)) >= 0);
+        assert_se(udev_rules_save_cache(rules, cache) >= 0);
+        rules = udev_rules_free(rules);
+        assert_se(udev_rules_load_cache_from_dirs(&rules, RESOLVE_NAME_EARLY, STRV_MAKE(dir), cache) >= 0);
+        rules = udev_rules_free(rules);
+
+        /* A file was removed */
+        assert_se(unlink(other) >= 0);
+        assert_se(udev_rules_load_cache_from_dirs(&rules, RESOLVE_NAME_EARLY, STRV_MAKE(dir), cache) == -ESTALE);
+
+        /* A file was changed */
+        assert_se(udev_rules_new_from_dirs(&rules, RESOLVE_NAME_EARLY, STRV_MAKE(dir)) >= 0);
+        assert_se(udev_rules_save_cache(rules, cache) >= 0);
+        rules = udev_rules_free(rules);
+        assert_se(write_string_file(early, strjoina(rules_early, "ENV{TEST_CHANGED}=\"1\"\n"), WRITE_STRING_FILE_CREATE) >= 0);
+        assert_se(udev_rules_load_cache_from_dirs(&rules, RESOLVE_NAME_EARLY, STRV_MAKE(dir), cache) == -ESTALE);
+
+        /* The cache is truncated */
+        assert_se(udev_rules_new_from_dirs(&rules, RESOLVE_NAME_EARLY, STRV_MAKE(dir)) >= 0);
+        assert_se(udev_rules_save_cache(rules, cache) >= 0);
+        rules = udev_rules_free(rules);
+        assert_se(read_full_file(cache, &buf, &size) >= 0);
+        assert_se(size > 1);
+        assert_se(truncate(cache, size - 1) >= 0);
+        assert_se(udev_rules_load_cache_from_dirs(&rules, RESOLVE_NAME_EARLY, STRV_MAKE(dir), cache) < 0);
+        assert_se(!rules);
+}
+
+int main(int argc, char *argv[]) {
+        _cleanup_(rm_rf_physical_and_freep) char *dir = NULL;
+        _cleanup_free_ char *early = NULL, *late = NULL;
+        char ***results;
+
+        test_setup_logging(LOG_INFO);
+
+        assert_se(mkdtemp_malloc("/tmp/test-udev-rules.XXXXXX", &dir) >= 0);
+        assert_se(early = path_join(dir, "50-test.rules"));
+        assert_se(late = path_join(dir, "90-test.rules"));
+        assert_se(write_string_file(early, rules_early, WRITE_STRING_FILE_CREATE) >= 0);
+        assert_se(write_string_file(late, rules_late, WRITE_STRING_FILE_CREATE) >= 0);
+
+        test_index(dir, &results);
+        test_cache(dir, results);
+        results_free(results);
+
+        return 0;
+}
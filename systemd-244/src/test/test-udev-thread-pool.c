@@ -0,0 +1,262 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "sd-device.h"
+
+#include "alloc-util.h"
+#include "device-util.h"
+#include "io-util.h"
+#include "strv.h"
+#include "tests.h"
+#include "udev-builtin.h"
+#include "udev-thread-pool.h"
+
+#define N_ITEMS 1000U
+
+typedef struct Item {
+        unsigned index;
+        unsigned n_processed;
+        usec_t delay;
+
+        /* for test_builtins() */
+        const char *syspath;
+        char **properties;
+} Item;
+
+typedef struct Context {
+        unsigned n_threads_new;
+        unsigned n_threads_free;
+
+        /* Only if at most one thread is running */
+        bool record_order;
+        unsigned order[N_ITEMS];
+        unsigned n_order;
+} Context;
+
+static int thread_new(void *userdata, void **ret) {
+        Context *c = userdata;
+
+        c->n_threads_new++;
+        *ret = c;
+        return 0;
+}
+
+static void thread_free(void *thread_data) {
+        Context *c = thread_data;
+
+        c->n_threads_free++;
+}
+
+static void process(void *item, void *thread_data) {
+        Context *c = thread_data;
+        Item *i = item;
+
+        if (i->delay > 0)
+                (void) usleep(i->delay);
+
+        __atomic_add_fetch(&i->n_processed, 1, __ATOMIC_RELAXED);
+
+        if (c->record_order) {
+                assert_se(c->n_order < N_ITEMS);
+                c->order[c->n_order++] = i->index;
+        }
+}
+
+static const UdevThreadPoolOps ops = {
+        .thread_new = thread_new,
+        .thread_free = thread_free,
+        .process = process,
+};
+
+static Item *collect_one(UdevThreadPool *pool) {
+        Item *i;
+
+        for (;;) {
+                eventfd_t v;
+
+                i = udev_thread_pool_collect(pool);
+                if (i)
+                        return i;
+
+                assert_se(fd_wait_for_event(udev_thread_pool_get_fd(pool), POLLIN, 10 * USEC_PER_SEC) > 0);
+                (void) eventfd_read(udev_thread_pool_get_fd(pool), &v);
+        }
+}
+
+static void test_order(void) {
+        _cleanup_(udev_thread_pool_freep) UdevThreadPool *pool = NULL;
+        Context c = {
+                .record_order = true,
+        };
+        Item items[N_ITEMS] = {};
+        unsigned k;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(udev_thread_pool_new(&pool, &ops, &c) >= 0);
+
+        /* With a single thread, items are processed and handed back in the order they were submitted */
+        for (k = 0; k < N_ITEMS; k++) {
+                items[k].index = k;
+                assert_se(udev_thread_pool_submit(pool, items + k, 1) >= 0);
+        }
+
+        assert_se(udev_thread_pool_get_n_threads(pool) == 1);
+        assert_se(udev_thread_pool_get_n_items(pool) == N_ITEMS);
+
+        for (k = 0; k < N_ITEMS; k++)
+                assert_se(collect_one(pool) == items + k);
+
+        assert_se(udev_thread_pool_get_n_items(pool) == 0);
+        assert_se(!udev_thread_pool_collect(pool));
+
+        assert_se(c.n_order == N_ITEMS);
+        for (k = 0; k < N_ITEMS; k++) {
+                assert_se(c.order[k] == k);
+                assert_se(items[k].n_processed == 1);
+        }
+}
+
+static void test_threads(void) {
+        _cleanup_(udev_thread_pool_freep) UdevThreadPool *pool = NULL;
+        Context c = {};
+        Item items[N_ITEMS] = {};
+        unsigned k;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(udev_thread_pool_new(&pool, &ops, &c) >= 0);
+
+        /* Threads are started while all running ones are busy, up to the limit */
+        for (k = 0; k < N_ITEMS; k++) {
+                items[k].index = k;
+                items[k].delay = k < 4 ? 100 * USEC_PER_MSEC : 0;
+                assert_se(udev_thread_pool_submit(pool, items + k, 4) >= 0);
+        }
+
+        assert_se(udev_thread_pool_get_n_threads(pool) == 4);
+
+        for (k = 0; k < N_ITEMS; k++)
+                assert_se(collect_one(pool));
+
+        assert_se(udev_thread_pool_get_n_items(pool) == 0);
+        for (k = 0; k < N_ITEMS; k++)
+                assert_se(items[k].n_processed == 1);
+
+        pool = udev_thread_pool_free(pool);
+        assert_se(c.n_threads_new == 4);
+        assert_se(c.n_threads_free == 4);
+}
+
+static void test_stop(void) {
+        _cleanup_(udev_thread_pool_freep) UdevThreadPool *pool = NULL;
+        Context c = {};
+        Item items[20] = {}, dummy = {};
+        unsigned k;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(udev_thread_pool_new(&pool, &ops, &c) >= 0);
+
+        for (k = 0; k < ELEMENTSOF(items); k++) {
+                items[k].index = k;
+                items[k].delay = USEC_PER_MSEC;
+                assert_se(udev_thread_pool_submit(pool, items + k, 2) >= 0);
+        }
+
+        /* Whatever was queued is processed before the threads exit */
+        udev_thread_pool_stop(pool);
+        assert_se(udev_thread_pool_get_n_threads(pool) == 0);
+        assert_se(c.n_threads_free == c.n_threads_new);
+
+        for (k = 0; k < ELEMENTSOF(items); k++)
+                assert_se(items[k].n_processed == 1);
+
+        assert_se(udev_thread_pool_get_n_items(pool) == ELEMENTSOF(items));
+        for (k = 0; k < ELEMENTSOF(items); k++)
+                assert_se(udev_thread_pool_collect(pool));
+        assert_se(!udev_thread_pool_collect(pool));
+
+        assert_se(udev_thread_pool_submit(pool, &dummy, 2) == -ESHUTDOWN);
+}
+
+static char **run_builtins(const char *syspath) {
+        _cleanup_(sd_device_unrefp) sd_device *dev = NULL;
+        const char *key, *value;
+        char **l = NULL;
+
+        assert_se(sd_device_new_from_syspath(&dev, syspath) >= 0);
+
+        /* path_id is serialized by the builtin lock, input_id is declared thread safe */
+        (void) udev_builtin_run(dev, UDEV_BUILTIN_PATH_ID, "path_id", false);
+        (void) udev_builtin_run(dev, UDEV_BUILTIN_INPUT_ID, "input_id", false);
+
+        FOREACH_DEVICE_PROPERTY(dev, key, value)
+                assert_se(strv_extendf(&l, "%s=%s", key, value) >= 0);
+
+        return l;
+}
+
+static void process_builtins(void *item, void *thread_data) {
+        Item *i = item;
+
+        i->properties = run_builtins(i->syspath);
+}
+
+static void test_builtins(void) {
+        static const UdevThreadPoolOps builtin_ops = {
+                .process = process_builtins,
+        };
+        _cleanup_(sd_device_enumerator_unrefp) sd_device_enumerator *e = NULL;
+        _cleanup_(udev_thread_pool_freep) UdevThreadPool *pool = NULL;
+        _cleanup_free_ Item *items = NULL;
+        unsigned n = 0, k;
+        sd_device *d;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(sd_device_enumerator_new(&e) >= 0);
+        assert_se(sd_device_enumerator_allow_uninitialized(e) >= 0);
+        assert_se(items = new0(Item, N_ITEMS));
+
+        FOREACH_DEVICE(e, d) {
+                if (n >= N_ITEMS)
+                        break;
+
+                assert_se(sd_device_get_syspath(d, &items[n++].syspath) >= 0);
+        }
+
+        if (n == 0) {
+                log_info("No devices found, skipping");
+                return;
+        }
+
+        /* Running the builtins concurrently gives the same results as running them one after another */
+        assert_se(udev_thread_pool_new(&pool, &builtin_ops, NULL) >= 0);
+        for (k = 0; k < n; k++)
+                assert_se(udev_thread_pool_submit(pool, items + k, 8) >= 0);
+        for (k = 0; k < n; k++)
+                assert_se(collect_one(pool));
+
+        for (k = 0; k < n; k++) {
+                _cleanup_strv_free_ char **l = NULL;
+
+                l = run_builtins(items[k].syspath);
+                assert_se(strv_equal(l, items[k].properties));
+                strv_free(items[k].properties);
+        }
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        test_order();
+        test_threads();
+        test_stop();
+        test_builtins();
+
+        return 0;
+}
@@ -0,0 +1,141 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+#include "sd-device.h"
+
+#include "alloc-util.h"
+#include "device-enumerator-private.h"
+#include "device-util.h"
+#include "path-util.h"
+#include "string-util.h"
+#include "strv.h"
+#include "tests.h"
+#include "udev-trigger-order.h"
+
+#define NONE TRIGGER_ORDER_NONE
+
+static void check(char **devpaths, const size_t *expected, size_t expected_first_delayed) {
+        _cleanup_free_ size_t *after = NULL;
+        size_t i, n, first_delayed;
+
+        n = strv_length(devpaths);
+        assert_se(after = new(size_t, n));
+
+        assert_se(udev_trigger_order((const char * const*) devpaths, n, after, &first_delayed) >= 0);
+
+        for (i = 0; i < n; i++) {
+                log_debug("%s → %s", devpaths[i], after[i] == NONE ? "-" : devpaths[after[i]]);
+                assert_se(after[i] == expected[i]);
+        }
+        assert_se(first_delayed == expected_first_delayed);
+}
+
+static void test_parents(void) {
+        log_info("/* %s */", __func__);
+
+        /* Children wait for the closest ancestor in the set, siblings do not wait for each other, and a device
+         * with a common prefix but in another directory is no ancestor */
+        check(STRV_MAKE("/devices/pci0000:00",
+                        "/devices/pci0000:00/0000:00:01.0",
+                        "/devices/pci0000:00/0000:00:01.0/usb1",
+                        "/devices/pci0000:00/0000:00:01.0/usb1/1-1/1-1:1.0",
+                        "/devices/pci0000:00/0000:00:01.0/usb10",
+                        "/devices/pci0000:00/0000:00:02.0",
+                        "/devices/platform",
+                        "/devices/platform/serial8250/tty/ttyS0",
+                        "/devices/virtual/net/lo"),
+              (const size_t[]) { NONE, 0, 1, 2, 1, 0, NONE, 6, NONE },
+              9);
+
+        /* A child enumerated before its parent does not wait for it */
+        check(STRV_MAKE("/devices/a/b",
+                        "/devices/a",
+                        "/devices/a/b/c"),
+              (const size_t[]) { NONE, NONE, 0 },
+              3);
+
+        /* Children of duplicates wait for the first one */
+        check(STRV_MAKE("/devices/a",
+                        "/devices/a",
+                        "/devices/a/b"),
+              (const size_t[]) { NONE, NONE, 0 },
+              3);
+}
+
+static void test_sound_card(void) {
+        log_info("/* %s */", __func__);
+
+        /* Devices of a sound card are chained, the one of another card is not */
+        check(STRV_MAKE("/devices/pci0000:00/0000:00:1b.0",
+                        "/devices/pci0000:00/0000:00:1b.0/sound/card0",
+                        "/devices/pci0000:00/0000:00:1b.0/sound/card0/hwC0D0",
+                        "/devices/pci0000:00/0000:00:1b.0/sound/card0/pcmC0D0p",
+                        "/devices/pci0000:00/0000:00:1b.0/sound/card0/controlC0",
+                        "/devices/pci0000:00/0000:00:1b.0/sound/card1/controlC1",
+                        "/devices/pci0000:00/0000:00:1b.0/sound/card10/controlC10"),
+              (const size_t[]) { NONE, 0, 1, 2, 3, 0, 0 },
+              7);
+}
+
+static void test_delayed(void) {
+        log_info("/* %s */", __func__);
+
+        check(STRV_MAKE("/devices/virtual/block/loop0",
+                        "/devices/virtual/block/md0",
+                        "/devices/virtual/block/dm-0",
+                        "/devices/virtual/block/dm-0/dm-0p1"),
+              (const size_t[]) { NONE, NONE, NONE, 2 },
+              1);
+}
+
+static void test_enumerated(void) {
+        _cleanup_(sd_device_enumerator_unrefp) sd_device_enumerator *e = NULL;
+        _cleanup_free_ const char **devpaths = NULL;
+        _cleanup_free_ size_t *after = NULL;
+        size_t n = 0, n_allocated = 0, i, first_delayed;
+        sd_device *d;
+
+        log_info("/* %s */", __func__);
+
+        assert_se(sd_device_enumerator_new(&e) >= 0);
+        assert_se(sd_device_enumerator_allow_uninitialized(e) >= 0);
+        assert_se(device_enumerator_scan_devices(e) >= 0);
+
+        FOREACH_DEVICE_AND_SUBSYSTEM(e, d) {
+                assert_se(GREEDY_REALLOC(devpaths, n_allocated, n + 1));
+                assert_se(sd_device_get_devpath(d, devpaths + n) >= 0);
+                n++;
+        }
+
+        if (n == 0) {
+                log_info("No devices found, skipping");
+                return;
+        }
+
+        assert_se(after = new(size_t, n));
+        assert_se(udev_trigger_order(devpaths, n, after, &first_delayed) >= 0);
+
+        /* Every device that waits, waits for an earlier one, which is an ancestor or of the same sound card */
+        for (i = 0; i < n; i++) {
+                const char *p;
+
+                if (after[i] == NONE)
+                        continue;
+
+                assert_se(after[i] < i);
+
+                p = path_startswith(devpaths[i], devpaths[after[i]]);
+                assert_se((p && !isempty(p)) || strstr(devpaths[i], "/sound/card"));
+        }
+        assert_se(first_delayed <= n);
+}
+
+int main(int argc, char *argv[]) {
+        test_setup_logging(LOG_INFO);
+
+        test_parents();
+        test_sound_card();
+        test_delayed();
+        test_enumerated();
+
+        return 0;
+}
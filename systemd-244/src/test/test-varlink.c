@@ -10,6 +10,8 @@
 #include "json.h"
 #include "rm-rf.h"
 #include "strv.h"
+#include "tests.h"
+#include "time-util.h"
 #include "tmpfile-util.h"
 #include "user-util.h"
 #include "varlink.h"
@@ -48,6 +50,25 @@ static int method_something(Varlink *link, JsonVariant *parameters, VarlinkMetho
         return varlink_reply(link, ret);
 }
 
+static int method_count(Varlink *link, JsonVariant *parameters, VarlinkMethodFlags flags, void *userdata) {
+        intmax_t i, n;
+        int r;
+
+        /* Streams the numbers 1…n, one reply each */
+
+        n = json_variant_integer(json_variant_by_key(parameters, "n"));
+        if (n <= 0 || !FLAGS_SET(flags, VARLINK_METHOD_MORE))
+                return varlink_error(link, "io.test.BadParameters", NULL);
+
+        for (i = 1; i < n; i++) {
+                r = varlink_notifyb(link, JSON_BUILD_OBJECT(JSON_BUILD_PAIR("i", JSON_BUILD_INTEGER(i))));
+                if (r < 0)
+                        return r;
+        }
+
+        return varlink_replyb(link, JSON_BUILD_OBJECT(JSON_BUILD_PAIR("i", JSON_BUILD_INTEGER(n))));
+}
+
 static int method_done(Varlink *link, JsonVariant *parameters, VarlinkMethodFlags flags, void *userdata) {
 
         if (++n_done == 2)
@@ -143,8 +164,10 @@ static void flood_test(const char *address) {
 static void *thread(void *arg) {
         _cleanup_(varlink_flush_close_unrefp) Varlink *c = NULL;
         _cleanup_(json_variant_unrefp) JsonVariant *i = NULL;
+        VarlinkReplyFlags flags;
         JsonVariant *o = NULL;
         const char *e;
+        intmax_t n;
 
         assert_se(json_build(&i, JSON_BUILD_OBJECT(JSON_BUILD_PAIR("a", JSON_BUILD_INTEGER(88)),
                                                    JSON_BUILD_PAIR("b", JSON_BUILD_INTEGER(99)))) >= 0);
@@ -160,6 +183,30 @@ static void *thread(void *arg) {
         assert_se(streq_ptr(json_variant_string(json_variant_by_key(o, "method")), "io.test.IDontExist"));
         assert_se(streq(e, VARLINK_ERROR_METHOD_NOT_FOUND));
 
+        /* Pipeline a couple of calls, and collect the replies in order afterwards */
+        assert_se(varlink_call_enqueue(c, "io.test.DoSomething", i, 0) >= 0);
+        assert_se(varlink_call_enqueueb(c, "io.test.Count", VARLINK_METHOD_MORE, JSON_BUILD_OBJECT(JSON_BUILD_PAIR("n", JSON_BUILD_INTEGER(3)))) >= 0);
+        assert_se(varlink_call_enqueueb(c, "io.test.IDontExist", 0, JSON_BUILD_OBJECT(JSON_BUILD_PAIR("x", JSON_BUILD_INTEGER(1)))) >= 0);
+        assert_se(varlink_call(c, "io.test.DoSomething", i, &o, &e, NULL) == -EBUSY);
+
+        assert_se(varlink_collect(c, &o, &e, &flags) > 0);
+        assert_se(json_variant_integer(json_variant_by_key(o, "sum")) == 88 + 99);
+        assert_se(!e);
+        assert_se(flags == 0);
+
+        for (n = 1; n <= 3; n++) {
+                assert_se(varlink_collect(c, &o, &e, &flags) > 0);
+                assert_se(json_variant_integer(json_variant_by_key(o, "i")) == n);
+                assert_se(!e);
+                assert_se(flags == (n < 3 ? VARLINK_REPLY_CONTINUES : 0));
+        }
+
+        assert_se(varlink_collect(c, &o, &e, &flags) > 0);
+        assert_se(streq(e, VARLINK_ERROR_METHOD_NOT_FOUND));
+        assert_se(flags == VARLINK_REPLY_ERROR);
+
+        assert_se(varlink_collect(c, &o, &e, &flags) == 0);
+
         flood_test(arg);
 
         assert_se(varlink_send(c, "io.test.Done", NULL) >= 0);
@@ -184,6 +231,90 @@ static int block_fd_handler(sd_event_source *s, int fd, uint32_t revents, void *
         return 0;
 }
 
+static int method_quit(Varlink *link, JsonVariant *parameters, VarlinkMethodFlags flags, void *userdata) {
+        return sd_event_exit(varlink_get_event(link), 0);
+}
+
+static void *benchmark_server(void *arg) {
+        _cleanup_(varlink_server_unrefp) VarlinkServer *s = NULL;
+        _cleanup_(sd_event_unrefp) sd_event *e = NULL;
+
+        assert_se(sd_event_new(&e) >= 0);
+
+        assert_se(varlink_server_new(&s, 0) >= 0);
+        assert_se(varlink_server_bind_method(s, "io.test.DoSomething", method_something) >= 0);
+        assert_se(varlink_server_bind_method(s, "io.test.Count", method_count) >= 0);
+        assert_se(varlink_server_bind_method(s, "io.test.Quit", method_quit) >= 0);
+        assert_se(varlink_server_attach_event(s, e, 0) >= 0);
+        assert_se(varlink_server_add_connection(s, PTR_TO_FD(arg), NULL) >= 0);
+
+        assert_se(sd_event_loop(e) >= 0);
+
+        return NULL;
+}
+
+static void benchmark(unsigned n_calls, unsigned batch) {
+        _cleanup_(varlink_flush_close_unrefp) Varlink *c = NULL;
+        _cleanup_(json_variant_unrefp) JsonVariant *i = NULL;
+        char buf[FORMAT_TIMESPAN_MAX];
+        VarlinkReplyFlags flags;
+        unsigned k, j, n = 0;
+        int fds[2];
+        JsonVariant *o;
+        const char *e;
+        pthread_t t;
+        usec_t ts;
+
+        /* Measures calls over a socketpair to a server in another thread, either one after the other
+         * (batch == 1), or pipelined in batches */
+
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, fds) >= 0);
+        assert_se(pthread_create(&t, NULL, benchmark_server, FD_TO_PTR(fds[0])) == 0);
+        assert_se(varlink_connect_fd(&c, fds[1]) >= 0);
+
+        assert_se(json_build(&i, JSON_BUILD_OBJECT(JSON_BUILD_PAIR("a", JSON_BUILD_INTEGER(1)),
+                                                   JSON_BUILD_PAIR("b", JSON_BUILD_INTEGER(2)))) >= 0);
+
+        ts = now(CLOCK_MONOTONIC);
+
+        for (k = 0; k < n_calls; k += batch) {
+                if (batch == 1) {
+                        assert_se(varlink_call(c, "io.test.DoSomething", i, &o, &e, NULL) > 0);
+                        n++;
+                        continue;
+                }
+
+                for (j = k; j < MIN(k + batch, n_calls); j++)
+                        assert_se(varlink_call_enqueue(c, "io.test.DoSomething", i, 0) >= 0);
+
+                while (varlink_collect(c, &o, &e, &flags) > 0) {
+                        assert_se(json_variant_integer(json_variant_by_key(o, "sum")) == 3);
+                        n++;
+                }
+        }
+
+        assert_se(n == n_calls);
+
+        log_info("%u calls, %s: %s", n_calls,
+                 batch == 1 ? "sequential" : "pipelined",
+                 format_timespan(buf, sizeof buf, now(CLOCK_MONOTONIC) - ts, 1));
+
+        /* Streaming replies */
+        ts = now(CLOCK_MONOTONIC);
+
+        assert_se(varlink_call_enqueueb(c, "io.test.Count", VARLINK_METHOD_MORE, JSON_BUILD_OBJECT(JSON_BUILD_PAIR("n", JSON_BUILD_INTEGER(n_calls)))) >= 0);
+        for (n = 0; varlink_collect(c, &o, &e, &flags) > 0; n++)
+                assert_se(json_variant_integer(json_variant_by_key(o, "i")) == n + 1);
+        assert_se(n == n_calls);
+
+        log_info("%u streamed replies: %s", n_calls,
+                 format_timespan(buf, sizeof buf, now(CLOCK_MONOTONIC) - ts, 1));
+
+        assert_se(varlink_send(c, "io.test.Quit", NULL) >= 0);
+        assert_se(varlink_flush(c) >= 0);
+        assert_se(pthread_join(t, NULL) == 0);
+}
+
 int main(int argc, char *argv[]) {
         _cleanup_(sd_event_source_unrefp) sd_event_source *block_event = NULL;
         _cleanup_(varlink_server_unrefp) VarlinkServer *s = NULL;
@@ -212,6 +343,7 @@ int main(int argc, char *argv[]) {
         assert_se(varlink_server_set_description(s, "our-server") >= 0);
 
         assert_se(varlink_server_bind_method(s, "io.test.DoSomething", method_something) >= 0);
+        assert_se(varlink_server_bind_method(s, "io.test.Count", method_count) >= 0);
         assert_se(varlink_server_bind_method(s, "io.test.Done", method_done) >= 0);
         assert_se(varlink_server_bind_connect(s, on_connect) >= 0);
         assert_se(varlink_server_listen_address(s, sp, 0600) >= 0);
@@ -235,5 +367,10 @@ int main(int argc, char *argv[]) {
 
         assert_se(pthread_join(t, NULL) == 0);
 
+        /* Without the debug logging of every single message */
+        log_set_max_level(LOG_INFO);
+        benchmark(slow_tests_enabled() ? 100000U : 5000U, 1);
+        benchmark(slow_tests_enabled() ? 100000U : 5000U, 64);
+
         return 0;
 }
@@ -37,4 +37,5 @@ const UdevBuiltin udev_builtin_btrfs = {
         .name = "btrfs",
         .cmd = builtin_btrfs,
         .help = "btrfs volume management",
+        .thread_safe = true,
 };
@@ -13,6 +13,7 @@
 #include "hwdb-util.h"
 #include "parse-util.h"
 #include "string-util.h"
+#include "strv.h"
 #include "udev-builtin.h"
 
 static sd_hwdb *hwdb;
@@ -65,10 +66,12 @@ static const char *modalias_usb(sd_device *dev, char *s, size_t size) {
 static int udev_builtin_hwdb_search(sd_device *dev, sd_device *srcdev,
                                     const char *subsystem, const char *prefix,
                                     const char *filter, bool test) {
+        _cleanup_strv_free_ char **lookups = NULL;
+        const char *key, *value;
         sd_device *d;
         char s[16];
         bool last = false;
-        int r = 0;
+        int n = 0, r;
 
         assert(dev);
 
@@ -101,9 +104,12 @@ static int udev_builtin_hwdb_search(sd_device *dev, sd_device *srcdev,
                 if (!modalias)
                         goto next;
 
-                r = udev_builtin_hwdb_lookup(dev, prefix, modalias, filter, test);
-                if (r > 0)
-                        break;
+                if (prefix)
+                        r = strv_extendf(&lookups, "%s%s", prefix, modalias);
+                else
+                        r = strv_extend(&lookups, modalias);
+                if (r < 0)
+                        return r;
 
                 if (last)
                         break;
@@ -112,7 +118,22 @@ next:
                         break;
         }
 
-        return r;
+        /* Look up all modaliases in one go, the closest device with matching properties wins */
+        r = hwdb_seek_first(hwdb, lookups, filter, NULL);
+        if (r <= 0)
+                return r;
+
+        while (sd_hwdb_enumerate(hwdb, &key, &value) > 0) {
+                if (filter && fnmatch(filter, key, FNM_NOESCAPE) != 0)
+                        continue;
+
+                r = udev_builtin_add_property(dev, test, key, value);
+                if (r < 0)
+                        return r;
+                n++;
+        }
+
+        return n;
 }
 
 static int builtin_hwdb(sd_device *dev, int argc, char *argv[], bool test) {
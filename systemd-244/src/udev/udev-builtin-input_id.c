@@ -359,4 +359,5 @@ const UdevBuiltin udev_builtin_input_id = {
         .name = "input_id",
         .cmd = builtin_input_id,
         .help = "Input device properties",
+        .thread_safe = true,
 };
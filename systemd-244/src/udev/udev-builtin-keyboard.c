@@ -253,4 +253,5 @@ const UdevBuiltin udev_builtin_keyboard = {
         .name = "keyboard",
         .cmd = builtin_keyboard,
         .help = "Keyboard scan code to key mapping",
+        .thread_safe = true,
 };
@@ -459,4 +459,5 @@ const UdevBuiltin udev_builtin_usb_id = {
         .cmd = builtin_usb_id,
         .help = "USB device properties",
         .run_once = true,
+        .thread_safe = true,
 };
@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: LGPL-2.1+ */
 
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 
 #include "device-private.h"
@@ -11,6 +12,9 @@
 
 static bool initialized;
 
+/* Serializes the builtins which are not thread safe, as udevd may run them from several worker threads */
+static pthread_mutex_t builtin_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static const UdevBuiltin *const builtins[_UDEV_BUILTIN_MAX] = {
 #if HAVE_BLKID
         [UDEV_BUILTIN_BLKID] = &udev_builtin_blkid,
@@ -109,6 +113,7 @@ UdevBuiltinCommand udev_builtin_lookup(const char *command) {
 
 int udev_builtin_run(sd_device *dev, UdevBuiltinCommand cmd, const char *command, bool test) {
         _cleanup_strv_free_ char **argv = NULL;
+        int r;
 
         assert(dev);
         assert(cmd >= 0 && cmd < _UDEV_BUILTIN_MAX);
@@ -121,9 +126,17 @@ int udev_builtin_run(sd_device *dev, UdevBuiltinCommand cmd, const char *command
         if (!argv)
                 return -ENOMEM;
 
+        if (builtins[cmd]->thread_safe)
+                return builtins[cmd]->cmd(dev, strv_length(argv), argv, test);
+
+        assert_se(pthread_mutex_lock(&builtin_lock) == 0);
+
         /* we need '0' here to reset the internal state */
         optind = 0;
-        return builtins[cmd]->cmd(dev, strv_length(argv), argv, test);
+        r = builtins[cmd]->cmd(dev, strv_length(argv), argv, test);
+
+        assert_se(pthread_mutex_unlock(&builtin_lock) == 0);
+        return r;
 }
 
 int udev_builtin_add_property(sd_device *dev, bool test, const char *key, const char *val) {
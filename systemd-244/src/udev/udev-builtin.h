@@ -35,6 +35,7 @@ typedef struct UdevBuiltin {
         void (*exit)(void);
         bool (*validate)(void);
         bool run_once;
+        bool thread_safe; /* cmd() may be called concurrently, without taking the builtin lock */
 } UdevBuiltin;
 
 #define PTR_TO_UDEV_BUILTIN_CMD(p) ((UdevBuiltinCommand) ((intptr_t) (p)-1))
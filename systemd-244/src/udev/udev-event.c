@@ -18,6 +18,7 @@
 #include "fs-util.h"
 #include "format-util.h"
 #include "libudev-util.h"
+#include "missing_syscall.h"
 #include "netlink-util.h"
 #include "parse-util.h"
 #include "path-util.h"
@@ -43,6 +44,7 @@ typedef struct Spawn {
         usec_t timeout_usec;
         usec_t event_birth_usec;
         bool accept_failure;
+        bool no_sigchld;
         int fd_stdout;
         int fd_stderr;
         char *result;
@@ -632,7 +634,42 @@ static int on_spawn_sigchld(sd_event_source *s, const siginfo_t *si, void *userd
         return 1;
 }
 
+static int spawn_reap(sd_event_source *s, Spawn *spawn) {
+        siginfo_t si = {};
+
+        assert(s);
+        assert(spawn);
+
+        if (waitid(P_PID, spawn->pid, &si, WEXITED|WNOHANG) < 0)
+                return sd_event_exit(sd_event_source_get_event(s), -errno);
+        if (si.si_pid == 0)
+                return 0; /* still running */
+
+        return on_spawn_sigchld(s, &si, spawn);
+}
+
+static int on_spawn_pidfd(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        return spawn_reap(s, userdata);
+}
+
+#define SPAWN_POLL_USEC (10 * USEC_PER_MSEC)
+
+static int on_spawn_poll(sd_event_source *s, uint64_t usec, void *userdata) {
+        int r;
+
+        r = spawn_reap(s, userdata);
+        if (r != 0)
+                return r;
+
+        r = sd_event_source_set_time(s, now(CLOCK_MONOTONIC) + SPAWN_POLL_USEC);
+        if (r < 0)
+                return r;
+
+        return sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+}
+
 static int spawn_wait(Spawn *spawn) {
+        _cleanup_close_ int pidfd = -1; /* must be closed after the event loop is freed */
         _cleanup_(sd_event_unrefp) sd_event *e = NULL;
         int r;
 
@@ -681,7 +718,23 @@ static int spawn_wait(Spawn *spawn) {
                         return r;
         }
 
-        r = sd_event_add_child(e, NULL, spawn->pid, WEXITED, on_spawn_sigchld, spawn);
+        if (!spawn->no_sigchld) {
+                r = sd_event_add_child(e, NULL, spawn->pid, WEXITED, on_spawn_sigchld, spawn);
+                if (r < 0)
+                        return r;
+
+                return sd_event_loop(e);
+        }
+
+        /* SIGCHLD is delivered to whichever thread of the process picks it up first, hence when called from
+         * one of several threads, watch a pidfd for the process instead, or poll on older kernels. */
+        pidfd = pidfd_open(spawn->pid, 0);
+        if (pidfd >= 0)
+                r = sd_event_add_io(e, NULL, pidfd, EPOLLIN, on_spawn_pidfd, spawn);
+        else if (IN_SET(errno, ENOSYS, EPERM))
+                r = sd_event_add_time(e, NULL, CLOCK_MONOTONIC, 0, 1, on_spawn_poll, spawn);
+        else
+                return -errno;
         if (r < 0)
                 return r;
 
@@ -764,6 +817,7 @@ int udev_event_spawn(UdevEvent *event,
                 .cmd = cmd,
                 .pid = pid,
                 .accept_failure = accept_failure,
+                .no_sigchld = event->worker_thread,
                 .timeout_warn_usec = udev_warn_timeout(timeout_usec),
                 .timeout_usec = timeout_usec,
                 .event_birth_usec = event->birth_usec,
@@ -42,6 +42,7 @@ typedef struct UdevEvent {
         bool name_final:1;
         bool devlink_final:1;
         bool run_final:1;
+        bool worker_thread:1; /* processed by one of several threads, SIGCHLD cannot be used */
 } UdevEvent;
 
 UdevEvent *udev_event_new(sd_device *dev, usec_t exec_delay_usec, sd_netlink *rtnl);
@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 
 #include "alloc-util.h"
@@ -17,6 +18,7 @@
 #include "fs-util.h"
 #include "libudev-util.h"
 #include "mkdir.h"
+#include "parse-util.h"
 #include "path-util.h"
 #include "selinux-util.h"
 #include "smack-util.h"
@@ -104,17 +106,94 @@ static int node_symlink(sd_device *dev, const char *node, const char *slink) {
         return r;
 }
 
+/* The stack directory /run/udev/links/<escaped link name>/ has one entry per device claiming the link,
+ * named after the device ID. The entry is a symlink to "<priority>:<devnode>", so that finding the device
+ * with the highest priority needs no database lookups. Entries created by older versions are empty
+ * regular files, for those we still have to look into the database. */
+static int stack_entry_read(int dirfd, const char *id, int *ret_priority, char **ret_devnode) {
+        _cleanup_free_ char *buf = NULL;
+        char *colon;
+        int r, priority;
+
+        assert(id);
+
+        r = readlinkat_malloc(dirfd, id, &buf);
+        if (r < 0)
+                return r;
+
+        colon = strchr(buf, ':');
+        if (!colon)
+                return -EINVAL;
+        *colon = '\0';
+
+        r = safe_atoi(buf, &priority);
+        if (r < 0)
+                return r;
+
+        if (!path_is_absolute(colon + 1))
+                return -EINVAL;
+
+        if (ret_devnode) {
+                char *devnode;
+
+                devnode = strdup(colon + 1);
+                if (!devnode)
+                        return -ENOMEM;
+
+                *ret_devnode = devnode;
+        }
+
+        if (ret_priority)
+                *ret_priority = priority;
+
+        return 0;
+}
+
+static int stack_entry_write(sd_device *dev, const char *filename) {
+        char priority_str[DECIMAL_STR_MAX(int)];
+        const char *devnode, *content;
+        int r, priority;
+
+        assert(dev);
+        assert(filename);
+
+        r = device_get_devlink_priority(dev, &priority);
+        if (r < 0)
+                return r;
+
+        r = sd_device_get_devname(dev, &devnode);
+        if (r < 0)
+                return r;
+
+        xsprintf(priority_str, "%i", priority);
+        content = strjoina(priority_str, ":", devnode);
+
+        do {
+                r = mkdir_parents(filename, 0755);
+                if (!IN_SET(r, 0, -ENOENT))
+                        break;
+                r = symlink_atomic(content, filename);
+        } while (r == -ENOENT);
+
+        return r;
+}
+
 /* find device node of device with highest priority */
 static int link_find_prioritized(sd_device *dev, bool add, const char *stackdir, char **ret) {
         _cleanup_closedir_ DIR *dir = NULL;
         _cleanup_free_ char *target = NULL;
+        const char *id_filename;
         struct dirent *dent;
         int r, priority = 0;
 
-        assert(!add || dev);
+        assert(dev);
         assert(stackdir);
         assert(ret);
 
+        r = device_get_id_filename(dev, &id_filename);
+        if (r < 0)
+                return r;
+
         if (add) {
                 const char *devnode;
 
@@ -142,8 +221,7 @@ static int link_find_prioritized(sd_device *dev, bool add, const char *stackdir,
         }
 
         FOREACH_DIRENT_ALL(dent, dir, break) {
-                _cleanup_(sd_device_unrefp) sd_device *dev_db = NULL;
-                const char *devnode, *id_filename;
+                _cleanup_free_ char *devnode = NULL;
                 int db_prio = 0;
 
                 if (dent->d_name[0] == '\0')
@@ -153,30 +231,40 @@ static int link_find_prioritized(sd_device *dev, bool add, const char *stackdir,
 
                 log_device_debug(dev, "Found '%s' claiming '%s'", dent->d_name, stackdir);
 
-                if (device_get_id_filename(dev, &id_filename) < 0)
-                        continue;
-
                 /* did we find ourself? */
                 if (streq(dent->d_name, id_filename))
                         continue;
 
-                if (sd_device_new_from_device_id(&dev_db, dent->d_name) < 0)
-                        continue;
+                r = stack_entry_read(dirfd(dir), dent->d_name, &db_prio, &devnode);
+                if (r == -ENOMEM)
+                        return r;
+                if (r == -EINVAL) {
+                        _cleanup_(sd_device_unrefp) sd_device *dev_db = NULL;
+                        const char *s;
 
-                if (sd_device_get_devname(dev_db, &devnode) < 0)
-                        continue;
+                        /* Not a symlink, i.e. created by an older version, hence read the priority from the
+                         * database */
+                        if (sd_device_new_from_device_id(&dev_db, dent->d_name) < 0)
+                                continue;
+
+                        if (sd_device_get_devname(dev_db, &s) < 0)
+                                continue;
 
-                if (device_get_devlink_priority(dev_db, &db_prio) < 0)
+                        if (device_get_devlink_priority(dev_db, &db_prio) < 0)
+                                continue;
+
+                        devnode = strdup(s);
+                        if (!devnode)
+                                return -ENOMEM;
+                } else if (r < 0)
                         continue;
 
                 if (target && db_prio <= priority)
                         continue;
 
-                log_device_debug(dev_db, "Device claims priority %i for '%s'", db_prio, stackdir);
+                log_device_debug(dev, "Device '%s' claims priority %i for '%s'", dent->d_name, db_prio, stackdir);
 
-                r = free_and_strdup(&target, devnode);
-                if (r < 0)
-                        return r;
+                free_and_replace(target, devnode);
                 priority = db_prio;
         }
 
@@ -187,12 +275,62 @@ static int link_find_prioritized(sd_device *dev, bool add, const char *stackdir,
         return 0;
 }
 
+/* Returns the ID and the priority of the device the link currently points to, if that device still claims it */
+static int link_get_owner(const char *slink, const char *stackdir, char **ret_id, int *ret_priority) {
+        _cleanup_free_ char *id = NULL, *filename = NULL;
+        struct stat st;
+        int r;
+
+        assert(slink);
+        assert(stackdir);
+        assert(ret_id);
+        assert(ret_priority);
+
+        if (lstat(slink, &st) < 0)
+                return -errno;
+        if (!S_ISLNK(st.st_mode))
+                return -ENOLINK;
+
+        if (stat(slink, &st) < 0)
+                return -errno;
+        if (!S_ISBLK(st.st_mode) && !S_ISCHR(st.st_mode))
+                return -ENODEV;
+
+        if (asprintf(&id, "%c%u:%u", S_ISBLK(st.st_mode) ? 'b' : 'c', major(st.st_rdev), minor(st.st_rdev)) < 0)
+                return -ENOMEM;
+
+        filename = path_join(stackdir, id);
+        if (!filename)
+                return -ENOMEM;
+
+        r = stack_entry_read(AT_FDCWD, filename, ret_priority, NULL);
+        if (r < 0)
+                return r;
+
+        *ret_id = TAKE_PTR(id);
+        return 0;
+}
+
+static bool stack_dir_unchanged(const struct stat *a, const struct stat *b) {
+        assert(a);
+        assert(b);
+
+        /* Both zeroed out if the directory did not exist */
+        return a->st_dev == b->st_dev &&
+               a->st_ino == b->st_ino &&
+               a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+               a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+#define LINK_UPDATE_MAX_RETRIES 128
+
 /* manage "stack of names" with possibly specified device priorities */
 static int link_update(sd_device *dev, const char *slink, bool add) {
-        _cleanup_free_ char *target = NULL, *filename = NULL, *dirname = NULL;
+        _cleanup_free_ char *filename = NULL, *dirname = NULL, *owner_id = NULL;
         char name_enc[PATH_MAX];
         const char *id_filename;
-        int r;
+        int r, priority = 0, owner_priority;
+        unsigned i;
 
         assert(dev);
         assert(slink);
@@ -209,30 +347,52 @@ static int link_update(sd_device *dev, const char *slink, bool add) {
         if (!filename)
                 return log_oom();
 
-        if (!add && unlink(filename) == 0)
+        /* Update our own entry first, so that anybody looking at the stack after this point takes it into
+         * account. */
+        if (add) {
+                r = stack_entry_write(dev, filename);
+                if (r < 0)
+                        log_device_debug_errno(dev, r, "Failed to create stack entry '%s', ignoring: %m", filename);
+
+                (void) device_get_devlink_priority(dev, &priority);
+        } else if (unlink(filename) == 0)
                 (void) rmdir(dirname);
 
-        r = link_find_prioritized(dev, add, dirname, &target);
-        if (r < 0) {
-                log_device_debug(dev, "No reference left, removing '%s'", slink);
-                if (unlink(slink) == 0)
-                        (void) rmdir_parents(slink, "/");
-        } else
-                (void) node_symlink(dev, target, slink);
+        /* If the link belongs to another device, which still claims it, and which wins over us, then our
+         * entry does not change the result. This is the common case when many devices claim the same link,
+         * and saves us from reading the whole stack for each of them. */
+        if (link_get_owner(slink, dirname, &owner_id, &owner_priority) >= 0 &&
+            !streq(owner_id, id_filename) &&
+            (!add || owner_priority > priority)) {
+                log_device_debug(dev, "'%s' is claimed by '%s' with priority %i, not updating.", slink, owner_id, owner_priority);
+                return 0;
+        }
 
-        if (add)
-                do {
-                        _cleanup_close_ int fd = -1;
+        /* Other workers may update the same stack concurrently. Whoever modified the stack last sees all
+         * entries, so repeat until the stack did not change while we were looking at it. */
+        for (i = 0; i < LINK_UPDATE_MAX_RETRIES; i++) {
+                _cleanup_free_ char *target = NULL;
+                struct stat st1 = {}, st2 = {};
 
-                        r = mkdir_parents(filename, 0755);
-                        if (!IN_SET(r, 0, -ENOENT))
-                                break;
-                        fd = open(filename, O_WRONLY|O_CREAT|O_CLOEXEC|O_TRUNC|O_NOFOLLOW, 0444);
-                        if (fd < 0)
-                                r = -errno;
-                } while (r == -ENOENT);
+                if (stat(dirname, &st1) < 0 && errno != ENOENT)
+                        return log_device_debug_errno(dev, errno, "Failed to stat '%s': %m", dirname);
 
-        return r;
+                r = link_find_prioritized(dev, add, dirname, &target);
+                if (r < 0) {
+                        log_device_debug(dev, "No reference left, removing '%s'", slink);
+                        if (unlink(slink) == 0)
+                                (void) rmdir_parents(slink, "/");
+                } else
+                        (void) node_symlink(dev, target, slink);
+
+                if (stat(dirname, &st2) < 0 && errno != ENOENT)
+                        return log_device_debug_errno(dev, errno, "Failed to stat '%s': %m", dirname);
+
+                if (stack_dir_unchanged(&st1, &st2))
+                        return 0;
+        }
+
+        return log_device_debug_errno(dev, SYNTHETIC_ERRNO(ELOOP), "'%s' keeps changing, giving up.", dirname);
 }
 
 int udev_node_update_old_links(sd_device *dev, sd_device *dev_old) {
@@ -0,0 +1,450 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "alloc-util.h"
+#include "hashmap.h"
+#include "list.h"
+#include "string-util.h"
+#include "udev-queue-index.h"
+
+typedef struct UdevQueueLink UdevQueueLink;
+typedef struct UdevQueueList UdevQueueList;
+typedef struct UdevQueueBucket UdevQueueBucket;
+typedef struct UdevQueueNode UdevQueueNode;
+
+struct UdevQueueLink {
+        UdevQueueEntry *entry;
+        LIST_FIELDS(UdevQueueLink, links);
+};
+
+/* Kept ordered by sequence number, hence the first element is always the oldest event */
+struct UdevQueueList {
+        LIST_HEAD(UdevQueueLink, head);
+        UdevQueueLink *tail;
+};
+
+struct UdevQueueBucket {
+        uint64_t key; /* devnum or ifindex */
+        UdevQueueList list;
+};
+
+/* One component of a devpath. */
+struct UdevQueueNode {
+        UdevQueueNode *parent;
+        Hashmap *children;
+
+        UdevQueueList events;  /* events for exactly this devpath */
+        UdevQueueList subtree; /* events for this devpath and anything below it */
+
+        char name[];
+};
+
+struct UdevQueueIndex {
+        UdevQueueNode *root;
+
+        Hashmap *block_devnums; /* devnum → UdevQueueBucket */
+        Hashmap *char_devnums;
+        Hashmap *ifindexes;     /* ifindex → UdevQueueBucket */
+
+        unsigned n_entries;
+};
+
+struct UdevQueueEntry {
+        UdevQueueIndex *index;
+        uint64_t seqnum;
+        char *devpath_old;
+
+        bool is_block;
+
+        UdevQueueBucket *devnum_bucket;
+        UdevQueueBucket *ifindex_bucket;
+        UdevQueueLink devnum_link;
+        UdevQueueLink ifindex_link;
+
+        UdevQueueNode *node; /* the deepest node we are linked into so far, the devpath's node when complete */
+        bool complete;
+        UdevQueueLink link;
+
+        unsigned n_subtree_links;
+        UdevQueueLink subtree_links[]; /* one per devpath component, top-most first */
+};
+
+static void queue_list_insert(UdevQueueList *l, UdevQueueLink *k) {
+        UdevQueueLink *i;
+
+        assert(l);
+        assert(k);
+
+        /* Events are queued in the order of their sequence numbers, hence this normally appends */
+        for (i = l->tail; i && i->entry->seqnum > k->entry->seqnum; i = i->links_prev)
+                ;
+
+        LIST_INSERT_AFTER(links, l->head, i, k);
+        if (i == l->tail)
+                l->tail = k;
+}
+
+static void queue_list_remove(UdevQueueList *l, UdevQueueLink *k) {
+        assert(l);
+        assert(k);
+
+        if (l->tail == k)
+                l->tail = k->links_prev;
+
+        LIST_REMOVE(links, l->head, k);
+}
+
+static bool queue_list_has_earlier(UdevQueueList *l, uint64_t seqnum, uint64_t *ret) {
+        assert(l);
+
+        if (!l->head || l->head->entry->seqnum >= seqnum)
+                return false;
+
+        *ret = l->head->entry->seqnum;
+        return true;
+}
+
+static UdevQueueNode *queue_node_free(UdevQueueNode *node) {
+        if (!node)
+                return NULL;
+
+        assert(!node->subtree.head);
+        assert(hashmap_isempty(node->children));
+
+        if (node->parent)
+                hashmap_remove(node->parent->children, node->name);
+
+        hashmap_free(node->children);
+        return mfree(node);
+}
+
+static int queue_node_get_child(UdevQueueNode *node, const char *name, size_t len, UdevQueueNode **ret) {
+        UdevQueueNode *child;
+        const char *s;
+        int r;
+
+        assert(node);
+        assert(name);
+        assert(ret);
+
+        s = strndupa(name, len);
+
+        child = hashmap_get(node->children, s);
+        if (child) {
+                *ret = child;
+                return 0;
+        }
+
+        r = hashmap_ensure_allocated(&node->children, &string_hash_ops);
+        if (r < 0)
+                return r;
+
+        child = malloc0(offsetof(UdevQueueNode, name) + len + 1);
+        if (!child)
+                return -ENOMEM;
+
+        memcpy(child->name, name, len);
+
+        r = hashmap_put(node->children, child->name, child);
+        if (r < 0) {
+                free(child);
+                return r;
+        }
+
+        child->parent = node;
+
+        *ret = child;
+        return 1;
+}
+
+static UdevQueueNode *queue_index_find_node(UdevQueueIndex *index, const char *devpath) {
+        UdevQueueNode *node;
+        const char *p;
+
+        assert(index);
+        assert(devpath);
+
+        node = index->root;
+
+        for (p = devpath; node; ) {
+                size_t n;
+
+                p += strspn(p, "/");
+                if (*p == 0)
+                        return node;
+
+                n = strcspn(p, "/");
+                node = hashmap_get(node->children, strndupa(p, n));
+                p += n;
+        }
+
+        return NULL;
+}
+
+int udev_queue_index_new(UdevQueueIndex **ret) {
+        _cleanup_free_ UdevQueueIndex *index = NULL;
+
+        assert(ret);
+
+        index = new0(UdevQueueIndex, 1);
+        if (!index)
+                return -ENOMEM;
+
+        index->root = new0(UdevQueueNode, 1);
+        if (!index->root)
+                return -ENOMEM;
+
+        *ret = TAKE_PTR(index);
+        return 0;
+}
+
+UdevQueueIndex *udev_queue_index_free(UdevQueueIndex *index) {
+        if (!index)
+                return NULL;
+
+        /* All events must be gone already */
+        assert(index->n_entries == 0);
+
+        queue_node_free(index->root);
+
+        hashmap_free(index->block_devnums);
+        hashmap_free(index->char_devnums);
+        hashmap_free(index->ifindexes);
+
+        return mfree(index);
+}
+
+unsigned udev_queue_index_size(UdevQueueIndex *index) {
+        return index ? index->n_entries : 0;
+}
+
+static int queue_bucket_add(Hashmap **h, uint64_t key, UdevQueueLink *link, UdevQueueBucket **ret) {
+        UdevQueueBucket *b;
+        int r;
+
+        assert(h);
+        assert(link);
+        assert(ret);
+
+        b = hashmap_get(*h, &key);
+        if (!b) {
+                r = hashmap_ensure_allocated(h, &uint64_hash_ops);
+                if (r < 0)
+                        return r;
+
+                b = new0(UdevQueueBucket, 1);
+                if (!b)
+                        return -ENOMEM;
+
+                b->key = key;
+
+                r = hashmap_put(*h, &b->key, b);
+                if (r < 0) {
+                        free(b);
+                        return r;
+                }
+        }
+
+        queue_list_insert(&b->list, link);
+
+        *ret = b;
+        return 0;
+}
+
+static void queue_bucket_remove(Hashmap *h, UdevQueueBucket *b, UdevQueueLink *link) {
+        assert(b);
+        assert(link);
+
+        queue_list_remove(&b->list, link);
+
+        if (!b->list.head) {
+                hashmap_remove(h, &b->key);
+                free(b);
+        }
+}
+
+UdevQueueEntry *udev_queue_entry_free(UdevQueueEntry *entry) {
+        UdevQueueIndex *index;
+        UdevQueueNode *node;
+
+        if (!entry)
+                return NULL;
+
+        index = entry->index;
+        assert(index);
+
+        if (entry->devnum_bucket)
+                queue_bucket_remove(entry->is_block ? index->block_devnums : index->char_devnums,
+                                    entry->devnum_bucket, &entry->devnum_link);
+
+        if (entry->ifindex_bucket)
+                queue_bucket_remove(index->ifindexes, entry->ifindex_bucket, &entry->ifindex_link);
+
+        node = entry->node;
+
+        if (entry->complete) {
+                queue_list_remove(&node->events, &entry->link);
+                index->n_entries--;
+        }
+
+        /* Walk up the devpath, and drop the nodes that are no longer needed on the way */
+        while (entry->n_subtree_links > 0) {
+                UdevQueueNode *parent;
+
+                assert(node && node != index->root);
+
+                parent = node->parent;
+
+                queue_list_remove(&node->subtree, &entry->subtree_links[--entry->n_subtree_links]);
+                if (!node->subtree.head)
+                        queue_node_free(node);
+
+                node = parent;
+        }
+
+        free(entry->devpath_old);
+        return mfree(entry);
+}
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(UdevQueueEntry*, udev_queue_entry_free);
+
+int udev_queue_index_add(UdevQueueIndex *index, sd_device *dev, uint64_t seqnum, UdevQueueEntry **ret) {
+        _cleanup_(udev_queue_entry_freep) UdevQueueEntry *entry = NULL;
+        const char *devpath, *devpath_old = NULL, *subsystem = NULL, *p;
+        dev_t devnum = makedev(0, 0);
+        unsigned depth = 0;
+        int r, ifindex = 0;
+
+        assert(index);
+        assert(dev);
+        assert(ret);
+
+        r = sd_device_get_devpath(dev, &devpath);
+        if (r < 0)
+                return r;
+
+        r = sd_device_get_subsystem(dev, &subsystem);
+        if (r < 0 && r != -ENOENT)
+                return r;
+
+        r = sd_device_get_property_value(dev, "DEVPATH_OLD", &devpath_old);
+        if (r < 0 && r != -ENOENT)
+                return r;
+
+        r = sd_device_get_devnum(dev, &devnum);
+        if (r < 0 && r != -ENOENT)
+                return r;
+
+        r = sd_device_get_ifindex(dev, &ifindex);
+        if (r < 0 && r != -ENOENT)
+                return r;
+
+        for (p = devpath + strspn(devpath, "/"); *p; p += strspn(p, "/")) {
+                p += strcspn(p, "/");
+                depth++;
+        }
+
+        entry = malloc0(offsetof(UdevQueueEntry, subtree_links) + depth * sizeof(UdevQueueLink));
+        if (!entry)
+                return -ENOMEM;
+
+        entry->index = index;
+        entry->seqnum = seqnum;
+        entry->is_block = streq_ptr(subsystem, "block");
+        entry->node = index->root;
+        entry->link.entry = entry->devnum_link.entry = entry->ifindex_link.entry = entry;
+
+        if (devpath_old) {
+                entry->devpath_old = strdup(devpath_old);
+                if (!entry->devpath_old)
+                        return -ENOMEM;
+        }
+
+        /* Devices without subsystem never block others by their devnum */
+        if (major(devnum) != 0 && subsystem) {
+                r = queue_bucket_add(entry->is_block ? &index->block_devnums : &index->char_devnums,
+                                     devnum, &entry->devnum_link, &entry->devnum_bucket);
+                if (r < 0)
+                        return r;
+        }
+
+        if (ifindex > 0) {
+                r = queue_bucket_add(&index->ifindexes, ifindex, &entry->ifindex_link, &entry->ifindex_bucket);
+                if (r < 0)
+                        return r;
+        }
+
+        for (p = devpath + strspn(devpath, "/"); *p; p += strspn(p, "/")) {
+                UdevQueueNode *child;
+                UdevQueueLink *k;
+                size_t n;
+
+                n = strcspn(p, "/");
+
+                r = queue_node_get_child(entry->node, p, n, &child);
+                if (r < 0)
+                        return r;
+
+                k = entry->subtree_links + entry->n_subtree_links++;
+                k->entry = entry;
+                queue_list_insert(&child->subtree, k);
+
+                entry->node = child;
+                p += n;
+        }
+
+        assert(entry->n_subtree_links == depth);
+
+        queue_list_insert(&entry->node->events, &entry->link);
+        entry->complete = true;
+        index->n_entries++;
+
+        *ret = TAKE_PTR(entry);
+        return 0;
+}
+
+bool udev_queue_entry_is_blocked(UdevQueueEntry *entry, uint64_t *ret_blocker) {
+        UdevQueueNode *node;
+        uint64_t seqnum;
+
+        assert(entry);
+        assert(entry->complete);
+
+        /* All lists are ordered by sequence number, hence we only need to look at the oldest event in each */
+
+        /* Same major/minor */
+        if (entry->devnum_bucket &&
+            queue_list_has_earlier(&entry->devnum_bucket->list, entry->seqnum, &seqnum))
+                goto blocked;
+
+        /* Same network interface index */
+        if (entry->ifindex_bucket &&
+            queue_list_has_earlier(&entry->ifindex_bucket->list, entry->seqnum, &seqnum))
+                goto blocked;
+
+        /* Our old name */
+        if (entry->devpath_old) {
+                node = queue_index_find_node(entry->index, entry->devpath_old);
+                if (node && queue_list_has_earlier(&node->events, entry->seqnum, &seqnum))
+                        goto blocked;
+        }
+
+        /* Identical or parent device */
+        for (node = entry->node; node; node = node->parent)
+                if (queue_list_has_earlier(&node->events, entry->seqnum, &seqnum))
+                        goto blocked;
+
+        /* Child device */
+        if (queue_list_has_earlier(&entry->node->subtree, entry->seqnum, &seqnum))
+                goto blocked;
+
+        return false;
+
+blocked:
+        if (ret_blocker)
+                *ret_blocker = seqnum;
+        return true;
+}
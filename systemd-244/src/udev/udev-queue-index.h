@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "sd-device.h"
+
+#include "macro.h"
+
+/* Tracks which queued events have to wait for which earlier ones. An event is blocked by an earlier one for
+ * the same device, a parent or child device, the device it was renamed from, or a device with the same
+ * device number or network interface index. Entries are indexed by devpath in a trie, and by devnum and
+ * ifindex, so that looking up blockers does not need to scan the whole queue. */
+
+typedef struct UdevQueueIndex UdevQueueIndex;
+typedef struct UdevQueueEntry UdevQueueEntry;
+
+int udev_queue_index_new(UdevQueueIndex **ret);
+UdevQueueIndex *udev_queue_index_free(UdevQueueIndex *index);
+DEFINE_TRIVIAL_CLEANUP_FUNC(UdevQueueIndex*, udev_queue_index_free);
+
+unsigned udev_queue_index_size(UdevQueueIndex *index);
+
+/* Adding is cheapest if events come in the order of their sequence numbers, as they usually do */
+int udev_queue_index_add(UdevQueueIndex *index, sd_device *dev, uint64_t seqnum, UdevQueueEntry **ret);
+UdevQueueEntry *udev_queue_entry_free(UdevQueueEntry *entry);
+
+bool udev_queue_entry_is_blocked(UdevQueueEntry *entry, uint64_t *ret_blocker);
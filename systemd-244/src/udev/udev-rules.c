@@ -1,6 +1,8 @@
 /* SPDX-License-Identifier: GPL-2.0+ */
 
 #include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
 
 #include "alloc-util.h"
 #include "architecture.h"
@@ -16,15 +18,18 @@
 #include "glob-util.h"
 #include "libudev-util.h"
 #include "list.h"
+#include "memory-util.h"
 #include "mkdir.h"
 #include "nulstr-util.h"
 #include "parse-util.h"
 #include "path-util.h"
 #include "proc-cmdline.h"
+#include "sort-util.h"
 #include "stat-util.h"
 #include "strv.h"
 #include "strxcpyx.h"
 #include "sysctl-util.h"
+#include "tmpfile-util.h"
 #include "udev-builtin.h"
 #include "udev-event.h"
 #include "udev-rules.h"
@@ -134,9 +139,38 @@ typedef enum {
         LINE_UPDATE_SOMETHING = 1 << 5, /* has other TK_A_* or TK_M_IMPORT tokens */
 } UdevRuleLineType;
 
+typedef enum {
+        GLOB_TYPE_PLAIN,   /* no special characters, e.g. "foo" in "foo|bar*" */
+        GLOB_TYPE_PREFIX,  /* "foo*" */
+        GLOB_TYPE_SUFFIX,  /* "*foo" */
+        GLOB_TYPE_INFIX,   /* "*foo*" */
+        GLOB_TYPE_FNMATCH, /* anything else */
+        _GLOB_TYPE_MAX,
+        _GLOB_TYPE_INVALID = -1
+} UdevRuleGlobType;
+
+/* Lines are indexed by the first of these match keys they have with a plain, non-empty value. */
+typedef enum {
+        DISPATCH_SUBSYSTEM,
+        DISPATCH_KERNEL,
+        DISPATCH_ACTION,
+        _DISPATCH_KEY_MAX,
+        _DISPATCH_KEY_INVALID = -1
+} UdevRuleDispatchKey;
+
 typedef struct UdevRuleFile UdevRuleFile;
 typedef struct UdevRuleLine UdevRuleLine;
 typedef struct UdevRuleToken UdevRuleToken;
+typedef struct UdevRuleGlob UdevRuleGlob;
+typedef struct UdevRuleLineSet UdevRuleLineSet;
+typedef struct UdevRuleStamp UdevRuleStamp;
+
+/* A precompiled alternative of a glob match. The pattern points into the value of the token. */
+struct UdevRuleGlob {
+        UdevRuleGlobType type;
+        const char *pattern;
+        size_t len; /* of the literal part, for all but GLOB_TYPE_FNMATCH */
+};
 
 struct UdevRuleToken {
         UdevRuleTokenType type:8;
@@ -146,13 +180,15 @@ struct UdevRuleToken {
         bool attr_match_remove_trailing_whitespace:1;
         const char *value;
         void *data;
-        LIST_FIELDS(UdevRuleToken, tokens);
+        UdevRuleGlob *globs; /* for MATCH_TYPE_GLOB and MATCH_TYPE_GLOB_WITH_EMPTY, terminated by a NULL pattern */
 };
 
 struct UdevRuleLine {
         char *line;
+        size_t line_size; /* including the trailing NUL, the buffer contains more NULs after parsing */
         unsigned line_number;
         UdevRuleLineType type;
+        unsigned index; /* in UdevRules.lines */
 
         const char *label;
         const char *goto_label;
@@ -160,8 +196,12 @@ struct UdevRuleLine {
 
         UdevRuleFile *rule_file;
         UdevRuleToken *current_token;
-        LIST_HEAD(UdevRuleToken, tokens);
+        UdevRuleToken *tokens; /* sorted by type */
+        size_t n_tokens, tokens_allocated;
         LIST_FIELDS(UdevRuleLine, rule_lines);
+
+        usec_t time_usec; /* only accounted if timing is enabled */
+        unsigned n_applied;
 };
 
 struct UdevRuleFile {
@@ -171,23 +211,64 @@ struct UdevRuleFile {
         LIST_FIELDS(UdevRuleFile, rule_files);
 };
 
+/* Indices of lines in UdevRules.lines, in ascending order */
+struct UdevRuleLineSet {
+        unsigned *indices;
+        size_t n_indices, n_allocated;
+};
+
+/* What the rules were read from, to tell whether a cache is still valid */
+struct UdevRuleStamp {
+        char *path;
+        uint64_t inode;
+        uint64_t mtime_nsec;
+        uint64_t size;
+};
+
 struct UdevRules {
+        char **dirs; /* NULL for the default directories */
         usec_t dirs_ts_usec;
         ResolveNameTiming resolve_name_timing;
-        Hashmap *known_users;
-        Hashmap *known_groups;
+        Hashmap *known_users;  /* name → uid, UID_INVALID if it could not be resolved */
+        Hashmap *known_groups; /* name → gid, GID_INVALID if it could not be resolved */
         UdevRuleFile *current_file;
         LIST_HEAD(UdevRuleFile, rule_files);
+
+        UdevRuleStamp *stamps;
+        size_t n_stamps;
+
+        /* All lines of all files in order, and the dispatch index over them */
+        UdevRuleLine **lines;
+        size_t n_lines;
+        UdevRuleLineSet unindexed;
+        Hashmap *dispatch[_DISPATCH_KEY_MAX]; /* value → UdevRuleLineSet */
+        bool no_index; /* walk all lines, for comparison */
+
+        bool timing;
 };
 
+/* The line and token an event is currently applied to. The rules are not modified while events are
+ * processed, so that udevd's worker threads can share them, hence this is kept per thread rather than in
+ * UdevRules.current_file and friends, which are only used while parsing. */
+static thread_local UdevRuleLine *applying_line = NULL;
+static thread_local UdevRuleToken *applying_token = NULL;
+
+/* getpwnam() and friends are not reentrant */
+static pthread_mutex_t creds_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*** Logging helpers ***/
 
 #define log_rule_full(device, rules, level, error, fmt, ...)            \
         ({                                                              \
                 UdevRules *_r = (rules);                                \
-                UdevRuleFile *_f = _r ? _r->current_file : NULL;        \
-                UdevRuleLine *_l = _f ? _f->current_line : NULL;        \
-                const char *_n = _f ? _f->filename : NULL;              \
+                UdevRuleLine *_l = applying_line;                       \
+                UdevRuleFile *_f = _l ? _l->rule_file :                 \
+                                   _r ? _r->current_file : NULL;        \
+                const char *_n;                                         \
+                                                                        \
+                if (!_l && _f)                                          \
+                        _l = _f->current_line;                          \
+                _n = _f ? _f->filename : NULL;                          \
                                                                         \
                 log_device_full(device, level, error, "%s:%u " fmt,     \
                                 strna(_n), _l ? _l->line_number : 0,    \
@@ -245,19 +326,17 @@ static void log_unknown_owner(sd_device *dev, UdevRules *rules, int error, const
 
 /*** Other functions ***/
 
-static void udev_rule_token_free(UdevRuleToken *token) {
-        free(token);
-}
-
 static void udev_rule_line_clear_tokens(UdevRuleLine *rule_line) {
-        UdevRuleToken *i, *next;
+        size_t i;
 
         assert(rule_line);
 
-        LIST_FOREACH_SAFE(tokens, i, next, rule_line->tokens)
-                udev_rule_token_free(i);
+        for (i = 0; i < rule_line->n_tokens; i++)
+                free(rule_line->tokens[i].globs);
 
-        rule_line->tokens = NULL;
+        rule_line->tokens = mfree(rule_line->tokens);
+        rule_line->n_tokens = rule_line->tokens_allocated = 0;
+        rule_line->current_token = NULL;
 }
 
 static void udev_rule_line_free(UdevRuleLine *rule_line) {
@@ -292,22 +371,68 @@ static void udev_rule_file_free(UdevRuleFile *rule_file) {
         free(rule_file);
 }
 
+static void udev_rule_line_set_free(UdevRuleLineSet *set) {
+        if (!set)
+                return;
+
+        free(set->indices);
+        free(set);
+}
+
+static void udev_rules_clear_index(UdevRules *rules) {
+        UdevRuleDispatchKey k;
+
+        assert(rules);
+
+        rules->lines = mfree(rules->lines);
+        rules->n_lines = 0;
+
+        rules->unindexed.indices = mfree(rules->unindexed.indices);
+        rules->unindexed.n_indices = rules->unindexed.n_allocated = 0;
+
+        for (k = 0; k < _DISPATCH_KEY_MAX; k++)
+                rules->dispatch[k] = hashmap_free_with_destructor(rules->dispatch[k], udev_rule_line_set_free);
+}
+
+static void udev_rules_clear_stamps(UdevRules *rules) {
+        size_t i;
+
+        assert(rules);
+
+        for (i = 0; i < rules->n_stamps; i++)
+                free(rules->stamps[i].path);
+
+        rules->stamps = mfree(rules->stamps);
+        rules->n_stamps = 0;
+}
+
 UdevRules *udev_rules_free(UdevRules *rules) {
         UdevRuleFile *i, *next;
 
         if (!rules)
                 return NULL;
 
+        udev_rules_clear_index(rules);
+        udev_rules_clear_stamps(rules);
+
         LIST_FOREACH_SAFE(rule_files, i, next, rules->rule_files)
                 udev_rule_file_free(i);
 
         hashmap_free_free_key(rules->known_users);
         hashmap_free_free_key(rules->known_groups);
+        strv_free(rules->dirs);
         return mfree(rules);
 }
 
+static const char* const* udev_rules_dirs(UdevRules *rules) {
+        assert(rules);
+
+        return rules->dirs ? (const char* const*) rules->dirs : RULES_DIRS;
+}
+
 static int rule_resolve_user(UdevRules *rules, const char *name, uid_t *ret) {
         _cleanup_free_ char *n = NULL;
+        const char *known = NULL;
         uid_t uid;
         void *val;
         int r;
@@ -315,17 +440,18 @@ static int rule_resolve_user(UdevRules *rules, const char *name, uid_t *ret) {
         assert(rules);
         assert(name);
 
-        val = hashmap_get(rules->known_users, name);
-        if (val) {
+        val = hashmap_get2(rules->known_users, name, (void**) &known);
+        if (known) {
                 *ret = PTR_TO_UID(val);
                 return 0;
         }
 
+        /* Names that cannot be resolved are remembered too, as the cache is only valid as long as nothing
+         * resolves differently */
         r = get_user_creds(&name, &uid, NULL, NULL, NULL, USER_CREDS_ALLOW_MISSING);
         if (r < 0) {
                 log_unknown_owner(NULL, rules, r, "user", name);
-                *ret = UID_INVALID;
-                return 0;
+                uid = UID_INVALID;
         }
 
         n = strdup(name);
@@ -347,6 +473,7 @@ static int rule_resolve_user(UdevRules *rules, const char *name, uid_t *ret) {
 
 static int rule_resolve_group(UdevRules *rules, const char *name, gid_t *ret) {
         _cleanup_free_ char *n = NULL;
+        const char *known = NULL;
         gid_t gid;
         void *val;
         int r;
@@ -354,8 +481,8 @@ static int rule_resolve_group(UdevRules *rules, const char *name, gid_t *ret) {
         assert(rules);
         assert(name);
 
-        val = hashmap_get(rules->known_groups, name);
-        if (val) {
+        val = hashmap_get2(rules->known_groups, name, (void**) &known);
+        if (known) {
                 *ret = PTR_TO_GID(val);
                 return 0;
         }
@@ -363,8 +490,7 @@ static int rule_resolve_group(UdevRules *rules, const char *name, gid_t *ret) {
         r = get_group_creds(&name, &gid, USER_CREDS_ALLOW_MISSING);
         if (r < 0) {
                 log_unknown_owner(NULL, rules, r, "group", name);
-                *ret = GID_INVALID;
-                return 0;
+                gid = GID_INVALID;
         }
 
         n = strdup(name);
@@ -394,16 +520,94 @@ static UdevRuleSubstituteType rule_get_substitution_type(const char *str) {
         return SUBST_TYPE_PLAIN;
 }
 
-static void rule_line_append_token(UdevRuleLine *rule_line, UdevRuleToken *token) {
-        assert(rule_line);
+static UdevRuleGlobType glob_get_type(const char *pattern, size_t *ret_len) {
+        size_t len;
+
+        assert(pattern);
+        assert(ret_len);
+
+        /* Only '*' at the beginning and/or the end of the pattern is handled without fnmatch(). As fnmatch()
+         * is called without flags, '*' also matches '/' and leading dots, hence this is equivalent. */
+
+        len = strlen(pattern);
+
+        if (pattern[strcspn(pattern, "?[\\")] != '\0') {
+                *ret_len = len;
+                return GLOB_TYPE_FNMATCH;
+        }
+
+        if (pattern[0] == '*') {
+                pattern++;
+                len--;
+
+                if (len > 0 && pattern[len - 1] == '*' && !memchr(pattern, '*', len - 1)) {
+                        *ret_len = len - 1;
+                        return GLOB_TYPE_INFIX;
+                }
+                if (!memchr(pattern, '*', len)) {
+                        *ret_len = len;
+                        return GLOB_TYPE_SUFFIX;
+                }
+        } else if (!strchr(pattern, '*')) {
+                *ret_len = len;
+                return GLOB_TYPE_PLAIN;
+        } else if (pattern[len - 1] == '*' && !memchr(pattern, '*', len - 1)) {
+                *ret_len = len - 1;
+                return GLOB_TYPE_PREFIX;
+        }
+
+        *ret_len = len;
+        return GLOB_TYPE_FNMATCH;
+}
+
+static int rule_token_compile_globs(UdevRuleToken *token) {
+        size_t n = 0, k = 0;
+        const char *i;
+
         assert(token);
 
-        if (rule_line->current_token)
-                LIST_APPEND(tokens, rule_line->current_token, token);
-        else
-                LIST_APPEND(tokens, rule_line->tokens, token);
+        /* Only values which have been converted to nulstr are matched with token_match_string(). This must be
+         * called only after the whole line is parsed, as the parser terminates the values in place. */
+        if (!IN_SET(token->match_type, MATCH_TYPE_GLOB, MATCH_TYPE_GLOB_WITH_EMPTY) ||
+            !(token->type < TK_M_TEST || token->type == TK_M_RESULT))
+                return 0;
+
+        NULSTR_FOREACH(i, token->value)
+                n++;
+
+        token->globs = new(UdevRuleGlob, n + 1);
+        if (!token->globs)
+                return -ENOMEM;
+
+        NULSTR_FOREACH(i, token->value) {
+                UdevRuleGlob *g = token->globs + k++;
 
-        rule_line->current_token = token;
+                g->type = glob_get_type(i, &g->len);
+                g->pattern = IN_SET(g->type, GLOB_TYPE_SUFFIX, GLOB_TYPE_INFIX) ? i + 1 : i;
+        }
+
+        token->globs[k] = (UdevRuleGlob) {};
+        return 0;
+}
+
+static bool glob_match(const UdevRuleGlob *glob, const char *str, size_t len) {
+        assert(glob);
+        assert(str);
+
+        switch (glob->type) {
+        case GLOB_TYPE_PLAIN:
+                return len == glob->len && memcmp(str, glob->pattern, len) == 0;
+        case GLOB_TYPE_PREFIX:
+                return len >= glob->len && memcmp(str, glob->pattern, glob->len) == 0;
+        case GLOB_TYPE_SUFFIX:
+                return len >= glob->len && memcmp(str + len - glob->len, glob->pattern, glob->len) == 0;
+        case GLOB_TYPE_INFIX:
+                return memmem_safe(str, len, glob->pattern, glob->len);
+        case GLOB_TYPE_FNMATCH:
+                return fnmatch(glob->pattern, str, 0) == 0;
+        default:
+                assert_not_reached("Invalid glob type");
+        }
 }
 
 static int rule_line_add_token(UdevRuleLine *rule_line, UdevRuleTokenType type, UdevRuleOperatorType op, char *value, void *data) {
@@ -475,10 +679,10 @@ static int rule_line_add_token(UdevRuleLine *rule_line, UdevRuleTokenType type,
                 subst_type = rule_get_substitution_type((const char*) data);
         }
 
-        token = new(UdevRuleToken, 1);
-        if (!token)
+        if (!GREEDY_REALLOC(rule_line->tokens, rule_line->tokens_allocated, rule_line->n_tokens + 1))
                 return -ENOMEM;
 
+        token = rule_line->tokens + rule_line->n_tokens;
         *token = (UdevRuleToken) {
                 .type = type,
                 .op = op,
@@ -489,7 +693,7 @@ static int rule_line_add_token(UdevRuleLine *rule_line, UdevRuleTokenType type,
                 .attr_match_remove_trailing_whitespace = remove_trailing_whitespace,
         };
 
-        rule_line_append_token(rule_line, token);
+        rule_line->n_tokens++;
 
         if (token->type == TK_A_NAME)
                 SET_FLAG(rule_line->type, LINE_HAS_NAME, true);
@@ -1056,24 +1260,30 @@ static int parse_line(char **line, char **ret_key, char **ret_attr, UdevRuleOper
         return 1;
 }
 
-static void sort_tokens(UdevRuleLine *rule_line) {
-        UdevRuleToken *head_old;
+static int compile_and_sort_tokens(UdevRuleLine *rule_line) {
+        size_t i, j;
+        int r;
 
         assert(rule_line);
 
-        head_old = TAKE_PTR(rule_line->tokens);
-        rule_line->current_token = NULL;
+        for (i = 0; i < rule_line->n_tokens; i++) {
+                r = rule_token_compile_globs(rule_line->tokens + i);
+                if (r < 0)
+                        return r;
+        }
 
-        while (!LIST_IS_EMPTY(head_old)) {
-                UdevRuleToken *t, *min_token = NULL;
+        /* Insertion sort, which is stable, and lines have only a few tokens. */
+        for (i = 1; i < rule_line->n_tokens; i++) {
+                UdevRuleToken t = rule_line->tokens[i];
 
-                LIST_FOREACH(tokens, t, head_old)
-                        if (!min_token || min_token->type > t->type)
-                                min_token = t;
+                for (j = i; j > 0 && rule_line->tokens[j - 1].type > t.type; j--)
+                        rule_line->tokens[j] = rule_line->tokens[j - 1];
 
-                LIST_REMOVE(tokens, head_old, min_token);
-                rule_line_append_token(rule_line, min_token);
+                rule_line->tokens[j] = t;
         }
+
+        rule_line->current_token = NULL;
+        return 0;
 }
 
 static int rule_add_line(UdevRules *rules, const char *line_str, unsigned line_nr) {
@@ -1102,6 +1312,7 @@ static int rule_add_line(UdevRules *rules, const char *line_str, unsigned line_n
 
         *rule_line = (UdevRuleLine) {
                 .line = TAKE_PTR(line),
+                .line_size = strlen(line_str) + 1,
                 .line_number = line_nr,
                 .rule_file = rule_file,
         };
@@ -1133,7 +1344,10 @@ static int rule_add_line(UdevRules *rules, const char *line_str, unsigned line_n
                 return 0;
         }
 
-        sort_tokens(rule_line);
+        r = compile_and_sort_tokens(rule_line);
+        if (r < 0)
+                return log_oom();
+
         TAKE_PTR(rule_line);
         return 0;
 }
@@ -1276,12 +1490,191 @@ static int parse_file(UdevRules *rules, const char *filename) {
         return 0;
 }
 
-int udev_rules_new(UdevRules **ret_rules, ResolveNameTiming resolve_name_timing) {
-        _cleanup_(udev_rules_freep) UdevRules *rules = NULL;
+static int rule_line_set_add(UdevRuleLineSet *set, unsigned index) {
+        assert(set);
+
+        /* Lines are added in order, so this keeps the set sorted and free of duplicates */
+        if (set->n_indices > 0 && set->indices[set->n_indices - 1] == index)
+                return 0;
+
+        if (!GREEDY_REALLOC(set->indices, set->n_allocated, set->n_indices + 1))
+                return -ENOMEM;
+
+        set->indices[set->n_indices++] = index;
+        return 0;
+}
+
+static UdevRuleDispatchKey token_get_dispatch_key(const UdevRuleToken *token) {
+        assert(token);
+
+        /* Only a positive match on plain values tells which values a line may apply to. */
+        if (token->op != OP_MATCH || token->match_type != MATCH_TYPE_PLAIN)
+                return _DISPATCH_KEY_INVALID;
+
+        switch (token->type) {
+        case TK_M_SUBSYSTEM:
+                return DISPATCH_SUBSYSTEM;
+        case TK_M_KERNEL:
+                return DISPATCH_KERNEL;
+        case TK_M_ACTION:
+                return DISPATCH_ACTION;
+        default:
+                return _DISPATCH_KEY_INVALID;
+        }
+}
+
+static int rules_dispatch_add(UdevRules *rules, UdevRuleDispatchKey key, const char *value, unsigned index) {
+        UdevRuleLineSet *set;
+        int r;
+
+        assert(rules);
+        assert(key >= 0 && key < _DISPATCH_KEY_MAX);
+        assert(value);
+
+        set = hashmap_get(rules->dispatch[key], value);
+        if (!set) {
+                r = hashmap_ensure_allocated(&rules->dispatch[key], &string_hash_ops);
+                if (r < 0)
+                        return r;
+
+                set = new0(UdevRuleLineSet, 1);
+                if (!set)
+                        return -ENOMEM;
+
+                /* The key points into the line, which lives as long as the index */
+                r = hashmap_put(rules->dispatch[key], value, set);
+                if (r < 0) {
+                        free(set);
+                        return r;
+                }
+        }
+
+        return rule_line_set_add(set, index);
+}
+
+static int udev_rules_build_index(UdevRules *rules) {
+        UdevRuleFile *file;
+        UdevRuleLine *line;
+        size_t n = 0;
+        int r;
+
+        assert(rules);
+
+        /* Number all lines, and index them by the value of the match on SUBSYSTEM, KERNEL or ACTION they
+         * have. Since the tokens are sorted by type, and all tokens before TK_M_SUBSYSTEM are plain matches
+         * without side effects, a line whose indexed match fails would not do anything for the event. Hence
+         * only the lines indexed under the values of the event, and the ones not indexed at all, need to be
+         * looked at. */
+
+        udev_rules_clear_index(rules);
+
+        LIST_FOREACH(rule_files, file, rules->rule_files)
+                LIST_FOREACH(rule_lines, line, file->rule_lines)
+                        n++;
+
+        rules->lines = new(UdevRuleLine*, n);
+        if (!rules->lines)
+                return -ENOMEM;
+
+        LIST_FOREACH(rule_files, file, rules->rule_files)
+                LIST_FOREACH(rule_lines, line, file->rule_lines) {
+                        UdevRuleDispatchKey key = _DISPATCH_KEY_INVALID;
+                        UdevRuleToken *token, *best = NULL;
+                        const char *v;
+
+                        line->index = rules->n_lines;
+                        rules->lines[rules->n_lines++] = line;
+
+                        /* Lines with a label only are nothing but jump targets */
+                        if (line->type == LINE_HAS_LABEL)
+                                continue;
+
+                        for (token = line->tokens; token < line->tokens + line->n_tokens && token->type <= TK_M_SUBSYSTEM; token++) {
+                                UdevRuleDispatchKey k;
+
+                                k = token_get_dispatch_key(token);
+                                if (k >= 0 && (key < 0 || k < key)) {
+                                        key = k;
+                                        best = token;
+                                }
+                        }
+
+                        if (!best) {
+                                r = rule_line_set_add(&rules->unindexed, line->index);
+                                if (r < 0)
+                                        return r;
+                                continue;
+                        }
+
+                        NULSTR_FOREACH(v, best->value) {
+                                r = rules_dispatch_add(rules, key, v, line->index);
+                                if (r < 0)
+                                        return r;
+                        }
+                }
+
+        assert(rules->n_lines == n);
+        return 0;
+}
+
+static int rule_stamp_init(UdevRuleStamp *stamp, const char *path) {
+        struct stat st;
+
+        assert(stamp);
+        assert(path);
+
+        *stamp = (UdevRuleStamp) {
+                .path = strdup(path),
+        };
+        if (!stamp->path)
+                return -ENOMEM;
+
+        /* A missing file is recorded as such */
+        if (stat(path, &st) >= 0) {
+                stamp->inode = st.st_ino;
+                stamp->mtime_nsec = timespec_load_nsec(&st.st_mtim);
+                stamp->size = st.st_size;
+        }
+
+        return 0;
+}
+
+static int udev_rules_enumerate(UdevRules *rules, char ***ret_files) {
         _cleanup_strv_free_ char **files = NULL;
         char **f;
         int r;
 
+        assert(rules);
+        assert(ret_files);
+
+        r = conf_files_list_strv(&files, ".rules", NULL, 0, udev_rules_dirs(rules));
+        if (r < 0)
+                return r;
+
+        /* Remember what the rules are read from, so that a cache of them can be validated later. User and
+         * group names resolved while reading them are validated separately, as they may come from any NSS
+         * module, not only from /etc/passwd and /etc/group. */
+        udev_rules_clear_stamps(rules);
+
+        rules->stamps = new0(UdevRuleStamp, strv_length(files));
+        if (!rules->stamps && !strv_isempty(files))
+                return -ENOMEM;
+
+        STRV_FOREACH(f, files) {
+                r = rule_stamp_init(rules->stamps + rules->n_stamps, *f);
+                if (r < 0)
+                        return r;
+                rules->n_stamps++;
+        }
+
+        *ret_files = TAKE_PTR(files);
+        return 0;
+}
+
+static int udev_rules_alloc(UdevRules **ret_rules, ResolveNameTiming resolve_name_timing, char **dirs) {
+        _cleanup_(udev_rules_freep) UdevRules *rules = NULL;
+
+        assert(ret_rules);
         assert(resolve_name_timing >= 0 && resolve_name_timing < _RESOLVE_NAME_TIMING_MAX);
 
         rules = new(UdevRules, 1);
@@ -1292,15 +1685,39 @@ int udev_rules_new(UdevRules **ret_rules, ResolveNameTiming resolve_name_timing)
                 .resolve_name_timing = resolve_name_timing,
         };
 
+        if (dirs) {
+                rules->dirs = strv_copy(dirs);
+                if (!rules->dirs)
+                        return -ENOMEM;
+        }
+
         (void) udev_rules_check_timestamp(rules);
 
-        r = conf_files_list_strv(&files, ".rules", NULL, 0, RULES_DIRS);
+        *ret_rules = TAKE_PTR(rules);
+        return 0;
+}
+
+int udev_rules_new_from_dirs(UdevRules **ret_rules, ResolveNameTiming resolve_name_timing, char **dirs) {
+        _cleanup_(udev_rules_freep) UdevRules *rules = NULL;
+        _cleanup_strv_free_ char **files = NULL;
+        char **f;
+        int r;
+
+        r = udev_rules_alloc(&rules, resolve_name_timing, dirs);
+        if (r < 0)
+                return r;
+
+        r = udev_rules_enumerate(rules, &files);
         if (r < 0)
                 return log_error_errno(r, "Failed to enumerate rules files: %m");
 
         STRV_FOREACH(f, files)
                 (void) parse_file(rules, *f);
 
+        r = udev_rules_build_index(rules);
+        if (r < 0)
+                return log_error_errno(r, "Failed to index rules: %m");
+
         *ret_rules = TAKE_PTR(rules);
         return 0;
 }
@@ -1309,78 +1726,643 @@ bool udev_rules_check_timestamp(UdevRules *rules) {
         if (!rules)
                 return false;
 
-        return paths_check_timestamp(RULES_DIRS, &rules->dirs_ts_usec, true);
+        return paths_check_timestamp(udev_rules_dirs(rules), &rules->dirs_ts_usec, true);
 }
 
-static bool token_match_string(UdevRuleToken *token, const char *str) {
-        const char *i, *value;
-        bool match = false;
-
-        assert(token);
-        assert(token->value);
-        assert(token->type < _TK_M_MAX);
+/*** Cache of parsed rules ***/
+
+/* The cache is a dump of the parsed lines, each with its buffer as modified by the parser, and its tokens with
+ * the strings referenced as offsets into that buffer. It is written in native byte order, and only valid for
+ * the same version of udev and the same rules files, and as long as the user and group names resolved while
+ * parsing still resolve to the same IDs. Those are looked up again when loading the cache, through NSS, so
+ * that changes are noticed whatever database they come from. */
+
+#define RULES_CACHE_SIGNATURE "UDEVRULE"
+#define RULES_CACHE_FORMAT 2
+#define RULES_CACHE_OFFSET_NONE UINT32_MAX
+
+typedef struct _packed_ RulesCacheHeader {
+        char signature[8];
+        char version[16];
+        uint32_t format;
+        uint32_t n_token_types;
+        uint32_t resolve_name_timing;
+        uint32_t n_stamps;
+        uint32_t n_files;
+} RulesCacheHeader;
+
+typedef struct _packed_ RulesCacheStamp {
+        uint64_t inode;
+        uint64_t mtime_nsec;
+        uint64_t size;
+} RulesCacheStamp;
+
+typedef struct _packed_ RulesCacheLine {
+        uint32_t line_number;
+        uint32_t type;
+        uint32_t line_size;
+        uint32_t label;      /* offset */
+        uint32_t goto_label; /* offset */
+        uint32_t goto_line;  /* number of lines ahead in the same file, or 0 */
+        uint32_t n_tokens;
+} RulesCacheLine;
+
+enum {
+        RULES_CACHE_TOKEN_REMOVE_TRAILING_WHITESPACE = 1 << 0,
+        RULES_CACHE_TOKEN_DATA_IS_OFFSET             = 1 << 1,
+};
 
-        str = strempty(str);
-        value = token->value;
+typedef struct _packed_ RulesCacheToken {
+        uint8_t type;
+        uint8_t op;
+        int8_t match_type;
+        int8_t attr_subst_type;
+        uint8_t flags;
+        uint32_t value; /* offset */
+        uint64_t data;  /* offset if RULES_CACHE_TOKEN_DATA_IS_OFFSET, integer otherwise */
+} RulesCacheToken;
+
+static void rules_cache_header_init(RulesCacheHeader *header, const UdevRules *rules) {
+        assert(header);
+        assert(rules);
 
-        switch (token->match_type) {
-        case MATCH_TYPE_EMPTY:
-                match = isempty(str);
-                break;
-        case MATCH_TYPE_SUBSYSTEM:
-                NULSTR_FOREACH(i, "subsystem\0class\0bus\0")
-                        if (streq(i, str)) {
-                                match = true;
-                                break;
-                        }
-                break;
-        case MATCH_TYPE_PLAIN_WITH_EMPTY:
-                if (isempty(str)) {
-                        match = true;
-                        break;
-                }
-                _fallthrough_;
-        case MATCH_TYPE_PLAIN:
-                NULSTR_FOREACH(i, value)
-                        if (streq(i, str)) {
-                                match = true;
-                                break;
-                        }
-                break;
-        case MATCH_TYPE_GLOB_WITH_EMPTY:
-                if (isempty(str)) {
-                        match = true;
-                        break;
-                }
-                _fallthrough_;
-        case MATCH_TYPE_GLOB:
-                NULSTR_FOREACH(i, value)
-                        if ((fnmatch(i, str, 0) == 0)) {
-                                match = true;
-                                break;
-                        }
-                break;
-        default:
-                assert_not_reached("Invalid match type");
-        }
+        *header = (RulesCacheHeader) {
+                .format = RULES_CACHE_FORMAT,
+                .n_token_types = _TK_TYPE_MAX,
+                .resolve_name_timing = rules->resolve_name_timing,
+        };
 
-        return token->op == (match ? OP_MATCH : OP_NOMATCH);
+        memcpy(header->signature, RULES_CACHE_SIGNATURE, sizeof(header->signature));
+        strncpy(header->version, PACKAGE_VERSION, sizeof(header->version));
 }
 
-static bool token_match_attr(UdevRuleToken *token, sd_device *dev, UdevEvent *event) {
-        char nbuf[UTIL_NAME_SIZE], vbuf[UTIL_NAME_SIZE];
-        const char *name, *value;
+static uint32_t rule_line_offset(const UdevRuleLine *line, const void *p) {
+        const char *s = p;
 
-        assert(token);
-        assert(dev);
-        assert(event);
+        assert(line);
 
-        name = (const char*) token->data;
+        if (!s)
+                return RULES_CACHE_OFFSET_NONE;
 
-        switch (token->attr_subst_type) {
-        case SUBST_TYPE_FORMAT:
-                (void) udev_event_apply_format(event, name, nbuf, sizeof(nbuf), false);
-                name = nbuf;
+        assert(s >= line->line && s < line->line + line->line_size);
+        return s - line->line;
+}
+
+static void rules_cache_write_string(FILE *f, const char *s) {
+        uint32_t len = strlen(s);
+
+        fwrite(&len, sizeof(len), 1, f);
+        fwrite(s, 1, len, f);
+}
+
+static void rules_cache_write_names(FILE *f, Hashmap *names) {
+        uint32_t n = hashmap_size(names);
+        const char *name;
+        Iterator i;
+        void *val;
+
+        /* uid_t and gid_t are both 32bit, and stored the same way in the hashmaps */
+        assert_cc(sizeof(uid_t) == sizeof(uint32_t));
+        assert_cc(sizeof(gid_t) == sizeof(uint32_t));
+
+        fwrite(&n, sizeof(n), 1, f);
+
+        HASHMAP_FOREACH_KEY(val, name, names, i) {
+                uint32_t id = PTR_TO_UID(val);
+
+                rules_cache_write_string(f, name);
+                fwrite(&id, sizeof(id), 1, f);
+        }
+}
+
+int udev_rules_save_cache(UdevRules *rules, const char *path) {
+        _cleanup_(unlink_and_freep) char *temp_path = NULL;
+        _cleanup_fclose_ FILE *f = NULL;
+        RulesCacheHeader header;
+        UdevRuleFile *file;
+        UdevRuleLine *line;
+        size_t i;
+        int r;
+
+        assert(rules);
+        assert(path);
+
+        rules_cache_header_init(&header, rules);
+        header.n_stamps = rules->n_stamps;
+        LIST_FOREACH(rule_files, file, rules->rule_files)
+                header.n_files++;
+
+        (void) mkdir_parents(path, 0755);
+
+        r = fopen_temporary(path, &f, &temp_path);
+        if (r < 0)
+                return r;
+
+        (void) fchmod(fileno(f), 0644);
+
+        fwrite(&header, sizeof(header), 1, f);
+
+        for (i = 0; i < rules->n_stamps; i++) {
+                RulesCacheStamp s = {
+                        .inode = rules->stamps[i].inode,
+                        .mtime_nsec = rules->stamps[i].mtime_nsec,
+                        .size = rules->stamps[i].size,
+                };
+
+                rules_cache_write_string(f, rules->stamps[i].path);
+                fwrite(&s, sizeof(s), 1, f);
+        }
+
+        rules_cache_write_names(f, rules->known_users);
+        rules_cache_write_names(f, rules->known_groups);
+
+        LIST_FOREACH(rule_files, file, rules->rule_files) {
+                uint32_t n_lines = 0;
+
+                LIST_FOREACH(rule_lines, line, file->rule_lines)
+                        n_lines++;
+
+                rules_cache_write_string(f, file->filename);
+                fwrite(&n_lines, sizeof(n_lines), 1, f);
+
+                LIST_FOREACH(rule_lines, line, file->rule_lines) {
+                        RulesCacheLine l = {
+                                .line_number = line->line_number,
+                                .type = line->type,
+                                .line_size = line->line_size,
+                                .label = rule_line_offset(line, line->label),
+                                .goto_label = rule_line_offset(line, line->goto_label),
+                                .goto_line = line->goto_line ? line->goto_line->index - line->index : 0,
+                                .n_tokens = line->n_tokens,
+                        };
+                        UdevRuleToken *token;
+
+                        fwrite(&l, sizeof(l), 1, f);
+                        fwrite(line->line, 1, line->line_size, f);
+
+                        for (token = line->tokens; token < line->tokens + line->n_tokens; token++) {
+                                const char *d = token->data;
+                                RulesCacheToken t = {
+                                        .type = token->type,
+                                        .op = token->op,
+                                        .match_type = token->match_type,
+                                        .attr_subst_type = token->attr_subst_type,
+                                        .value = rule_line_offset(line, token->value),
+                                        .data = PTR_TO_UINT64(token->data),
+                                };
+
+                                if (token->attr_match_remove_trailing_whitespace)
+                                        t.flags |= RULES_CACHE_TOKEN_REMOVE_TRAILING_WHITESPACE;
+
+                                /* Attribute and property names point into the line, everything else is an integer */
+                                if (d && d >= line->line && d < line->line + line->line_size) {
+                                        t.flags |= RULES_CACHE_TOKEN_DATA_IS_OFFSET;
+                                        t.data = d - line->line;
+                                }
+
+                                fwrite(&t, sizeof(t), 1, f);
+                        }
+                }
+        }
+
+        r = fflush_and_check(f);
+        if (r < 0)
+                return r;
+
+        if (rename(temp_path, path) < 0)
+                return -errno;
+
+        temp_path = mfree(temp_path);
+        return 0;
+}
+
+typedef struct RulesCacheReader {
+        const char *p;
+        size_t left;
+} RulesCacheReader;
+
+static int rules_cache_read(RulesCacheReader *reader, void *buf, size_t n) {
+        assert(reader);
+
+        if (reader->left < n)
+                return -EBADMSG;
+
+        memcpy(buf, reader->p, n);
+        reader->p += n;
+        reader->left -= n;
+        return 0;
+}
+
+static int rules_cache_read_string(RulesCacheReader *reader, char **ret) {
+        uint32_t len;
+        char *s;
+        int r;
+
+        assert(reader);
+        assert(ret);
+
+        r = rules_cache_read(reader, &len, sizeof(len));
+        if (r < 0)
+                return r;
+
+        if (len > reader->left || memchr(reader->p, 0, len))
+                return -EBADMSG;
+
+        s = strndup(reader->p, len);
+        if (!s)
+                return -ENOMEM;
+
+        reader->p += len;
+        reader->left -= len;
+
+        *ret = s;
+        return 0;
+}
+
+static int rules_cache_check_names(RulesCacheReader *reader, bool groups) {
+        uint32_t i, n;
+        int r;
+
+        assert(reader);
+
+        r = rules_cache_read(reader, &n, sizeof(n));
+        if (r < 0)
+                return r;
+
+        for (i = 0; i < n; i++) {
+                _cleanup_free_ char *name = NULL;
+                const char *p;
+                uint32_t id, current;
+
+                r = rules_cache_read_string(reader, &name);
+                if (r < 0)
+                        return r;
+
+                r = rules_cache_read(reader, &id, sizeof(id));
+                if (r < 0)
+                        return r;
+
+                p = name;
+                if (groups)
+                        r = get_group_creds(&p, &current, USER_CREDS_ALLOW_MISSING);
+                else
+                        r = get_user_creds(&p, &current, NULL, NULL, NULL, USER_CREDS_ALLOW_MISSING);
+                if (r < 0)
+                        current = UID_INVALID;
+
+                if (id != current) {
+                        log_debug("%s '%s' resolves differently now, cache is stale.", groups ? "Group" : "User", name);
+                        return -ESTALE;
+                }
+        }
+
+        return 0;
+}
+
+static int rules_cache_resolve_offset(UdevRuleLine *line, uint32_t offset, const char **ret) {
+        assert(line);
+        assert(ret);
+
+        if (offset == RULES_CACHE_OFFSET_NONE) {
+                *ret = NULL;
+                return 0;
+        }
+
+        if (offset >= line->line_size)
+                return -EBADMSG;
+
+        *ret = line->line + offset;
+        return 0;
+}
+
+static int rules_cache_read_line(RulesCacheReader *reader, UdevRuleFile *file, uint32_t *ret_goto) {
+        _cleanup_(udev_rule_line_freep) UdevRuleLine *line = NULL;
+        RulesCacheLine l;
+        uint32_t i;
+        int r;
+
+        assert(reader);
+        assert(file);
+        assert(ret_goto);
+
+        r = rules_cache_read(reader, &l, sizeof(l));
+        if (r < 0)
+                return r;
+
+        if (l.line_size == 0 || l.line_size > reader->left || l.n_tokens > reader->left / sizeof(RulesCacheToken))
+                return -EBADMSG;
+
+        line = new0(UdevRuleLine, 1);
+        if (!line)
+                return -ENOMEM;
+
+        /* One more NUL, so that even a corrupted value is a terminated nulstr */
+        line->line = malloc(l.line_size + 1);
+        if (!line->line)
+                return -ENOMEM;
+
+        assert_se(rules_cache_read(reader, line->line, l.line_size) >= 0);
+        line->line[l.line_size] = '\0';
+        if (line->line[l.line_size - 1] != '\0')
+                return -EBADMSG;
+
+        line->line_size = l.line_size;
+        line->line_number = l.line_number;
+        line->type = l.type;
+
+        if (rules_cache_resolve_offset(line, l.label, &line->label) < 0 ||
+            rules_cache_resolve_offset(line, l.goto_label, &line->goto_label) < 0)
+                return -EBADMSG;
+
+        if (FLAGS_SET(line->type, LINE_HAS_GOTO) != (l.goto_line > 0))
+                return -EBADMSG;
+
+        line->tokens = new(UdevRuleToken, l.n_tokens);
+        if (!line->tokens && l.n_tokens > 0)
+                return -ENOMEM;
+        line->tokens_allocated = l.n_tokens;
+
+        for (i = 0; i < l.n_tokens; i++) {
+                UdevRuleToken *token = line->tokens + line->n_tokens;
+                RulesCacheToken t;
+
+                r = rules_cache_read(reader, &t, sizeof(t));
+                if (r < 0)
+                        return r;
+
+                if (t.type >= _TK_TYPE_MAX || t.op >= _OP_TYPE_MAX ||
+                    t.match_type < _MATCH_TYPE_INVALID || t.match_type >= _MATCH_TYPE_MAX ||
+                    t.attr_subst_type < _SUBST_TYPE_INVALID || t.attr_subst_type >= _SUBST_TYPE_MAX)
+                        return -EBADMSG;
+
+                *token = (UdevRuleToken) {
+                        .type = t.type,
+                        .op = t.op,
+                        .match_type = t.match_type,
+                        .attr_subst_type = t.attr_subst_type,
+                        .attr_match_remove_trailing_whitespace = FLAGS_SET(t.flags, RULES_CACHE_TOKEN_REMOVE_TRAILING_WHITESPACE),
+                        .data = UINT64_TO_PTR(t.data),
+                };
+
+                if (rules_cache_resolve_offset(line, t.value, &token->value) < 0)
+                        return -EBADMSG;
+
+                if (FLAGS_SET(t.flags, RULES_CACHE_TOKEN_DATA_IS_OFFSET)) {
+                        if (t.data >= line->line_size)
+                                return -EBADMSG;
+
+                        token->data = line->line + t.data;
+                }
+
+                if (t.type < _TK_M_MAX && (!token->value || t.match_type < 0))
+                        return -EBADMSG;
+
+                r = rule_token_compile_globs(token);
+                if (r < 0)
+                        return r;
+
+                line->n_tokens++;
+        }
+
+        line->rule_file = file;
+        if (file->current_line)
+                LIST_APPEND(rule_lines, file->current_line, line);
+        else
+                LIST_APPEND(rule_lines, file->rule_lines, line);
+        file->current_line = TAKE_PTR(line);
+
+        *ret_goto = l.goto_line;
+        return 0;
+}
+
+static int rules_cache_read_file(RulesCacheReader *reader, UdevRules *rules) {
+        _cleanup_free_ UdevRuleLine **lines = NULL;
+        _cleanup_free_ uint32_t *gotos = NULL;
+        _cleanup_free_ char *filename = NULL;
+        UdevRuleFile *rule_file;
+        uint32_t n_lines, i;
+        int r;
+
+        assert(reader);
+        assert(rules);
+
+        r = rules_cache_read_string(reader, &filename);
+        if (r < 0)
+                return r;
+
+        r = rules_cache_read(reader, &n_lines, sizeof(n_lines));
+        if (r < 0)
+                return r;
+
+        if (n_lines > reader->left / sizeof(RulesCacheLine))
+                return -EBADMSG;
+
+        lines = new(UdevRuleLine*, n_lines);
+        gotos = new(uint32_t, n_lines);
+        if ((!lines || !gotos) && n_lines > 0)
+                return -ENOMEM;
+
+        rule_file = new(UdevRuleFile, 1);
+        if (!rule_file)
+                return -ENOMEM;
+
+        *rule_file = (UdevRuleFile) {
+                .filename = TAKE_PTR(filename),
+        };
+
+        if (rules->current_file)
+                LIST_APPEND(rule_files, rules->current_file, rule_file);
+        else
+                LIST_APPEND(rule_files, rules->rule_files, rule_file);
+
+        rules->current_file = rule_file;
+
+        for (i = 0; i < n_lines; i++) {
+                r = rules_cache_read_line(reader, rule_file, gotos + i);
+                if (r < 0)
+                        return r;
+
+                lines[i] = rule_file->current_line;
+        }
+
+        for (i = 0; i < n_lines; i++) {
+                if (gotos[i] == 0)
+                        continue;
+
+                if (gotos[i] >= n_lines - i)
+                        return -EBADMSG;
+
+                lines[i]->goto_line = lines[i + gotos[i]];
+        }
+
+        return 0;
+}
+
+int udev_rules_load_cache_from_dirs(UdevRules **ret_rules, ResolveNameTiming resolve_name_timing, char **dirs, const char *path) {
+        _cleanup_(udev_rules_freep) UdevRules *rules = NULL;
+        _cleanup_strv_free_ char **files = NULL;
+        RulesCacheHeader header, expected;
+        _cleanup_free_ char *buf = NULL;
+        RulesCacheReader reader;
+        size_t size;
+        uint32_t i;
+        int r;
+
+        assert(ret_rules);
+        assert(path);
+
+        r = udev_rules_alloc(&rules, resolve_name_timing, dirs);
+        if (r < 0)
+                return r;
+
+        r = read_full_file(path, &buf, &size);
+        if (r < 0)
+                return r;
+
+        reader = (RulesCacheReader) {
+                .p = buf,
+                .left = size,
+        };
+
+        r = rules_cache_read(&reader, &header, sizeof(header));
+        if (r < 0)
+                return r;
+
+        rules_cache_header_init(&expected, rules);
+        expected.n_stamps = header.n_stamps;
+        expected.n_files = header.n_files;
+        if (memcmp(&header, &expected, sizeof(header)) != 0)
+                return -ESTALE;
+
+        /* Compare with what the rules would be read from now */
+        r = udev_rules_enumerate(rules, &files);
+        if (r < 0)
+                return r;
+
+        if (header.n_stamps != rules->n_stamps)
+                return -ESTALE;
+
+        for (i = 0; i < header.n_stamps; i++) {
+                _cleanup_free_ char *p = NULL;
+                RulesCacheStamp s;
+
+                r = rules_cache_read_string(&reader, &p);
+                if (r < 0)
+                        return r;
+
+                r = rules_cache_read(&reader, &s, sizeof(s));
+                if (r < 0)
+                        return r;
+
+                if (!streq(p, rules->stamps[i].path) ||
+                    s.inode != rules->stamps[i].inode ||
+                    s.mtime_nsec != rules->stamps[i].mtime_nsec ||
+                    s.size != rules->stamps[i].size)
+                        return -ESTALE;
+        }
+
+        r = rules_cache_check_names(&reader, false);
+        if (r < 0)
+                return r;
+
+        r = rules_cache_check_names(&reader, true);
+        if (r < 0)
+                return r;
+
+        for (i = 0; i < header.n_files; i++) {
+                r = rules_cache_read_file(&reader, rules);
+                if (r < 0)
+                        return r;
+        }
+
+        if (reader.left > 0)
+                return -EBADMSG;
+
+        r = udev_rules_build_index(rules);
+        if (r < 0)
+                return r;
+
+        log_debug("Loaded %zu rules from %s", rules->n_lines, path);
+
+        *ret_rules = TAKE_PTR(rules);
+        return 0;
+}
+
+static bool token_match_string(UdevRuleToken *token, const char *str) {
+        const char *i, *value;
+        bool match = false;
+
+        assert(token);
+        assert(token->value);
+        assert(token->type < _TK_M_MAX);
+
+        str = strempty(str);
+        value = token->value;
+
+        switch (token->match_type) {
+        case MATCH_TYPE_EMPTY:
+                match = isempty(str);
+                break;
+        case MATCH_TYPE_SUBSYSTEM:
+                NULSTR_FOREACH(i, "subsystem\0class\0bus\0")
+                        if (streq(i, str)) {
+                                match = true;
+                                break;
+                        }
+                break;
+        case MATCH_TYPE_PLAIN_WITH_EMPTY:
+                if (isempty(str)) {
+                        match = true;
+                        break;
+                }
+                _fallthrough_;
+        case MATCH_TYPE_PLAIN:
+                NULSTR_FOREACH(i, value)
+                        if (streq(i, str)) {
+                                match = true;
+                                break;
+                        }
+                break;
+        case MATCH_TYPE_GLOB_WITH_EMPTY:
+                if (isempty(str)) {
+                        match = true;
+                        break;
+                }
+                _fallthrough_;
+        case MATCH_TYPE_GLOB: {
+                size_t len = strlen(str);
+                const UdevRuleGlob *g;
+
+                assert(token->globs);
+
+                for (g = token->globs; g->pattern; g++)
+                        if (glob_match(g, str, len)) {
+                                match = true;
+                                break;
+                        }
+                break;
+        }
+        default:
+                assert_not_reached("Invalid match type");
+        }
+
+        return token->op == (match ? OP_MATCH : OP_NOMATCH);
+}
+
+static bool token_match_attr(UdevRuleToken *token, sd_device *dev, UdevEvent *event) {
+        char nbuf[UTIL_NAME_SIZE], vbuf[UTIL_NAME_SIZE];
+        const char *name, *value;
+
+        assert(token);
+        assert(dev);
+        assert(event);
+
+        name = (const char*) token->data;
+
+        switch (token->attr_subst_type) {
+        case SUBST_TYPE_FORMAT:
+                (void) udev_event_apply_format(event, name, nbuf, sizeof(nbuf), false);
+                name = nbuf;
                 _fallthrough_;
         case SUBST_TYPE_PLAIN:
                 if (sd_device_get_sysattr_value(dev, name, &value) < 0)
@@ -1540,7 +2522,7 @@ static int udev_rule_apply_token_to_event(
          * 1 on the current token matches the event, and
          * negative errno on some critical errors. */
 
-        token = rules->current_file->current_line->current_token;
+        token = applying_token;
 
         switch (token->type) {
         case TK_M_ACTION: {
@@ -1871,7 +2853,9 @@ static int udev_rule_apply_token_to_event(
                         event->owner_final = true;
 
                 (void) udev_event_apply_format(event, token->value, owner, sizeof(owner), false);
+                assert_se(pthread_mutex_lock(&creds_lock) == 0);
                 r = get_user_creds(&ow, &event->uid, NULL, NULL, NULL, USER_CREDS_ALLOW_MISSING);
+                assert_se(pthread_mutex_unlock(&creds_lock) == 0);
                 if (r < 0)
                         log_unknown_owner(dev, rules, r, "user", owner);
                 else
@@ -1888,7 +2872,9 @@ static int udev_rule_apply_token_to_event(
                         event->group_final = true;
 
                 (void) udev_event_apply_format(event, token->value, group, sizeof(group), false);
+                assert_se(pthread_mutex_lock(&creds_lock) == 0);
                 r = get_group_creds(&gr, &event->gid, USER_CREDS_ALLOW_MISSING);
+                assert_se(pthread_mutex_unlock(&creds_lock) == 0);
                 if (r < 0)
                         log_unknown_owner(dev, rules, r, "group", group);
                 else
@@ -2167,15 +3153,16 @@ static int udev_rule_apply_parent_token_to_event(
                 UdevEvent *event) {
 
         UdevRuleLine *line;
-        UdevRuleToken *head;
+        UdevRuleToken *head, *end;
         int r;
 
-        line = rules->current_file->current_line;
-        head = rules->current_file->current_line->current_token;
+        line = applying_line;
+        head = applying_token;
+        end = line->tokens + line->n_tokens;
         event->dev_parent = event->dev;
         for (;;) {
-                LIST_FOREACH(tokens, line->current_token, head) {
-                        if (!token_is_for_parents(line->current_token))
+                for (applying_token = head; applying_token < end; applying_token++) {
+                        if (!token_is_for_parents(applying_token))
                                 return true; /* All parent tokens match. */
                         r = udev_rule_apply_token_to_event(rules, event->dev_parent, event, 0, NULL);
                         if (r < 0)
@@ -2183,7 +3170,7 @@ static int udev_rule_apply_parent_token_to_event(
                         if (r == 0)
                                 break;
                 }
-                if (!line->current_token)
+                if (applying_token == end)
                         /* All parent tokens match. But no assign tokens in the line. Hmm... */
                         return true;
 
@@ -2199,33 +3186,20 @@ static int udev_rule_apply_line_to_event(
                 UdevEvent *event,
                 usec_t timeout_usec,
                 Hashmap *properties_list,
-                UdevRuleLine **next_line) {
+                UdevRuleLineType mask,
+                UdevRuleLine **ret_goto_line) {
 
-        UdevRuleLine *line = rules->current_file->current_line;
-        UdevRuleLineType mask = LINE_HAS_GOTO | LINE_UPDATE_SOMETHING;
-        UdevRuleToken *token, *next_token;
+        UdevRuleLine *line = applying_line;
+        UdevRuleToken *token;
         bool parents_done = false;
-        DeviceAction action;
         int r;
 
-        r = device_get_action(event->dev, &action);
-        if (r < 0)
-                return r;
-
-        if (action != DEVICE_ACTION_REMOVE) {
-                if (sd_device_get_devnum(event->dev, NULL) >= 0)
-                        mask |= LINE_HAS_DEVLINK;
-
-                if (sd_device_get_ifindex(event->dev, NULL) >= 0)
-                        mask |= LINE_HAS_NAME;
-        }
-
         if ((line->type & mask) == 0)
                 return 0;
 
         event->esc = ESCAPE_UNSET;
-        LIST_FOREACH_SAFE(tokens, token, next_token, line->tokens) {
-                line->current_token = token;
+        for (token = line->tokens; token < line->tokens + line->n_tokens; token++) {
+                applying_token = token;
 
                 if (token_is_for_parents(token)) {
                         if (parents_done)
@@ -2245,34 +3219,211 @@ static int udev_rule_apply_line_to_event(
         }
 
         if (line->goto_line)
-                *next_line = line->goto_line;
+                *ret_goto_line = line->goto_line;
 
         return 0;
 }
 
+/* Walks the lines an event needs to be applied to, in order, by merging the unindexed lines with the lines
+ * indexed under the values of the event. */
+typedef struct UdevRuleCursor {
+        const UdevRuleLineSet *sets[1 + _DISPATCH_KEY_MAX];
+        size_t positions[1 + _DISPATCH_KEY_MAX];
+        size_t n_sets;
+        bool all; /* the values could not be read, look at every line */
+        unsigned next;
+} UdevRuleCursor;
+
+static void rule_cursor_init(UdevRuleCursor *cursor, UdevRules *rules, sd_device *dev) {
+        const char *values[_DISPATCH_KEY_MAX] = {};
+        UdevRuleDispatchKey k;
+        DeviceAction a;
+        int r;
+
+        assert(cursor);
+        assert(rules);
+        assert(dev);
+
+        *cursor = (UdevRuleCursor) {
+                .sets[0] = &rules->unindexed,
+                .n_sets = 1,
+        };
+
+        if (rules->no_index) {
+                cursor->all = true;
+                return;
+        }
+
+        /* If any of them fails, let the rules report the error */
+        if (device_get_action(dev, &a) < 0 ||
+            sd_device_get_sysname(dev, &values[DISPATCH_KERNEL]) < 0) {
+                cursor->all = true;
+                return;
+        }
+
+        r = sd_device_get_subsystem(dev, &values[DISPATCH_SUBSYSTEM]);
+        if (r < 0 && r != -ENOENT) {
+                cursor->all = true;
+                return;
+        }
+
+        values[DISPATCH_ACTION] = device_action_to_string(a);
+
+        for (k = 0; k < _DISPATCH_KEY_MAX; k++) {
+                UdevRuleLineSet *set;
+
+                if (!values[k])
+                        continue;
+
+                set = hashmap_get(rules->dispatch[k], values[k]);
+                if (set)
+                        cursor->sets[cursor->n_sets++] = set;
+        }
+}
+
+static UdevRuleLine *rule_cursor_next(UdevRuleCursor *cursor, UdevRules *rules) {
+        unsigned best = UINT_MAX;
+        size_t i, best_set = 0;
+
+        assert(cursor);
+        assert(rules);
+
+        if (cursor->all)
+                return cursor->next < rules->n_lines ? rules->lines[cursor->next++] : NULL;
+
+        for (i = 0; i < cursor->n_sets; i++) {
+                const UdevRuleLineSet *set = cursor->sets[i];
+
+                /* Skip what was jumped over */
+                while (cursor->positions[i] < set->n_indices && set->indices[cursor->positions[i]] < cursor->next)
+                        cursor->positions[i]++;
+
+                if (cursor->positions[i] < set->n_indices && set->indices[cursor->positions[i]] < best) {
+                        best = set->indices[cursor->positions[i]];
+                        best_set = i;
+                }
+        }
+
+        if (best == UINT_MAX)
+                return NULL;
+
+        cursor->positions[best_set]++;
+        cursor->next = best + 1;
+        return rules->lines[best];
+}
+
 int udev_rules_apply_to_event(
                 UdevRules *rules,
                 UdevEvent *event,
                 usec_t timeout_usec,
                 Hashmap *properties_list) {
 
-        UdevRuleFile *file;
-        UdevRuleLine *next_line;
+        UdevRuleLineType mask = LINE_HAS_GOTO | LINE_UPDATE_SOMETHING;
+        UdevRuleCursor cursor;
+        DeviceAction action;
+        UdevRuleLine *line;
         int r;
 
         assert(rules);
         assert(event);
 
-        LIST_FOREACH(rule_files, file, rules->rule_files) {
-                rules->current_file = file;
-                LIST_FOREACH_SAFE(rule_lines, file->current_line, next_line, file->rule_lines) {
-                        r = udev_rule_apply_line_to_event(rules, event, timeout_usec, properties_list, &next_line);
-                        if (r < 0)
-                                return r;
+        if (rules->n_lines == 0)
+                return 0;
+
+        r = device_get_action(event->dev, &action);
+        if (r < 0)
+                return r;
+
+        if (action != DEVICE_ACTION_REMOVE) {
+                if (sd_device_get_devnum(event->dev, NULL) >= 0)
+                        mask |= LINE_HAS_DEVLINK;
+
+                if (sd_device_get_ifindex(event->dev, NULL) >= 0)
+                        mask |= LINE_HAS_NAME;
+        }
+
+        rule_cursor_init(&cursor, rules, event->dev);
+
+        while ((line = rule_cursor_next(&cursor, rules))) {
+                UdevRuleLine *goto_line = NULL;
+                usec_t ts = 0;
+
+                applying_line = line;
+
+                if (rules->timing)
+                        ts = now(CLOCK_MONOTONIC);
+
+                r = udev_rule_apply_line_to_event(rules, event, timeout_usec, properties_list, mask, &goto_line);
+
+                if (rules->timing) {
+                        line->time_usec += usec_sub_unsigned(now(CLOCK_MONOTONIC), ts);
+                        line->n_applied++;
                 }
+
+                if (r < 0)
+                        break;
+
+                if (goto_line)
+                        cursor.next = goto_line->index;
         }
 
-        return 0;
+        applying_line = NULL;
+        applying_token = NULL;
+
+        return r < 0 ? r : 0;
+}
+
+void udev_rules_set_timing(UdevRules *rules, bool b) {
+        assert(rules);
+
+        rules->timing = b;
+}
+
+void udev_rules_set_index(UdevRules *rules, bool b) {
+        assert(rules);
+
+        rules->no_index = !b;
+}
+
+static int rule_line_compare_time(UdevRuleLine * const *a, UdevRuleLine * const *b) {
+        int r;
+
+        r = CMP((*b)->time_usec, (*a)->time_usec);
+        if (r != 0)
+                return r;
+
+        return CMP((*a)->index, (*b)->index);
+}
+
+void udev_rules_dump_timing(UdevRules *rules, size_t n_max) {
+        _cleanup_free_ UdevRuleLine **lines = NULL;
+        char buf[FORMAT_TIMESPAN_MAX];
+        usec_t total = 0;
+        size_t i, n = 0;
+
+        assert(rules);
+
+        lines = new(UdevRuleLine*, rules->n_lines);
+        if (!lines && rules->n_lines > 0) {
+                log_oom();
+                return;
+        }
+
+        for (i = 0; i < rules->n_lines; i++)
+                if (rules->lines[i]->n_applied > 0) {
+                        lines[n++] = rules->lines[i];
+                        total += rules->lines[i]->time_usec;
+                }
+
+        typesafe_qsort(lines, n, rule_line_compare_time);
+
+        printf("Looked at %zu of %zu rules, which took %s.\n",
+               n, rules->n_lines, format_timespan(buf, sizeof(buf), total, 1));
+
+        for (i = 0; i < MIN(n, n_max); i++)
+                printf("%10s  %s:%u (%u times)\n",
+                       format_timespan(buf, sizeof(buf), lines[i]->time_usec, 1),
+                       lines[i]->rule_file->filename, lines[i]->line_number, lines[i]->n_applied);
 }
 
 static int apply_static_dev_perms(const char *devnode, uid_t uid, gid_t gid, mode_t mode, char **tags) {
@@ -2355,7 +3506,7 @@ static int udev_rule_line_apply_static_dev_perms(UdevRuleLine *rule_line) {
         if (!FLAGS_SET(rule_line->type, LINE_HAS_STATIC_NODE))
                 return 0;
 
-        LIST_FOREACH(tokens, token, rule_line->tokens)
+        for (token = rule_line->tokens; token < rule_line->tokens + rule_line->n_tokens; token++)
                 if (token->type == TK_A_OWNER_ID)
                         uid = PTR_TO_UID(token->data);
                 else if (token->type == TK_A_GROUP_ID)
@@ -16,12 +16,30 @@ typedef enum {
         _ESCAPE_TYPE_INVALID = -1
 } UdevRuleEscapeType;
 
-int udev_rules_new(UdevRules **ret_rules, ResolveNameTiming resolve_name_timing);
+#define UDEV_RULES_CACHE "/run/udev/rules.cache"
+
+/* dirs is NULL for the default directories */
+int udev_rules_new_from_dirs(UdevRules **ret_rules, ResolveNameTiming resolve_name_timing, char **dirs);
+static inline int udev_rules_new(UdevRules **ret_rules, ResolveNameTiming resolve_name_timing) {
+        return udev_rules_new_from_dirs(ret_rules, resolve_name_timing, NULL);
+}
 UdevRules *udev_rules_free(UdevRules *rules);
 DEFINE_TRIVIAL_CLEANUP_FUNC(UdevRules*, udev_rules_free);
 
+/* Returns -ESTALE if the cache does not match the current rules files, or resolved names changed */
+int udev_rules_load_cache_from_dirs(UdevRules **ret_rules, ResolveNameTiming resolve_name_timing, char **dirs, const char *path);
+static inline int udev_rules_load_cache(UdevRules **ret_rules, ResolveNameTiming resolve_name_timing, const char *path) {
+        return udev_rules_load_cache_from_dirs(ret_rules, resolve_name_timing, NULL, path);
+}
+int udev_rules_save_cache(UdevRules *rules, const char *path);
+
 bool udev_rules_check_timestamp(UdevRules *rules);
 int udev_rules_apply_to_event(UdevRules *rules, UdevEvent *event,
                               usec_t timeout_usec,
                               Hashmap *properties_list);
 int udev_rules_apply_static_dev_perms(UdevRules *rules);
+
+void udev_rules_set_timing(UdevRules *rules, bool b);
+/* Enabled by default. Without the index every line is looked at, which must give the same result. */
+void udev_rules_set_index(UdevRules *rules, bool b);
+void udev_rules_dump_timing(UdevRules *rules, size_t n_max);
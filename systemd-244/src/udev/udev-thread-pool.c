@@ -0,0 +1,295 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "list.h"
+#include "log.h"
+#include "udev-thread-pool.h"
+
+typedef struct WorkItem WorkItem;
+
+struct WorkItem {
+        void *item;
+        LIST_FIELDS(WorkItem, items);
+};
+
+typedef struct PoolThread {
+        UdevThreadPool *pool;
+        pthread_t thread;
+        void *data;
+} PoolThread;
+
+struct UdevThreadPool {
+        const UdevThreadPoolOps *ops;
+        void *userdata;
+
+        PoolThread **threads;
+        size_t n_threads, n_threads_allocated;
+        unsigned n_items; /* submitted, and not collected yet */
+        unsigned n_busy;  /* queued or in progress, protected by the lock */
+
+        /* Both lists are appended at the tail, so that items are processed and collected in order. The lists
+         * and everything below are protected by the lock. */
+        pthread_mutex_t lock;
+        pthread_cond_t cond; /* items were queued, or the threads shall exit */
+        LIST_HEAD(WorkItem, queue);
+        WorkItem *queue_tail;
+        LIST_HEAD(WorkItem, done);
+        WorkItem *done_tail;
+        bool exit;
+
+        int fd; /* eventfd, signalled when an item was added to the done list */
+};
+
+static void work_item_append(WorkItem **head, WorkItem **tail, WorkItem *w) {
+        LIST_INSERT_AFTER(items, *head, *tail, w);
+        *tail = w;
+}
+
+static WorkItem *work_item_pop(WorkItem **head, WorkItem **tail) {
+        WorkItem *w = *head;
+
+        if (!w)
+                return NULL;
+
+        if (*tail == w)
+                *tail = NULL;
+        LIST_REMOVE(items, *head, w);
+        return w;
+}
+
+int udev_thread_pool_new(UdevThreadPool **ret, const UdevThreadPoolOps *ops, void *userdata) {
+        _cleanup_(udev_thread_pool_freep) UdevThreadPool *pool = NULL;
+
+        assert(ret);
+        assert(ops);
+        assert(ops->process);
+
+        pool = new(UdevThreadPool, 1);
+        if (!pool)
+                return -ENOMEM;
+
+        *pool = (UdevThreadPool) {
+                .ops = ops,
+                .userdata = userdata,
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+                .cond = PTHREAD_COND_INITIALIZER,
+                .fd = -1,
+        };
+
+        pool->fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (pool->fd < 0)
+                return -errno;
+
+        *ret = TAKE_PTR(pool);
+        return 0;
+}
+
+UdevThreadPool *udev_thread_pool_free(UdevThreadPool *pool) {
+        WorkItem *w;
+
+        if (!pool)
+                return NULL;
+
+        udev_thread_pool_stop(pool);
+
+        while ((w = work_item_pop(&pool->done, &pool->done_tail)))
+                free(w);
+
+        safe_close(pool->fd);
+        return mfree(pool);
+}
+
+int udev_thread_pool_get_fd(UdevThreadPool *pool) {
+        assert(pool);
+
+        return pool->fd;
+}
+
+unsigned udev_thread_pool_get_n_threads(UdevThreadPool *pool) {
+        assert(pool);
+
+        return pool->n_threads;
+}
+
+unsigned udev_thread_pool_get_n_items(UdevThreadPool *pool) {
+        assert(pool);
+
+        return pool->n_items;
+}
+
+static void *pool_thread_main(void *userdata) {
+        PoolThread *thread = userdata;
+        UdevThreadPool *pool;
+
+        assert(thread);
+        assert(thread->pool);
+
+        pool = thread->pool;
+
+        assert_se(pthread_mutex_lock(&pool->lock) == 0);
+
+        for (;;) {
+                WorkItem *w;
+
+                while (!pool->queue && !pool->exit)
+                        assert_se(pthread_cond_wait(&pool->cond, &pool->lock) == 0);
+
+                /* Finish what was queued before exiting */
+                w = work_item_pop(&pool->queue, &pool->queue_tail);
+                if (!w)
+                        break;
+
+                assert_se(pthread_mutex_unlock(&pool->lock) == 0);
+
+                pool->ops->process(w->item, thread->data);
+
+                assert_se(pthread_mutex_lock(&pool->lock) == 0);
+
+                work_item_append(&pool->done, &pool->done_tail, w);
+                assert(pool->n_busy > 0);
+                pool->n_busy--;
+
+                if (eventfd_write(pool->fd, 1) < 0)
+                        log_warning_errno(errno, "Failed to signal owner of thread pool, ignoring: %m");
+        }
+
+        assert_se(pthread_mutex_unlock(&pool->lock) == 0);
+
+        return NULL;
+}
+
+static PoolThread *pool_thread_free(PoolThread *thread) {
+        if (!thread)
+                return NULL;
+
+        if (thread->pool->ops->thread_free)
+                thread->pool->ops->thread_free(thread->data);
+
+        return mfree(thread);
+}
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(PoolThread*, pool_thread_free);
+
+static int pool_thread_new(UdevThreadPool *pool) {
+        _cleanup_(pool_thread_freep) PoolThread *thread = NULL;
+        int r;
+
+        assert(pool);
+
+        if (!GREEDY_REALLOC(pool->threads, pool->n_threads_allocated, pool->n_threads + 1))
+                return -ENOMEM;
+
+        thread = new(PoolThread, 1);
+        if (!thread)
+                return -ENOMEM;
+
+        *thread = (PoolThread) {
+                .pool = pool,
+        };
+
+        if (pool->ops->thread_new) {
+                r = pool->ops->thread_new(pool->userdata, &thread->data);
+                if (r < 0)
+                        return r;
+        }
+
+        r = pthread_create(&thread->thread, NULL, pool_thread_main, thread);
+        if (r != 0)
+                return -r;
+
+        pool->threads[pool->n_threads++] = TAKE_PTR(thread);
+
+        log_debug("Worker thread %zu started.", pool->n_threads);
+        return 0;
+}
+
+int udev_thread_pool_submit(UdevThreadPool *pool, void *item, unsigned max_threads) {
+        WorkItem *w;
+        bool busy;
+        int r;
+
+        assert(pool);
+        assert(max_threads > 0);
+
+        if (pool->exit)
+                return -ESHUTDOWN;
+
+        w = new(WorkItem, 1);
+        if (!w)
+                return -ENOMEM;
+
+        *w = (WorkItem) {
+                .item = item,
+        };
+
+        assert_se(pthread_mutex_lock(&pool->lock) == 0);
+        busy = pool->n_busy >= pool->n_threads;
+        assert_se(pthread_mutex_unlock(&pool->lock) == 0);
+
+        /* All threads are busy with, or about to pick up, an item already */
+        if (busy && pool->n_threads < max_threads) {
+                r = pool_thread_new(pool);
+                if (r < 0) {
+                        if (pool->n_threads == 0) {
+                                free(w);
+                                return r;
+                        }
+
+                        log_warning_errno(r, "Failed to start worker thread, queueing for the running ones: %m");
+                }
+        }
+
+        assert_se(pthread_mutex_lock(&pool->lock) == 0);
+        work_item_append(&pool->queue, &pool->queue_tail, w);
+        pool->n_busy++;
+        assert_se(pthread_cond_signal(&pool->cond) == 0);
+        assert_se(pthread_mutex_unlock(&pool->lock) == 0);
+
+        pool->n_items++;
+        return 0;
+}
+
+void *udev_thread_pool_collect(UdevThreadPool *pool) {
+        WorkItem *w;
+        void *item;
+
+        assert(pool);
+
+        assert_se(pthread_mutex_lock(&pool->lock) == 0);
+        w = work_item_pop(&pool->done, &pool->done_tail);
+        assert_se(pthread_mutex_unlock(&pool->lock) == 0);
+
+        if (!w)
+                return NULL;
+
+        assert(pool->n_items > 0);
+        pool->n_items--;
+
+        item = w->item;
+        free(w);
+        return item;
+}
+
+void udev_thread_pool_stop(UdevThreadPool *pool) {
+        size_t i;
+
+        assert(pool);
+
+        assert_se(pthread_mutex_lock(&pool->lock) == 0);
+        pool->exit = true;
+        assert_se(pthread_cond_broadcast(&pool->cond) == 0);
+        assert_se(pthread_mutex_unlock(&pool->lock) == 0);
+
+        for (i = 0; i < pool->n_threads; i++) {
+                assert_se(pthread_join(pool->threads[i]->thread, NULL) == 0);
+                pool_thread_free(pool->threads[i]);
+        }
+
+        pool->threads = mfree(pool->threads);
+        pool->n_threads = pool->n_threads_allocated = 0;
+}
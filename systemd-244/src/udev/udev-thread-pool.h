@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+#pragma once
+
+#include "macro.h"
+
+/* A set of persistent threads, started on demand, which process work items in the order they were submitted.
+ * Items the threads are done with are handed back to the owner, which is woken up through an eventfd. Each
+ * thread may carry private state, created and destroyed in the owner's thread. */
+
+typedef struct UdevThreadPool UdevThreadPool;
+
+typedef struct UdevThreadPoolOps {
+        /* Called in the owner's thread, before a thread is started and after it exited */
+        int (*thread_new)(void *userdata, void **ret_thread_data);
+        void (*thread_free)(void *thread_data);
+
+        /* Called in a pool thread, without any lock held */
+        void (*process)(void *item, void *thread_data);
+} UdevThreadPoolOps;
+
+int udev_thread_pool_new(UdevThreadPool **ret, const UdevThreadPoolOps *ops, void *userdata);
+/* Stops the threads, see udev_thread_pool_stop(). Items that were not collected are not freed. */
+UdevThreadPool *udev_thread_pool_free(UdevThreadPool *pool);
+DEFINE_TRIVIAL_CLEANUP_FUNC(UdevThreadPool*, udev_thread_pool_free);
+
+/* Readable when items are ready to be collected. Read it before collecting, so that no wakeup is lost. */
+int udev_thread_pool_get_fd(UdevThreadPool *pool);
+
+unsigned udev_thread_pool_get_n_threads(UdevThreadPool *pool);
+/* Items submitted and not collected yet, i.e. queued, in progress or done */
+unsigned udev_thread_pool_get_n_items(UdevThreadPool *pool);
+
+/* Queues an item, and starts a new thread if all are busy and fewer than max_threads are running */
+int udev_thread_pool_submit(UdevThreadPool *pool, void *item, unsigned max_threads);
+/* Returns the next item the threads are done with, or NULL */
+void *udev_thread_pool_collect(UdevThreadPool *pool);
+
+/* Lets the threads process what is queued, and waits for them to exit. Nothing may be submitted afterwards. */
+void udev_thread_pool_stop(UdevThreadPool *pool);
@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+#include <errno.h>
+
+#include "alloc-util.h"
+#include "hashmap.h"
+#include "string-util.h"
+#include "udev-trigger-order.h"
+
+static bool devpath_is_delayed(const char *devpath) {
+        return strstr(devpath, "/block/md") || strstr(devpath, "/block/dm-");
+}
+
+/* Returns the length of the prefix naming the sound card, if the devpath is below one */
+static size_t devpath_sound_card_prefix(const char *devpath) {
+        const char *p;
+
+        p = strstr(devpath, "/sound/card");
+        if (!p)
+                return 0;
+
+        p = strchr(p + STRLEN("/sound/card"), '/');
+        if (!p)
+                return 0;
+
+        return p - devpath;
+}
+
+int udev_trigger_order(const char * const *devpaths, size_t n, size_t *ret_after, size_t *ret_first_delayed) {
+        _cleanup_hashmap_free_ Hashmap *by_devpath = NULL;
+        _cleanup_free_ char *buf = NULL;
+        size_t i, first_delayed = n;
+        int r;
+
+        assert(devpaths || n == 0);
+        assert(ret_after || n == 0);
+        assert(ret_first_delayed);
+
+        by_devpath = hashmap_new(&string_hash_ops);
+        if (!by_devpath)
+                return -ENOMEM;
+
+        for (i = 0; i < n; i++) {
+                const char *devpath = devpaths[i];
+                size_t k;
+
+                ret_after[i] = TRIGGER_ORDER_NONE;
+
+                if (!devpath)
+                        continue;
+
+                /* The index is stored plus one, so that the first device is not a NULL value. On duplicates,
+                 * the first one wins. */
+                r = hashmap_put(by_devpath, devpath, SIZE_TO_PTR(i + 1));
+                if (r < 0 && r != -EEXIST)
+                        return r;
+
+                if (first_delayed == n && devpath_is_delayed(devpath))
+                        first_delayed = i;
+
+                /* Devices of a sound card are written one after the other, in enumeration order, so that the
+                 * control device stays the last one. */
+                k = devpath_sound_card_prefix(devpath);
+                if (k > 0 && i > 0 && devpaths[i-1] &&
+                    strneq(devpaths[i-1], devpath, k) && IN_SET(devpaths[i-1][k], '/', 0)) {
+                        ret_after[i] = i - 1;
+                        continue;
+                }
+
+                /* Otherwise, wait for the closest ancestor. The enumerator orders parents before their
+                 * children, hence it is always added already, if it is in the set at all. */
+                r = free_and_strdup(&buf, devpath);
+                if (r < 0)
+                        return r;
+
+                for (;;) {
+                        size_t parent;
+                        char *p;
+
+                        p = strrchr(buf, '/');
+                        if (!p || p == buf)
+                                break;
+                        *p = 0;
+
+                        parent = PTR_TO_SIZE(hashmap_get(by_devpath, buf));
+                        if (parent > 0 && parent - 1 < i) {
+                                ret_after[i] = parent - 1;
+                                break;
+                        }
+                }
+        }
+
+        *ret_first_delayed = first_delayed;
+        return 0;
+}
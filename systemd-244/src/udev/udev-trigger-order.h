@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Decides the order in which udevadm trigger may write the uevents of a set of devices, given in the order the
+ * enumerator returned them, while writing them from several threads:
+ *  - a device is only written once its closest ancestor in the set was,
+ *  - devices of a sound card are written one after the other, so that the control device stays the last one,
+ *  - md and dm devices are only written after all others. */
+
+#define TRIGGER_ORDER_NONE SIZE_MAX
+
+/* devpaths[i] may be NULL if it is unknown, the device is then not ordered at all. On success, ret_after[i]
+ * is the index of the device that must be written before device i, or TRIGGER_ORDER_NONE, and always smaller
+ * than i. ret_first_delayed is the index of the first md or dm device, or n if there is none. */
+int udev_trigger_order(const char * const *devpaths, size_t n, size_t *ret_after, size_t *ret_first_delayed);
@@ -89,7 +89,7 @@ int hwdb_main(int argc, char *argv[], void *userdata) {
                                        "Either --update or --test must be used.");
 
         if (arg_update) {
-                r = hwdb_update(arg_root, arg_hwdb_bin_dir, arg_strict, true);
+                r = hwdb_update(arg_root, arg_hwdb_bin_dir, arg_strict, true, false);
                 if (r < 0)
                         return r;
         }
@@ -21,6 +21,7 @@
 #include "strxcpyx.h"
 #include "udev-builtin.h"
 #include "udev-event.h"
+#include "udev-rules.h"
 #include "udevadm.h"
 
 static const char *arg_action = "add";
@@ -102,6 +103,7 @@ int test_main(int argc, char *argv[], void *userdata) {
         _cleanup_(udev_rules_freep) UdevRules *rules = NULL;
         _cleanup_(udev_event_freep) UdevEvent *event = NULL;
         _cleanup_(sd_device_unrefp) sd_device *dev = NULL;
+        DeviceSysattrCacheStats stats;
         const char *cmd, *key, *value;
         sigset_t mask, sigmask_orig;
         Iterator i;
@@ -123,12 +125,17 @@ int test_main(int argc, char *argv[], void *userdata) {
 
         udev_builtin_init();
 
+        /* Report how often the same sysattrs are read through different device objects */
+        device_sysattr_cache_enable(true);
+
         r = udev_rules_new(&rules, arg_resolve_name_timing);
         if (r < 0) {
                 log_error_errno(r, "Failed to read udev rules: %m");
                 goto out;
         }
 
+        udev_rules_set_timing(rules, true);
+
         r = device_new_from_synthetic_event(&dev, arg_syspath, arg_action);
         if (r < 0) {
                 log_error_errno(r, "Failed to open device '%s': %m", arg_syspath);
@@ -155,6 +162,13 @@ int test_main(int argc, char *argv[], void *userdata) {
                 printf("run: '%s'\n", program);
         }
 
+        printf("\n");
+        udev_rules_dump_timing(rules, 10);
+
+        device_sysattr_cache_get_stats(&stats);
+        printf("sysattr cache: %"PRIu64" lookups, %"PRIu64" hits (%"PRIu64"%%)\n",
+               stats.n_lookups, stats.n_hits, stats.n_lookups > 0 ? stats.n_hits * 100 / stats.n_lookups : 0);
+
         r = 0;
 out:
         udev_builtin_exit();
@@ -2,6 +2,9 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
 
 #include "sd-device.h"
 #include "sd-event.h"
@@ -10,25 +13,142 @@
 #include "device-private.h"
 #include "fd-util.h"
 #include "fileio.h"
+#include "hashmap.h"
+#include "parse-util.h"
 #include "path-util.h"
 #include "process-util.h"
-#include "set.h"
 #include "string-util.h"
 #include "strv.h"
 #include "udevadm.h"
 #include "udevadm-util.h"
 #include "udev-ctrl.h"
+#include "udev-trigger-order.h"
 #include "virt.h"
 
+#define TRIGGER_JOBS_DEFAULT_MAX 8U
+#define TRIGGER_ITEM_NONE TRIGGER_ORDER_NONE
+/* If none of the events in flight was seen for that long, we stop throttling, rather than waiting for events
+ * that may never come. */
+#define TRIGGER_IN_FLIGHT_TIMEOUT_USEC (30 * USEC_PER_SEC)
+
 static bool arg_verbose = false;
 static bool arg_dry_run = false;
+static unsigned arg_jobs = 0;
+static unsigned arg_max_in_flight = 0;
+
+typedef enum TriggerItemState {
+        TRIGGER_ITEM_WAITING,
+        TRIGGER_ITEM_QUEUED,   /* uevent written, event not seen yet */
+        TRIGGER_ITEM_DONE,
+} TriggerItemState;
+
+typedef struct TriggerSubsystem {
+        const char *name;
+        unsigned n_items;
+        unsigned n_done;
+        unsigned n_settled;
+} TriggerSubsystem;
+
+typedef struct TriggerItem {
+        sd_device *device;
+        const char *syspath;
+        TriggerSubsystem *subsystem;
+        TriggerItemState state;
+        usec_t queued_usec;
+
+        /* The uevent is only written after the one of this item has been, that is the closest ancestor that is
+         * triggered too, or the previous device of the same sound card */
+        size_t after;
+        size_t first_child;
+        size_t next_sibling;
+} TriggerItem;
+
+typedef struct Trigger {
+        const char *action;
+        bool track;  /* whether we watch for the events to be processed */
+        bool settle; /* whether we wait for all of them before exiting */
+
+        TriggerItem *items;
+        size_t n_items, n_allocated;
+        size_t n_first_delayed; /* md and dm devices are written after everything else, see device_compare() */
+
+        Hashmap *items_by_syspath; /* keys are owned by the devices */
+        Hashmap *subsystems;
+
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        size_t *ready;
+        size_t ready_head, ready_tail;
+        size_t n_written; /* successfully or not */
+        unsigned n_in_flight;
+        unsigned max_in_flight; /* 0 if not throttling */
+        size_t in_flight_head; /* entries of ready before it are not in flight anymore */
+        bool aborted;
+        int ret;
+
+        int done_fd;
+} Trigger;
+
+static void trigger_done(Trigger *t) {
+        size_t i;
+
+        assert(t);
+
+        for (i = 0; i < t->n_items; i++)
+                sd_device_unref(t->items[i].device);
+        free(t->items);
+        free(t->ready);
+
+        hashmap_free(t->items_by_syspath);
+        hashmap_free_free(t->subsystems);
+
+        safe_close(t->done_fd);
+        (void) pthread_cond_destroy(&t->cond);
+        (void) pthread_mutex_destroy(&t->lock);
+}
+
+static int trigger_add_subsystem(Trigger *t, sd_device *d, TriggerSubsystem **ret) {
+        TriggerSubsystem *s;
+        const char *name;
+        int r;
+
+        if (sd_device_get_subsystem(d, &name) < 0)
+                name = "";
+
+        s = hashmap_get(t->subsystems, name);
+        if (!s) {
+                r = hashmap_ensure_allocated(&t->subsystems, &string_hash_ops);
+                if (r < 0)
+                        return r;
+
+                s = new0(TriggerSubsystem, 1);
+                if (!s)
+                        return -ENOMEM;
+
+                s->name = name;
 
-static int exec_list(sd_device_enumerator *e, const char *action, Set *settle_set) {
+                r = hashmap_put(t->subsystems, s->name, s);
+                if (r < 0) {
+                        free(s);
+                        return r;
+                }
+        }
+
+        s->n_items++;
+
+        *ret = s;
+        return 0;
+}
+
+static int trigger_collect(Trigger *t, sd_device_enumerator *e) {
         sd_device *d;
-        int r, ret = 0;
+        int r;
+
+        assert(t);
+        assert(e);
 
         FOREACH_DEVICE_AND_SUBSYSTEM(e, d) {
-                _cleanup_free_ char *filename = NULL;
+                TriggerItem *item;
                 const char *syspath;
 
                 if (sd_device_get_syspath(d, &syspath) < 0)
@@ -39,58 +159,410 @@ static int exec_list(sd_device_enumerator *e, const char *action, Set *settle_se
                 if (arg_dry_run)
                         continue;
 
-                filename = path_join(syspath, "uevent");
-                if (!filename)
+                if (!GREEDY_REALLOC(t->items, t->n_allocated, t->n_items + 1))
                         return log_oom();
 
-                r = write_string_file(filename, action, WRITE_STRING_FILE_DISABLE_BUFFER);
-                if (r < 0) {
-                        bool ignore = IN_SET(r, -ENOENT, -EACCES, -ENODEV, -EROFS);
-
-                        log_full_errno(ignore ? LOG_DEBUG : LOG_ERR, r,
-                                       "Failed to write '%s' to '%s'%s: %m",
-                                       action, filename, ignore ? ", ignoring" : "");
-                        if (r == -EROFS)
-                                return 0; /* Read only filesystem. Return earlier. */
-                        if (ret == 0 && !ignore)
-                                ret = r;
+                item = t->items + t->n_items;
+                *item = (TriggerItem) {
+                        .device = sd_device_ref(d),
+                        .syspath = syspath,
+                        .after = TRIGGER_ITEM_NONE,
+                        .first_child = TRIGGER_ITEM_NONE,
+                        .next_sibling = TRIGGER_ITEM_NONE,
+                };
+                t->n_items++;
+
+                if (t->settle) {
+                        r = trigger_add_subsystem(t, d, &item->subsystem);
+                        if (r < 0)
+                                return log_oom();
+                }
+        }
+
+        return 0;
+}
+
+static int trigger_prepare(Trigger *t) {
+        _cleanup_free_ size_t *after = NULL, *last_child = NULL;
+        _cleanup_free_ const char **devpaths = NULL;
+        size_t i;
+        int r;
+
+        assert(t);
+
+        t->items_by_syspath = hashmap_new(&string_hash_ops);
+        if (!t->items_by_syspath)
+                return log_oom();
+
+        t->ready = new(size_t, t->n_items);
+        devpaths = new(const char*, t->n_items);
+        after = new(size_t, t->n_items);
+        last_child = new(size_t, t->n_items);
+        if (!t->ready || !devpaths || !after || !last_child)
+                return log_oom();
+
+        for (i = 0; i < t->n_items; i++) {
+                TriggerItem *item = t->items + i;
+
+                r = hashmap_put(t->items_by_syspath, item->syspath, item);
+                if (r < 0 && r != -EEXIST)
+                        return log_oom();
+
+                if (sd_device_get_devpath(item->device, devpaths + i) < 0)
+                        devpaths[i] = NULL;
+
+                last_child[i] = TRIGGER_ITEM_NONE;
+        }
+
+        r = udev_trigger_order(devpaths, t->n_items, after, &t->n_first_delayed);
+        if (r < 0)
+                return log_error_errno(r, "Failed to order devices: %m");
+
+        /* Link the children in enumeration order */
+        for (i = 0; i < t->n_items; i++) {
+                size_t a = after[i];
+
+                t->items[i].after = a;
+                if (a == TRIGGER_ITEM_NONE)
+                        continue;
+
+                if (last_child[a] == TRIGGER_ITEM_NONE)
+                        t->items[a].first_child = i;
+                else
+                        t->items[last_child[a]].next_sibling = i;
+                last_child[a] = i;
+        }
+
+        return 0;
+}
+
+static void trigger_push_delayed(Trigger *t) {
+        size_t i;
+
+        for (i = t->n_first_delayed; i < t->n_items; i++)
+                if (t->items[i].after == TRIGGER_ITEM_NONE || t->items[i].after < t->n_first_delayed)
+                        t->ready[t->ready_tail++] = i;
+}
+
+static void trigger_push_initial(Trigger *t) {
+        size_t i;
+
+        for (i = 0; i < t->n_first_delayed; i++)
+                if (t->items[i].after == TRIGGER_ITEM_NONE)
+                        t->ready[t->ready_tail++] = i;
+
+        if (t->n_first_delayed == 0)
+                trigger_push_delayed(t);
+}
+
+static bool trigger_is_finished(Trigger *t) {
+        if (t->aborted)
+                return true;
+
+        if (t->n_written < t->n_items)
+                return false;
+
+        return !t->settle || t->n_in_flight == 0;
+}
+
+/* Called with the lock taken */
+static void trigger_item_finish(Trigger *t, TriggerItem *item, bool settled) {
+        TriggerSubsystem *s = item->subsystem;
+
+        if (item->state == TRIGGER_ITEM_QUEUED) {
+                assert(t->n_in_flight > 0);
+                t->n_in_flight--;
+        }
+
+        item->state = TRIGGER_ITEM_DONE;
+
+        if (!s)
+                return;
+
+        s->n_done++;
+        if (settled)
+                s->n_settled++;
+
+        if (arg_verbose && s->n_done == s->n_items)
+                printf("settled %u of %u devices of subsystem %s\n",
+                       s->n_settled, s->n_items, isempty(s->name) ? "(none)" : s->name);
+}
+
+/* Called with the lock taken */
+static void trigger_item_written(Trigger *t, size_t i, int r) {
+        TriggerItem *item = t->items + i;
+        size_t c;
+
+        if (r < 0) {
+                bool ignore = IN_SET(r, -ENOENT, -EACCES, -ENODEV, -EROFS);
+
+                log_full_errno(ignore ? LOG_DEBUG : LOG_ERR, r,
+                               "Failed to write '%s' to '%s/uevent'%s: %m",
+                               t->action, item->syspath, ignore ? ", ignoring" : "");
+                if (r == -EROFS)
+                        t->aborted = true; /* Read only filesystem, there's no point in continuing. */
+                else if (t->ret == 0 && !ignore)
+                        t->ret = r;
+
+                /* Unless we saw an event for it anyway */
+                if (item->state != TRIGGER_ITEM_DONE)
+                        trigger_item_finish(t, item, false);
+        } else if (!t->track)
+                item->state = TRIGGER_ITEM_DONE;
+
+        t->n_written++;
+
+        for (c = item->first_child; c != TRIGGER_ITEM_NONE; c = t->items[c].next_sibling)
+                if (c < t->n_first_delayed || i >= t->n_first_delayed)
+                        t->ready[t->ready_tail++] = c;
+
+        if (t->n_written == t->n_first_delayed && t->n_first_delayed < t->n_items)
+                trigger_push_delayed(t);
+
+        if (t->done_fd >= 0 && (t->aborted || t->n_written == t->n_items))
+                (void) eventfd_write(t->done_fd, 1);
+
+        (void) pthread_cond_broadcast(&t->cond);
+}
+
+static void* trigger_thread(void *userdata) {
+        Trigger *t = userdata;
+
+        assert(t);
+
+        (void) pthread_mutex_lock(&t->lock);
+
+        for (;;) {
+                _cleanup_free_ char *filename = NULL;
+                TriggerItem *item;
+                size_t i;
+                int r;
+
+                if (t->aborted || t->n_written == t->n_items)
+                        break;
+
+                if (t->ready_head == t->ready_tail ||
+                    (t->max_in_flight > 0 && t->n_in_flight >= t->max_in_flight)) {
+                        (void) pthread_cond_wait(&t->cond, &t->lock);
                         continue;
                 }
 
-                if (settle_set) {
-                        r = set_put_strdup(settle_set, syspath);
-                        if (r < 0)
-                                return log_oom();
+                i = t->ready[t->ready_head++];
+                item = t->items + i;
+
+                /* Mark it before writing, the event might be processed before we get the lock back */
+                if (t->track) {
+                        item->state = TRIGGER_ITEM_QUEUED;
+                        item->queued_usec = now(CLOCK_MONOTONIC);
+                        t->n_in_flight++;
                 }
+
+                (void) pthread_mutex_unlock(&t->lock);
+
+                filename = path_join(item->syspath, "uevent");
+                if (!filename)
+                        r = -ENOMEM;
+                else
+                        r = write_string_file(filename, t->action, WRITE_STRING_FILE_DISABLE_BUFFER);
+
+                (void) pthread_mutex_lock(&t->lock);
+
+                trigger_item_written(t, i, r);
         }
 
-        return ret;
+        (void) pthread_mutex_unlock(&t->lock);
+        return NULL;
 }
 
 static int device_monitor_handler(sd_device_monitor *m, sd_device *dev, void *userdata) {
-        _cleanup_free_ char *val = NULL;
-        Set *settle_set = userdata;
+        Trigger *t = userdata;
+        TriggerItem *item;
         const char *syspath;
+        bool finished;
 
         assert(dev);
-        assert(settle_set);
+        assert(t);
 
         if (sd_device_get_syspath(dev, &syspath) < 0)
                 return 0;
 
-        if (arg_verbose)
+        if (arg_verbose && t->settle)
                 printf("settle %s\n", syspath);
 
-        val = set_remove(settle_set, syspath);
-        if (!val)
-                log_debug("Got epoll event on syspath %s not present in syspath set", syspath);
+        item = hashmap_get(t->items_by_syspath, syspath);
+
+        (void) pthread_mutex_lock(&t->lock);
+
+        if (item && item->state == TRIGGER_ITEM_QUEUED) {
+                trigger_item_finish(t, item, true);
+                (void) pthread_cond_broadcast(&t->cond);
+        } else
+                log_debug("Got event for %s which we did not trigger or saw already, ignoring.", syspath);
 
-        if (set_isempty(settle_set))
+        finished = trigger_is_finished(t);
+
+        (void) pthread_mutex_unlock(&t->lock);
+
+        if (finished)
                 return sd_event_exit(sd_device_monitor_get_event(m), 0);
 
         return 0;
 }
 
+static int on_trigger_done(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        Trigger *t = userdata;
+        eventfd_t v;
+        bool finished;
+
+        assert(t);
+
+        (void) eventfd_read(t->done_fd, &v);
+
+        (void) pthread_mutex_lock(&t->lock);
+        finished = trigger_is_finished(t);
+        (void) pthread_mutex_unlock(&t->lock);
+
+        if (finished)
+                return sd_event_exit(sd_event_source_get_event(s), 0);
+
+        return 0;
+}
+
+static int on_in_flight_timeout(sd_event_source *s, uint64_t usec, void *userdata) {
+        char timeout[FORMAT_TIMESPAN_MAX];
+        Trigger *t = userdata;
+        const char *syspath = NULL;
+        usec_t next = usec + TRIGGER_IN_FLIGHT_TIMEOUT_USEC;
+        int r;
+
+        assert(t);
+
+        (void) pthread_mutex_lock(&t->lock);
+
+        /* Items are queued in the order of the ready list, hence the first one in it that is still in flight
+         * is the oldest one. */
+        for (; t->in_flight_head < t->ready_head; t->in_flight_head++) {
+                TriggerItem *item = t->items + t->ready[t->in_flight_head];
+
+                if (item->state != TRIGGER_ITEM_QUEUED)
+                        continue;
+
+                if (item->queued_usec + TRIGGER_IN_FLIGHT_TIMEOUT_USEC > usec) {
+                        next = item->queued_usec + TRIGGER_IN_FLIGHT_TIMEOUT_USEC;
+                        break;
+                }
+
+                /* The event may have been lost, or udevd is not processing events at all. Our accounting
+                 * cannot be trusted anymore then. */
+                syspath = item->syspath;
+                t->max_in_flight = 0;
+                (void) pthread_cond_broadcast(&t->cond);
+                break;
+        }
+
+        (void) pthread_mutex_unlock(&t->lock);
+
+        if (syspath) {
+                log_warning("No event seen for %s within %s, not limiting the number of events in flight anymore.",
+                            syspath, format_timespan(timeout, sizeof(timeout), TRIGGER_IN_FLIGHT_TIMEOUT_USEC, USEC_PER_SEC));
+                return sd_event_source_set_enabled(s, SD_EVENT_OFF);
+        }
+
+        r = sd_event_source_set_time(s, next);
+        if (r < 0)
+                return r;
+
+        return sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+}
+
+static unsigned default_n_jobs(void) {
+        cpu_set_t cpu_set;
+
+        if (arg_jobs > 0)
+                return arg_jobs;
+
+        if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) < 0)
+                return 1;
+
+        return MIN((unsigned) CPU_COUNT(&cpu_set), TRIGGER_JOBS_DEFAULT_MAX);
+}
+
+static unsigned trigger_n_jobs(Trigger *t) {
+        return MAX(1U, (unsigned) MIN((size_t) default_n_jobs(), t->n_items));
+}
+
+static int trigger_run(Trigger *t, sd_event *event) {
+        _cleanup_(sd_event_source_unrefp) sd_event_source *s = NULL, *timeout_source = NULL;
+        _cleanup_free_ pthread_t *threads = NULL;
+        unsigned n_jobs, n_threads = 0, i;
+        int r;
+
+        assert(t);
+
+        if (t->n_items == 0)
+                return 0;
+
+        r = trigger_prepare(t);
+        if (r < 0)
+                return r;
+
+        trigger_push_initial(t);
+
+        if (event) {
+                t->done_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+                if (t->done_fd < 0)
+                        return log_error_errno(errno, "Failed to create eventfd: %m");
+
+                r = sd_event_add_io(event, &s, t->done_fd, EPOLLIN, on_trigger_done, t);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to watch eventfd: %m");
+
+                if (t->max_in_flight > 0) {
+                        r = sd_event_add_time(event, &timeout_source, CLOCK_MONOTONIC,
+                                              now(CLOCK_MONOTONIC) + TRIGGER_IN_FLIGHT_TIMEOUT_USEC, USEC_PER_SEC,
+                                              on_in_flight_timeout, t);
+                        if (r < 0)
+                                return log_error_errno(r, "Failed to add timer: %m");
+                }
+        }
+
+        n_jobs = trigger_n_jobs(t);
+        threads = new(pthread_t, n_jobs);
+        if (!threads)
+                return log_oom();
+
+        for (i = 0; i < n_jobs; i++) {
+                r = pthread_create(threads + i, NULL, trigger_thread, t);
+                if (r != 0) {
+                        r = log_error_errno(r, "Failed to create thread: %m");
+                        break;
+                }
+                n_threads++;
+        }
+
+        if (n_threads == n_jobs && event) {
+                r = sd_event_loop(event);
+                if (r < 0)
+                        log_error_errno(r, "Event loop failed: %m");
+        }
+
+        /* If we bailed out early, make sure the threads don't wait for events nobody looks for anymore */
+        if (r < 0 || n_threads < n_jobs) {
+                (void) pthread_mutex_lock(&t->lock);
+                t->aborted = true;
+                (void) pthread_cond_broadcast(&t->cond);
+                (void) pthread_mutex_unlock(&t->lock);
+        }
+
+        for (i = 0; i < n_threads; i++)
+                (void) pthread_join(threads[i], NULL);
+
+        if (r < 0)
+                return r;
+
+        return t->ret;
+}
+
 static char* keyval(const char *str, const char **key, const char **val) {
         char *buf, *pos;
 
@@ -131,6 +603,10 @@ static int help(void) {
                "     --name-match=NAME              Trigger devices with this /dev name\n"
                "  -b --parent-match=NAME            Trigger devices with that parent device\n"
                "  -w --settle                       Wait for the triggered events to complete\n"
+               "  -j --jobs=N                       Number of threads scanning sysfs and writing\n"
+               "                                    uevents\n"
+               "     --max-in-flight=N              Maximum number of triggered events being\n"
+               "                                    processed by udevd at the same time\n"
                "     --wait-daemon[=SECONDS]        Wait for udevd daemon to be initialized\n"
                "                                    before triggering uevents\n"
                , program_invocation_short_name);
@@ -142,6 +618,7 @@ int trigger_main(int argc, char *argv[], void *userdata) {
         enum {
                 ARG_NAME = 0x100,
                 ARG_PING,
+                ARG_MAX_IN_FLIGHT,
         };
 
         static const struct option options[] = {
@@ -160,6 +637,8 @@ int trigger_main(int argc, char *argv[], void *userdata) {
                 { "parent-match",      required_argument, NULL, 'b'      },
                 { "settle",            no_argument,       NULL, 'w'      },
                 { "wait-daemon",       optional_argument, NULL, ARG_PING },
+                { "jobs",              required_argument, NULL, 'j'      },
+                { "max-in-flight",     required_argument, NULL, ARG_MAX_IN_FLIGHT },
                 { "version",           no_argument,       NULL, 'V'      },
                 { "help",              no_argument,       NULL, 'h'      },
                 {}
@@ -172,7 +651,11 @@ int trigger_main(int argc, char *argv[], void *userdata) {
         _cleanup_(sd_device_enumerator_unrefp) sd_device_enumerator *e = NULL;
         _cleanup_(sd_device_monitor_unrefp) sd_device_monitor *m = NULL;
         _cleanup_(sd_event_unrefp) sd_event *event = NULL;
-        _cleanup_set_free_free_ Set *settle_set = NULL;
+        _cleanup_(trigger_done) Trigger t = {
+                .done_fd = -1,
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+                .cond = PTHREAD_COND_INITIALIZER,
+        };
         usec_t ping_timeout_usec = 5 * USEC_PER_SEC;
         bool settle = false, ping = false;
         int c, r;
@@ -190,7 +673,7 @@ int trigger_main(int argc, char *argv[], void *userdata) {
         if (r < 0)
                 return r;
 
-        while ((c = getopt_long(argc, argv, "vnt:c:s:S:a:A:p:g:y:b:wVh", options, NULL)) >= 0) {
+        while ((c = getopt_long(argc, argv, "vnt:c:s:S:a:A:p:g:y:b:wj:Vh", options, NULL)) >= 0) {
                 _cleanup_free_ char *buf = NULL;
                 const char *key, *val;
 
@@ -279,6 +762,19 @@ int trigger_main(int argc, char *argv[], void *userdata) {
                         settle = true;
                         break;
 
+                case 'j':
+                        r = safe_atou(optarg, &arg_jobs);
+                        if (r < 0 || arg_jobs == 0)
+                                return log_error_errno(r < 0 ? r : SYNTHETIC_ERRNO(EINVAL),
+                                                       "Invalid number of jobs '%s'.", optarg);
+                        break;
+
+                case ARG_MAX_IN_FLIGHT:
+                        r = safe_atou(optarg, &arg_max_in_flight);
+                        if (r < 0)
+                                return log_error_errno(r, "Failed to parse --max-in-flight= value '%s': %m", optarg);
+                        break;
+
                 case ARG_NAME: {
                         _cleanup_(sd_device_unrefp) sd_device *dev = NULL;
 
@@ -341,11 +837,13 @@ int trigger_main(int argc, char *argv[], void *userdata) {
                         return log_error_errno(r, "Failed to add parent match '%s': %m", argv[optind]);
         }
 
-        if (settle) {
-                settle_set = set_new(&string_hash_ops);
-                if (!settle_set)
-                        return log_oom();
+        t.action = action;
+        t.settle = settle;
+        t.max_in_flight = arg_max_in_flight;
+        /* Throttling needs to know when our events are done too */
+        t.track = settle || arg_max_in_flight > 0;
 
+        if (t.track && !arg_dry_run) {
                 r = sd_event_default(&event);
                 if (r < 0)
                         return log_error_errno(r, "Failed to get default event: %m");
@@ -358,11 +856,13 @@ int trigger_main(int argc, char *argv[], void *userdata) {
                 if (r < 0)
                         return log_error_errno(r, "Failed to attach event to device monitor: %m");
 
-                r = sd_device_monitor_start(m, device_monitor_handler, settle_set);
+                r = sd_device_monitor_start(m, device_monitor_handler, &t);
                 if (r < 0)
                         return log_error_errno(r, "Failed to start device monitor: %m");
         }
 
+        (void) device_enumerator_set_n_threads(e, default_n_jobs());
+
         switch (device_type) {
         case TYPE_SUBSYSTEMS:
                 r = device_enumerator_scan_subsystems(e);
@@ -377,15 +877,10 @@ int trigger_main(int argc, char *argv[], void *userdata) {
         default:
                 assert_not_reached("Unknown device type");
         }
-        r = exec_list(e, action, settle_set);
+
+        r = trigger_collect(&t, e);
         if (r < 0)
                 return r;
 
-        if (event && !set_isempty(settle_set)) {
-                r = sd_event_loop(event);
-                if (r < 0)
-                        return log_error_errno(r, "Event loop failed: %m");
-        }
-
-        return 0;
+        return trigger_run(&t, event);
 }
@@ -13,9 +13,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/file.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/prctl.h>
 #include <sys/signalfd.h>
@@ -54,6 +56,7 @@
 #include "process-util.h"
 #include "selinux-util.h"
 #include "signal-util.h"
+#include "siphash24.h"
 #include "socket-util.h"
 #include "string-util.h"
 #include "strv.h"
@@ -62,11 +65,14 @@
 #include "udev-builtin.h"
 #include "udev-ctrl.h"
 #include "udev-event.h"
+#include "udev-queue-index.h"
+#include "udev-thread-pool.h"
 #include "udev-util.h"
 #include "udev-watch.h"
 #include "user-util.h"
 
 #define WORKER_NUM_MAX 2048U
+#define SYSATTR_GENERATION_SLOTS 4096U
 
 static bool arg_debug = false;
 static int arg_daemonize = false;
@@ -74,11 +80,22 @@ static ResolveNameTiming arg_resolve_name_timing = RESOLVE_NAME_EARLY;
 static unsigned arg_children_max = 0;
 static usec_t arg_exec_delay_usec = 0;
 static usec_t arg_event_timeout_usec = 180 * USEC_PER_SEC;
+static bool arg_worker_threads = false;
+static bool arg_sysattr_cache = false;
+
+/* With --sysattr-cache, the sequence number of the last event queued for any syspath hashing to a slot. The
+ * table is shared with the workers, which drop what they cached about a device once another event for it was
+ * queued. Collisions only cause entries to be dropped needlessly. */
+static uint64_t *sysattr_generations = NULL;
+
+typedef struct WorkerThread WorkerThread;
 
 typedef struct Manager {
         sd_event *event;
         Hashmap *workers;
         LIST_HEAD(struct event, events);
+        struct event *events_tail;
+        UdevQueueIndex *queue_index; /* which events wait for which */
         const char *cgroup;
         pid_t pid; /* the process that originally allocated the manager object */
 
@@ -95,6 +112,14 @@ typedef struct Manager {
         sd_event_source *inotify_event;
         sd_event_source *kill_workers_event;
 
+        /* With --worker-threads, events are processed by persistent threads of the main daemon instead of
+         * forked workers. The threads share the rules, the builtins and the properties with us, hence
+         * those must not be modified while any event is passed to them. A reload and changed properties
+         * are put off until the threads are done, and no further events are passed to them meanwhile. */
+        UdevThreadPool *thread_pool;
+        Hashmap *properties_pending;
+        bool reload_pending;
+
         usec_t last_usec;
 
         bool stop_exec_queue:1;
@@ -116,7 +141,7 @@ struct event {
         sd_device *dev_kernel; /* clone of originally received device */
 
         uint64_t seqnum;
-        uint64_t delaying_seqnum;
+        UdevQueueEntry *queue_entry;
 
         sd_event_source *timeout_warning_event;
         sd_event_source *timeout_event;
@@ -141,6 +166,12 @@ struct worker {
         struct event *event;
 };
 
+struct WorkerThread {
+        Manager *manager;
+        sd_device_monitor *monitor; /* to pass processed events on to libudev listeners */
+        sd_netlink *rtnl;
+};
+
 /* passed from worker to main process */
 struct worker_message {
 };
@@ -151,7 +182,10 @@ static void event_free(struct event *event) {
 
         assert(event->manager);
 
+        if (event->manager->events_tail == event)
+                event->manager->events_tail = event->event_prev;
         LIST_REMOVE(event, event->manager->events, event);
+        udev_queue_entry_free(event->queue_entry);
         sd_device_unref(event->dev);
         sd_device_unref(event->dev_kernel);
 
@@ -225,7 +259,13 @@ static int on_event_timeout(sd_event_source *s, uint64_t usec, void *userdata) {
         struct event *event = userdata;
 
         assert(event);
-        assert(event->worker);
+
+        if (!event->worker) {
+                /* Threads cannot be killed, but spawned programs are, as they time out on their own. Note
+                 * that only the clone of the device may be accessed here, the thread owns the device. */
+                log_device_error(event->dev_kernel, "Worker thread processing SEQNUM=%"PRIu64" timed out", event->seqnum);
+                return 1;
+        }
 
         kill_and_sigcont(event->worker->pid, SIGKILL);
         event->worker->state = WORKER_KILLED;
@@ -239,17 +279,36 @@ static int on_event_timeout_warning(sd_event_source *s, uint64_t usec, void *use
         struct event *event = userdata;
 
         assert(event);
-        assert(event->worker);
+
+        if (!event->worker) {
+                log_device_warning(event->dev_kernel, "Worker thread processing SEQNUM=%"PRIu64" is taking a long time", event->seqnum);
+                return 1;
+        }
 
         log_device_warning(event->dev, "Worker ["PID_FMT"] processing SEQNUM=%"PRIu64" is taking a long time", event->worker->pid, event->seqnum);
 
         return 1;
 }
 
-static void worker_attach_event(struct worker *worker, struct event *event) {
+static void event_add_timeouts(struct event *event) {
         sd_event *e;
         uint64_t usec;
 
+        assert(event);
+        assert(event->manager);
+
+        e = event->manager->event;
+
+        assert_se(sd_event_now(e, CLOCK_MONOTONIC, &usec) >= 0);
+
+        (void) sd_event_add_time(e, &event->timeout_warning_event, CLOCK_MONOTONIC,
+                                 usec + udev_warn_timeout(arg_event_timeout_usec), USEC_PER_SEC, on_event_timeout_warning, event);
+
+        (void) sd_event_add_time(e, &event->timeout_event, CLOCK_MONOTONIC,
+                                 usec + arg_event_timeout_usec, USEC_PER_SEC, on_event_timeout, event);
+}
+
+static void worker_attach_event(struct worker *worker, struct event *event) {
         assert(worker);
         assert(worker->manager);
         assert(event);
@@ -261,15 +320,7 @@ static void worker_attach_event(struct worker *worker, struct event *event) {
         event->state = EVENT_RUNNING;
         event->worker = worker;
 
-        e = worker->manager->event;
-
-        assert_se(sd_event_now(e, CLOCK_MONOTONIC, &usec) >= 0);
-
-        (void) sd_event_add_time(e, &event->timeout_warning_event, CLOCK_MONOTONIC,
-                                 usec + udev_warn_timeout(arg_event_timeout_usec), USEC_PER_SEC, on_event_timeout_warning, event);
-
-        (void) sd_event_add_time(e, &event->timeout_event, CLOCK_MONOTONIC,
-                                 usec + arg_event_timeout_usec, USEC_PER_SEC, on_event_timeout, event);
+        event_add_timeouts(event);
 }
 
 static void manager_clear_for_worker(Manager *manager) {
@@ -282,6 +333,7 @@ static void manager_clear_for_worker(Manager *manager) {
 
         manager->workers = hashmap_free(manager->workers);
         event_queue_cleanup(manager, EVENT_UNDEF);
+        manager->queue_index = udev_queue_index_free(manager->queue_index);
 
         manager->monitor = sd_device_monitor_unref(manager->monitor);
         manager->ctrl = udev_ctrl_unref(manager->ctrl);
@@ -289,10 +341,14 @@ static void manager_clear_for_worker(Manager *manager) {
         manager->worker_watch[READ_END] = safe_close(manager->worker_watch[READ_END]);
 }
 
+static void manager_stop_threads(Manager *manager);
+
 static void manager_free(Manager *manager) {
         if (!manager)
                 return;
 
+        manager_stop_threads(manager);
+
         udev_builtin_exit();
 
         if (manager->pid == getpid_cached())
@@ -303,6 +359,7 @@ static void manager_free(Manager *manager) {
         sd_netlink_unref(manager->rtnl);
 
         hashmap_free_free_free(manager->properties);
+        hashmap_free_free_free(manager->properties_pending);
         udev_rules_free(manager->rules);
 
         safe_close(manager->fd_inotify);
@@ -381,7 +438,7 @@ static int worker_lock_block_device(sd_device *dev, int *ret_fd) {
         return 1;
 }
 
-static int worker_process_device(Manager *manager, sd_device *dev) {
+static int worker_process_device(Manager *manager, sd_device *dev, sd_netlink **rtnl, bool in_thread) {
         _cleanup_(udev_event_freep) UdevEvent *udev_event = NULL;
         _cleanup_close_ int fd_lock = -1;
         DeviceAction action;
@@ -390,6 +447,7 @@ static int worker_process_device(Manager *manager, sd_device *dev) {
 
         assert(manager);
         assert(dev);
+        assert(rtnl);
 
         r = device_get_seqnum(dev, &seqnum);
         if (r < 0)
@@ -402,10 +460,12 @@ static int worker_process_device(Manager *manager, sd_device *dev) {
         log_device_debug(dev, "Processing device (SEQNUM=%"PRIu64", ACTION=%s)",
                          seqnum, device_action_to_string(action));
 
-        udev_event = udev_event_new(dev, arg_exec_delay_usec, manager->rtnl);
+        udev_event = udev_event_new(dev, arg_exec_delay_usec, *rtnl);
         if (!udev_event)
                 return -ENOMEM;
 
+        udev_event->worker_thread = in_thread;
+
         r = worker_lock_block_device(dev, &fd_lock);
         if (r < 0)
                 return r;
@@ -417,9 +477,9 @@ static int worker_process_device(Manager *manager, sd_device *dev) {
 
         udev_event_execute_run(udev_event, arg_event_timeout_usec);
 
-        if (!manager->rtnl)
+        if (!*rtnl)
                 /* in case rtnl was initialized */
-                manager->rtnl = sd_netlink_ref(udev_event->rtnl);
+                *rtnl = sd_netlink_ref(udev_event->rtnl);
 
         /* apply/restore inotify watch */
         if (udev_event->inotify_watch) {
@@ -442,7 +502,7 @@ static int worker_device_monitor_handler(sd_device_monitor *monitor, sd_device *
         assert(dev);
         assert(manager);
 
-        r = worker_process_device(manager, dev);
+        r = worker_process_device(manager, dev, &manager->rtnl, false);
         if (r < 0)
                 log_device_warning_errno(dev, r, "Failed to process device, ignoring: %m");
 
@@ -505,6 +565,14 @@ static int worker_main(Manager *_manager, sd_device_monitor *monitor, sd_device
         if (r < 0)
                 return log_error_errno(r, "Event loop failed: %m");
 
+        if (arg_sysattr_cache) {
+                DeviceSysattrCacheStats stats;
+
+                device_sysattr_cache_get_stats(&stats);
+                log_debug("Sysattr cache: %"PRIu64" lookups, %"PRIu64" hits, %zu devices cached.",
+                          stats.n_lookups, stats.n_hits, stats.n_devices);
+        }
+
         return 0;
 }
 
@@ -550,7 +618,128 @@ static int worker_spawn(Manager *manager, struct event *event) {
         return 0;
 }
 
-static void event_run(Manager *manager, struct event *event) {
+static void worker_thread_process(void *item, void *thread_data) {
+        struct event *event = item;
+        WorkerThread *thread = thread_data;
+        int r;
+
+        assert(event);
+        assert(thread);
+
+        r = worker_process_device(thread->manager, event->dev, &thread->rtnl, true);
+        if (r < 0)
+                log_device_warning_errno(event->dev, r, "Failed to process device, ignoring: %m");
+
+        /* send processed event back to libudev listeners */
+        r = device_monitor_send_device(thread->monitor, NULL, event->dev);
+        if (r < 0)
+                log_device_warning_errno(event->dev, r, "Failed to send device, ignoring: %m");
+}
+
+static void worker_thread_free(void *thread_data) {
+        WorkerThread *thread = thread_data;
+
+        if (!thread)
+                return;
+
+        sd_device_monitor_unref(thread->monitor);
+        sd_netlink_unref(thread->rtnl);
+
+        free(thread);
+}
+
+static int worker_thread_new(void *userdata, void **ret) {
+        _cleanup_free_ WorkerThread *thread = NULL;
+        int r;
+
+        assert(userdata);
+        assert(ret);
+
+        thread = new(WorkerThread, 1);
+        if (!thread)
+                return -ENOMEM;
+
+        *thread = (WorkerThread) {
+                .manager = userdata,
+        };
+
+        r = device_monitor_new_full(&thread->monitor, MONITOR_GROUP_NONE, -1);
+        if (r < 0)
+                return r;
+
+        /* Signals stay blocked in the thread, as they are in the main thread, and only the latter handles
+         * them. SIGCHLD is not used at all, see spawn_wait(). */
+        *ret = TAKE_PTR(thread);
+        return 0;
+}
+
+static const UdevThreadPoolOps worker_thread_ops = {
+        .thread_new = worker_thread_new,
+        .thread_free = worker_thread_free,
+        .process = worker_thread_process,
+};
+
+static bool manager_threads_busy(Manager *manager) {
+        assert(manager);
+
+        return manager->thread_pool && udev_thread_pool_get_n_items(manager->thread_pool) > 0;
+}
+
+/* Collects the events the threads are done with */
+static void manager_collect_thread_events(Manager *manager) {
+        struct event *event;
+
+        assert(manager);
+
+        if (!manager->thread_pool)
+                return;
+
+        while ((event = udev_thread_pool_collect(manager->thread_pool)))
+                event_free(event);
+}
+
+static void manager_stop_threads(Manager *manager) {
+        assert(manager);
+
+        if (!manager->thread_pool)
+                return;
+
+        udev_thread_pool_stop(manager->thread_pool);
+        manager_collect_thread_events(manager);
+        manager->thread_pool = udev_thread_pool_free(manager->thread_pool);
+}
+
+/* Returns 0 if no thread is available to run the event right now */
+static int event_run_thread(Manager *manager, struct event *event) {
+        int r;
+
+        assert(manager);
+        assert(manager->thread_pool);
+        assert(event);
+
+        /* Wait until the shared state was updated */
+        if (manager->reload_pending || !hashmap_isempty(manager->properties_pending))
+                return 0;
+
+        if (udev_thread_pool_get_n_items(manager->thread_pool) >= arg_children_max)
+                return 0;
+
+        r = udev_thread_pool_submit(manager->thread_pool, event, arg_children_max);
+        if (r < 0) {
+                log_device_error_errno(event->dev, r, "Failed to pass event to worker threads: %m");
+                return 0;
+        }
+
+        /* The thread only accesses the device, hence the event may still be modified here */
+        event->state = EVENT_RUNNING;
+        event_add_timeouts(event);
+
+        log_device_debug(event->dev_kernel, "Passed SEQNUM=%"PRIu64" to worker threads.", event->seqnum);
+        return 1;
+}
+
+/* Returns 0 if no worker is available to run the event right now */
+static int event_run(Manager *manager, struct event *event) {
         static bool log_children_max_reached = true;
         struct worker *worker;
         Iterator i;
@@ -559,6 +748,9 @@ static void event_run(Manager *manager, struct event *event) {
         assert(manager);
         assert(event);
 
+        if (arg_worker_threads)
+                return event_run_thread(manager, event);
+
         HASHMAP_FOREACH(worker, manager->workers, i) {
                 if (worker->state != WORKER_IDLE)
                         continue;
@@ -572,7 +764,7 @@ static void event_run(Manager *manager, struct event *event) {
                         continue;
                 }
                 worker_attach_event(worker, event);
-                return;
+                return 1;
         }
 
         if (hashmap_size(manager->workers) >= arg_children_max) {
@@ -583,7 +775,7 @@ static void event_run(Manager *manager, struct event *event) {
                         log_debug("Maximum number (%u) of children reached.", hashmap_size(manager->workers));
                         log_children_max_reached = false;
                 }
-                return;
+                return 0;
         }
 
         /* Re-enable the debug message for the next batch of events */
@@ -591,6 +783,49 @@ static void event_run(Manager *manager, struct event *event) {
 
         /* start new worker and pass initial device */
         worker_spawn(manager, event);
+        return 1;
+}
+
+static uint64_t *sysattr_generation_slot(const char *syspath) {
+        /* The slots need to be the same in all processes, hence use a fixed key */
+        static const uint8_t key[16] = {
+                0x5d, 0x1c, 0x67, 0x0e, 0x8b, 0x29, 0x4f, 0xa2,
+                0x93, 0x30, 0xe1, 0x7a, 0x0c, 0xd5, 0x46, 0xb8,
+        };
+
+        return sysattr_generations + siphash24_string(syspath, key) % SYSATTR_GENERATION_SLOTS;
+}
+
+static uint64_t sysattr_generation(const char *syspath) {
+        return __atomic_load_n(sysattr_generation_slot(syspath), __ATOMIC_ACQUIRE);
+}
+
+static void sysattr_generation_bump(sd_device *dev, uint64_t seqnum) {
+        const char *syspath, *devpath_old;
+
+        if (!sysattr_generations)
+                return;
+
+        if (sd_device_get_syspath(dev, &syspath) >= 0)
+                __atomic_store_n(sysattr_generation_slot(syspath), seqnum, __ATOMIC_RELEASE);
+
+        if (sd_device_get_property_value(dev, "DEVPATH_OLD", &devpath_old) >= 0)
+                __atomic_store_n(sysattr_generation_slot(strjoina("/sys", devpath_old)), seqnum, __ATOMIC_RELEASE);
+}
+
+static int sysattr_cache_setup(void) {
+        void *p;
+
+        p = mmap(NULL, SYSATTR_GENERATION_SLOTS * sizeof(uint64_t), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+                return -errno;
+
+        sysattr_generations = p;
+
+        device_sysattr_cache_set_generation_func(sysattr_generation);
+        device_sysattr_cache_enable(true);
+
+        return 0;
 }
 
 static int event_queue_insert(Manager *manager, sd_device *dev) {
@@ -637,13 +872,26 @@ static int event_queue_insert(Manager *manager, sd_device *dev) {
                 .state = EVENT_QUEUED,
         };
 
+        r = udev_queue_index_add(manager->queue_index, dev, seqnum, &event->queue_entry);
+        if (r < 0) {
+                sd_device_unref(event->dev);
+                sd_device_unref(event->dev_kernel);
+                free(event);
+                return r;
+        }
+
         if (LIST_IS_EMPTY(manager->events)) {
                 r = touch("/run/udev/queue");
                 if (r < 0)
                         log_warning_errno(r, "Failed to touch /run/udev/queue: %m");
         }
 
-        LIST_APPEND(event, manager->events, event);
+        /* Before any worker may see the event */
+        sysattr_generation_bump(dev, seqnum);
+
+        /* The queue may get long during coldplug, hence don't look for its end every time */
+        LIST_INSERT_AFTER(event, manager->events, manager->events_tail, event);
+        manager->events_tail = event;
 
         log_device_debug(dev, "Device (SEQNUM=%"PRIu64", ACTION=%s) is queued",
                          seqnum, device_action_to_string(action));
@@ -666,134 +914,74 @@ static void manager_kill_workers(Manager *manager) {
         }
 }
 
-/* lookup event for identical, parent, child device */
-static int is_device_busy(Manager *manager, struct event *event) {
-        const char *subsystem, *devpath, *devpath_old = NULL;
-        dev_t devnum = makedev(0, 0);
-        struct event *loop_event;
-        size_t devpath_len;
-        int r, ifindex = 0;
-        bool is_block;
+static void manager_exit(Manager *manager) {
+        assert(manager);
 
-        r = sd_device_get_subsystem(event->dev, &subsystem);
-        if (r < 0)
-                return r;
+        manager->exit = true;
 
-        is_block = streq(subsystem, "block");
+        sd_notify(false,
+                  "STOPPING=1\n"
+                  "STATUS=Starting shutdown...");
 
-        r = sd_device_get_devpath(event->dev, &devpath);
-        if (r < 0)
-                return r;
+        /* close sources of new events and discard buffered events */
+        manager->ctrl = udev_ctrl_unref(manager->ctrl);
 
-        devpath_len = strlen(devpath);
+        manager->inotify_event = sd_event_source_unref(manager->inotify_event);
+        manager->fd_inotify = safe_close(manager->fd_inotify);
 
-        r = sd_device_get_property_value(event->dev, "DEVPATH_OLD", &devpath_old);
-        if (r < 0 && r != -ENOENT)
-                return r;
+        manager->monitor = sd_device_monitor_unref(manager->monitor);
 
-        r = sd_device_get_devnum(event->dev, &devnum);
-        if (r < 0 && r != -ENOENT)
-                return r;
+        /* discard queued events and kill workers */
+        event_queue_cleanup(manager, EVENT_QUEUED);
+        manager_kill_workers(manager);
+}
 
-        r = sd_device_get_ifindex(event->dev, &ifindex);
-        if (r < 0 && r != -ENOENT)
-                return r;
+static int properties_put(Hashmap **properties, char *key, char *val) {
+        _cleanup_free_ char *old_key = NULL, *old_val = NULL;
+        int r;
 
-        /* check if queue contains events we depend on */
-        LIST_FOREACH(event, loop_event, manager->events) {
-                size_t loop_devpath_len, common;
-                const char *loop_devpath;
+        /* Takes ownership of key and val on success. A NULL val unsets the property in the events. */
 
-                /* we already found a later event, earlier cannot block us, no need to check again */
-                if (loop_event->seqnum < event->delaying_seqnum)
-                        continue;
+        old_val = hashmap_remove2(*properties, key, (void **) &old_key);
 
-                /* event we checked earlier still exists, no need to check again */
-                if (loop_event->seqnum == event->delaying_seqnum)
-                        return true;
+        r = hashmap_ensure_allocated(properties, &string_hash_ops);
+        if (r < 0)
+                return r;
 
-                /* found ourself, no later event can block us */
-                if (loop_event->seqnum >= event->seqnum)
-                        break;
+        return hashmap_put(*properties, key, val);
+}
 
-                /* check major/minor */
-                if (major(devnum) != 0) {
-                        const char *s;
-                        dev_t d;
+/* Applies what was put off while events were passed to the worker threads, once they are done with them */
+static void manager_apply_pending(Manager *manager) {
+        char *key, *val;
+        int r;
 
-                        if (sd_device_get_subsystem(loop_event->dev, &s) < 0)
-                                continue;
+        assert(manager);
 
-                        if (sd_device_get_devnum(loop_event->dev, &d) >= 0 &&
-                            devnum == d && is_block == streq(s, "block"))
-                                goto set_delaying_seqnum;
-                }
+        if (manager_threads_busy(manager))
+                return;
 
-                /* check network device ifindex */
-                if (ifindex > 0) {
-                        int i;
+        while (!hashmap_isempty(manager->properties_pending)) {
+                val = hashmap_steal_first_key_and_value(manager->properties_pending, (void **) &key);
 
-                        if (sd_device_get_ifindex(loop_event->dev, &i) >= 0 &&
-                            ifindex == i)
-                                goto set_delaying_seqnum;
+                r = properties_put(&manager->properties, key, val);
+                if (r < 0) {
+                        log_oom();
+                        free(key);
+                        free(val);
                 }
-
-                if (sd_device_get_devpath(loop_event->dev, &loop_devpath) < 0)
-                        continue;
-
-                /* check our old name */
-                if (devpath_old && streq(devpath_old, loop_devpath))
-                        goto set_delaying_seqnum;
-
-                loop_devpath_len = strlen(loop_devpath);
-
-                /* compare devpath */
-                common = MIN(devpath_len, loop_devpath_len);
-
-                /* one devpath is contained in the other? */
-                if (!strneq(devpath, loop_devpath, common))
-                        continue;
-
-                /* identical device event found */
-                if (devpath_len == loop_devpath_len)
-                        goto set_delaying_seqnum;
-
-                /* parent device event found */
-                if (devpath[common] == '/')
-                        goto set_delaying_seqnum;
-
-                /* child device event found */
-                if (loop_devpath[common] == '/')
-                        goto set_delaying_seqnum;
         }
 
-        return false;
-
-set_delaying_seqnum:
-        event->delaying_seqnum = loop_event->seqnum;
-        return true;
-}
-
-static void manager_exit(Manager *manager) {
-        assert(manager);
-
-        manager->exit = true;
-
-        sd_notify(false,
-                  "STOPPING=1\n"
-                  "STATUS=Starting shutdown...");
-
-        /* close sources of new events and discard buffered events */
-        manager->ctrl = udev_ctrl_unref(manager->ctrl);
-
-        manager->inotify_event = sd_event_source_unref(manager->inotify_event);
-        manager->fd_inotify = safe_close(manager->fd_inotify);
+        if (manager->reload_pending) {
+                manager->reload_pending = false;
 
-        manager->monitor = sd_device_monitor_unref(manager->monitor);
+                manager->rules = udev_rules_free(manager->rules);
+                udev_builtin_exit();
 
-        /* discard queued events and kill workers */
-        event_queue_cleanup(manager, EVENT_QUEUED);
-        manager_kill_workers(manager);
+                sd_notifyf(false,
+                           "READY=1\n"
+                           "STATUS=Processing with %u children at max", arg_children_max);
+        }
 }
 
 /* reload requested, HUP signal received, rules changed, builtin changed */
@@ -806,12 +994,11 @@ static void manager_reload(Manager *manager) {
                   "STATUS=Flushing configuration...");
 
         manager_kill_workers(manager);
-        manager->rules = udev_rules_free(manager->rules);
-        udev_builtin_exit();
 
-        sd_notifyf(false,
-                   "READY=1\n"
-                   "STATUS=Processing with %u children at max", arg_children_max);
+        /* Worker threads share the rules and the builtins, hence those are only flushed when the threads
+         * are done with the events passed to them. Waiting here would block the main loop meanwhile. */
+        manager->reload_pending = true;
+        manager_apply_pending(manager);
 }
 
 static int on_kill_workers_event(sd_event_source *s, uint64_t usec, void *userdata) {
@@ -825,6 +1012,31 @@ static int on_kill_workers_event(sd_event_source *s, uint64_t usec, void *userda
         return 1;
 }
 
+static int manager_load_rules(Manager *manager) {
+        int r;
+
+        assert(manager);
+        assert(!manager->rules);
+
+        /* Reading the rules files takes a while, hence the parsed rules are kept in /run, to be picked up
+         * again by the next instance, as long as the rules files did not change. */
+        r = udev_rules_load_cache(&manager->rules, arg_resolve_name_timing, UDEV_RULES_CACHE);
+        if (r >= 0)
+                return 0;
+        if (r != -ENOENT)
+                log_debug_errno(r, "Failed to load %s, reading rules files instead: %m", UDEV_RULES_CACHE);
+
+        r = udev_rules_new(&manager->rules, arg_resolve_name_timing);
+        if (r < 0)
+                return r;
+
+        r = udev_rules_save_cache(manager->rules, UDEV_RULES_CACHE);
+        if (r < 0)
+                log_debug_errno(r, "Failed to write %s, ignoring: %m", UDEV_RULES_CACHE);
+
+        return 0;
+}
+
 static void event_queue_start(Manager *manager) {
         struct event *event;
         usec_t usec;
@@ -854,7 +1066,7 @@ static void event_queue_start(Manager *manager) {
         udev_builtin_init();
 
         if (!manager->rules) {
-                r = udev_rules_new(&manager->rules, arg_resolve_name_timing);
+                r = manager_load_rules(manager);
                 if (r < 0) {
                         log_warning_errno(r, "Failed to read udev rules: %m");
                         return;
@@ -866,10 +1078,12 @@ static void event_queue_start(Manager *manager) {
                         continue;
 
                 /* do not start event if parent or child event is still running */
-                if (is_device_busy(manager, event) != 0)
+                if (udev_queue_entry_is_blocked(event->queue_entry, NULL))
                         continue;
 
-                event_run(manager, event);
+                /* all workers are busy, no need to look at the rest of the queue */
+                if (event_run(manager, event) == 0)
+                        break;
         }
 }
 
@@ -955,6 +1169,23 @@ static int on_worker(sd_event_source *s, int fd, uint32_t revents, void *userdat
         return 1;
 }
 
+static int on_worker_thread(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        Manager *manager = userdata;
+        eventfd_t v;
+
+        assert(manager);
+
+        (void) eventfd_read(fd, &v);
+
+        manager_collect_thread_events(manager);
+        manager_apply_pending(manager);
+
+        /* we have free threads, try to schedule events */
+        event_queue_start(manager);
+
+        return 1;
+}
+
 static int on_uevent(sd_device_monitor *monitor, sd_device *dev, void *userdata) {
         Manager *manager = userdata;
         int r;
@@ -1004,7 +1235,7 @@ static int on_ctrl_msg(struct udev_ctrl *uctrl, enum udev_ctrl_msg_type type, co
                 manager_reload(manager);
                 break;
         case UDEV_CTRL_SET_ENV: {
-                _cleanup_free_ char *key = NULL, *val = NULL, *old_key = NULL, *old_val = NULL;
+                _cleanup_free_ char *key = NULL, *val = NULL;
                 const char *eq;
 
                 eq = strchr(value->buf, '=');
@@ -1019,24 +1250,10 @@ static int on_ctrl_msg(struct udev_ctrl *uctrl, enum udev_ctrl_msg_type type, co
                         return 1;
                 }
 
-                old_val = hashmap_remove2(manager->properties, key, (void **) &old_key);
-
-                r = hashmap_ensure_allocated(&manager->properties, &string_hash_ops);
-                if (r < 0) {
-                        log_oom();
-                        return 1;
-                }
-
                 eq++;
-                if (isempty(eq)) {
+                if (isempty(eq))
                         log_debug("Received udev control message (ENV), unsetting '%s'", key);
-
-                        r = hashmap_put(manager->properties, key, NULL);
-                        if (r < 0) {
-                                log_oom();
-                                return 1;
-                        }
-                } else {
+                else {
                         val = strdup(eq);
                         if (!val) {
                                 log_oom();
@@ -1044,12 +1261,14 @@ static int on_ctrl_msg(struct udev_ctrl *uctrl, enum udev_ctrl_msg_type type, co
                         }
 
                         log_debug("Received udev control message (ENV), setting '%s=%s'", key, val);
+                }
 
-                        r = hashmap_put(manager->properties, key, val);
-                        if (r < 0) {
-                                log_oom();
-                                return 1;
-                        }
+                /* Worker threads read the properties, hence changes are put off until they are done */
+                r = properties_put(manager_threads_busy(manager) ? &manager->properties_pending : &manager->properties,
+                                   key, val);
+                if (r < 0) {
+                        log_oom();
+                        return 1;
                 }
 
                 key = val = NULL;
@@ -1406,6 +1625,8 @@ static int listen_fds(int *ret_ctrl, int *ret_netlink) {
  *   udev.children_max=<number of workers>     events are fully serialized if set to 1
  *   udev.exec_delay=<number of seconds>       delay execution of every executed program
  *   udev.event_timeout=<number of seconds>    seconds to wait before terminating an event
+ *   udev.worker_threads=<boolean>             process events in threads instead of worker processes
+ *   udev.sysattr_cache=<boolean>              share read sysattr values between events
  */
 static int parse_proc_cmdline_item(const char *key, const char *value, void *data) {
         int r = 0;
@@ -1445,6 +1666,18 @@ static int parse_proc_cmdline_item(const char *key, const char *value, void *dat
 
                 r = parse_sec(value, &arg_exec_delay_usec);
 
+        } else if (proc_cmdline_key_streq(key, "udev.worker_threads")) {
+
+                r = parse_boolean(value);
+                if (r >= 0)
+                        arg_worker_threads = r;
+
+        } else if (proc_cmdline_key_streq(key, "udev.sysattr_cache")) {
+
+                r = parse_boolean(value);
+                if (r >= 0)
+                        arg_sysattr_cache = r;
+
         } else if (startswith(key, "udev."))
                 log_warning("Unknown udev kernel command line option \"%s\", ignoring", key);
 
@@ -1473,6 +1706,8 @@ static int help(void) {
                "  -t --event-timeout=SECONDS  Seconds to wait before terminating an event\n"
                "  -N --resolve-names=early|late|never\n"
                "                              When to resolve users and groups\n"
+               "     --worker-threads[=BOOL]  Process events in threads instead of processes\n"
+               "     --sysattr-cache[=BOOL]   Share read sysattr values between events\n"
                "\nSee the %s for details.\n"
                , program_invocation_short_name
                , link
@@ -1482,6 +1717,11 @@ static int help(void) {
 }
 
 static int parse_argv(int argc, char *argv[]) {
+        enum {
+                ARG_WORKER_THREADS = 0x100,
+                ARG_SYSATTR_CACHE,
+        };
+
         static const struct option options[] = {
                 { "daemon",             no_argument,            NULL, 'd' },
                 { "debug",              no_argument,            NULL, 'D' },
@@ -1489,6 +1729,8 @@ static int parse_argv(int argc, char *argv[]) {
                 { "exec-delay",         required_argument,      NULL, 'e' },
                 { "event-timeout",      required_argument,      NULL, 't' },
                 { "resolve-names",      required_argument,      NULL, 'N' },
+                { "worker-threads",     optional_argument,      NULL, ARG_WORKER_THREADS },
+                { "sysattr-cache",      optional_argument,      NULL, ARG_SYSATTR_CACHE  },
                 { "help",               no_argument,            NULL, 'h' },
                 { "version",            no_argument,            NULL, 'V' },
                 {}
@@ -1533,6 +1775,20 @@ static int parse_argv(int argc, char *argv[]) {
                                 arg_resolve_name_timing = t;
                         break;
                 }
+                case ARG_WORKER_THREADS:
+                        r = optarg ? parse_boolean(optarg) : true;
+                        if (r < 0)
+                                log_warning_errno(r, "Failed to parse --worker-threads= value '%s', ignoring: %m", optarg);
+                        else
+                                arg_worker_threads = r;
+                        break;
+                case ARG_SYSATTR_CACHE:
+                        r = optarg ? parse_boolean(optarg) : true;
+                        if (r < 0)
+                                log_warning_errno(r, "Failed to parse --sysattr-cache= value '%s', ignoring: %m", optarg);
+                        else
+                                arg_sysattr_cache = r;
+                        break;
                 case 'h':
                         return help();
                 case 'V':
@@ -1579,6 +1835,10 @@ static int manager_new(Manager **ret, int fd_ctrl, int fd_uevent, const char *cg
 
         (void) sd_device_monitor_set_receive_buffer_size(manager->monitor, 128 * 1024 * 1024);
 
+        r = udev_queue_index_new(&manager->queue_index);
+        if (r < 0)
+                return log_oom();
+
         r = device_monitor_enable_receiving(manager->monitor);
         if (r < 0)
                 return log_error_errno(r, "Failed to bind netlink socket: %m");
@@ -1630,9 +1890,12 @@ static int main_loop(Manager *manager) {
         if (r < 0)
                 return log_error_errno(r, "Failed to create SIGHUP event source: %m");
 
-        r = sd_event_add_signal(manager->event, NULL, SIGCHLD, on_sigchld, manager);
-        if (r < 0)
-                return log_error_errno(r, "Failed to create SIGCHLD event source: %m");
+        /* Worker threads reap what they spawn themselves, hence do not reap anything here then */
+        if (!arg_worker_threads) {
+                r = sd_event_add_signal(manager->event, NULL, SIGCHLD, on_sigchld, manager);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to create SIGCHLD event source: %m");
+        }
 
         r = sd_event_set_watchdog(manager->event, true);
         if (r < 0)
@@ -1672,14 +1935,24 @@ static int main_loop(Manager *manager) {
         if (r < 0)
                 return log_error_errno(r, "Failed to create worker event source: %m");
 
+        if (arg_worker_threads) {
+                r = udev_thread_pool_new(&manager->thread_pool, &worker_thread_ops, manager);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to create worker threads: %m");
+
+                r = sd_event_add_io(manager->event, NULL, udev_thread_pool_get_fd(manager->thread_pool), EPOLLIN, on_worker_thread, manager);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to create worker thread event source: %m");
+        }
+
         r = sd_event_add_post(manager->event, NULL, on_post, manager);
         if (r < 0)
                 return log_error_errno(r, "Failed to create post event source: %m");
 
         udev_builtin_init();
 
-        r = udev_rules_new(&manager->rules, arg_resolve_name_timing);
-        if (!manager->rules)
+        r = manager_load_rules(manager);
+        if (r < 0)
                 return log_error_errno(r, "Failed to read udev rules: %m");
 
         r = udev_rules_apply_static_dev_perms(manager->rules);
@@ -1748,6 +2021,12 @@ static int run(int argc, char *argv[]) {
                 log_debug("Set children_max to %u", arg_children_max);
         }
 
+        if (arg_sysattr_cache) {
+                r = sysattr_cache_setup();
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set up sysattr cache: %m");
+        }
+
         /* set umask before creating any file/directory */
         r = chdir("/");
         if (r < 0)